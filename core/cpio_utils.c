@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 #ifdef CONFIG_GUNZIP
 #include <zlib.h>
 #endif
@@ -19,6 +20,7 @@
 #include "util.h"
 #include "sslapi.h"
 #include "progress.h"
+#include "handler.h"
 
 #define MODULE_NAME "cpio"
 
@@ -76,6 +78,35 @@ static int fill_buffer(int fd, unsigned char *buf, unsigned int nbytes, unsigned
 	return count;
 }
 
+/*
+ * Timing of the copy stages, only if statistics are requested
+ */
+static unsigned long long stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void stats_add(struct copy_stats *stats, COPY_STAGE stage,
+		      unsigned long long start)
+{
+	unsigned long long ns = stats_now() - start;
+	unsigned long long us = ns / 1000;
+	unsigned int bucket = 0;
+
+	stats->ns[stage] += ns;
+	stats->calls[stage]++;
+
+	/* bucket n counts latencies below 2^n us */
+	while (us && bucket < COPY_STATS_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+	stats->hist[stage][bucket]++;
+}
+
 /*
  * Export the copy_write{,_*} functions to be used in other modules
  * for copying a buffer to a file.
@@ -144,6 +175,86 @@ int copy_write_padded(void *out, const void *buf, unsigned int len)
 
 typedef int (*PipelineStep)(void *state, void *buffer, size_t size);
 
+/*
+ * Output of the pipeline: data is passed to the callback as it
+ * comes, or in blocks of a fixed size if the handler asks for it.
+ * The last block is padded with zeroes up to the alignment.
+ */
+struct OutputState
+{
+	writeimage callback;
+	void *out;
+	uint8_t *block;
+	unsigned int size;
+	unsigned int align;
+	unsigned int len;
+	struct copy_stats *stats;
+};
+
+static int output_callback(struct OutputState *state, const void *buf,
+			   unsigned int len)
+{
+	unsigned long long start;
+	int ret;
+
+	if (!state->stats)
+		return state->callback(state->out, buf, len);
+
+	start = stats_now();
+	ret = state->callback(state->out, buf, len);
+	stats_add(state->stats, COPY_STAGE_CALLBACK, start);
+	state->stats->bytes_out += len;
+
+	return ret;
+}
+
+static int output_write(struct OutputState *state, const uint8_t *buf,
+			unsigned int len)
+{
+	unsigned int n;
+
+	if (!state->block)
+		return output_callback(state, buf, len);
+
+	while (len) {
+		/* full blocks are not copied */
+		if (!state->len && len >= state->size) {
+			if (output_callback(state, buf, state->size) < 0)
+				return -1;
+			buf += state->size;
+			len -= state->size;
+			continue;
+		}
+		n = min(state->size - state->len, len);
+		memcpy(state->block + state->len, buf, n);
+		state->len += n;
+		buf += n;
+		len -= n;
+		if (state->len == state->size) {
+			if (output_callback(state, state->block, state->size) < 0)
+				return -1;
+			state->len = 0;
+		}
+	}
+
+	return 0;
+}
+
+static int output_flush(struct OutputState *state)
+{
+	unsigned int pad = 0;
+
+	if (!state->block || !state->len)
+		return 0;
+
+	if (state->align && state->len % state->align)
+		pad = state->align - state->len % state->align;
+	memset(state->block + state->len, 0, pad);
+	state->len += pad;
+
+	return output_callback(state, state->block, state->len);
+}
+
 struct InputState
 {
 	int fdin;
@@ -151,18 +262,44 @@ struct InputState
 	unsigned long *offs;
 	void *dgst;	/* use a private context for HASH */
 	uint32_t checksum;
+	struct copy_stats *stats;
 };
 
 static int input_step(void *state, void *buffer, size_t size)
 {
 	struct InputState *s = (struct InputState *)state;
+	unsigned long long start;
+	uint8_t *p = buffer;
+	int ret, i;
+
 	if (size >= s->nbytes) {
 		size = s->nbytes;
 	}
-	int ret = fill_buffer(s->fdin, buffer, size, s->offs, &s->checksum, s->dgst);
-	if (ret < 0) {
+	if (!s->stats) {
+		ret = fill_buffer(s->fdin, buffer, size, s->offs, &s->checksum, s->dgst);
+		if (ret < 0) {
+			return ret;
+		}
+		s->nbytes -= ret;
+		return ret;
+	}
+
+	/* Same as above, reading and verifying are measured apart */
+	start = stats_now();
+	ret = fill_buffer(s->fdin, buffer, size, s->offs, NULL, NULL);
+	stats_add(s->stats, COPY_STAGE_READ, start);
+	if (ret <= 0) {
 		return ret;
 	}
+
+	start = stats_now();
+	for (i = 0; i < ret; i++)
+		s->checksum += p[i];
+	if (s->dgst && swupdate_HASH_update(s->dgst, buffer, ret) < 0)
+		return -EFAULT;
+	stats_add(s->stats, COPY_STAGE_HASH, start);
+
+	s->stats->bytes_in += ret;
 	s->nbytes -= ret;
 	return ret;
 }
@@ -177,6 +314,7 @@ struct DecryptState
 	uint8_t output[BUFF_SIZE + AES_BLOCK_SIZE];
 	int outlen;
 	bool eof;
+	struct copy_stats *stats;
 };
 
 static int decrypt_step(void *state, void *buffer, size_t size)
@@ -203,6 +341,8 @@ static int decrypt_step(void *state, void *buffer, size_t size)
 	inlen = ret;
 
 	if (!s->eof) {
+		unsigned long long start = s->stats ? stats_now() : 0;
+
 		if (inlen != 0) {
 			ret = swupdate_DECRYPT_update(s->dcrypt,
 				s->output, &s->outlen, s->input, inlen);
@@ -215,6 +355,8 @@ static int decrypt_step(void *state, void *buffer, size_t size)
 				s->output, &s->outlen);
 			s->eof = true;
 		}
+		if (s->stats)
+			stats_add(s->stats, COPY_STAGE_DECRYPT, start);
 		if (ret < 0) {
 			return ret;
 		}
@@ -244,6 +386,7 @@ struct GunzipState
 	bool initialized;
 	uint8_t input[BUFF_SIZE];
 	bool eof;
+	struct copy_stats *stats;
 };
 
 static int gunzip_step(void *state, void *buffer, size_t size)
@@ -269,7 +412,13 @@ static int gunzip_step(void *state, void *buffer, size_t size)
 			break;
 		}
 
-		ret = inflate(&s->strm, Z_NO_FLUSH);
+		if (s->stats) {
+			unsigned long long start = stats_now();
+
+			ret = inflate(&s->strm, Z_NO_FLUSH);
+			stats_add(s->stats, COPY_STAGE_INFLATE, start);
+		} else
+			ret = inflate(&s->strm, Z_NO_FLUSH);
 		outlen = size - s->strm.avail_out;
 		if (ret == Z_STREAM_END) {
 			s->eof = true;
@@ -285,11 +434,14 @@ static int gunzip_step(void *state, void *buffer, size_t size)
 
 #endif
 
-int copyfile(int fdin, void *out, unsigned int nbytes, unsigned long *offs, unsigned long long seek,
-	int skip_file, int __attribute__ ((__unused__)) compressed,
-	uint32_t *checksum, unsigned char *hash, int encrypted, writeimage callback)
+static int copy_pipeline(int fdin, void *out, unsigned int nbytes, unsigned long *offs,
+	unsigned long long seek, int skip_file,
+	int __attribute__ ((__unused__)) compressed, uint32_t *checksum,
+	unsigned char *hash, int encrypted, writeimage callback,
+	unsigned int out_size, unsigned int out_align,
+	struct copy_stats *stats)
 {
-	unsigned int percent, prevpercent = 0;
+	unsigned int done, prevdone = 0;
 	int ret = 0;
 	int len;
 	unsigned char md_value[64]; /*
@@ -306,13 +458,15 @@ int copyfile(int fdin, void *out, unsigned int nbytes, unsigned long *offs, unsi
 		.nbytes = nbytes,
 		.offs = offs,
 		.dgst = NULL,
-		.checksum = 0
+		.checksum = 0,
+		.stats = stats
 	};
 
 	struct DecryptState decrypt_state = {
 		.upstream_step = NULL, .upstream_state = NULL,
 		.dcrypt = NULL,
-		.outlen = 0, .eof = false
+		.outlen = 0, .eof = false,
+		.stats = stats
 	};
 
 #ifdef CONFIG_GUNZIP
@@ -324,16 +478,32 @@ int copyfile(int fdin, void *out, unsigned int nbytes, unsigned long *offs, unsi
 			.avail_out = 0, .next_out = Z_NULL
 		},
 		.initialized = false,
-		.eof = false
+		.eof = false,
+		.stats = stats
 	};
 #endif
 
+	struct OutputState output_state = {
+		.callback = callback ? callback : copy_write,
+		.out = out,
+		.block = NULL,
+		.len = 0,
+		.stats = stats
+	};
+
 	PipelineStep step = NULL;
 	void *state = NULL;
 	uint8_t buffer[BUFF_SIZE];
 
-	if (!callback) {
-		callback = copy_write;
+	if (out_size || out_align) {
+		output_state.size = out_size ? out_size : BUFF_SIZE;
+		output_state.align = out_align;
+		if (out_align)
+			output_state.size = ((output_state.size + out_align - 1) /
+					     out_align) * out_align;
+		output_state.block = malloc(output_state.size);
+		if (!output_state.block)
+			return -ENOMEM;
 	}
 
 	if (checksum)
@@ -432,16 +602,20 @@ int copyfile(int fdin, void *out, unsigned int nbytes, unsigned long *offs, unsi
 		 * results corrupted. This lets the cleanup routine
 		 * to remove it
 		 */
-		if (callback(out, buffer, len) < 0) {
+		ret = output_write(&output_state, buffer, len);
+		if (ret < 0) {
 			ret = -ENOSPC;
 			goto copyfile_exit;
 		}
 
-		percent = (unsigned)(100ULL * (nbytes - input_state.nbytes) / nbytes);
-		if (percent != prevpercent) {
-			prevpercent = percent;
-			swupdate_progress_update(percent);
-		}
+		done = nbytes - input_state.nbytes;
+		swupdate_progress_bytes(done - prevdone, done, nbytes);
+		prevdone = done;
+	}
+
+	if (output_flush(&output_state) < 0) {
+		ret = -ENOSPC;
+		goto copyfile_exit;
 	}
 
 	if (IsValidHash(hash)) {
@@ -478,6 +652,7 @@ int copyfile(int fdin, void *out, unsigned int nbytes, unsigned long *offs, unsi
 	ret = 0;
 
 copyfile_exit:
+	free(output_state.block);
 	if (decrypt_state.dcrypt) {
 		swupdate_DECRYPT_cleanup(decrypt_state.dcrypt);
 	}
@@ -493,9 +668,35 @@ copyfile_exit:
 	return ret;
 }
 
+int copyfile(int fdin, void *out, unsigned int nbytes, unsigned long *offs,
+	unsigned long long seek, int skip_file, int compressed,
+	uint32_t *checksum, unsigned char *hash, int encrypted, writeimage callback)
+{
+	return copy_pipeline(fdin, out, nbytes, offs, seek, skip_file,
+			     compressed, checksum, hash, encrypted, callback,
+			     0, 0, NULL);
+}
+
+/*
+ * Size and alignment of the writes requested
+ * by the handler of the image
+ */
+static void image_output(struct img_type *img, unsigned int *size,
+			 unsigned int *align)
+{
+	struct installer_handler *hnd = find_handler(img);
+
+	*size = hnd ? hnd->caps.buffer_size : 0;
+	*align = hnd ? hnd->caps.alignment : 0;
+}
+
 int copyimage(void *out, struct img_type *img, writeimage callback)
 {
-	return copyfile(img->fdin,
+	unsigned int size, align;
+
+	image_output(img, &size, &align);
+
+	return copy_pipeline(img->fdin,
 			out,
 			img->size,
 			(unsigned long *)&img->offset,
@@ -505,7 +706,40 @@ int copyimage(void *out, struct img_type *img, writeimage callback)
 			&img->checksum,
 			img->sha256,
 			img->is_encrypted,
-			callback);
+			callback,
+			size, align,
+			NULL);
+}
+
+/*
+ * Same as copyimage(), measuring the time spent in each
+ * stage of the pipeline. Statistics are added to the
+ * ones already in stats.
+ */
+int copyimage_stats(void *out, struct img_type *img, writeimage callback,
+		    struct copy_stats *stats)
+{
+	unsigned long long start = stats_now();
+	unsigned int size, align;
+	int ret;
+
+	image_output(img, &size, &align);
+	ret = copy_pipeline(img->fdin,
+			out,
+			img->size,
+			(unsigned long *)&img->offset,
+			img->seek,
+			0, /* no skip */
+			img->compressed,
+			&img->checksum,
+			img->sha256,
+			img->is_encrypted,
+			callback,
+			size, align,
+			stats);
+	stats->total_ns += stats_now() - start;
+
+	return ret;
 }
 
 int extract_cpio_header(int fd, struct filehdr *fhdr, unsigned long *offset)
@@ -21,8 +21,8 @@ struct installer_handler supported_types[MAX_INSTALLER_HANDLER];
 static unsigned long nr_installers = 0;
 static unsigned long handler_index = ULONG_MAX;
 
-int register_handler(const char *desc,
-		handler installer, HANDLER_MASK mask, void *data)
+int register_handler_caps(const char *desc, handler installer,
+		HANDLER_MASK mask, void *data, const struct handler_caps *caps)
 {
 
 	if (nr_installers > MAX_INSTALLER_HANDLER - 1)
@@ -33,11 +33,46 @@ int register_handler(const char *desc,
 	supported_types[nr_installers].installer = installer;
 	supported_types[nr_installers].data = data;
 	supported_types[nr_installers].mask = mask;
+	/*
+	 * Without capabilities, a handler reads the image
+	 * as a stream, but it is installed alone
+	 */
+	if (caps)
+		supported_types[nr_installers].caps = *caps;
+	else {
+		memset(&supported_types[nr_installers].caps, 0,
+			sizeof(supported_types[nr_installers].caps));
+		supported_types[nr_installers].caps.flags = HANDLER_CAP_STREAM;
+		supported_types[nr_installers].caps.concurrency = HANDLER_EXCLUSIVE;
+	}
 	nr_installers++;
 
 	return 0;
 }
 
+int register_handler(const char *desc,
+		handler installer, HANDLER_MASK mask, void *data)
+{
+	return register_handler_caps(desc, installer, mask, data, NULL);
+}
+
+/*
+ * Key of the device held by an image, used to check
+ * which images can be installed at the same time
+ */
+const char *get_handler_device(struct installer_handler *hnd,
+		struct img_type *img)
+{
+	if (hnd->caps.device)
+		return hnd->caps.device(img);
+	if (strlen(img->device))
+		return img->device;
+	if (strlen(img->path))
+		return img->path;
+
+	return NULL;
+}
+
 void print_registered_handlers(void)
 {
 	unsigned int i;
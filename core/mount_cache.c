@@ -0,0 +1,270 @@
+/*
+ * (C) Copyright 2026
+ * agent, agent@local.
+ *
+ * SPDX-License-Identifier:     GPL-2.0-or-later
+ */
+
+/*
+ * Cache of the filesystems mounted by the handlers.
+ * During an installation (between swupdate_mount_cache_begin()
+ * and swupdate_mount_cache_end()) a device is mounted the first
+ * time a handler needs it and it stays mounted until the end,
+ * so that many files on the same filesystem do not pay for a
+ * mount / umount cycle each one. Outside a session a filesystem
+ * is unmounted as soon as the last user releases it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "bsdqueue.h"
+#include "swupdate.h"
+#include "util.h"
+
+struct mount_entry {
+	char *device;
+	char *fstype;
+	char *dir;		/* mount point with trailing slash */
+	unsigned int refcount;
+	LIST_ENTRY(mount_entry) next;
+};
+
+LIST_HEAD(mountlist, mount_entry);
+
+static struct mountlist mounts = LIST_HEAD_INITIALIZER(mounts);
+static pthread_mutex_t mounts_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool session;
+static bool sync_pending;	/* files written during the session */
+static unsigned int nmount, numount, nreuse;
+
+static void free_entry(struct mount_entry *entry)
+{
+	free(entry->device);
+	free(entry->fstype);
+	free(entry->dir);
+	free(entry);
+}
+
+static int umount_entry(struct mount_entry *entry)
+{
+	size_t len = strlen(entry->dir);
+	int ret;
+
+	/* umount() and rmdir() do not want the trailing slash */
+	entry->dir[len - 1] = '\0';
+	ret = swupdate_umount(entry->dir);
+	if (ret) {
+		ERROR("Device %s cannot be unmounted from %s: %s",
+			entry->device, entry->dir, strerror(errno));
+		entry->dir[len - 1] = '/';
+		return ret;
+	}
+	numount++;
+	rmdir(entry->dir);
+
+	LIST_REMOVE(entry, next);
+	free_entry(entry);
+
+	return 0;
+}
+
+static struct mount_entry *mount_entry(const char *device, const char *fstype)
+{
+	struct mount_entry *entry;
+	size_t len;
+
+	entry = (struct mount_entry *)calloc(1, sizeof(*entry));
+	if (!entry)
+		return NULL;
+
+	/* room for the trailing slash added after mkdtemp() */
+	if (asprintf(&entry->dir, "%s%sXXXXXX/", get_tmpdir(),
+		DATADST_DIR_SUFFIX) == ENOMEM_ASPRINTF) {
+		free(entry);
+		return NULL;
+	}
+	entry->device = strdup(device);
+	entry->fstype = strdup(fstype);
+	if (!entry->device || !entry->fstype)
+		goto err_free;
+
+	len = strlen(entry->dir);
+	entry->dir[len - 1] = '\0';
+	if (!mkdtemp(entry->dir)) {
+		ERROR("Unable to create a mount point %s: %s",
+			entry->dir, strerror(errno));
+		goto err_free;
+	}
+
+	if (swupdate_mount(device, entry->dir, fstype)) {
+		ERROR("Device %s with filesystem %s cannot be mounted: %s",
+			device, fstype, strerror(errno));
+		rmdir(entry->dir);
+		goto err_free;
+	}
+	nmount++;
+	entry->dir[len - 1] = '/';
+
+	LIST_INSERT_HEAD(&mounts, entry, next);
+
+	return entry;
+
+err_free:
+	free_entry(entry);
+	return NULL;
+}
+
+/*
+ * Return the directory where device is mounted with fstype,
+ * with a trailing slash. The result must be released with
+ * swupdate_umount_cached().
+ */
+const char *swupdate_mount_cached(const char *device, const char *fstype)
+{
+	struct mount_entry *entry;
+	const char *dir = NULL;
+
+	pthread_mutex_lock(&mounts_lock);
+	LIST_FOREACH(entry, &mounts, next) {
+		if (!strcmp(entry->device, device) &&
+		    !strcmp(entry->fstype, fstype))
+			break;
+	}
+
+	if (entry) {
+		nreuse++;
+	} else {
+		entry = mount_entry(device, fstype);
+		if (entry)
+			TRACE("Mount cache: %s (%s) mounted on %s",
+				device, fstype, entry->dir);
+	}
+
+	if (entry) {
+		entry->refcount++;
+		dir = entry->dir;
+	}
+	pthread_mutex_unlock(&mounts_lock);
+
+	return dir;
+}
+
+int swupdate_umount_cached(const char *dir)
+{
+	struct mount_entry *entry;
+	int ret = 0;
+
+	if (!dir)
+		return 0;
+
+	pthread_mutex_lock(&mounts_lock);
+	LIST_FOREACH(entry, &mounts, next) {
+		if (entry->dir == dir || !strcmp(entry->dir, dir))
+			break;
+	}
+	if (!entry) {
+		pthread_mutex_unlock(&mounts_lock);
+		ERROR("%s is not in the mount cache", dir);
+		return -EINVAL;
+	}
+
+	if (entry->refcount)
+		entry->refcount--;
+	if (!entry->refcount && !session)
+		ret = umount_entry(entry);
+	pthread_mutex_unlock(&mounts_lock);
+
+	return ret;
+}
+
+/*
+ * A device written by something else than a file on the
+ * mounted filesystem must not be mounted at the same time.
+ * NULL releases all the cached mounts.
+ */
+void swupdate_mount_cache_release(const char *device)
+{
+	struct mount_entry *entry, *tmp;
+
+	pthread_mutex_lock(&mounts_lock);
+	LIST_FOREACH_SAFE(entry, &mounts, next, tmp) {
+		if (device && strcmp(entry->device, device))
+			continue;
+		if (entry->refcount) {
+			WARN("Device %s is still in use on %s",
+				entry->device, entry->dir);
+			continue;
+		}
+		TRACE("Mount cache: releasing %s before a device is written",
+			entry->device);
+		umount_entry(entry);
+	}
+	pthread_mutex_unlock(&mounts_lock);
+}
+
+/*
+ * Files written during an installation are synced once at its
+ * end instead of one by one: returns true if the caller does
+ * not need to sync.
+ */
+bool swupdate_mount_cache_defer_sync(void)
+{
+	bool defer;
+
+	pthread_mutex_lock(&mounts_lock);
+	defer = session;
+	if (defer)
+		sync_pending = true;
+	pthread_mutex_unlock(&mounts_lock);
+
+	return defer;
+}
+
+/*
+ * A session already started, as for the images
+ * installed while streaming, goes on
+ */
+void swupdate_mount_cache_begin(void)
+{
+	pthread_mutex_lock(&mounts_lock);
+	if (!session)
+		nmount = numount = nreuse = 0;
+	session = true;
+	pthread_mutex_unlock(&mounts_lock);
+}
+
+/*
+ * Flush and unmount everything mounted during the session
+ */
+int swupdate_mount_cache_end(void)
+{
+	struct mount_entry *entry, *tmp;
+	int ret = 0;
+
+	pthread_mutex_lock(&mounts_lock);
+	session = false;
+	if (!LIST_EMPTY(&mounts) || sync_pending)
+		sync();
+	sync_pending = false;
+	LIST_FOREACH_SAFE(entry, &mounts, next, tmp) {
+		if (entry->refcount) {
+			WARN("Device %s is still in use on %s, not unmounted",
+				entry->device, entry->dir);
+			continue;
+		}
+		if (umount_entry(entry))
+			ret = -1;
+	}
+	if (nmount || numount)
+		TRACE("Mount cache: %u mounts, %u umounts, %u mounts saved",
+			nmount, numount, nreuse);
+	pthread_mutex_unlock(&mounts_lock);
+
+	return ret;
+}
@@ -10,6 +10,10 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sched.h>
+#include <semaphore.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -48,14 +52,87 @@ static struct notifylist clients;
  * It is checked if the notification is
  * coming from the main process - if not,
  * message is sent to an internal IPC
+ *
+ * A subprocess collects its notifications in a batch and sends
+ * it as one datagram: a header followed by count records, each
+ * one with the length of its text (NUL included) and only the
+ * used bytes, padded to 4. The chatter is sent at most after
+ * NOTIFY_IPC_SLICE_MS, and it is rate limited; everything else
+ * is sent at once, after the chatter queued before it.
+ */
+#define NOTIFY_IPC_MAGIC	0x4e544659	/* "NTFY" */
+#define NOTIFY_IPC_BATCH_SIZE	(16 * 1024)
+#define NOTIFY_IPC_SLICE_MS	20
+#define NOTIFY_IPC_RATE		500	/* chatter messages per second */
+
+struct notify_ipc_hdr {
+	uint32_t magic;
+	uint32_t count;
+	uint32_t dropped;	/* chatter dropped before this batch */
+};
+
+struct notify_ipc_rec {
+	int32_t status;
+	int32_t error;
+	int32_t level;
+	uint32_t len;
+	/* followed by len bytes of text, padded to 4 */
+};
+
+#define NOTIFY_IPC_ALIGN(len)	(((len) + 3) & ~3U)
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	size_t used;
+	unsigned int count;
+	unsigned int dropped;
+	struct timespec first;		/* when the batch was started */
+	struct timespec refill;		/* last refill of the tokens */
+	unsigned int tokens;
+	char buf[NOTIFY_IPC_BATCH_SIZE] __attribute__ ((aligned (4)));
+} batch = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.used = sizeof(struct notify_ipc_hdr),
+	.tokens = NOTIFY_IPC_RATE,
+};
+
+/*
+ * In the main process the notifiers do not run in the thread
+ * that emits the notification: notify() copies it into a slot
+ * of a bounded queue and a dispatcher thread calls the notifiers,
+ * so that a slow console or syslog does not block the installer.
+ * Producers claim a slot with a compare and swap on the enqueue
+ * position, so that any thread can notify without a lock; each
+ * slot carries a sequence number telling if it is free (seq == pos),
+ * published (seq == pos + 1) or still being dispatched.
+ * Only the dispatcher reads from the queue.
  */
-struct notify_ipc_msg {
+#define NOTIFY_QUEUE_LEN	128	/* must be a power of 2 */
+#define NOTIFY_FLUSH_TIMEOUT	5	/* seconds */
+
+struct notify_slot {
+	unsigned long seq;
 	RECOVERY_STATUS status;
 	int error;
 	int level;
+	bool nomsg;
 	char buf[NOTIFY_BUF_SIZE];
 };
 
+static struct notify_slot slots[NOTIFY_QUEUE_LEN];
+static unsigned long enqueue_pos;
+static unsigned long dequeue_pos;
+static sem_t notify_sem;
+static pthread_t dispatcher;
+static pid_t dispatcher_pid;
+static bool dispatcher_running;
+static unsigned long dropped, overflows;
+
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;
+
 static struct sockaddr_un notify_client;
 static struct sockaddr_un notify_server;
 static int notifyfd = -1;
@@ -84,35 +161,356 @@ int register_notifier(notifier client)
 	return 0;
 }
 
+static void dispatch(RECOVERY_STATUS status, int error, int level,
+		     const char *msg)
+{
+	struct notify_elem *elem;
+
+	STAILQ_FOREACH(elem, &clients, next)
+		(elem->client)(status, error, level, msg);
+}
+
+/*
+ * Only the chatter can be dropped when the queue is full:
+ * a change of the status, an error or a warning waits for
+ * a free slot.
+ */
+static bool can_drop(RECOVERY_STATUS status, int level)
+{
+	return status == RUN && level >= INFOLEVEL && level <= LASTLOGLEVEL;
+}
+
+static struct notify_slot *claim_slot(RECOVERY_STATUS status, int level)
+{
+	struct notify_slot *slot;
+	unsigned long pos, seq;
+	bool waited = false;
+
+	pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &slots[pos & (NOTIFY_QUEUE_LEN - 1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1,
+					true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if ((long)(seq - pos) < 0) {
+			/* queue is full */
+			if (can_drop(status, level)) {
+				__atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+				return NULL;
+			}
+			if (!waited) {
+				__atomic_fetch_add(&overflows, 1, __ATOMIC_RELAXED);
+				waited = true;
+			}
+			sem_post(&notify_sem);
+			sched_yield();
+			pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+		} else
+			pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+	}
+	slot->status = status;
+	slot->level = level;
+
+	return slot;
+}
+
+static void publish_slot(struct notify_slot *slot)
+{
+	unsigned long pos = slot->seq;
+
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	sem_post(&notify_sem);
+}
+
+/*
+ * The queue is used only by the threads of the process running the
+ * dispatcher, a child forked by the main process and not yet
+ * initialized must not wait for a dispatcher it does not have.
+ */
+static bool use_queue(pid_t self)
+{
+	return dispatcher_running && self == dispatcher_pid &&
+		!pthread_equal(pthread_self(), dispatcher);
+}
+
+static long elapsed_ms(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000 +
+		(to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+/*
+ * Token bucket for the chatter of a subprocess,
+ * the burst is one second of messages
+ */
+static bool take_token(void)
+{
+	struct timespec now;
+	unsigned long refill;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	refill = elapsed_ms(&batch.refill, &now) * NOTIFY_IPC_RATE / 1000;
+	if (refill) {
+		refill += batch.tokens;
+		batch.tokens = refill > NOTIFY_IPC_RATE ? NOTIFY_IPC_RATE : refill;
+		batch.refill = now;
+	}
+	if (!batch.tokens)
+		return false;
+	batch.tokens--;
+
+	return true;
+}
+
+static void batch_started(void)
+{
+	if (batch.count || batch.dropped)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &batch.first);
+	pthread_cond_signal(&batch.cond);
+}
+
+/*
+ * Send the batch, blocking if the main process does not keep up
+ */
+static void batch_send(void)
+{
+	struct notify_ipc_hdr hdr;
+
+	if (!batch.count && !batch.dropped)
+		return;
+
+	hdr.magic = NOTIFY_IPC_MAGIC;
+	hdr.count = batch.count;
+	hdr.dropped = batch.dropped;
+	memcpy(batch.buf, &hdr, sizeof(hdr));
+	while (sendto(notifyfd, batch.buf, batch.used, 0,
+		      (struct sockaddr *) &notify_server,
+		      sizeof(struct sockaddr_un)) < 0 && errno == EINTR);
+
+	batch.used = sizeof(hdr);
+	batch.count = 0;
+	batch.dropped = 0;
+}
+
+static void notify_ipc(RECOVERY_STATUS status, int error, int level,
+		       const char *fmt, va_list ap)
+{
+	struct notify_ipc_rec rec;
+	char *text;
+	int len;
+
+	if (notifyfd <= 0)
+		return;
+
+	pthread_mutex_lock(&batch.lock);
+	if (can_drop(status, level) && !take_token()) {
+		batch_started();
+		batch.dropped++;
+		pthread_mutex_unlock(&batch.lock);
+		return;
+	}
+
+	if (batch.used + sizeof(rec) + NOTIFY_BUF_SIZE > sizeof(batch.buf))
+		batch_send();
+
+	text = batch.buf + batch.used + sizeof(rec);
+	len = fmt ? vsnprintf(text, NOTIFY_BUF_SIZE, fmt, ap) : 0;
+	if (len < 0)
+		len = 0;
+	else if (len >= NOTIFY_BUF_SIZE)
+		len = NOTIFY_BUF_SIZE - 1;
+	text[len] = '\0';
+
+	rec.status = status;
+	rec.error = error;
+	rec.level = level;
+	rec.len = len + 1;
+	memcpy(batch.buf + batch.used, &rec, sizeof(rec));
+
+	batch_started();
+	batch.used += sizeof(rec) + NOTIFY_IPC_ALIGN(rec.len);
+	batch.count++;
+
+	if (!can_drop(status, level))
+		batch_send();
+	pthread_mutex_unlock(&batch.lock);
+}
+
+/*
+ * Subprocess: send the chatter collected in a time slice
+ */
+static void *notify_ipc_flusher(void __attribute__ ((__unused__)) *data)
+{
+	struct timespec now, deadline;
+
+	pthread_mutex_lock(&batch.lock);
+	for (;;) {
+		if (!batch.count && !batch.dropped) {
+			pthread_cond_wait(&batch.cond, &batch.lock);
+			continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (elapsed_ms(&batch.first, &now) >= NOTIFY_IPC_SLICE_MS) {
+			batch_send();
+			continue;
+		}
+		deadline = batch.first;
+		deadline.tv_nsec += NOTIFY_IPC_SLICE_MS * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&batch.cond, &batch.lock, &deadline);
+	}
+
+	return NULL;
+}
+
+static void notify_ipc_flush(void)
+{
+	pthread_mutex_lock(&batch.lock);
+	batch_send();
+	pthread_mutex_unlock(&batch.lock);
+}
+
 /*
  * Main function to send notification. It is checked
  * if it is sent by the main process, where the notifier
  * are running. If not, send the notification via
  * IPC to the main process that will dispatch it
  * to the notifiers.
+ * The message is formatted only once, directly into
+ * the slot of the queue (or into the IPC message).
  */
+static void vnotify(RECOVERY_STATUS status, int error, int level,
+		    const char *fmt, va_list ap)
+{
+	struct notify_slot *slot;
+	char buf[NOTIFY_BUF_SIZE];
+	pid_t self = getpid();
+
+	if (pid == self) {
+		notify_ipc(status, error, level, fmt, ap);
+		return;
+	}
+
+	/* Main process */
+	if (!use_queue(self)) {
+		/*
+		 * Before the dispatcher is started or when a notifier
+		 * notifies itself, the notifiers are called directly
+		 */
+		if (fmt)
+			vsnprintf(buf, sizeof(buf), fmt, ap);
+		dispatch(status, error, level, fmt ? buf : NULL);
+		return;
+	}
+
+	slot = claim_slot(status, level);
+	if (!slot)
+		return;
+	slot->error = error;
+	slot->nomsg = !fmt;
+	if (fmt)
+		vsnprintf(slot->buf, sizeof(slot->buf), fmt, ap);
+	publish_slot(slot);
+}
+
+static void notify_msg(RECOVERY_STATUS status, int error, int level,
+		       const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vnotify(status, error, level, fmt, ap);
+	va_end(ap);
+}
+
 void notify(RECOVERY_STATUS status, int error, int level, const char *msg)
 {
-	struct notify_elem *elem;
-	struct notify_ipc_msg notifymsg;
+	if (msg)
+		notify_msg(status, error, level, "%s", msg);
+	else
+		notify_msg(status, error, level, NULL);
+}
 
-	if (pid == getpid()) {
-		if (notifyfd > 0) {
-			notifymsg.status = status;
-			notifymsg.error = error;
-			notifymsg.level = level;
-			if (msg)
-				strcpy(notifymsg.buf, msg);
-			else
-				notifymsg.buf[0] = '\0';
-			sendto(notifyfd, &notifymsg, sizeof(notifymsg), 0,
-			      (struct sockaddr *) &notify_server,
-				sizeof(struct sockaddr_un));
+void notifyf(RECOVERY_STATUS status, int error, int level,
+	     const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vnotify(status, error, level, fmt, ap);
+	va_end(ap);
+}
+
+/*
+ * Dispatcher thread: it calls the notifiers for
+ * the queued notifications, in the order they were
+ * queued.
+ */
+static void *notify_dispatcher(void __attribute__ ((__unused__)) *data)
+{
+	struct notify_slot *slot;
+	unsigned long ndropped, noverflows;
+
+	for (;;) {
+		while (sem_wait(&notify_sem) && errno == EINTR);
+
+		for (;;) {
+			slot = &slots[dequeue_pos & (NOTIFY_QUEUE_LEN - 1)];
+			if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) !=
+			    dequeue_pos + 1)
+				break;
+			dispatch(slot->status, slot->error, slot->level,
+				 slot->nomsg ? NULL : slot->buf);
+			__atomic_store_n(&slot->seq, dequeue_pos + NOTIFY_QUEUE_LEN,
+					 __ATOMIC_RELEASE);
+			__atomic_store_n(&dequeue_pos, dequeue_pos + 1,
+					 __ATOMIC_RELEASE);
 		}
-	} else { /* Main process */
-		STAILQ_FOREACH(elem, &clients, next)
-			(elem->client)(status, error, level, msg);
+
+		ndropped = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+		noverflows = __atomic_exchange_n(&overflows, 0, __ATOMIC_RELAXED);
+		if (ndropped || noverflows)
+			notify_msg(RUN, RECOVERY_NO_ERROR, WARNLEVEL,
+				   "Notification queue full: %lu messages dropped, "
+				   "%lu waited", ndropped, noverflows);
+
+		pthread_mutex_lock(&flush_lock);
+		pthread_cond_broadcast(&flush_cond);
+		pthread_mutex_unlock(&flush_lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * Wait until the notifiers have seen all notifications
+ * queued before the call
+ */
+void notify_flush(void)
+{
+	unsigned long target;
+	struct timespec deadline;
+
+	if (!use_queue(getpid()))
+		return;
+
+	target = __atomic_load_n(&enqueue_pos, __ATOMIC_ACQUIRE);
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += NOTIFY_FLUSH_TIMEOUT;
+
+	pthread_mutex_lock(&flush_lock);
+	while ((long)(__atomic_load_n(&dequeue_pos, __ATOMIC_ACQUIRE) - target) < 0) {
+		if (pthread_cond_timedwait(&flush_cond, &flush_lock, &deadline) ==
+		    ETIMEDOUT)
+			break;
 	}
+	pthread_mutex_unlock(&flush_lock);
 }
 
 /*
@@ -258,9 +656,13 @@ static void addr_init(struct sockaddr_un *addr, const char *path)
 static void *notifier_thread (void __attribute__ ((__unused__)) *data)
 {
 	int serverfd;
-	int len;
+	ssize_t len;
 	int attempt = 0;
-	struct notify_ipc_msg msg;
+	static char buf[NOTIFY_IPC_BATCH_SIZE] __attribute__ ((aligned (4)));
+	struct notify_ipc_hdr hdr;
+	struct notify_ipc_rec rec;
+	size_t off;
+	unsigned int i;
 
 	/* Initialize and bind to UDS */
 	serverfd = socket(AF_UNIX, SOCK_DGRAM, 0);
@@ -296,11 +698,29 @@ static void *notifier_thread (void __attribute__ ((__unused__)) *data)
 	} while (1);
 
 	do {
-		len =  recvfrom(serverfd, &msg, sizeof(msg), 0, NULL, NULL);
-
-		if (len > 0) {
-			notify(msg.status, msg.error, msg.level, msg.buf);
+		len =  recvfrom(serverfd, buf, sizeof(buf), 0, NULL, NULL);
+
+		if (len < (ssize_t)sizeof(hdr))
+			continue;
+		memcpy(&hdr, buf, sizeof(hdr));
+		if (hdr.magic != NOTIFY_IPC_MAGIC)
+			continue;
+
+		off = sizeof(hdr);
+		for (i = 0; i < hdr.count; i++) {
+			if (off + sizeof(rec) > (size_t)len)
+				break;
+			memcpy(&rec, buf + off, sizeof(rec));
+			off += sizeof(rec);
+			if (!rec.len || rec.len > (size_t)len - off ||
+			    buf[off + rec.len - 1] != '\0')
+				break;
+			notify(rec.status, rec.error, rec.level, buf + off);
+			off += NOTIFY_IPC_ALIGN(rec.len);
 		}
+		if (hdr.dropped)
+			WARN("%u notifications dropped by a subprocess",
+				hdr.dropped);
 
 	} while(1);
 }
@@ -355,16 +775,32 @@ void notify_init(void)
 			close(notifyfd);
 			return;
 		}
+		clock_gettime(CLOCK_MONOTONIC, &batch.refill);
+		start_thread(notify_ipc_flusher, NULL);
+		if (atexit(notify_ipc_flush) != 0)
+			fprintf(stderr, "Cannot flush notifications on exit\n");
 	} else {
 		/*
 		 * If this is the main process, start setting the name of the
 		 * socket. This can changed if more as one instance of swupdate
 		 * is started (name adjusted to avoid adrress is in use)
 		 */
+		unsigned int i;
+
 		addr_init(&notify_server, "NotifyServer");
 		STAILQ_INIT(&clients);
 		register_notifier(console_notifier);
 		register_notifier(process_notifier);
+
+		for (i = 0; i < NOTIFY_QUEUE_LEN; i++)
+			slots[i].seq = i;
+		sem_init(&notify_sem, 0, 0);
+		dispatcher_pid = getpid();
+		dispatcher = start_thread(notify_dispatcher, NULL);
+		dispatcher_running = true;
+		if (atexit(notify_flush) != 0)
+			TRACE("Cannot flush notifications on exit");
+
 		start_thread(notifier_thread, NULL);
 	}
 }
@@ -375,6 +375,7 @@ static int install_from_file(char *fname, int check)
 
 	ret = install_images(&swcfg, fdsw, 1);
 
+	notify_flush();
 	swupdate_progress_end(ret == 0 ? SUCCESS : FAILURE);
 
 	close(fdsw);
@@ -508,6 +509,7 @@ static int read_globals_settings(void *elem, void *data)
 	get_field(LIBCFG_PARSER, elem, "verbose", &sw->globals.verbose);
 	get_field(LIBCFG_PARSER, elem, "loglevel", &sw->globals.loglevel);
 	get_field(LIBCFG_PARSER, elem, "syslog", &sw->globals.syslog_enabled);
+	get_field(LIBCFG_PARSER, elem, "progress-rate", &sw->globals.progress_rate);
 	GET_FIELD_STRING(LIBCFG_PARSER, elem,
 				"no-downgrading", sw->globals.minimum_version);
 	if (strlen(sw->globals.minimum_version))
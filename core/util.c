@@ -182,6 +182,104 @@ int openfileoutput(const char *filename)
 	return fdout;
 }
 
+/*
+ * Create a temporary file in the same directory as filename, so that
+ * it can replace filename atomically with rename() once it is written.
+ * If filename already exists, the temporary file gets its mode and
+ * owner. Files with more hard links are not replaced, because rename()
+ * would break the links. On failure, *tmpname is NULL.
+ */
+int openfileoutput_tmp(const char *filename, char **tmpname)
+{
+	struct stat st;
+	char *dir, *base;
+	int fdout;
+
+	*tmpname = NULL;
+	if (!stat(filename, &st)) {
+		if (!S_ISREG(st.st_mode) || st.st_nlink > 1)
+			return -1;
+	} else if (errno != ENOENT) {
+		return -1;
+	} else {
+		st.st_mode = S_IRUSR | S_IWUSR;
+		st.st_uid = geteuid();
+		st.st_gid = getegid();
+	}
+
+	dir = dirname(strdupa(filename));
+	base = basename(strdupa(filename));
+	if (asprintf(tmpname, "%s/.%s.XXXXXX", dir, base) == ENOMEM_ASPRINTF) {
+		*tmpname = NULL;
+		return -1;
+	}
+
+	fdout = mkstemp(*tmpname);
+	if (fdout < 0) {
+		TRACE("Cannot create %s: %s", *tmpname, strerror(errno));
+		free(*tmpname);
+		*tmpname = NULL;
+		return -1;
+	}
+
+	if (fchmod(fdout, st.st_mode & 07777) ||
+	    ((st.st_uid != geteuid() || st.st_gid != getegid()) &&
+	     fchown(fdout, st.st_uid, st.st_gid))) {
+		TRACE("Cannot set owner and mode of %s: %s", *tmpname,
+			strerror(errno));
+		close(fdout);
+		unlink(*tmpname);
+		free(*tmpname);
+		*tmpname = NULL;
+		return -1;
+	}
+
+	return fdout;
+}
+
+/*
+ * Move a file created with openfileoutput_tmp() in place,
+ * the file descriptor is closed in any case. During an
+ * installation the data is synced once at its end.
+ */
+int closefileoutput_tmp(int fdout, char *tmpname, const char *filename,
+			bool commit)
+{
+	bool sync_now = !swupdate_mount_cache_defer_sync();
+	int ret = 0, fddir;
+
+	if (commit && sync_now && fsync(fdout)) {
+		ERROR("Cannot sync %s: %s", tmpname, strerror(errno));
+		ret = -1;
+	}
+	if (close(fdout) && commit && !ret) {
+		ERROR("Cannot close %s: %s", tmpname, strerror(errno));
+		ret = -1;
+	}
+
+	if (commit && !ret) {
+		if (rename(tmpname, filename)) {
+			ERROR("Cannot rename %s to %s: %s", tmpname, filename,
+				strerror(errno));
+			ret = -1;
+		} else {
+			fddir = sync_now ?
+				open(dirname(tmpname), O_RDONLY | O_DIRECTORY) : -1;
+			if (fddir >= 0) {
+				(void)fsync(fddir);
+				close(fddir);
+			}
+			free(tmpname);
+			return 0;
+		}
+	}
+
+	unlink(tmpname);
+	free(tmpname);
+
+	return ret;
+}
+
 int mkpath(char *dir, mode_t mode)
 {
 	if (!dir) {
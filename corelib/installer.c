@@ -20,6 +20,11 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/mount.h>
+#if defined(__linux__)
+#include <sys/sysmacros.h>
+#endif
+#include <pthread.h>
+#include <signal.h>
 
 #include "generated/autoconf.h"
 #include "bsdqueue.h"
@@ -33,6 +38,165 @@
 #include "bootloader.h"
 #include "progress.h"
 
+/* Pipe size for each target when an image is installed to several targets */
+#define FANOUT_PIPE_SIZE	(1024 * 1024)
+
+/* Maximum number of images installed at the same time */
+#define MAX_PARALLEL_INSTALL	4
+
+/*
+ * Target of an image installed to several handlers at once:
+ * the handler runs in its own thread and reads the already
+ * decrypted / decompressed data from a pipe.
+ */
+struct fanout_sink {
+	struct img_type img;	/* copy of the image, reads from the pipe */
+	struct installer_handler *hnd;
+	pthread_t thread;
+	bool running;
+	int fd;			/* write end of the pipe, -1 when closed */
+	int ret;
+};
+
+struct fanout_state {
+	struct fanout_sink *sinks;
+	unsigned int count;
+};
+
+/*
+ * Images installed by the scheduler in one step: more
+ * images are there if the same file is decoded once for
+ * several targets. Jobs holding different devices run
+ * in parallel if their handlers allow it.
+ */
+struct install_job {
+	struct img_type **imgs;
+	unsigned int count;
+	bool parallel;
+	int fdin;
+	bool private_fd;	/* fdin must be closed after install */
+	int dry_run;
+	pthread_t thread;
+	int ret;
+};
+
+/*
+ * Handler for an image, replaced by the
+ * dummy one in case of dry run
+ */
+static struct installer_handler *image_handler(struct img_type *img, int dry_run)
+{
+	if (dry_run)
+		strcpy(img->type, "dummy");
+
+	return find_handler(img);
+}
+
+#if defined(__linux__)
+/*
+ * Number of a block device and of the disk it is on,
+ * the same if it is not a partition. 0 if not a block device.
+ */
+static dev_t block_device(const char *device, dev_t *disk)
+{
+	char path[64];
+	unsigned int major_nr, minor_nr;
+	struct stat st;
+	FILE *fp;
+
+	*disk = 0;
+	if (stat(device, &st) || !S_ISBLK(st.st_mode))
+		return 0;
+
+	*disk = st.st_rdev;
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/partition",
+		 major(st.st_rdev), minor(st.st_rdev));
+	if (access(path, F_OK))
+		return st.st_rdev;
+
+	/* the parent of a partition in sysfs is the disk */
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../dev",
+		 major(st.st_rdev), minor(st.st_rdev));
+	fp = fopen(path, "r");
+	if (fp) {
+		if (fscanf(fp, "%u:%u", &major_nr, &minor_nr) == 2)
+			*disk = makedev(major_nr, minor_nr);
+		fclose(fp);
+	}
+
+	return st.st_rdev;
+}
+#endif
+
+/*
+ * Check if two images hold the same device, NULL
+ * device means the image must be installed alone.
+ * A disk and its partitions are the same device.
+ */
+static bool same_device(const char *a, const char *b)
+{
+#if defined(__linux__)
+	dev_t dev_a, dev_b, disk_a, disk_b;
+#endif
+
+	if (!a || !b || !strcmp(a, b))
+		return true;
+
+#if defined(__linux__)
+	dev_a = block_device(a, &disk_a);
+	dev_b = block_device(b, &disk_b);
+	if (!dev_a || !dev_b)
+		return false;
+
+	return dev_a == dev_b || dev_a == disk_b || dev_b == disk_a;
+#else
+	return false;
+#endif
+}
+
+/*
+ * Images decoded once run at the same time and read from a pipe:
+ * handlers must support streaming and concurrency
+ */
+static bool fanout_handlers_ok(struct img_type *imgs[], unsigned int count,
+			       int dry_run)
+{
+	struct installer_handler *hnd;
+	const char *devices[count];
+	unsigned int i, j;
+
+	for (i = 0; i < count; i++) {
+		hnd = image_handler(imgs[i], dry_run);
+		if (!hnd || !(hnd->caps.flags & HANDLER_CAP_STREAM) ||
+		    hnd->caps.concurrency == HANDLER_EXCLUSIVE)
+			return false;
+		devices[i] = NULL;
+		if (hnd->caps.concurrency == HANDLER_SHARED)
+			continue;
+		devices[i] = get_handler_device(hnd, imgs[i]);
+		if (!devices[i])
+			return false;
+		for (j = 0; j < i; j++)
+			if (devices[j] && !strcmp(devices[i], devices[j]))
+				return false;
+	}
+
+	return true;
+}
+
+/*
+ * Images referring to the same file can be decoded
+ * once and installed together
+ */
+static bool fanout_compatible(struct img_type *a, struct img_type *b)
+{
+	return !strcmp(a->fname, b->fname) &&
+		a->compressed == b->compressed &&
+		a->is_encrypted == b->is_encrypted &&
+		a->install_directly == b->install_directly &&
+		!memcmp(a->sha256, b->sha256, sizeof(a->sha256));
+}
+
 /*
  * function returns:
  * 0 = do not skip the file, it must be installed
@@ -65,21 +229,32 @@ int check_if_required(struct imglist *list, struct filehdr *pfdh,
 				return -EBADF;
 			}
 			/*
-			 *  Streaming is possible to only one handler
-			 *  If more img requires the same file,
-			 *  sw-description contains an error
+			 *  Streaming to several handlers is possible
+			 *  only if the file is decoded in the same way
+			 *  for all of them (see install_fanout())
 			 */
-			if (install_direct) {
-				ERROR("sw-description: stream to several handlers unsupported");
-				return -EINVAL;
-			}
+			if (img->install_directly) {
+				struct installer_handler *hnd = find_handler(img);
 
+				if (hnd && !(hnd->caps.flags & HANDLER_CAP_STREAM)) {
+					WARN("Handler %s cannot stream, %s is extracted first",
+						hnd->desc, img->fname);
+					img->install_directly = 0;
+				}
+			}
 			if (img->install_directly) {
+				if (install_direct &&
+				    !fanout_compatible(*pimg, img)) {
+					ERROR("sw-description: stream to several handlers "
+					      "with different compression, encryption "
+					      "or sha256 unsupported");
+					return -EINVAL;
+				}
 				skip = INSTALL_FROM_STREAM;
 				install_direct++;
-			}
-
-			*pimg = img;
+				*pimg = img;
+			} else if (!install_direct)
+				*pimg = img;
 		}
 	}
 
@@ -238,6 +413,488 @@ int install_single_image(struct img_type *img, int dry_run)
 	return ret;
 }
 
+/*
+ * Size of the data passed to the handlers: if the image
+ * is compressed or encrypted, it must be set in sw-description
+ * with the "decompressed-size" property.
+ */
+static long long fanout_size(struct img_type *imgs[], unsigned int count)
+{
+	char *value, *first = NULL;
+	unsigned int i;
+
+	if (!imgs[0]->compressed && !imgs[0]->is_encrypted)
+		return imgs[0]->size;
+
+	for (i = 0; i < count; i++) {
+		value = dict_get_value(&imgs[i]->properties, "decompressed-size");
+		if (!value || (first && strcmp(first, value)))
+			return -1;
+		first = value;
+	}
+
+	return ustrtoull(first, 0);
+}
+
+static void *fanout_sink_thread(void *data)
+{
+	struct fanout_sink *sink = (struct fanout_sink *)data;
+
+	/* the progress is the one of the decoder */
+	swupdate_progress_mute(true);
+	sink->ret = sink->hnd->installer(&sink->img, sink->hnd->data);
+	if (sink->ret)
+		TRACE("Installer for %s not successful !", sink->hnd->desc);
+
+	/*
+	 * Closing the read end lets the writer know
+	 * that this handler does not take more data
+	 */
+	close(sink->img.fdin);
+
+	return NULL;
+}
+
+static int fanout_write(void *out, const void *buf, unsigned int len)
+{
+	struct fanout_state *state = (struct fanout_state *)out;
+	struct fanout_sink *sink;
+	unsigned int i, count;
+	const char *p;
+	ssize_t ret;
+
+	for (i = 0; i < state->count; i++) {
+		sink = &state->sinks[i];
+		p = buf;
+		count = len;
+		while (sink->fd >= 0 && count) {
+			ret = write(sink->fd, p, count);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret > 0) {
+				p += ret;
+				count -= ret;
+				continue;
+			}
+			if (errno != EPIPE) {
+				ERROR("cannot pass data to %s: %s",
+					sink->img.type, strerror(errno));
+				return -1;
+			}
+
+			/*
+			 * The handler has returned: an error stops
+			 * the installation of all targets, a handler
+			 * that does not need the rest is simply dropped.
+			 */
+			close(sink->fd);
+			sink->fd = -1;
+			pthread_join(sink->thread, NULL);
+			sink->running = false;
+			if (sink->ret) {
+				ERROR("Installing %s to %s failed, stopping all targets",
+					sink->img.fname, sink->img.type);
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Install an image to several targets decoding (reading,
+ * verifying, decrypting, decompressing) it just once.
+ * The first image provides the input (fdin, offset, size),
+ * each handler gets the plain data through its own pipe and
+ * runs in its own thread. If a target or the decoding fails,
+ * the whole group fails.
+ */
+int install_fanout(struct img_type *imgs[], unsigned int count, int dry_run)
+{
+	struct img_type *img = imgs[0];
+	struct fanout_state state;
+	struct fanout_sink *sink;
+	sigset_t sigpipe_mask, saved_mask;
+	struct timespec zerotime = {0, 0};
+	long long size;
+	unsigned int i;
+	int fds[2];
+	int ret = 0, sink_ret = 0;
+
+	if (count == 1)
+		return install_single_image(img, dry_run);
+
+	size = fanout_size(imgs, count);
+	if (size < 0) {
+		ERROR("%s is installed %u times, \"decompressed-size\" must be set",
+			img->fname, count);
+		return -EINVAL;
+	}
+	if (!fanout_handlers_ok(imgs, count, dry_run)) {
+		ERROR("%s is installed %u times, but the handlers cannot "
+		      "get it at the same time", img->fname, count);
+		return -EINVAL;
+	}
+
+	state.count = count;
+	state.sinks = (struct fanout_sink *)calloc(count, sizeof(*state.sinks));
+	if (!state.sinks)
+		return -ENOMEM;
+
+	for (i = 0; i < count; i++) {
+		sink = &state.sinks[i];
+		sink->fd = -1;
+		sink->hnd = image_handler(imgs[i], dry_run);
+		if (!sink->hnd) {
+			TRACE("Image Type %s not supported", imgs[i]->type);
+			ret = -1;
+			goto out;
+		}
+	}
+
+	TRACE("Installing %s to %u targets", img->fname, count);
+	swupdate_progress_inc_step(img->fname);
+
+	/* The writer must get EPIPE instead of being killed */
+	sigemptyset(&sigpipe_mask);
+	sigaddset(&sigpipe_mask, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &sigpipe_mask, &saved_mask);
+
+	for (i = 0; i < count; i++) {
+		sink = &state.sinks[i];
+		if (pipe(fds) < 0) {
+			ERROR("Cannot create pipe: %s", strerror(errno));
+			ret = -EFAULT;
+			break;
+		}
+#ifdef F_SETPIPE_SZ
+		/* best effort, the default size is enough to work */
+		fcntl(fds[1], F_SETPIPE_SZ,
+		      max((unsigned int)FANOUT_PIPE_SIZE,
+			  sink->hnd->caps.buffer_size));
+#endif
+
+		sink->img = *imgs[i];
+		sink->img.fdin = fds[0];
+		sink->img.offset = 0;
+		sink->img.size = size;
+		sink->img.checksum = 0;
+		sink->img.compressed = 0;
+		sink->img.is_encrypted = 0;
+		/* verified once while decoding */
+		memset(sink->img.sha256, 0, sizeof(sink->img.sha256));
+		sink->fd = fds[1];
+
+		TRACE("Found installer for stream %s %s", imgs[i]->fname,
+			sink->hnd->desc);
+		if (pthread_create(&sink->thread, NULL, fanout_sink_thread, sink)) {
+			ERROR("Cannot start thread for %s", imgs[i]->type);
+			close(fds[0]);
+			close(fds[1]);
+			sink->fd = -1;
+			ret = -EFAULT;
+			break;
+		}
+		sink->running = true;
+	}
+
+	if (!ret)
+		ret = copyfile(img->fdin, &state, img->size,
+			       (unsigned long *)&img->offset, 0, 0,
+			       img->compressed, &img->checksum,
+			       img->sha256, img->is_encrypted,
+			       fanout_write);
+
+	/*
+	 * EOF for the handlers, then collect the results:
+	 * a failing handler is the reason if decoding was stopped
+	 */
+	for (i = 0; i < count; i++) {
+		sink = &state.sinks[i];
+		if (sink->fd >= 0)
+			close(sink->fd);
+		if (sink->running)
+			pthread_join(sink->thread, NULL);
+		if (sink->ret && !sink_ret)
+			sink_ret = sink->ret;
+	}
+	if (sink_ret)
+		ret = sink_ret;
+
+	/* Drop a pending SIGPIPE before restoring the mask */
+	while (sigtimedwait(&sigpipe_mask, NULL, &zerotime) > 0);
+	pthread_sigmask(SIG_SETMASK, &saved_mask, NULL);
+
+	swupdate_progress_step_completed();
+	/* one step for each image in the progress */
+	for (i = 1; i < count; i++) {
+		swupdate_progress_inc_step(imgs[i]->fname);
+		swupdate_progress_step_completed();
+	}
+
+out:
+	free(state.sinks);
+	return ret;
+}
+
+static const char *job_image_device(struct img_type *img, int dry_run)
+{
+	struct installer_handler *hnd = image_handler(img, dry_run);
+
+	if (!hnd || hnd->caps.concurrency == HANDLER_SHARED)
+		return NULL;
+
+	return get_handler_device(hnd, img);
+}
+
+/*
+ * A job can run together with other jobs if all its handlers
+ * allow it and the devices they hold are known
+ */
+static bool job_parallel(struct install_job *job)
+{
+	struct installer_handler *hnd;
+	struct img_type *img;
+	unsigned int i;
+
+	for (i = 0; i < job->count; i++) {
+		img = job->imgs[i];
+		hnd = image_handler(img, job->dry_run);
+		if (!hnd)
+			return false;
+		if (hnd->caps.concurrency == HANDLER_EXCLUSIVE) {
+			TRACE("Scheduler: %s is installed alone, handler %s is exclusive",
+				img->fname, hnd->desc);
+			return false;
+		}
+		if (hnd->caps.concurrency == HANDLER_PER_DEVICE &&
+		    !get_handler_device(hnd, img)) {
+			TRACE("Scheduler: %s is installed alone, no device for handler %s",
+				img->fname, hnd->desc);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Check if a job holds a device used by one of the
+ * jobs already selected to run at the same time
+ */
+static bool jobs_conflict(struct install_job *batch, unsigned int count,
+			  struct install_job *job)
+{
+	const char *dev, *other;
+	unsigned int i, j, k;
+
+	for (i = 0; i < job->count; i++) {
+		dev = job_image_device(job->imgs[i], job->dry_run);
+		if (!dev)
+			continue;
+		for (j = 0; j < count; j++) {
+			for (k = 0; k < batch[j].count; k++) {
+				other = job_image_device(batch[j].imgs[k],
+							 batch[j].dry_run);
+				if (other && same_device(dev, other)) {
+					TRACE("Scheduler: %s waits for %s, both use %s",
+						job->imgs[i]->fname,
+						batch[j].imgs[k]->fname, dev);
+					return true;
+				}
+			}
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Set the input for the first image of a job: the
+ * temporary copy or the image in the SWU file. Jobs
+ * running in parallel need their own file offset,
+ * -EAGAIN if the SWU file cannot be opened again.
+ */
+static int prepare_job(struct install_job *job, int fdsw, int fromfile,
+		       bool private_fd)
+{
+	struct img_type *img = job->imgs[0];
+	const char* TMPDIR = get_tmpdir();
+	struct filehdr fdh;
+	struct stat buf;
+	char *filename;
+	int ret;
+
+	if (!fromfile) {
+		if (asprintf(&filename, "%s%s", TMPDIR, img->fname) ==
+			ENOMEM_ASPRINTF) {
+			ERROR("Path too long: %s%s", TMPDIR, img->fname);
+			return -1;
+		}
+
+		ret = stat(filename, &buf);
+		if (ret) {
+			TRACE("%s not found or wrong", filename);
+			free(filename);
+			return -1;
+		}
+		img->size = buf.st_size;
+
+		job->fdin = open(filename, O_RDONLY);
+		free(filename);
+		if (job->fdin < 0) {
+			ERROR("Image %s cannot be opened",
+			img->fname);
+			return -1;
+		}
+		job->private_fd = true;
+	} else {
+		job->fdin = fdsw;
+		if (private_fd) {
+			if (asprintf(&filename, "/proc/self/fd/%d", fdsw) ==
+				ENOMEM_ASPRINTF)
+				return -ENOMEM;
+			job->fdin = open(filename, O_RDONLY);
+			free(filename);
+			if (job->fdin < 0) {
+				TRACE("Image %s cannot be opened again: %s",
+					img->fname, strerror(errno));
+				return -EAGAIN;
+			}
+			job->private_fd = true;
+		}
+		if (extract_img_from_cpio(job->fdin, img->offset, &fdh) < 0)
+			return -1;
+		img->size = fdh.size;
+		img->checksum = fdh.chksum;
+	}
+	img->fdin = job->fdin;
+
+	return 0;
+}
+
+static void cleanup_job(struct install_job *job)
+{
+	if (job->private_fd)
+		close(job->fdin);
+	job->private_fd = false;
+	job->fdin = -1;
+}
+
+static void *install_job_thread(void *data)
+{
+	struct install_job *job = (struct install_job *)data;
+
+	job->ret = install_fanout(job->imgs, job->count, job->dry_run);
+
+	return NULL;
+}
+
+static int run_jobs(struct install_job *jobs, unsigned int count,
+		    int fdsw, int fromfile)
+{
+	struct install_job *job;
+	bool *started, *serial;
+	unsigned int i, j;
+	int ret = 0;
+
+	if (count == 1) {
+		ret = prepare_job(jobs, fdsw, fromfile, false);
+		if (!ret)
+			ret = install_fanout(jobs->imgs, jobs->count, jobs->dry_run);
+		cleanup_job(jobs);
+		return ret;
+	}
+
+	started = (bool *)calloc(2 * count, sizeof(*started));
+	if (!started)
+		return -ENOMEM;
+	serial = &started[count];
+
+	TRACE("Scheduler: installing %u images in parallel", count);
+	for (i = 0; i < count && !ret; i++) {
+		job = &jobs[i];
+		for (j = 0; j < job->count; j++)
+			TRACE("Scheduler:   %s with %s on %s", job->imgs[j]->fname,
+				job->imgs[j]->type,
+				job_image_device(job->imgs[j], job->dry_run) ?: "-");
+		ret = prepare_job(job, fdsw, fromfile, true);
+		if (ret == -EAGAIN) {
+			/* it shares the SWU file, installed after the others */
+			TRACE("Scheduler: %s is installed alone",
+				job->imgs[0]->fname);
+			serial[i] = true;
+			ret = 0;
+			continue;
+		}
+		if (ret)
+			break;
+		if (pthread_create(&job->thread, NULL, install_job_thread, job)) {
+			TRACE("Scheduler: cannot start thread, installing %s now",
+				job->imgs[0]->fname);
+			ret = install_fanout(job->imgs, job->count, job->dry_run);
+			cleanup_job(job);
+			continue;
+		}
+		started[i] = true;
+	}
+
+	/* wait for all of them, even if one has failed */
+	for (i = 0; i < count; i++) {
+		job = &jobs[i];
+		if (started[i]) {
+			pthread_join(job->thread, NULL);
+			if (!ret)
+				ret = job->ret;
+		}
+		cleanup_job(job);
+	}
+
+	for (i = 0; i < count && !ret; i++) {
+		if (!serial[i])
+			continue;
+		job = &jobs[i];
+		ret = prepare_job(job, fdsw, fromfile, false);
+		if (!ret)
+			ret = install_fanout(job->imgs, job->count, job->dry_run);
+		cleanup_job(job);
+	}
+
+	free(started);
+	return ret;
+}
+
+/*
+ * Images writing a device without mounting it must not
+ * find it still mounted by a previous image. A raw write
+ * can go to the disk of a mounted partition and UBI volumes
+ * are set by name: nothing stays mounted while they are written.
+ */
+void release_mounts(struct img_type *imgs[], unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		if ((strlen(imgs[i]->device) && !strlen(imgs[i]->filesystem)) ||
+		    strlen(imgs[i]->volname)) {
+			swupdate_mount_cache_release(NULL);
+			return;
+		}
+	}
+}
+
+static void free_jobs(struct install_job *jobs, unsigned int njobs)
+{
+	unsigned int i;
+
+	if (!jobs)
+		return;
+	for (i = 0; i < njobs; i++)
+		free(jobs[i].imgs);
+	free(jobs);
+}
+
 /*
  * streamfd: file descriptor if it is required to extract
  *           images from the stream (update from file)
@@ -248,11 +905,13 @@ int install_images(struct swupdate_cfg *sw, int fdsw, int fromfile)
 {
 	int ret;
 	struct img_type *img;
-	char *filename;
-	struct filehdr fdh;
-	struct stat buf;
 	const char* TMPDIR = get_tmpdir();
 	int dry_run = sw->globals.dry_run;
+	struct img_type **imgs = NULL;
+	struct install_job *jobs = NULL, *job;
+	bool *done = NULL;
+	unsigned int nimgs = 0, njobs = 0, count, i, j, k;
+	unsigned long long expected;
 
 	/* Extract all scripts, preinstall scripts must be run now */
 	const char* tmpdir_scripts = get_tmpdirscripts();
@@ -272,7 +931,28 @@ int install_images(struct swupdate_cfg *sw, int fdsw, int fromfile)
 		}
 	}
 
-	LIST_FOREACH(img, &sw->images, next) {
+	/* Devices mounted by the handlers stay mounted until the end */
+	swupdate_mount_cache_begin();
+
+	LIST_FOREACH(img, &sw->images, next)
+		nimgs++;
+	imgs = (struct img_type **)calloc(nimgs + 1, sizeof(*imgs));
+	jobs = (struct install_job *)calloc(nimgs + 1, sizeof(*jobs));
+	done = (bool *)calloc(nimgs + 1, sizeof(*done));
+	if (!imgs || !jobs || !done) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	nimgs = 0;
+	LIST_FOREACH(img, &sw->images, next)
+		imgs[nimgs++] = img;
+
+	for (i = 0; i < nimgs; i++) {
+		img = imgs[i];
+
+		/* already installed together with a previous image */
+		if (done[i])
+			continue;
 
 		/*
 		 *  If image is flagged to be installed from stream
@@ -284,36 +964,6 @@ int install_images(struct swupdate_cfg *sw, int fdsw, int fromfile)
 		if (!fromfile && img->install_directly)
 			continue;
 
-		if (!fromfile) {
-		    if (asprintf(&filename, "%s%s", TMPDIR, img->fname) ==
-				ENOMEM_ASPRINTF) {
-				ERROR("Path too long: %s%s", TMPDIR, img->fname);
-				return -1;
-			}
-
-			ret = stat(filename, &buf);
-			if (ret) {
-				TRACE("%s not found or wrong", filename);
-				free(filename);
-				return -1;
-			}
-			img->size = buf.st_size;
-
-			img->fdin = open(filename, O_RDONLY);
-			free(filename);
-			if (img->fdin < 0) {
-				ERROR("Image %s cannot be opened",
-				img->fname);
-				return -1;
-			}
-		} else {
-			if (extract_img_from_cpio(fdsw, img->offset, &fdh) < 0)
-				return -1;
-			img->size = fdh.size;
-			img->checksum = fdh.chksum;
-			img->fdin = fdsw;
-		}
-
 		if ((strlen(img->path) > 0) &&
 			(strlen(img->extract_file) > 0) &&
 			(strncmp(img->path, img->extract_file, sizeof(img->path)) == 0)){
@@ -329,17 +979,88 @@ int install_images(struct swupdate_cfg *sw, int fdsw, int fromfile)
 				}
 			}
 			free_image(img);
-			ret = 0;
-		} else {
-			ret = install_single_image(img, dry_run);
+			continue;
 		}
 
-		if (!fromfile)
-			close(img->fdin);
+		job = &jobs[njobs++];
+		job->imgs = (struct img_type **)calloc(nimgs, sizeof(*job->imgs));
+		if (!job->imgs) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		job->dry_run = dry_run;
+		job->fdin = -1;
 
+		/*
+		 * Other images referring to the same file are
+		 * installed now, decoding the file just once
+		 */
+		job->imgs[0] = img;
+		job->count = 1;
+		for (j = i + 1; j < nimgs; j++) {
+			if (done[j] || !fanout_compatible(img, imgs[j]))
+				continue;
+			if ((strlen(imgs[j]->path) > 0) &&
+			    !strncmp(imgs[j]->path, imgs[j]->extract_file,
+				     sizeof(imgs[j]->path)))
+				continue;
+			job->imgs[job->count++] = imgs[j];
+		}
+		if (job->count > 1 && fanout_size(job->imgs, job->count) < 0) {
+			TRACE("%s: \"decompressed-size\" not set, "
+			      "decoding it for each target", img->fname);
+			job->count = 1;
+		}
+		if (job->count > 1 &&
+		    !fanout_handlers_ok(job->imgs, job->count, dry_run)) {
+			TRACE("%s: handlers cannot get data at the same time, "
+			      "decoding it for each target", img->fname);
+			job->count = 1;
+		}
+		for (j = 1; j < job->count; j++)
+			for (k = i + 1; k < nimgs; k++)
+				if (imgs[k] == job->imgs[j])
+					done[k] = true;
+
+		job->parallel = job_parallel(job);
+	}
+
+	/*
+	 * each job reads its image once, for the ETA in the progress:
+	 * a fan-out counts only the bytes read by the decoder
+	 */
+	expected = 0;
+	for (i = 0; i < njobs; i++)
+		expected += jobs[i].imgs[0]->size;
+	swupdate_progress_expected(expected);
+
+	/*
+	 * Run jobs in the order of sw-description: consecutive
+	 * jobs not sharing a device are started together
+	 */
+	for (i = 0; i < njobs; i += count) {
+		count = 1;
+		while (jobs[i].parallel && i + count < njobs &&
+		       count < MAX_PARALLEL_INSTALL &&
+		       jobs[i + count].parallel &&
+		       !jobs_conflict(&jobs[i], count, &jobs[i + count]))
+			count++;
+
+		for (j = 0; j < count; j++)
+			release_mounts(jobs[i + j].imgs, jobs[i + j].count);
+		ret = run_jobs(&jobs[i], count, fdsw, fromfile);
 		if (ret)
-			return ret;
+			goto out;
+	}
+
+	free_jobs(jobs, njobs);
+	free(imgs);
+	free(done);
 
+	ret = swupdate_mount_cache_end();
+	if (ret) {
+		ERROR("Devices mounted during the update cannot be unmounted");
+		return ret;
 	}
 
 	/*
@@ -367,6 +1088,13 @@ int install_images(struct swupdate_cfg *sw, int fdsw, int fromfile)
 	ret |= run_prepost_scripts(&sw->bootscripts, POSTINSTALL);
 
 	return ret;
+
+out:
+	free_jobs(jobs, njobs);
+	free(imgs);
+	free(done);
+	swupdate_mount_cache_end();
+	return ret;
 }
 
 static void remove_sw_file(char __attribute__ ((__unused__)) *fname)
@@ -982,8 +982,13 @@ static int l_register_handler( lua_State *L ) {
 		/* cleanup stack */
 		lua_pop (L, 1);
 
-		register_handler(handler_desc, l_handler_wrapper,
-				 mask, l_func_ref);
+		/* all Lua handlers share the same Lua state */
+		static const struct handler_caps lua_caps = {
+			.flags = HANDLER_CAP_STREAM,
+			.concurrency = HANDLER_EXCLUSIVE,
+		};
+		register_handler_caps(handler_desc, l_handler_wrapper,
+				 mask, l_func_ref, &lua_caps);
 		return 0;
 	}
 }
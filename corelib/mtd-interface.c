@@ -276,6 +276,35 @@ static void scan_ubi_volumes(struct mtd_ubi_info *info)
 	info->scanned = 1;
 }
 
+/*
+ * Drop the cached volumes of a MTD device and read them again
+ * from the kernel, for example after the layout was changed.
+ */
+int ubi_rescan_volumes(int mtd)
+{
+	struct flash_description *flash = get_flash_info();
+	struct mtd_ubi_info *info = &flash->mtd_info[mtd];
+	struct ubi_part *vol, *tmp;
+	int err;
+
+	LIST_FOREACH_SAFE(vol, &info->ubi_partitions, next, tmp) {
+		LIST_REMOVE(vol, next);
+		free(vol);
+	}
+
+	err = ubi_get_dev_info1(flash->libubi, info->dev_info.dev_num,
+				&info->dev_info);
+	if (err) {
+		ERROR("cannot get information about UBI device %d",
+			info->dev_info.dev_num);
+		return -ENODEV;
+	}
+
+	scan_ubi_volumes(info);
+
+	return 0;
+}
+
 static void scan_for_ubi_devices(void)
 {
 	struct flash_description *flash = get_flash_info();
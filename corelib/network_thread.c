@@ -17,10 +17,11 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/un.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <time.h>
 
 #include "bsdqueue.h"
 #include "util.h"
@@ -38,65 +39,159 @@
 #define LISTENQ	1024
 
 #define NUM_CACHED_MESSAGES 100
+#define MAX_SUBSCRIBER_EVENTS 256
 #define DEFAULT_INTERNAL_TIMEOUT 60
 
-struct msg_elem {
+/*
+ * History of the notifications: a ring of records, whose text is
+ * stored in a ring of bytes, so that nothing is allocated when a
+ * message is added. The oldest messages are overwritten when
+ * either of them is full. Each message gets a sequence number,
+ * GET_STATUS, the subscribers and GET_HISTORY read the history
+ * with their own cursor.
+ */
+#define MSG_HISTORY_RECORDS	1024
+#define MSG_HISTORY_SIZE	(128 * 1024)
+#define MSG_MAX_LEN		2047
+/* messages returned at once by GET_HISTORY in a frame */
+#define MSG_HISTORY_BATCH	256
+
+struct msg_record {
 	RECOVERY_STATUS status;
 	int error;
 	int level;
-	char *msg;
-	SIMPLEQ_ENTRY(msg_elem) next;
+	unsigned int off;	/* text in history.text */
+	unsigned int len;	/* without the terminating zero */
 };
 
-SIMPLEQ_HEAD(msglist, msg_elem);
-static struct msglist notifymsgs;
-static unsigned long nrmsgs = 0;
+static struct {
+	struct msg_record rec[MSG_HISTORY_RECORDS];
+	char text[MSG_HISTORY_SIZE];
+	unsigned int first;	/* sequence number of the oldest message */
+	unsigned int next;	/* sequence number of the next message */
+	unsigned int head;	/* where the text of the next message goes */
+} history;
+
+/* next message returned by GET_STATUS */
+static unsigned int status_seq = 0;
+static unsigned int nsubscribers = 0;
+static int event_wakeup = 0;
+static int event_wakefd = -1;
 
 static pthread_mutex_t msglock = PTHREAD_MUTEX_INITIALIZER;
 
-static void clean_msg(char *msg, char drop)
+/*
+ * Sequence numbers wrap around, they are compared
+ * by their distance
+ */
+static inline int seq_before(unsigned int a, unsigned int b)
 {
-	char *lfpos;
-	lfpos = strchr(msg, drop);
-	while (lfpos) {
-		*lfpos = ' ';
-		lfpos = strchr(msg, drop);
-	}
+	return (int)(a - b) < 0;
 }
 
-static void network_notifier(RECOVERY_STATUS status, int error, int level, const char *msg)
+static inline struct msg_record *history_record(unsigned int seq)
 {
-	int len = msg ? strlen(msg) : 0;
-	struct msg_elem *newmsg = (struct msg_elem *)calloc(1, sizeof(*newmsg) + len + 1);
-	struct msg_elem *oldmsg;
+	return &history.rec[seq % MSG_HISTORY_RECORDS];
+}
 
-	if (!newmsg)
-		return;
+static int history_overlaps(const struct msg_record *rec,
+			    unsigned int off, unsigned int size)
+{
+	return rec->off < off + size && off < rec->off + rec->len + 1;
+}
 
-	pthread_mutex_lock(&msglock);
-	nrmsgs++;
-	if (nrmsgs > NUM_CACHED_MESSAGES) {
-		oldmsg = SIMPLEQ_FIRST(&notifymsgs);
-		SIMPLEQ_REMOVE_HEAD(&notifymsgs, next);
-		free(oldmsg);
-		nrmsgs--;
+/*
+ * Must be called with msglock held
+ */
+static void history_add(RECOVERY_STATUS status, int error, int level,
+			const char *msg)
+{
+	unsigned int len = msg ? strnlen(msg, MSG_MAX_LEN) : 0;
+	unsigned int off = history.head;
+	struct msg_record *rec;
+	int wrap = 0;
+	char *dst;
+
+	if (off + len + 1 > MSG_HISTORY_SIZE) {
+		off = 0;
+		wrap = 1;
+	}
+
+	/*
+	 * The text is stored in the order of the messages, the
+	 * oldest ones are after head: drop them until the new
+	 * text fits, together with the ones at the end of the
+	 * buffer when it wraps around
+	 */
+	while (history.first != history.next) {
+		rec = history_record(history.first);
+		if (history.next - history.first < MSG_HISTORY_RECORDS &&
+		    !history_overlaps(rec, off, len + 1) &&
+		    !(wrap && rec->off >= history.head))
+			break;
+		history.first++;
 	}
-	newmsg->msg = (char *)newmsg + sizeof(struct msg_elem);
 
-	newmsg->status = status;
-	newmsg->error = error;
-	newmsg->level = level;
+	rec = history_record(history.next++);
+	rec->status = status;
+	rec->error = error;
+	rec->level = level;
+	rec->off = off;
+	rec->len = len;
 
-	if (msg) {
-		strncpy(newmsg->msg, msg, len);
-		clean_msg(newmsg->msg, '\t');
-		clean_msg(newmsg->msg, '\n');
-		clean_msg(newmsg->msg, '\r');
+	dst = &history.text[off];
+	for (unsigned int i = 0; i < len; i++) {
+		char c = msg[i];
+
+		dst[i] = (c == '\t' || c == '\n' || c == '\r') ? ' ' : c;
 	}
+	dst[len] = '\0';
+	history.head = off + len + 1;
+}
+
+/*
+ * Copy the message seq, if it is still in the history,
+ * with msglock held
+ */
+static int history_get(unsigned int seq, struct msg_record *rec,
+		       char *text, size_t size)
+{
+	struct msg_record *r;
+	size_t len;
+
+	if (seq_before(seq, history.first) || !seq_before(seq, history.next))
+		return -ENOENT;
+
+	r = history_record(seq);
+	*rec = *r;
+	len = r->len < size - 1 ? r->len : size - 1;
+	memcpy(text, &history.text[r->off], len);
+	text[len] = '\0';
 
+	return 0;
+}
+
+static void network_notifier(RECOVERY_STATUS status, int error, int level, const char *msg)
+{
+	int wakeup = 0;
 
-	SIMPLEQ_INSERT_TAIL(&notifymsgs, newmsg, next);
+	pthread_mutex_lock(&msglock);
+	history_add(status, error, level, msg);
+	if (nsubscribers && !event_wakeup) {
+		event_wakeup = 1;
+		wakeup = 1;
+	}
 	pthread_mutex_unlock(&msglock);
+
+	/*
+	 * the network thread sends the events to the subscribers,
+	 * a full pipe means that it is already woken up
+	 */
+	if (wakeup && event_wakefd >= 0) {
+		ssize_t __attribute__ ((__unused__)) ret;
+
+		ret = write(event_wakefd, "", 1);
+	}
 }
 
 int listener_create(const char *path, int type)
@@ -145,44 +240,17 @@ int listener_create(const char *path, int type)
 
 }
 
-static void cleanum_msg_list(void)
+/*
+ * GET_STATUS does not return the messages of the previous runs,
+ * they are still in the history for GET_HISTORY
+ */
+static void skip_old_messages(void)
 {
-	struct msg_elem *notification;
-
 	pthread_mutex_lock(&msglock);
-
-	while (!SIMPLEQ_EMPTY(&notifymsgs)) {
-		notification = SIMPLEQ_FIRST(&notifymsgs);
-		SIMPLEQ_REMOVE_HEAD(&notifymsgs, next);
-		free(notification);
-	}
-	nrmsgs = 0;
+	status_seq = history.next;
 	pthread_mutex_unlock(&msglock);
 }
 
-static void empty_pipe(int fd)
-{
-	fd_set fds;
-	int ret;
-	ipc_message msg;
-	struct timeval tv;
-
-	do {
-		FD_ZERO(&fds);
-		FD_SET(fd, &fds);
-		tv.tv_sec = 0;
-		tv.tv_usec = 10000; /* Check for not more as 10 mSec */
-		ret = select(fd + 1, &fds, NULL, NULL, &tv);
-		if (ret <= 0 || !FD_ISSET(fd, &fds))
-			break;
-		/*
-		 * simply read to drop old messages
-		 */
-		if (read(fd, &msg, sizeof(msg)) < 0)
-			break;
-	} while (1);
-}
-
 static void unlink_socket(void)
 {
 #ifdef CONFIG_SYSTEMD
@@ -197,220 +265,1577 @@ static void unlink_socket(void)
 	unlink((char*)CONFIG_SOCKET_CTRL_PATH);
 }
 
-void *network_thread (void *data)
-{
-	struct installer *instp = (struct installer *)data;
-	int ctrllisten, ctrlconnfd;
-	socklen_t clilen;
-	struct sockaddr_un cliaddr;
+
+/*
+ * The control socket is served by a single event loop:
+ * each client is a small state machine, requests for the
+ * subprocesses are forwarded without waiting for the answer,
+ * so a slow subprocess does not stop the other clients.
+ */
+#define MAX_EVENTS	16
+
+enum ctrl_source {
+	CTRL_LISTEN,
+	CTRL_CLIENT,
+	CTRL_SUBPROCESS,
+	CTRL_EVENTS,
+	CTRL_POSTUPDATE,
+};
+
+enum client_state {
+	CLIENT_READ,		/* waiting for the request */
+	CLIENT_FORWARD,		/* waiting for the subprocess */
+	CLIENT_POSTUPDATE,	/* waiting for the post-update actions */
+	CLIENT_WRITE,		/* sending the answer */
+	CLIENT_SUBSCRIBED,	/* receiving the events */
+};
+
+struct subprocess_chan;
+
+/*
+ * Installation requested on the connection,
+ * started when the ACK has been sent
+ */
+struct install_request {
+	sourcetype source;
+	int dry_run;
+	unsigned int len;
+	char info[sizeof(((struct installer *)0)->info)];
+};
+
+struct sub_event {
+	char *data;		/* encoded GET_STATUS message */
+	size_t len;
+	SIMPLEQ_ENTRY(sub_event) next;
+};
+
+struct ctrl_client {
+	enum ctrl_source kind;	/* must be the first field */
+	int fd;
+	enum client_state state;
+	int version;		/* 1: fixed ipc_message, 2: frames */
+	int request;		/* type of the request being served */
+	struct ipc_frame_header hdr;
+	char *payload;		/* TLVs of a frame */
+	ipc_frame frame;	/* request too large for msg */
 	ipc_message msg;
-	int nread;
-	struct msg_elem *notification;
+	size_t offset;
+	char *out;		/* answer being sent */
+	size_t outlen;
+	int keep_open;		/* read another request after the answer */
+	int passfd;		/* descriptor received with the request */
+	int level;		/* subscription: notifications up to level */
+	RECOVERY_STATUS last_status;	/* subscription: last status sent */
+	unsigned int seq;	/* subscription: first message to send */
+	SIMPLEQ_HEAD(, sub_event) pending;	/* subscription: not sent yet */
+	unsigned int npending;
+	unsigned long long deadline;
+	struct subprocess_chan *chan;
+	struct install_request *install;	/* after the answer */
+	LIST_ENTRY(ctrl_client) next;
+	SIMPLEQ_ENTRY(ctrl_client) waiting;
+};
+
+/*
+ * A subprocess answers in the order of the requests,
+ * one request at a time is sent to it. Answers are not
+ * tagged: if the client of the request leaves, the
+ * channel stays busy until the answer is read and dropped,
+ * or until the subprocess is given up at orphan_deadline.
+ */
+struct subprocess_chan {
+	enum ctrl_source kind;	/* must be the first field */
+	int fd;
+	sourcetype source;
+	struct ctrl_client *inflight;
+	int orphaned;		/* the answer has no client */
+	unsigned long long orphan_deadline;
+	char *out;		/* request being sent */
+	size_t outlen, outoffset;
+	ipc_message answer;
+	size_t offset;
+	SIMPLEQ_HEAD(, ctrl_client) waiting;
+	LIST_ENTRY(subprocess_chan) next;
+};
+
+/*
+ * Post-update actions can reboot or run a command,
+ * they run in a thread and the client is answered
+ * when they are done
+ */
+struct postupdate_job {
+	enum ctrl_source kind;	/* must be the first field */
+	int fd[2];		/* written by the thread when done */
+	pthread_t thread;
+	struct ctrl_client *client;	/* NULL if it has gone away */
+	char *info;
 	int ret;
-	int pipe;
-	fd_set pipefds;
-	struct timeval tv;
+};
 
-	if (!instp) {
-		TRACE("Fatal error: Network thread aborting...");
-		return (void *)0;
-	}
+struct ctrl_server {
+	int epfd;
+	enum ctrl_source listen_kind;
+	int listenfd;
+	enum ctrl_source events_kind;
+	int eventfd[2];		/* wakes up the loop for new events */
+	unsigned int event_seq;	/* next message for the subscribers */
+	struct installer *instp;
+	int install_pending;	/* ACK for an installation being sent */
+	struct postupdate_job *postupdate;	/* running post-update actions */
+	LIST_HEAD(, ctrl_client) clients;
+	LIST_HEAD(, subprocess_chan) chans;
+	/* freed after the events already returned by epoll */
+	LIST_HEAD(, ctrl_client) dead_clients;
+	LIST_HEAD(, subprocess_chan) dead_chans;
+};
 
-	SIMPLEQ_INIT(&notifymsgs);
-	register_notifier(network_notifier);
+static unsigned long long now_ms(void)
+{
+	struct timespec ts;
 
-	/* Initialize and bind to UDS */
-	ctrllisten = listener_create((char*)CONFIG_SOCKET_CTRL_PATH, SOCK_STREAM);
-	if (ctrllisten < 0 ) {
-		TRACE("Error creating IPC sockets");
-		exit(2);
-	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-	if (atexit(unlink_socket) != 0) {
-		TRACE("Cannot setup socket cleanup on exit, %s won't be unlinked.",
-			  (char*)CONFIG_SOCKET_CTRL_PATH);
+static int set_nonblock(int fd, int on)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags < 0)
+		return -1;
+	flags = on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+	return fcntl(fd, F_SETFL, flags);
+}
+
+static int ctrl_watch(struct ctrl_server *srv, int op, int fd,
+		      uint32_t events, void *ptr)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = ptr;
+	return epoll_ctl(srv->epfd, op, fd, &ev);
+}
+
+static void client_close(struct ctrl_server *srv, struct ctrl_client *c);
+static void forward_next(struct ctrl_server *srv, struct subprocess_chan *chan);
+static void install_handover(struct ctrl_server *srv, struct ctrl_client *c);
+
+static void free_answer(struct ctrl_client *c)
+{
+	if (c->out != (char *)&c->msg)
+		free(c->out);
+	c->out = NULL;
+	c->outlen = 0;
+}
+
+static void client_reset(struct ctrl_client *c)
+{
+	free_answer(c);
+	free(c->payload);
+	c->payload = NULL;
+	ipc_frame_free(&c->frame);
+	c->state = CLIENT_READ;
+	c->offset = 0;
+	c->keep_open = 0;
+}
+
+/*
+ * The answer uses the protocol of the request
+ */
+static int encode_answer(struct ctrl_client *c)
+{
+	ipc_frame answer;
+
+	free_answer(c);
+	if (c->version < 2) {
+		c->out = (char *)&c->msg;
+		c->outlen = sizeof(c->msg);
+		return 0;
 	}
 
-	do {
-		clilen = sizeof(cliaddr);
-		if ( (ctrlconnfd = accept(ctrllisten, (struct sockaddr *) &cliaddr, &clilen)) < 0) {
+	if (c->msg.type == IPC_HELLO) {
+		memset(&answer, 0, sizeof(answer));
+		answer.type = IPC_HELLO;
+		answer.version = IPC_VERSION;
+	} else if (ipc_frame_from_message(&answer, &c->msg, c->request))
+		return -ENOMEM;
+
+	c->out = ipc_frame_build(&answer, &c->outlen);
+	ipc_frame_free(&answer);
+
+	return c->out ? 0 : -ENOMEM;
+}
+
+static int sub_next(struct ctrl_client *c);
+
+static void client_write(struct ctrl_server *srv, struct ctrl_client *c)
+{
+	ssize_t ret;
+
+again:
+	while (c->offset < c->outlen) {
+		ret = send(c->fd, c->out + c->offset, c->outlen - c->offset,
+			   MSG_NOSIGNAL);
+		if (ret < 0) {
 			if (errno == EINTR)
 				continue;
-			else {
-				TRACE("Accept returns: %s", strerror(errno));
-				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				ctrl_watch(srv, EPOLL_CTL_MOD, c->fd, EPOLLOUT, c);
+				return;
 			}
+			TRACE("Error write on socket ctrl: %s", strerror(errno));
+			break;
 		}
-		nread = read(ctrlconnfd, (void *)&msg, sizeof(msg));
+		c->offset += ret;
+	}
+
+	if (c->offset == c->outlen && c->state == CLIENT_SUBSCRIBED) {
+		if (sub_next(c))
+			goto again;
+		ctrl_watch(srv, EPOLL_CTL_MOD, c->fd, EPOLLIN, c);
+		return;
+	}
+
+	if (c->offset == c->outlen && c->install) {
+		install_handover(srv, c);
+		return;
+	}
+
+	if (c->offset == c->outlen && c->keep_open) {
+		client_reset(c);
+		ctrl_watch(srv, EPOLL_CTL_MOD, c->fd, EPOLLIN, c);
+		return;
+	}
+
+	/* a connection serves a single request */
+	client_close(srv, c);
+}
+
+/*
+ * Send the answer already in c->out
+ */
+static void client_send(struct ctrl_server *srv, struct ctrl_client *c)
+{
+	c->state = CLIENT_WRITE;
+	c->offset = 0;
+	c->chan = NULL;
+	c->deadline = now_ms() + DEFAULT_INTERNAL_TIMEOUT * 1000ULL;
+	client_write(srv, c);
+}
+
+static void client_answer(struct ctrl_server *srv, struct ctrl_client *c)
+{
+	if (encode_answer(c)) {
+		client_close(srv, c);
+		return;
+	}
+	client_send(srv, c);
+}
+
+static void client_nack(struct ctrl_server *srv, struct ctrl_client *c,
+			const char *reason)
+{
+	c->msg.type = NACK;
+	if (reason) {
+		memset(c->msg.data.msg, 0, sizeof(c->msg.data.msg));
+		strncpy(c->msg.data.msg, reason, sizeof(c->msg.data.msg) - 1);
+	}
+	client_answer(srv, c);
+}
+
+/*
+ * Stop waiting for the subprocess
+ */
+static void client_detach(struct ctrl_client *c)
+{
+	struct subprocess_chan *chan = c->chan;
+
+	if (!chan)
+		return;
+
+	c->chan = NULL;
+	if (chan->inflight == c) {
+		/* the next request waits until the answer is dropped */
+		chan->inflight = NULL;
+		chan->orphaned = 1;
+		chan->orphan_deadline = now_ms() +
+			DEFAULT_INTERNAL_TIMEOUT * 1000ULL;
+	} else {
+		SIMPLEQ_REMOVE(&chan->waiting, c, ctrl_client, waiting);
+	}
+}
+
+/*
+ * The client leaves the loop, fd is closed if it is not
+ * handed over to someone else
+ */
+static void unsubscribe(struct ctrl_client *c)
+{
+	struct sub_event *ev;
+
+	if (c->state != CLIENT_SUBSCRIBED)
+		return;
+
+	pthread_mutex_lock(&msglock);
+	nsubscribers--;
+	pthread_mutex_unlock(&msglock);
+
+	while (!SIMPLEQ_EMPTY(&c->pending)) {
+		ev = SIMPLEQ_FIRST(&c->pending);
+		SIMPLEQ_REMOVE_HEAD(&c->pending, next);
+		free(ev->data);
+		free(ev);
+	}
+	c->npending = 0;
+}
+
+static void client_release(struct ctrl_server *srv, struct ctrl_client *c,
+			   int close_fd)
+{
+	unsubscribe(c);
+	client_detach(c);
+	if (srv->postupdate && srv->postupdate->client == c)
+		srv->postupdate->client = NULL;
+	epoll_ctl(srv->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	if (close_fd)
+		close(c->fd);
+	c->fd = -1;
+	if (c->passfd >= 0)
+		close(c->passfd);
+	c->passfd = -1;
+	if (c->install) {
+		free(c->install);
+		c->install = NULL;
+		srv->install_pending = 0;
+	}
+	client_reset(c);
+	LIST_REMOVE(c, next);
+	LIST_INSERT_HEAD(&srv->dead_clients, c, next);
+}
+
+static void client_close(struct ctrl_server *srv, struct ctrl_client *c)
+{
+	client_release(srv, c, 1);
+}
+
+static struct subprocess_chan *get_chan(struct ctrl_server *srv, sourcetype source)
+{
+	struct subprocess_chan *chan;
+	int fd;
+
+	LIST_FOREACH(chan, &srv->chans, next) {
+		if (chan->source == source)
+			return chan;
+	}
+
+	fd = pctl_getfd_from_type(source);
+	if (fd < 0)
+		return NULL;
+	if (fcntl(fd, F_GETFL) < 0 && errno == EBADF) {
+		ERROR("Pipe not available or closed: %d", fd);
+		return NULL;
+	}
+
+	chan = (struct subprocess_chan *)calloc(1, sizeof(*chan));
+	if (!chan)
+		return NULL;
+	chan->kind = CTRL_SUBPROCESS;
+	chan->fd = fd;
+	chan->source = source;
+	SIMPLEQ_INIT(&chan->waiting);
+
+	set_nonblock(fd, 1);
+	if (ctrl_watch(srv, EPOLL_CTL_ADD, fd, EPOLLIN, chan) < 0) {
+		ERROR("Cannot watch channel for %s: %s",
+			pctl_getname_from_type(source), strerror(errno));
+		free(chan);
+		return NULL;
+	}
+	LIST_INSERT_HEAD(&srv->chans, chan, next);
+
+	return chan;
+}
+
+/*
+ * Send the next waiting request to the subprocess
+ */
+static int chan_write(struct ctrl_server *srv, struct subprocess_chan *chan)
+{
+	ssize_t ret;
 
-		if (nread != sizeof(msg)) {
-			TRACE("IPC message too short: fragmentation not supported");
-			close(ctrlconnfd);
+	while (chan->outoffset < chan->outlen) {
+		ret = write(chan->fd, chan->out + chan->outoffset,
+			    chan->outlen - chan->outoffset);
+		if (ret < 0 && errno == EINTR)
 			continue;
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			ctrl_watch(srv, EPOLL_CTL_MOD, chan->fd,
+				   EPOLLIN | EPOLLOUT, chan);
+			return 0;
 		}
-#ifdef DEBUG_IPC
-		TRACE("request header: magic[0x%08X] type[0x%08X]", msg.magic, msg.type);
-#endif
+		if (ret <= 0)
+			break;
+		chan->outoffset += ret;
+	}
 
-		pthread_mutex_lock(&stream_mutex);
-		if (msg.magic == IPC_MAGIC)  {
-			switch (msg.type) {
-			case POST_UPDATE:
-				if (postupdate(get_swupdate_cfg(),
-							   msg.data.instmsg.len > 0 ? msg.data.instmsg.buf : NULL) == 0) {
-					msg.type = ACK;
-					sprintf(msg.data.msg, "Post-update actions successfully executed.");
-				} else {
-					msg.type = NACK;
-					sprintf(msg.data.msg, "Post-update actions failed.");
-				}
-				break;
-			case SWUPDATE_SUBPROCESS:
-				/*
-				 *  this request is not for the installer,
-				 *  but for one of the subprocesses
-				 *  forward the request without checking
-				 *  the payload
-				 */
-			       
-				pipe = pctl_getfd_from_type(msg.data.instmsg.source);
-				if (pipe < 0) {
-					ERROR("Cannot find channel for requested process");
-					msg.type = NACK;
-					break;
-				}
-				TRACE("Received Message for %s",
-					pctl_getname_from_type(msg.data.instmsg.source));
-				if (fcntl(pipe, F_GETFL) < 0 && errno == EBADF) {
-					ERROR("Pipe not available or closed: %d", pipe);
-					msg.type = NACK;
-					break;
-				}
+	if (chan->outoffset < chan->outlen)
+		ERROR("Writing to pipe failed !");
+	free(chan->out);
+	chan->out = NULL;
+	ctrl_watch(srv, EPOLL_CTL_MOD, chan->fd, EPOLLIN, chan);
 
-				/*
-				 * Cleanup the queue to be sure there are not
-				 * outstanding messages
-				 */
-				empty_pipe(pipe);
+	return chan->outoffset < chan->outlen ? -1 : 0;
+}
 
-				ret = write(pipe, &msg, sizeof(msg));
-				if (ret != sizeof(msg)) {
-					ERROR("Writing to pipe failed !");
-					msg.type = NACK;
-					break;
-				}
+/*
+ * Send the next waiting request to the subprocess. A request
+ * too large for ipc_message is sent as a frame.
+ */
+static void forward_next(struct ctrl_server *srv, struct subprocess_chan *chan)
+{
+	struct ctrl_client *c;
 
-				/*
-				 * Do not block forever for an answer
-				 * This would block the whole thread
-				 * If a message requires more time,
-				 * the destination process should sent an
-				 * answer back explaining this in the payload
-				 */
-				FD_ZERO(&pipefds);
-				FD_SET(pipe, &pipefds);
-				tv.tv_usec = 0;
-				if (!msg.data.instmsg.timeout)
-					tv.tv_sec = DEFAULT_INTERNAL_TIMEOUT;
-				else
-					tv.tv_sec = msg.data.instmsg.timeout;
-				ret = select(pipe + 1, &pipefds, NULL, NULL, &tv);
+	while (!chan->inflight && !chan->orphaned && !chan->out &&
+	       !SIMPLEQ_EMPTY(&chan->waiting)) {
+		c = SIMPLEQ_FIRST(&chan->waiting);
+		SIMPLEQ_REMOVE_HEAD(&chan->waiting, waiting);
 
-				/*
-				 * If there is an error or timeout,
-				 * send a NACK back
-				 */
-				if (ret <= 0 || !FD_ISSET(pipe, &pipefds)) {
-					msg.type = NACK;
-					break;
-				}
-
-				ret = read(pipe, &msg, sizeof(msg));
-				if (ret != sizeof(msg)) {
-					ERROR("Reading from pipe failed !");
-					msg.type = NACK;
-					break;
-				}
+		if (c->frame.data) {
+			c->frame.type = SWUPDATE_SUBPROCESS;
+			chan->out = ipc_frame_build(&c->frame, &chan->outlen);
+		} else {
+			chan->out = (char *)malloc(sizeof(c->msg));
+			if (chan->out)
+				memcpy(chan->out, &c->msg, sizeof(c->msg));
+			chan->outlen = sizeof(c->msg);
+		}
+		chan->outoffset = 0;
+		if (!chan->out || chan_write(srv, chan)) {
+			c->chan = NULL;
+			client_nack(srv, c, NULL);
+			continue;
+		}
+		chan->inflight = c;
+	}
+}
 
-				/*
-				 * ACK/NACK was inserted by the called SUBPROCESS
-				 * It should not be touched here
-				 */
+static void forward_request(struct ctrl_server *srv, struct ctrl_client *c)
+{
+	struct subprocess_chan *chan;
+	unsigned int timeout;
 
-				break;
-			case REQ_INSTALL:
-			case REQ_INSTALL_DRYRUN:
-				TRACE("Incoming network request: processing...");
-				if (instp->status == IDLE) {
-					instp->fd = ctrlconnfd;
-					instp->source = msg.data.instmsg.source;
-					instp->len = min(msg.data.instmsg.len, sizeof(instp->info));
-
-					/*
-					 * Communicate if a dryrun is asked and set it
-					 */
-					if (msg.type == REQ_INSTALL_DRYRUN)
-						instp->dry_run = 1;
-					else
-						instp->dry_run = 0;
-
-					memcpy(instp->info, msg.data.instmsg.buf,
-						instp->len);
-
-					/*
-					 * Prepare answer
-					 */
-					msg.type = ACK;
-
-					/* Drop all old notification from last run */
-					cleanum_msg_list();
-
-					/* Wake-up the installer */
-					pthread_cond_signal(&stream_wkup);
-				} else {
-					msg.type = NACK;
-					sprintf(msg.data.msg, "Installation in progress");
-				}
-				break;
-			case GET_STATUS:
-				msg.type = GET_STATUS;
-				memset(msg.data.msg, 0, sizeof(msg.data.msg));
-				msg.data.status.current = instp->status;
-				msg.data.status.last_result = instp->last_install;
-				msg.data.status.error = instp->last_error;
-
-				/* Get first notification from the queue */
-				pthread_mutex_lock(&msglock);
-				notification = SIMPLEQ_FIRST(&notifymsgs);
-				if (notification) {
-					SIMPLEQ_REMOVE_HEAD(&notifymsgs, next);
-					nrmsgs--;
-					strncpy(msg.data.status.desc, notification->msg,
-						sizeof(msg.data.status.desc) - 1);
-#ifdef DEBUG_IPC
-					printf("GET STATUS: %s\n", msg.data.status.desc);
-#endif
-					msg.data.status.current = notification->status;
-					msg.data.status.error = notification->error;
-				}
-				pthread_mutex_unlock(&msglock);
+	chan = get_chan(srv, c->msg.data.instmsg.source);
+	if (!chan) {
+		ERROR("Cannot find channel for requested process");
+		client_nack(srv, c, NULL);
+		return;
+	}
+	TRACE("Received Message for %s",
+		pctl_getname_from_type(c->msg.data.instmsg.source));
 
-				break;
-			default:
-				msg.type = NACK;
+	/*
+	 * Do not wait forever for an answer. If a message
+	 * requires more time, the destination process should
+	 * send an answer back explaining this in the payload
+	 */
+	timeout = c->msg.data.instmsg.timeout ? c->msg.data.instmsg.timeout :
+			DEFAULT_INTERNAL_TIMEOUT;
+	c->deadline = now_ms() + timeout * 1000ULL;
+	c->state = CLIENT_FORWARD;
+	c->chan = chan;
+	ctrl_watch(srv, EPOLL_CTL_MOD, c->fd, 0, c);
+
+	SIMPLEQ_INSERT_TAIL(&chan->waiting, c, waiting);
+	forward_next(srv, chan);
+}
+
+static void chan_read(struct ctrl_server *srv, struct subprocess_chan *chan)
+{
+	struct ctrl_client *c;
+	ssize_t ret;
+
+	for (;;) {
+		ret = read(chan->fd, (char *)&chan->answer + chan->offset,
+			   sizeof(chan->answer) - chan->offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (ret <= 0) {
+			ERROR("Reading from pipe failed !");
+			epoll_ctl(srv->epfd, EPOLL_CTL_DEL, chan->fd, NULL);
+			chan->fd = -1;
+			LIST_REMOVE(chan, next);
+			if (chan->inflight) {
+				chan->inflight->chan = NULL;
+				client_nack(srv, chan->inflight, NULL);
 			}
-		} else {
-			/* Wrong request */
-			msg.type = NACK;
-			sprintf(msg.data.msg, "Wrong request: aborting");
+			while (!SIMPLEQ_EMPTY(&chan->waiting)) {
+				c = SIMPLEQ_FIRST(&chan->waiting);
+				SIMPLEQ_REMOVE_HEAD(&chan->waiting, waiting);
+				c->chan = NULL;
+				client_nack(srv, c, NULL);
+			}
+			free(chan->out);
+			chan->out = NULL;
+			LIST_INSERT_HEAD(&srv->dead_chans, chan, next);
+			return;
+		}
+		chan->offset += ret;
+		if (chan->offset < sizeof(chan->answer))
+			continue;
+
+		chan->offset = 0;
+		c = chan->inflight;
+		if (!c) {
+			/* answer to a request that has timed out */
+			TRACE("Dropping late answer from %s",
+				pctl_getname_from_type(chan->source));
+			chan->orphaned = 0;
+			forward_next(srv, chan);
+			continue;
 		}
-		ret = write(ctrlconnfd, &msg, sizeof(msg));
-		if (ret < 0)
-			printf("Error write on socket ctrl");
 
-		if (msg.type != ACK)
-			close(ctrlconnfd);
-		pthread_mutex_unlock(&stream_mutex);
-	} while (1);
-	return (void *)0; 
+		/*
+		 * ACK/NACK was inserted by the called SUBPROCESS
+		 * It should not be touched here
+		 */
+		chan->inflight = NULL;
+		memcpy(&c->msg, &chan->answer, sizeof(c->msg));
+		client_answer(srv, c);
+		forward_next(srv, chan);
+	}
+}
+
+static void chan_event(struct ctrl_server *srv, struct subprocess_chan *chan,
+		       uint32_t events)
+{
+	/* closed while handling a previous event */
+	if (chan->fd < 0)
+		return;
+
+	if ((events & EPOLLOUT) && chan->out) {
+		if (chan_write(srv, chan)) {
+			struct ctrl_client *c = chan->inflight;
+
+			/* the request was not sent, no answer is coming */
+			chan->inflight = NULL;
+			chan->orphaned = 0;
+			if (c) {
+				c->chan = NULL;
+				client_nack(srv, c, NULL);
+			}
+		}
+		if (!chan->out)
+			forward_next(srv, chan);
+	}
+	if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+		chan_read(srv, chan);
+}
+
+/*
+ * Wake up the installer for the image on fd
+ */
+static void install_start(struct ctrl_server *srv, int fd, int fromfile,
+			  const struct install_request *req)
+{
+	struct installer *instp = srv->instp;
+
+	/* Drop all old notification from last run */
+	skip_old_messages();
+
+	pthread_mutex_lock(&stream_mutex);
+	instp->fd = fd;
+	instp->fromfile = fromfile;
+	instp->source = req->source;
+	instp->len = req->len;
+
+	/*
+	 * Communicate if a dryrun is asked and set it
+	 */
+	instp->dry_run = req->dry_run;
+
+	memcpy(instp->info, req->info, instp->len);
+
+	/* Wake-up the installer */
+	instp->status = START;
+	pthread_cond_signal(&stream_wkup);
+	pthread_mutex_unlock(&stream_mutex);
+}
+
+/*
+ * The ACK has been sent, the installer reads the
+ * image from the socket, that leaves the loop
+ */
+static void install_handover(struct ctrl_server *srv, struct ctrl_client *c)
+{
+	struct install_request *req = c->install;
+	int fd = c->fd;
+
+	c->install = NULL;
+	srv->install_pending = 0;
+	client_release(srv, c, 0);
+	set_nonblock(fd, 0);
+	install_start(srv, fd, 0, req);
+	free(req);
+}
+
+/*
+ * Images are read at their offsets after sw-description has
+ * been verified: only a memfd that the client cannot change
+ * anymore can be read as a file, anything else is streamed.
+ */
+static int fd_sealed(int fd)
+{
+#ifdef F_GET_SEALS
+	const int seals = F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW;
+	int ret = fcntl(fd, F_GET_SEALS);
+
+	return ret >= 0 && (ret & seals) == seals;
+#else
+	(void)fd;
+	return 0;
+#endif
+}
+
+/*
+ * The connection is handed over to the installer: the
+ * answer is sent before, and the socket is no longer
+ * part of the loop. If the client passed a descriptor
+ * for the image, the installer gets it instead, and the
+ * connection is closed after the answer.
+ */
+static void start_install(struct ctrl_server *srv, struct ctrl_client *c)
+{
+	struct installer *instp = srv->instp;
+	ipc_message *msg = &c->msg;
+	int fd_request = msg->type == REQ_INSTALL_FD ||
+			 msg->type == REQ_INSTALL_FD_DRYRUN;
+	struct install_request *req;
+	struct stat st;
+	int fromfile;
+	int idle;
+	int fd;
+
+	TRACE("Incoming network request: processing...");
+	pthread_mutex_lock(&stream_mutex);
+	idle = instp->status == IDLE && !srv->install_pending;
+	pthread_mutex_unlock(&stream_mutex);
+
+	if (!idle) {
+		client_nack(srv, c, "Installation in progress");
+		return;
+	}
+
+	if (fd_request && c->passfd < 0) {
+		client_nack(srv, c, "No file descriptor for the image");
+		return;
+	}
+
+	req = (struct install_request *)malloc(sizeof(*req));
+	if (!req) {
+		client_nack(srv, c, "Out of memory");
+		return;
+	}
+	req->source = msg->data.instmsg.source;
+	req->dry_run = msg->type == REQ_INSTALL_DRYRUN ||
+		       msg->type == REQ_INSTALL_FD_DRYRUN;
+	req->len = min(msg->data.instmsg.len, sizeof(req->info));
+	memcpy(req->info, msg->data.instmsg.buf, req->len);
+
+	/*
+	 * Prepare answer
+	 */
+	msg->type = ACK;
+	memset(&msg->data, 0, sizeof(msg->data));
+	if (!fd_request) {
+		/* the installer starts when the ACK is sent */
+		c->install = req;
+		srv->install_pending = 1;
+		client_answer(srv, c);
+		return;
+	}
+
+	fd = c->passfd;
+	c->passfd = -1;
+	/* a sealed memfd is read at the offsets of the images */
+	fromfile = !fstat(fd, &st) && S_ISREG(st.st_mode) && fd_sealed(fd);
+	TRACE("Image passed as %s", fromfile ? "file" : "stream");
+	client_answer(srv, c);
+	install_start(srv, fd, fromfile, req);
+	free(req);
+}
+
+static void get_status(struct ctrl_server *srv, struct ctrl_client *c)
+{
+	struct installer *instp = srv->instp;
+	ipc_message *msg = &c->msg;
+	struct msg_record rec;
+
+	msg->type = GET_STATUS;
+	memset(msg->data.msg, 0, sizeof(msg->data.msg));
+	pthread_mutex_lock(&stream_mutex);
+	msg->data.status.current = instp->status;
+	msg->data.status.last_result = instp->last_install;
+	msg->data.status.error = instp->last_error;
+	pthread_mutex_unlock(&stream_mutex);
+
+	/* Get the first notification not read yet, of the last ones */
+	pthread_mutex_lock(&msglock);
+	if (history.next - status_seq > NUM_CACHED_MESSAGES)
+		status_seq = history.next - NUM_CACHED_MESSAGES;
+	if (seq_before(status_seq, history.first))
+		status_seq = history.first;
+	if (!history_get(status_seq, &rec, msg->data.status.desc,
+			 sizeof(msg->data.status.desc))) {
+		status_seq++;
+#ifdef DEBUG_IPC
+		printf("GET STATUS: %s\n", msg->data.status.desc);
+#endif
+		msg->data.status.current = rec.status;
+		msg->data.status.error = rec.error;
+	}
+	pthread_mutex_unlock(&msglock);
+
+	client_answer(srv, c);
+}
+
+/*
+ * Protocol version 2: the messages from seq on, up to
+ * MSG_HISTORY_BATCH, in a single frame. With msglock held.
+ */
+static int history_frame(struct ctrl_client *c, unsigned int seq)
+{
+	struct ipc_history_record hdr;
+	struct msg_record *rec;
+	ipc_frame frame;
+	unsigned int end, n;
+	size_t size = 0;
+	char *p;
+
+	memset(&frame, 0, sizeof(frame));
+	frame.type = GET_HISTORY;
+	frame.current = c->msg.data.history.current;
+	frame.error = c->msg.data.history.error;
+	frame.seq = seq;
+	frame.next = history.next;
+
+	for (end = seq, n = 0; end != history.next && n < MSG_HISTORY_BATCH;
+	     end++, n++)
+		size += sizeof(hdr) + history_record(end)->len;
+
+	frame.data = (char *)malloc(size + 1);
+	if (!frame.data)
+		return -ENOMEM;
+	p = frame.data;
+	for (n = seq; n != end; n++) {
+		rec = history_record(n);
+		hdr.seq = n;
+		hdr.status = rec->status;
+		hdr.error = rec->error;
+		hdr.level = rec->level;
+		hdr.len = rec->len;
+		memcpy(p, &hdr, sizeof(hdr));
+		p += sizeof(hdr);
+		memcpy(p, &history.text[rec->off], rec->len);
+		p += rec->len;
+	}
+	*p = '\0';
+	frame.len = size;
+
+	free_answer(c);
+	c->out = ipc_frame_build(&frame, &c->outlen);
+	ipc_frame_free(&frame);
+
+	return c->out ? 0 : -ENOMEM;
+}
+
+/*
+ * Messages in the history starting from the sequence number in the
+ * request: the oldest one for version 1 clients, a batch in a frame
+ * for version 2. A higher sequence number in the answer means that
+ * the messages in between were overwritten, a sequence number equal
+ * to next (no message) that there is nothing new yet.
+ */
+static void get_history(struct ctrl_server *srv, struct ctrl_client *c)
+{
+	struct installer *instp = srv->instp;
+	ipc_message *msg = &c->msg;
+	unsigned int seq = msg->data.history.seq;
+	struct msg_record rec;
+	int ret;
+
+	msg->type = GET_HISTORY;
+	memset(&msg->data, 0, sizeof(msg->data));
+	pthread_mutex_lock(&stream_mutex);
+	msg->data.history.current = instp->status;
+	msg->data.history.error = instp->last_error;
+	pthread_mutex_unlock(&stream_mutex);
+
+	pthread_mutex_lock(&msglock);
+	if (seq_before(seq, history.first))
+		seq = history.first;
+	if (!seq_before(seq, history.next))
+		seq = history.next;
+
+	if (c->version >= 2) {
+		ret = history_frame(c, seq);
+		pthread_mutex_unlock(&msglock);
+		if (ret)
+			client_close(srv, c);
+		else
+			client_send(srv, c);
+		return;
+	}
+
+	if (!history_get(seq, &rec, msg->data.history.desc,
+			 sizeof(msg->data.history.desc))) {
+		msg->data.history.current = rec.status;
+		msg->data.history.error = rec.error;
+		msg->data.history.level = rec.level;
+	}
+	msg->data.history.seq = seq;
+	msg->data.history.next = history.next;
+	pthread_mutex_unlock(&msglock);
+
+	client_answer(srv, c);
+}
+
+/*
+ * Subscribers receive a GET_STATUS message for each event,
+ * encoded as their request. A subscriber that does not read
+ * them is dropped instead of queueing without limits.
+ */
+static int sub_push(struct ctrl_client *c, const ipc_message *msg)
+{
+	struct sub_event *ev;
+	ipc_frame frame;
+
+	if (c->npending >= MAX_SUBSCRIBER_EVENTS)
+		return -ENOBUFS;
+
+	ev = (struct sub_event *)calloc(1, sizeof(*ev));
+	if (!ev)
+		return -ENOMEM;
+
+	if (c->version < 2) {
+		ev->data = (char *)malloc(sizeof(*msg));
+		if (ev->data)
+			memcpy(ev->data, msg, sizeof(*msg));
+		ev->len = sizeof(*msg);
+	} else if (!ipc_frame_from_message(&frame, msg, GET_STATUS)) {
+		ev->data = ipc_frame_build(&frame, &ev->len);
+		ipc_frame_free(&frame);
+	}
+	if (!ev->data) {
+		free(ev);
+		return -ENOMEM;
+	}
+
+	SIMPLEQ_INSERT_TAIL(&c->pending, ev, next);
+	c->npending++;
+
+	return 0;
+}
+
+/*
+ * The next event becomes the answer being sent
+ */
+static int sub_next(struct ctrl_client *c)
+{
+	struct sub_event *ev = SIMPLEQ_FIRST(&c->pending);
+
+	free_answer(c);
+	c->offset = 0;
+	if (!ev)
+		return 0;
+
+	SIMPLEQ_REMOVE_HEAD(&c->pending, next);
+	c->npending--;
+	c->out = ev->data;
+	c->outlen = ev->len;
+	free(ev);
+
+	return 1;
+}
+
+static void sub_send(struct ctrl_server *srv, struct ctrl_client *c,
+		     const ipc_message *msg)
+{
+	if (sub_push(c, msg)) {
+		TRACE("IPC subscriber does not read its events, closing");
+		client_close(srv, c);
+		return;
+	}
+
+	/* otherwise it follows the one being sent */
+	if (!c->out) {
+		sub_next(c);
+		client_write(srv, c);
+	}
+}
+
+static void subscribe(struct ctrl_server *srv, struct ctrl_client *c)
+{
+	struct installer *instp = srv->instp;
+	ipc_message status;
+
+	c->level = c->msg.data.subscribe.level;
+	c->msg.type = ACK;
+	memset(&c->msg.data, 0, sizeof(c->msg.data));
+	if (encode_answer(c)) {
+		client_close(srv, c);
+		return;
+	}
+
+	c->state = CLIENT_SUBSCRIBED;
+	c->offset = 0;
+	c->keep_open = 0;
+	pthread_mutex_lock(&msglock);
+	c->seq = history.next;
+	if (!nsubscribers++)
+		srv->event_seq = c->seq;
+	pthread_mutex_unlock(&msglock);
+
+	/* the current status follows the ACK */
+	memset(&status, 0, sizeof(status));
+	status.magic = IPC_MAGIC;
+	status.type = GET_STATUS;
+	pthread_mutex_lock(&stream_mutex);
+	status.data.status.current = instp->status;
+	status.data.status.last_result = instp->last_install;
+	status.data.status.error = instp->last_error;
+	pthread_mutex_unlock(&stream_mutex);
+	c->last_status = instp->status;
+
+	if (sub_push(c, &status)) {
+		client_close(srv, c);
+		return;
+	}
+	client_write(srv, c);
+}
+
+/*
+ * A subscriber does not send anything else,
+ * only the end of the connection is relevant
+ */
+static void sub_drain(struct ctrl_server *srv, struct ctrl_client *c)
+{
+	char buf[64];
+	ssize_t ret;
+
+	do {
+		ret = read(c->fd, buf, sizeof(buf));
+	} while (ret > 0 || (ret < 0 && errno == EINTR));
+
+	if (!ret || (errno != EAGAIN && errno != EWOULDBLOCK))
+		client_close(srv, c);
+}
+
+static void dispatch_events(struct ctrl_server *srv)
+{
+	struct installer *instp = srv->instp;
+	struct ctrl_client *c, *tmp;
+	struct msg_record rec;
+	unsigned int seq, end;
+	ipc_message msg, state;
+	char buf[64];
+	int ret;
+
+	while (read(srv->eventfd[0], buf, sizeof(buf)) > 0)
+		;
+
+	pthread_mutex_lock(&msglock);
+	event_wakeup = 0;
+	end = history.next;
+	if (seq_before(srv->event_seq, history.first)) {
+		TRACE("IPC subscribers lost %u notifications",
+			history.first - srv->event_seq);
+		srv->event_seq = history.first;
+	}
+	pthread_mutex_unlock(&msglock);
+
+	for (seq = srv->event_seq; seq != end; seq++) {
+		memset(&msg, 0, sizeof(msg));
+		msg.magic = IPC_MAGIC;
+		msg.type = GET_STATUS;
+
+		pthread_mutex_lock(&msglock);
+		ret = history_get(seq, &rec, msg.data.status.desc,
+				  sizeof(msg.data.status.desc));
+		pthread_mutex_unlock(&msglock);
+		/* overwritten in the meantime */
+		if (ret)
+			continue;
+
+		msg.data.status.current = rec.status;
+		msg.data.status.error = rec.error;
+		pthread_mutex_lock(&stream_mutex);
+		msg.data.status.last_result = instp->last_install;
+		pthread_mutex_unlock(&stream_mutex);
+		/* filtered out notifications still report a new status */
+		state = msg;
+		memset(state.data.status.desc, 0, sizeof(state.data.status.desc));
+
+		LIST_FOREACH_SAFE(c, &srv->clients, next, tmp) {
+			if (c->state != CLIENT_SUBSCRIBED ||
+			    seq_before(seq, c->seq))
+				continue;
+			c->seq = seq + 1;
+			if (c->level && rec.level > c->level) {
+				if (c->last_status == rec.status)
+					continue;
+				c->last_status = rec.status;
+				sub_send(srv, c, &state);
+				continue;
+			}
+			c->last_status = rec.status;
+			sub_send(srv, c, &msg);
+		}
+	}
+	srv->event_seq = end;
+}
+
+static void postupdate_answer(struct ctrl_server *srv, struct ctrl_client *c,
+			      int ret)
+{
+	if (ret == 0) {
+		c->msg.type = ACK;
+		sprintf(c->msg.data.msg, "Post-update actions successfully executed.");
+	} else {
+		c->msg.type = NACK;
+		sprintf(c->msg.data.msg, "Post-update actions failed.");
+	}
+	client_answer(srv, c);
+}
+
+static void *postupdate_thread(void *data)
+{
+	struct postupdate_job *job = (struct postupdate_job *)data;
+	ssize_t ret;
+
+	job->ret = postupdate(get_swupdate_cfg(), job->info);
+
+	do {
+		ret = write(job->fd[1], "", 1);
+	} while (ret < 0 && errno == EINTR);
+
+	return NULL;
+}
+
+static void postupdate_free(struct postupdate_job *job)
+{
+	close(job->fd[0]);
+	close(job->fd[1]);
+	free(job->info);
+	free(job);
+}
+
+/*
+ * Run the post-update actions without stopping the loop,
+ * only one request at a time
+ */
+static void postupdate_start(struct ctrl_server *srv, struct ctrl_client *c)
+{
+	struct postupdate_job *job;
+	ipc_message *msg = &c->msg;
+
+	if (srv->postupdate) {
+		client_nack(srv, c, "Post-update actions already running");
+		return;
+	}
+
+	job = (struct postupdate_job *)calloc(1, sizeof(*job));
+	if (!job) {
+		client_nack(srv, c, NULL);
+		return;
+	}
+	job->kind = CTRL_POSTUPDATE;
+	if (msg->data.instmsg.len > 0)
+		job->info = strndup(msg->data.instmsg.buf,
+				    sizeof(msg->data.instmsg.buf));
+	if (pipe2(job->fd, O_NONBLOCK | O_CLOEXEC) < 0) {
+		free(job->info);
+		free(job);
+		client_nack(srv, c, NULL);
+		return;
+	}
+	if (ctrl_watch(srv, EPOLL_CTL_ADD, job->fd[0], EPOLLIN, job) < 0 ||
+	    pthread_create(&job->thread, NULL, postupdate_thread, job)) {
+		TRACE("Cannot start post-update thread, running it now");
+		epoll_ctl(srv->epfd, EPOLL_CTL_DEL, job->fd[0], NULL);
+		postupdate_answer(srv, c, postupdate(get_swupdate_cfg(), job->info));
+		postupdate_free(job);
+		return;
+	}
+
+	job->client = c;
+	srv->postupdate = job;
+	c->state = CLIENT_POSTUPDATE;
+	ctrl_watch(srv, EPOLL_CTL_MOD, c->fd, 0, c);
+}
+
+static void postupdate_done(struct ctrl_server *srv, struct postupdate_job *job)
+{
+	pthread_join(job->thread, NULL);
+	epoll_ctl(srv->epfd, EPOLL_CTL_DEL, job->fd[0], NULL);
+	srv->postupdate = NULL;
+	if (job->client)
+		postupdate_answer(srv, job->client, job->ret);
+	postupdate_free(job);
+}
+
+static void process_request(struct ctrl_server *srv, struct ctrl_client *c)
+{
+	ipc_message *msg = &c->msg;
+
+#ifdef DEBUG_IPC
+	TRACE("request header: magic[0x%08X] type[0x%08X]", msg->magic, msg->type);
+#endif
+
+	if (msg->magic != IPC_MAGIC) {
+		/* Wrong request */
+		client_nack(srv, c, "Wrong request: aborting");
+		return;
+	}
+
+	switch (msg->type) {
+	case POST_UPDATE:
+		postupdate_start(srv, c);
+		break;
+	case SWUPDATE_SUBPROCESS:
+		/*
+		 *  this request is not for the installer,
+		 *  but for one of the subprocesses
+		 *  forward the request without checking
+		 *  the payload
+		 */
+		forward_request(srv, c);
+		break;
+	case REQ_INSTALL:
+	case REQ_INSTALL_DRYRUN:
+	case REQ_INSTALL_FD:
+	case REQ_INSTALL_FD_DRYRUN:
+		start_install(srv, c);
+		break;
+	case GET_STATUS:
+		get_status(srv, c);
+		break;
+	case SUBSCRIBE:
+		subscribe(srv, c);
+		break;
+	case GET_HISTORY:
+		get_history(srv, c);
+		break;
+	default:
+		client_nack(srv, c, NULL);
+	}
+}
+
+/*
+ * A frame is decoded into msg, data that does not fit
+ * is kept in frame to be forwarded to a subprocess
+ */
+static void frame_received(struct ctrl_server *srv, struct ctrl_client *c)
+{
+	int ret;
+
+	ret = ipc_frame_parse(c->hdr.type, c->payload, c->hdr.len, &c->frame);
+	free(c->payload);
+	c->payload = NULL;
+	if (ret) {
+		TRACE("IPC frame cannot be parsed, closing");
+		client_close(srv, c);
+		return;
+	}
+	c->version = 2;
+	c->request = c->frame.type;
+
+	if (c->frame.type == IPC_HELLO) {
+		/* the request follows on the same connection */
+		ipc_frame_free(&c->frame);
+		memset(&c->msg, 0, sizeof(c->msg));
+		c->msg.magic = IPC_MAGIC;
+		c->msg.type = IPC_HELLO;
+		c->keep_open = 1;
+		client_answer(srv, c);
+		return;
+	}
+
+	ret = ipc_frame_to_message(&c->frame, &c->msg, c->request);
+	if (!ret || c->request != SWUPDATE_SUBPROCESS)
+		ipc_frame_free(&c->frame);
+	if (ret && c->request != SWUPDATE_SUBPROCESS) {
+		client_nack(srv, c, "Message too large");
+		return;
+	}
+
+	process_request(srv, c);
+}
+
+/*
+ * read() that also takes the descriptor a client can
+ * pass with SCM_RIGHTS along the request
+ */
+static ssize_t client_recv(struct ctrl_client *c, void *buf, size_t size)
+{
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * 4)];
+		struct cmsghdr align;
+	} control;
+	unsigned int i, nfds;
+	int fd;
+	ssize_t ret;
+
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = buf;
+	iov.iov_len = size;
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control.buf;
+	mh.msg_controllen = sizeof(control.buf);
+
+	ret = recvmsg(c->fd, &mh, MSG_CMSG_CLOEXEC);
+	if (ret < 0)
+		return ret;
+
+	for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < nfds; i++) {
+			memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+			/* only one descriptor per request */
+			if (c->passfd < 0)
+				c->passfd = fd;
+			else
+				close(fd);
+		}
+	}
+
+	return ret;
+}
+
+static void client_read(struct ctrl_server *srv, struct ctrl_client *c)
+{
+	size_t hdrlen = sizeof(c->hdr);
+	size_t size;
+	ssize_t ret;
+	char *dst;
+
+	for (;;) {
+		if (c->offset < hdrlen) {
+			dst = (char *)&c->hdr + c->offset;
+			size = hdrlen - c->offset;
+		} else if (c->hdr.magic == IPC_MAGIC_V2) {
+			if (c->offset == hdrlen + c->hdr.len)
+				break;
+			dst = c->payload + c->offset - hdrlen;
+			size = hdrlen + c->hdr.len - c->offset;
+		} else {
+			/* fixed ipc_message, even with a wrong magic */
+			if (c->offset == sizeof(c->msg))
+				break;
+			dst = (char *)&c->msg + c->offset;
+			size = sizeof(c->msg) - c->offset;
+		}
+
+		ret = client_recv(c, dst, size);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (ret <= 0) {
+			if (c->offset)
+				TRACE("IPC message too short: %zu bytes", c->offset);
+			client_close(srv, c);
+			return;
+		}
+		c->offset += ret;
+
+		if (c->offset != hdrlen)
+			continue;
+		if (c->hdr.magic == IPC_MAGIC_V2) {
+			if (c->hdr.len > IPC_MAX_FRAME_SIZE + 1024) {
+				TRACE("IPC frame too large: %u bytes", c->hdr.len);
+				client_close(srv, c);
+				return;
+			}
+			c->payload = (char *)malloc(c->hdr.len ? c->hdr.len : 1);
+			if (!c->payload) {
+				client_close(srv, c);
+				return;
+			}
+		} else
+			memcpy(&c->msg, &c->hdr, hdrlen);
+	}
+
+	if (c->hdr.magic == IPC_MAGIC_V2) {
+		frame_received(srv, c);
+		return;
+	}
+
+	c->version = 1;
+	c->request = c->msg.type;
+	process_request(srv, c);
+}
+
+static void client_event(struct ctrl_server *srv, struct ctrl_client *c,
+			 uint32_t events)
+{
+	/* closed while handling a previous event */
+	if (c->fd < 0)
+		return;
+
+	switch (c->state) {
+	case CLIENT_READ:
+		client_read(srv, c);
+		break;
+	case CLIENT_WRITE:
+		client_write(srv, c);
+		break;
+	case CLIENT_FORWARD:
+	case CLIENT_POSTUPDATE:
+		/* nothing to read, the client has gone away */
+		if (events & (EPOLLHUP | EPOLLERR))
+			client_close(srv, c);
+		break;
+	case CLIENT_SUBSCRIBED:
+		if (events & EPOLLOUT)
+			client_write(srv, c);
+		if (c->fd >= 0 && (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+			sub_drain(srv, c);
+		break;
+	}
+}
+
+static void free_dead(struct ctrl_server *srv)
+{
+	struct ctrl_client *c;
+	struct subprocess_chan *chan;
+
+	while (!LIST_EMPTY(&srv->dead_clients)) {
+		c = LIST_FIRST(&srv->dead_clients);
+		LIST_REMOVE(c, next);
+		free(c);
+	}
+	while (!LIST_EMPTY(&srv->dead_chans)) {
+		chan = LIST_FIRST(&srv->dead_chans);
+		LIST_REMOVE(chan, next);
+		free(chan);
+	}
+}
+
+static void client_accept(struct ctrl_server *srv)
+{
+	struct ctrl_client *c;
+	int fd;
+
+	for (;;) {
+		fd = accept(srv->listenfd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				TRACE("Accept returns: %s", strerror(errno));
+			return;
+		}
+
+		c = (struct ctrl_client *)calloc(1, sizeof(*c));
+		if (!c) {
+			close(fd);
+			continue;
+		}
+		c->kind = CTRL_CLIENT;
+		c->fd = fd;
+		c->passfd = -1;
+		SIMPLEQ_INIT(&c->pending);
+		c->state = CLIENT_READ;
+		c->deadline = now_ms() + DEFAULT_INTERNAL_TIMEOUT * 1000ULL;
+		set_nonblock(fd, 1);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		if (ctrl_watch(srv, EPOLL_CTL_ADD, fd, EPOLLIN, c) < 0) {
+			TRACE("Cannot watch client: %s", strerror(errno));
+			close(fd);
+			free(c);
+			continue;
+		}
+		LIST_INSERT_HEAD(&srv->clients, c, next);
+	}
+}
+
+/*
+ * A subprocess that does not answer a request whose client
+ * has gone away is given up: what it has sent is dropped and
+ * the next request is forwarded.
+ */
+static void chan_reset(struct ctrl_server *srv, struct subprocess_chan *chan)
+{
+	char buf[256];
+
+	WARN("No answer from %s, dropping the request",
+		pctl_getname_from_type(chan->source));
+	while (read(chan->fd, buf, sizeof(buf)) > 0)
+		;
+	chan->offset = 0;
+	chan->orphaned = 0;
+	forward_next(srv, chan);
+}
+
+/*
+ * Clients that do not send their request or whose
+ * subprocess does not answer in time are dropped,
+ * returns the time to the next deadline
+ */
+static int check_timeouts(struct ctrl_server *srv)
+{
+	struct ctrl_client *c;
+	struct subprocess_chan *chan, *tmp;
+	unsigned long long now = now_ms(), next;
+
+	LIST_FOREACH_SAFE(chan, &srv->chans, next, tmp) {
+		if (chan->orphaned && chan->orphan_deadline <= now)
+			chan_reset(srv, chan);
+	}
+
+restart:
+	next = 0;
+	LIST_FOREACH(chan, &srv->chans, next) {
+		if (chan->orphaned &&
+		    (!next || chan->orphan_deadline < next))
+			next = chan->orphan_deadline;
+	}
+	LIST_FOREACH(c, &srv->clients, next) {
+		/*
+		 * a subscription lasts until the client closes it,
+		 * post-update actions take the time they need
+		 */
+		if (c->state == CLIENT_SUBSCRIBED ||
+		    c->state == CLIENT_POSTUPDATE)
+			continue;
+		if (c->deadline <= now) {
+			if (c->state == CLIENT_FORWARD) {
+				/*
+				 * If there is an error or timeout,
+				 * send a NACK back
+				 */
+				TRACE("Timeout waiting for %s",
+					pctl_getname_from_type(c->msg.data.instmsg.source));
+				client_detach(c);
+				client_nack(srv, c, NULL);
+			} else {
+				TRACE("IPC client %s, closing",
+					c->state == CLIENT_READ ?
+					"did not send a request" : "does not read the answer");
+				client_close(srv, c);
+			}
+			/* other clients may have been served meanwhile */
+			goto restart;
+		}
+		if (!next || c->deadline < next)
+			next = c->deadline;
+	}
+
+	return next ? (int)(next - now) : -1;
+}
+
+void *network_thread (void *data)
+{
+	struct installer *instp = (struct installer *)data;
+	struct epoll_event events[MAX_EVENTS];
+	struct ctrl_server srv;
+	enum ctrl_source *kind;
+	int timeout;
+	int n, i;
+
+	if (!instp) {
+		TRACE("Fatal error: Network thread aborting...");
+		return (void *)0;
+	}
+
+	register_notifier(network_notifier);
+
+	memset(&srv, 0, sizeof(srv));
+	srv.instp = instp;
+	srv.listen_kind = CTRL_LISTEN;
+	LIST_INIT(&srv.clients);
+	LIST_INIT(&srv.chans);
+	LIST_INIT(&srv.dead_clients);
+	LIST_INIT(&srv.dead_chans);
+
+	/* Initialize and bind to UDS */
+	srv.listenfd = listener_create((char*)CONFIG_SOCKET_CTRL_PATH, SOCK_STREAM);
+	if (srv.listenfd < 0 ) {
+		TRACE("Error creating IPC sockets");
+		exit(2);
+	}
+
+	if (atexit(unlink_socket) != 0) {
+		TRACE("Cannot setup socket cleanup on exit, %s won't be unlinked.",
+			  (char*)CONFIG_SOCKET_CTRL_PATH);
+	}
+
+	srv.epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (srv.epfd < 0) {
+		TRACE("Error creating IPC event loop: %s", strerror(errno));
+		exit(2);
+	}
+	set_nonblock(srv.listenfd, 1);
+	if (ctrl_watch(&srv, EPOLL_CTL_ADD, srv.listenfd, EPOLLIN,
+		       &srv.listen_kind) < 0) {
+		TRACE("Error watching IPC socket: %s", strerror(errno));
+		exit(2);
+	}
+
+	srv.events_kind = CTRL_EVENTS;
+	if (pipe2(srv.eventfd, O_NONBLOCK | O_CLOEXEC) < 0 ||
+	    ctrl_watch(&srv, EPOLL_CTL_ADD, srv.eventfd[0], EPOLLIN,
+		       &srv.events_kind) < 0) {
+		TRACE("Error creating IPC event pipe: %s", strerror(errno));
+		exit(2);
+	}
+	event_wakefd = srv.eventfd[1];
+
+	do {
+		timeout = check_timeouts(&srv);
+		n = epoll_wait(srv.epfd, events, MAX_EVENTS, timeout);
+		if (n < 0) {
+			if (errno != EINTR)
+				TRACE("epoll_wait returns: %s", strerror(errno));
+			continue;
+		}
+
+		for (i = 0; i < n; i++) {
+			kind = (enum ctrl_source *)events[i].data.ptr;
+			switch (*kind) {
+			case CTRL_LISTEN:
+				client_accept(&srv);
+				break;
+			case CTRL_SUBPROCESS:
+				chan_event(&srv, (struct subprocess_chan *)kind,
+					   events[i].events);
+				break;
+			case CTRL_CLIENT:
+				client_event(&srv, (struct ctrl_client *)kind,
+					     events[i].events);
+				break;
+			case CTRL_EVENTS:
+				dispatch_events(&srv);
+				break;
+			case CTRL_POSTUPDATE:
+				postupdate_done(&srv,
+					(struct postupdate_job *)kind);
+				break;
+			}
+		}
+		free_dead(&srv);
+	} while (1);
+
+	return (void *)0;
 }
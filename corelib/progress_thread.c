@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
@@ -18,6 +19,10 @@
 #include <sys/stat.h>
 #include <sys/un.h>
 #include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <pthread.h>
@@ -34,12 +39,83 @@
 #include <systemd/sd-daemon.h>
 #endif
 
+/*
+ * The installer does not talk to the progress clients: each
+ * message is published in a shared memory segment, that clients
+ * map and read without locks (seqlock) when their eventfd is
+ * signalled, and queued for the progress thread, that sends it
+ * to the clients reading from the socket. A slow client does
+ * not slow down the installation.
+ */
+#define PROGRESS_QUEUE_LEN	64
+#define PROGRESS_SEND_TIMEOUT	5	/* seconds */
+#define PROGRESS_SHM_CLIENTS	16
+
+/*
+ * Rates are sampled at most every PROGRESS_RATE_SAMPLE_MS,
+ * the smoothed rate is an exponential moving average with
+ * a time constant of PROGRESS_RATE_TAU_MS
+ */
+#define PROGRESS_RATE_SAMPLE_MS	250
+#define PROGRESS_RATE_TAU_MS	3000
+
+/*
+ * The data path only updates counters, the progress thread
+ * publishes them at most PROGRESS_DEFAULT_RATE times per second
+ * (progress-rate in the configuration)
+ */
+#define PROGRESS_DEFAULT_RATE	10
+
 struct progress_conn {
 	SIMPLEQ_ENTRY(progress_conn) next;
 	int sockfd;
+	int eventfd;		/* shared memory client if >= 0 */
+	bool ext;		/* client wants the extended messages */
+};
+
+struct progress_meter {
+	unsigned long long bytes;
+	unsigned long long sampled;	/* bytes at the last sample */
+	struct timespec last;		/* time of the last sample */
+	double rate;
+	double avg;
+};
+
+struct progress_entry {
+	struct progress_msg msg;
+	struct progress_ext ext;
+};
+
+/*
+ * Written without lock by the copies, see swupdate_progress_bytes()
+ */
+struct progress_counters {
+	unsigned long long dwl_bytes;
+	unsigned long long inst_bytes;
+	unsigned long long cur_done;
+	unsigned long long cur_total;
+	unsigned int percent;		/* set by swupdate_progress_update() */
+	bool running;			/* a step is running */
+	bool dirty;			/* changed since the last publish */
+	bool ticking;			/* the thread publishes periodically */
+	bool shared;			/* steps of parallel jobs are running */
+};
+
+/*
+ * A step started by swupdate_progress_inc_step(). Jobs
+ * installed at the same time run their steps together, but
+ * only the oldest one is published: the others wait in the
+ * list and take over, in order, when it is completed.
+ */
+struct progress_step {
+	SIMPLEQ_ENTRY(progress_step) next;
+	char image[sizeof(((struct progress_msg *)0)->cur_image)];
+	bool published;			/* read without lock by its thread */
+	bool completed;
 };
 
 SIMPLEQ_HEAD(connections, progress_conn);
+SIMPLEQ_HEAD(progress_steps, progress_step);
 
 /*
  * Structure contains data regarding
@@ -47,13 +123,53 @@ SIMPLEQ_HEAD(connections, progress_conn);
  */
 struct swupdate_progress {
 	struct progress_msg msg;
+	struct progress_ext ext;
+	struct progress_meter dwl, inst;
+	struct progress_counters cnt;
 	char *current_image;
 	const handler *curhnd;
 	struct connections conns;
+	struct progress_steps steps;
 	pthread_mutex_t lock;
 	bool step_running;
+	struct progress_shm *shm;
+	int shmfd;
+	/* eventfds of the shared memory clients */
+	int evfds[PROGRESS_SHM_CLIENTS];
+	unsigned int nevfds;
+	/* messages for the socket clients, oldest at head */
+	struct progress_entry queue[PROGRESS_QUEUE_LEN];
+	unsigned int head, count;
+	unsigned long dropped;
+	int wakefd[2];
+};
+static struct swupdate_progress progress = {
+	.steps = SIMPLEQ_HEAD_INITIALIZER(progress.steps),
+	.ext.eta = -1,
+	.shmfd = -1,
+	.wakefd = {-1, -1},
 };
-static struct swupdate_progress progress;
+
+/* step of the calling thread, between inc_step and step_completed */
+static __thread struct progress_step *thread_step;
+/* the calling thread does not report bytes and percentage */
+static __thread bool thread_muted;
+
+/*
+ * Seqlock writer, the writers are serialized by progress.lock
+ */
+static void publish_shm(struct progress_shm *shm, const struct progress_msg *msg,
+			const struct progress_ext *ext)
+{
+	unsigned int seq = shm->seq;
+
+	__atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&shm->msg, msg, sizeof(*msg));
+	shm->msg.magic = PROGRESS_EXT_MAGIC;
+	memcpy(&shm->ext, ext, sizeof(*ext));
+	__atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
 
 /*
  * This must be called after acquiring the mutex
@@ -61,35 +177,107 @@ static struct swupdate_progress progress;
  */
 static void send_progress_msg(void)
 {
-	struct progress_conn *conn, *tmp;
 	struct swupdate_progress *prbar = &progress;
-	void *buf;
-	size_t count;
-	ssize_t n;
+	uint64_t one = 1;
+	unsigned int tail, i;
+	ssize_t __attribute__ ((__unused__)) ret;
 
-	SIMPLEQ_FOREACH_SAFE(conn, &prbar->conns, next, tmp) {
-		buf = &prbar->msg;
-		count = sizeof(prbar->msg);
-		while (count > 0) {
-			n = send(conn->sockfd, buf, count, MSG_NOSIGNAL);
-			if (n <= 0) {
-				TRACE("A progress client disappeared, removing it.");
-				close(conn->sockfd);
-				SIMPLEQ_REMOVE(&prbar->conns, conn,
-					       	progress_conn, next);
-				free(conn);
-				break;
-			}
-			count -= (size_t)n;
-			buf = (char*)buf + n;
-		}
+	if (prbar->shm) {
+		publish_shm(prbar->shm, &prbar->msg, &prbar->ext);
+		for (i = 0; i < prbar->nevfds; i++)
+			ret = write(prbar->evfds[i], &one, sizeof(one));
+	}
+
+	if (prbar->count == PROGRESS_QUEUE_LEN) {
+		/* the socket clients are too slow, drop the oldest */
+		prbar->head = (prbar->head + 1) % PROGRESS_QUEUE_LEN;
+		prbar->count--;
+		prbar->dropped++;
 	}
+	tail = (prbar->head + prbar->count) % PROGRESS_QUEUE_LEN;
+	memcpy(&prbar->queue[tail].msg, &prbar->msg, sizeof(prbar->msg));
+	memcpy(&prbar->queue[tail].ext, &prbar->ext, sizeof(prbar->ext));
+	prbar->count++;
+
+	/* a full pipe means that the thread is already woken up */
+	if (prbar->wakefd[1] >= 0)
+		ret = write(prbar->wakefd[1], "", 1);
+}
+
+static unsigned int rate_value(double rate)
+{
+	return rate > (double)UINT_MAX ? UINT_MAX : (unsigned int)rate;
+}
+
+/*
+ * Returns true if a new sample was taken
+ */
+static bool meter_sample(struct progress_meter *m, const struct timespec *now)
+{
+	long ms;
+
+	/* the time before the first data does not count */
+	if ((!m->last.tv_sec && !m->last.tv_nsec) ||
+	    (m->bytes == m->sampled && m->avg <= 0)) {
+		m->last = *now;
+		return false;
+	}
+	ms = (now->tv_sec - m->last.tv_sec) * 1000 +
+		(now->tv_nsec - m->last.tv_nsec) / 1000000;
+	if (ms < PROGRESS_RATE_SAMPLE_MS)
+		return false;
+
+	m->rate = (m->bytes - m->sampled) * 1000.0 / ms;
+	if (m->avg > 0)
+		m->avg += (m->rate - m->avg) * ms / (PROGRESS_RATE_TAU_MS + ms);
+	else
+		m->avg = m->rate;
+	m->sampled = m->bytes;
+	m->last = *now;
+
+	return true;
+}
+
+/*
+ * The ETA is for the whole installation if the installer
+ * said how much data the handlers get, else for the
+ * current step
+ */
+static void update_ext(struct swupdate_progress *prbar)
+{
+	struct progress_ext *ext = &prbar->ext;
+	unsigned long long left = 0;
+
+	ext->dwl_bytes = prbar->dwl.bytes;
+	ext->dwl_rate = rate_value(prbar->dwl.rate);
+	ext->dwl_rate_avg = rate_value(prbar->dwl.avg);
+	ext->inst_bytes = prbar->inst.bytes;
+	ext->inst_rate = rate_value(prbar->inst.rate);
+	ext->inst_rate_avg = rate_value(prbar->inst.avg);
+
+	if (ext->inst_total > ext->inst_bytes)
+		left = ext->inst_total - ext->inst_bytes;
+	else if (ext->cur_total > ext->cur_bytes)
+		left = ext->cur_total - ext->cur_bytes;
+	if (!left)
+		ext->eta = ext->inst_total ? 0 : -1;
+	else if (prbar->inst.avg >= 1)
+		ext->eta = (int)(left / prbar->inst.avg + 0.5);
+	else
+		ext->eta = -1;
 }
 
 void swupdate_progress_init(unsigned int nsteps) {
 	struct swupdate_progress *prbar = &progress;
 	pthread_mutex_lock(&prbar->lock);
 
+	memset(&prbar->ext, 0, sizeof(prbar->ext));
+	prbar->ext.eta = -1;
+	memset(&prbar->dwl, 0, sizeof(prbar->dwl));
+	memset(&prbar->inst, 0, sizeof(prbar->inst));
+	__atomic_store_n(&prbar->cnt.dwl_bytes, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&prbar->cnt.inst_bytes, 0, __ATOMIC_RELAXED);
+
 	prbar->msg.nsteps = nsteps;
 	prbar->msg.cur_step = 0;
 	prbar->msg.status = START;
@@ -102,36 +290,246 @@ void swupdate_progress_init(unsigned int nsteps) {
 	pthread_mutex_unlock(&prbar->lock);
 }
 
-void swupdate_progress_update(unsigned int perc)
+static void progress_wake(void)
 {
 	struct swupdate_progress *prbar = &progress;
-	pthread_mutex_lock(&prbar->lock);
-	if (perc != prbar->msg.cur_percent && prbar->step_running) {
-		prbar->msg.cur_percent = perc;
+	ssize_t __attribute__ ((__unused__)) ret;
+
+	if (prbar->wakefd[1] >= 0)
+		ret = write(prbar->wakefd[1], "", 1);
+}
+
+static void counters_changed(struct progress_counters *cnt)
+{
+	__atomic_store_n(&cnt->dirty, true, __ATOMIC_RELEASE);
+	/* only the first change after an idle period wakes up the thread */
+	if (!__atomic_load_n(&cnt->ticking, __ATOMIC_ACQUIRE) &&
+	    !__atomic_exchange_n(&cnt->ticking, true, __ATOMIC_ACQ_REL))
+		progress_wake();
+}
+
+/*
+ * While steps of parallel jobs run, only the thread of the
+ * published step sets its percentage. Else any thread does,
+ * handlers can copy in a thread of their own.
+ */
+static bool step_reports(struct progress_counters *cnt)
+{
+	struct progress_step *step = thread_step;
+
+	if (step)
+		return __atomic_load_n(&step->published, __ATOMIC_RELAXED);
+
+	return !__atomic_load_n(&cnt->shared, __ATOMIC_RELAXED);
+}
+
+/*
+ * Called for each chunk copied: delta bytes were read since the
+ * last call, done of total for this copy. While a step is running,
+ * the data goes to a handler, else it is the SWU being received.
+ * This runs in the data path and does not take the lock, the
+ * progress thread publishes the counters.
+ */
+void swupdate_progress_bytes(unsigned long long delta, unsigned long long done,
+			     unsigned long long total)
+{
+	struct progress_counters *cnt = &progress.cnt;
+
+	if (thread_muted)
+		return;
+
+	if (__atomic_load_n(&cnt->running, __ATOMIC_RELAXED)) {
+		__atomic_fetch_add(&cnt->inst_bytes, delta, __ATOMIC_RELAXED);
+		if (step_reports(cnt)) {
+			__atomic_store_n(&cnt->cur_done, done, __ATOMIC_RELAXED);
+			__atomic_store_n(&cnt->cur_total, total, __ATOMIC_RELAXED);
+		}
+	} else
+		__atomic_fetch_add(&cnt->dwl_bytes, delta, __ATOMIC_RELAXED);
+	counters_changed(cnt);
+}
+
+/*
+ * Data copied by the calling thread is already counted
+ * by another one, as the handlers fed by a fan-out
+ */
+void swupdate_progress_mute(bool mute)
+{
+	thread_muted = mute;
+}
+
+/*
+ * For handlers that know only the percentage
+ */
+void swupdate_progress_update(unsigned int perc)
+{
+	struct progress_counters *cnt = &progress.cnt;
+
+	if (!thread_muted &&
+	    __atomic_load_n(&cnt->running, __ATOMIC_RELAXED) &&
+	    step_reports(cnt) &&
+	    __atomic_exchange_n(&cnt->percent, perc, __ATOMIC_RELAXED) != perc)
+		counters_changed(cnt);
+}
+
+/*
+ * Copy the counters into the message,
+ * with the mutex for the progress structure
+ */
+static void fold_counters(struct swupdate_progress *prbar)
+{
+	struct progress_counters *cnt = &prbar->cnt;
+	unsigned long long done, total;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	prbar->dwl.bytes = __atomic_load_n(&cnt->dwl_bytes, __ATOMIC_RELAXED);
+	prbar->inst.bytes = __atomic_load_n(&cnt->inst_bytes, __ATOMIC_RELAXED);
+	meter_sample(&prbar->dwl, &now);
+	meter_sample(&prbar->inst, &now);
+	if (prbar->step_running) {
+		done = __atomic_load_n(&cnt->cur_done, __ATOMIC_RELAXED);
+		total = __atomic_load_n(&cnt->cur_total, __ATOMIC_RELAXED);
+		prbar->ext.cur_bytes = done;
+		prbar->ext.cur_total = total;
+		if (total) {
+			prbar->ext.cur_permille = (unsigned int)(done * 1000 / total);
+			prbar->msg.cur_percent = (unsigned int)(done * 100 / total);
+		} else {
+			prbar->msg.cur_percent = __atomic_load_n(&cnt->percent,
+								 __ATOMIC_RELAXED);
+			prbar->ext.cur_permille = prbar->msg.cur_percent * 10;
+		}
+	}
+	update_ext(prbar);
+}
+
+/*
+ * Send what was not published yet before the step or the
+ * update changes, with the mutex for the progress structure
+ */
+static void flush_counters(struct swupdate_progress *prbar)
+{
+	if (__atomic_exchange_n(&prbar->cnt.dirty, false, __ATOMIC_ACQ_REL)) {
+		fold_counters(prbar);
 		send_progress_msg();
 	}
-	pthread_mutex_unlock(&prbar->lock);
 }
 
-void swupdate_progress_inc_step(char *image)
+static void set_running(struct swupdate_progress *prbar, bool running)
+{
+	prbar->step_running = running;
+	__atomic_store_n(&prbar->cnt.running, running, __ATOMIC_RELAXED);
+}
+
+/*
+ * The handlers are still going to get bytes of data,
+ * used for the ETA
+ */
+void swupdate_progress_expected(unsigned long long bytes)
 {
 	struct swupdate_progress *prbar = &progress;
 	pthread_mutex_lock(&prbar->lock);
+	prbar->ext.inst_total = __atomic_load_n(&prbar->cnt.inst_bytes,
+						__ATOMIC_RELAXED) + bytes;
+	pthread_mutex_unlock(&prbar->lock);
+}
+
+/*
+ * Publish the start of a step, with the mutex
+ * for the progress structure
+ */
+static void start_step(struct swupdate_progress *prbar, const char *image)
+{
 	prbar->msg.cur_step++;
 	prbar->msg.cur_percent = 0;
+	prbar->ext.cur_bytes = 0;
+	prbar->ext.cur_total = 0;
+	prbar->ext.cur_permille = 0;
+	__atomic_store_n(&prbar->cnt.cur_done, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&prbar->cnt.cur_total, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&prbar->cnt.percent, 0, __ATOMIC_RELAXED);
+	update_ext(prbar);
 	strncpy(prbar->msg.cur_image, image, sizeof(prbar->msg.cur_image));
-	prbar->step_running = true;
+	set_running(prbar, true);
 	prbar->msg.status = RUN;
 	send_progress_msg();
+}
+
+/*
+ * The published step is completed: the steps that were
+ * completed in the meantime are reported in the order they
+ * were started, then the oldest running one is published.
+ */
+static void next_step(struct swupdate_progress *prbar)
+{
+	struct progress_step *step;
+
+	while ((step = SIMPLEQ_FIRST(&prbar->steps)) != NULL) {
+		start_step(prbar, step->image);
+		if (!step->completed) {
+			__atomic_store_n(&step->published, true, __ATOMIC_RELAXED);
+			break;
+		}
+		SIMPLEQ_REMOVE_HEAD(&prbar->steps, next);
+		free(step);
+		prbar->msg.cur_percent = 100;
+		prbar->ext.cur_permille = 1000;
+		send_progress_msg();
+	}
+
+	if (!step) {
+		set_running(prbar, false);
+		prbar->msg.status = IDLE;
+	}
+	__atomic_store_n(&prbar->cnt.shared,
+			 step && SIMPLEQ_NEXT(step, next), __ATOMIC_RELAXED);
+}
+
+void swupdate_progress_inc_step(char *image)
+{
+	struct swupdate_progress *prbar = &progress;
+	struct progress_step *step;
+
+	step = (struct progress_step *)calloc(1, sizeof(*step));
+	pthread_mutex_lock(&prbar->lock);
+	flush_counters(prbar);
+	if (step) {
+		strncpy(step->image, image, sizeof(step->image) - 1);
+		/* first step if none is running, else it waits its turn */
+		step->published = SIMPLEQ_EMPTY(&prbar->steps);
+		__atomic_store_n(&prbar->cnt.shared, !step->published,
+				 __ATOMIC_RELAXED);
+		SIMPLEQ_INSERT_TAIL(&prbar->steps, step, next);
+		thread_step = step;
+	}
+	if (!step || step->published)
+		start_step(prbar, image);
 	pthread_mutex_unlock(&prbar->lock);
 }
 
 void swupdate_progress_step_completed(void)
 {
 	struct swupdate_progress *prbar = &progress;
+	struct progress_step *step = thread_step;
+
+	thread_step = NULL;
 	pthread_mutex_lock(&prbar->lock);
-	prbar->step_running = false;
-	prbar->msg.status = IDLE;
+	if (step && !step->published) {
+		/* reported when the steps before it are completed */
+		step->completed = true;
+		pthread_mutex_unlock(&prbar->lock);
+		return;
+	}
+	flush_counters(prbar);
+	if (step) {
+		SIMPLEQ_REMOVE(&prbar->steps, step, progress_step, next);
+		free(step);
+		next_step(prbar);
+	} else {
+		set_running(prbar, false);
+		prbar->msg.status = IDLE;
+	}
 	pthread_mutex_unlock(&prbar->lock);
 }
 
@@ -139,8 +537,10 @@ void swupdate_progress_end(RECOVERY_STATUS status)
 {
 	struct swupdate_progress *prbar = &progress;
 	pthread_mutex_lock(&prbar->lock);
-	prbar->step_running = false;
+	flush_counters(prbar);
+	set_running(prbar, false);
 	prbar->msg.status = status;
+	fold_counters(prbar);
 	send_progress_msg();
 	pthread_mutex_unlock(&prbar->lock);
 }
@@ -167,7 +567,8 @@ void swupdate_progress_done(const char *info)
 		snprintf(prbar->msg.info, sizeof(prbar->msg.info), "%s", info);
 		prbar->msg.infolen = strlen(prbar->msg.info);
 	}
-	prbar->step_running = false;
+	flush_counters(prbar);
+	set_running(prbar, false);
 	prbar->msg.status = DONE;
 	send_progress_msg();
 	prbar->msg.infolen = 0;
@@ -188,17 +589,314 @@ static void unlink_socket(void)
 	unlink((char*)CONFIG_SOCKET_PROGRESS_PATH);
 }
 
-void *progress_bar_thread (void __attribute__ ((__unused__)) *data)
+static void remove_conn(struct progress_conn *conn)
+{
+	struct swupdate_progress *prbar = &progress;
+	unsigned int i;
+
+	close(conn->sockfd);
+	if (conn->eventfd >= 0) {
+		pthread_mutex_lock(&prbar->lock);
+		for (i = 0; i < prbar->nevfds; i++) {
+			if (prbar->evfds[i] == conn->eventfd) {
+				prbar->evfds[i] = prbar->evfds[--prbar->nevfds];
+				break;
+			}
+		}
+		pthread_mutex_unlock(&prbar->lock);
+		close(conn->eventfd);
+	}
+	SIMPLEQ_REMOVE(&prbar->conns, conn, progress_conn, next);
+	free(conn);
+}
+
+static int send_all(int fd, const void *buf, size_t count)
+{
+	ssize_t n;
+
+	while (count > 0) {
+		n = send(fd, buf, count, MSG_NOSIGNAL);
+		if (n <= 0)
+			return -1;
+		count -= (size_t)n;
+		buf = (const char *)buf + n;
+	}
+
+	return 0;
+}
+
+static int create_shm(void)
+{
+	struct swupdate_progress *prbar = &progress;
+	char *path;
+	int fd;
+
+#ifdef MFD_CLOEXEC
+	fd = memfd_create("swupdate-progress", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+	fd = -1;
+#endif
+	if (fd < 0) {
+		if (asprintf(&path, "%sprogress-XXXXXX", get_tmpdir()) ==
+		    ENOMEM_ASPRINTF)
+			return -ENOMEM;
+		fd = mkstemp(path);
+		if (fd >= 0)
+			unlink(path);
+		free(path);
+		if (fd < 0)
+			return -errno;
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
+
+	if (ftruncate(fd, sizeof(*prbar->shm)) < 0) {
+		close(fd);
+		return -errno;
+	}
+	prbar->shm = (struct progress_shm *)mmap(NULL, sizeof(*prbar->shm),
+			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (prbar->shm == MAP_FAILED) {
+		prbar->shm = NULL;
+		close(fd);
+		return -errno;
+	}
+	prbar->shm->magic = PROGRESS_SHM_MAGIC;
+	prbar->shmfd = fd;
+
+#ifdef F_ADD_SEALS
+	/*
+	 * Clients cannot resize the segment, and if the kernel
+	 * knows F_SEAL_FUTURE_WRITE, they cannot map it writable
+	 */
+#ifdef F_SEAL_FUTURE_WRITE
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+		  F_SEAL_FUTURE_WRITE | F_SEAL_SEAL) == 0)
+		return 0;
+#endif
+	fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+#endif
+
+	return 0;
+}
+
+/*
+ * Clients get a read-only descriptor for the segment,
+ * or nothing: a copy of the descriptor would let them
+ * write into it
+ */
+static int shm_client_fd(void)
+{
+	struct swupdate_progress *prbar = &progress;
+	char path[64];
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", prbar->shmfd);
+
+	return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+/*
+ * The client asked for the shared memory: it gets the segment
+ * and its own eventfd, and no more messages on the socket.
+ * If it cannot, the answer has no descriptors and the client
+ * goes on with the messages.
+ */
+static void switch_to_shm(struct progress_conn *conn)
+{
+	struct swupdate_progress *prbar = &progress;
+	struct progress_msg announce;
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	int fds[2];
+	ssize_t n;
+
+	if (conn->eventfd >= 0)
+		return;
+
+	memset(&announce, 0, sizeof(announce));
+	announce.magic = PROGRESS_SHM_MAGIC;
+
+	if (!prbar->shm) {
+		send_all(conn->sockfd, &announce, sizeof(announce));
+		return;
+	}
+	if (prbar->nevfds == PROGRESS_SHM_CLIENTS) {
+		WARN("Too many progress shared memory clients");
+		send_all(conn->sockfd, &announce, sizeof(announce));
+		return;
+	}
+
+	fds[0] = shm_client_fd();
+	fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fds[0] < 0 || fds[1] < 0) {
+		WARN("Progress shared memory cannot be passed: %s",
+			strerror(errno));
+		if (fds[0] >= 0)
+			close(fds[0]);
+		if (fds[1] >= 0)
+			close(fds[1]);
+		send_all(conn->sockfd, &announce, sizeof(announce));
+		return;
+	}
+
+	memset(&mh, 0, sizeof(mh));
+	memset(&control, 0, sizeof(control));
+	iov.iov_base = &announce;
+	iov.iov_len = sizeof(announce);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control.buf;
+	mh.msg_controllen = sizeof(control.buf);
+	cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	n = sendmsg(conn->sockfd, &mh, MSG_NOSIGNAL);
+	close(fds[0]);
+	if (n <= 0 || send_all(conn->sockfd, (char *)&announce + n,
+			       sizeof(announce) - n)) {
+		close(fds[1]);
+		return;
+	}
+	conn->eventfd = fds[1];
+	pthread_mutex_lock(&prbar->lock);
+	prbar->evfds[prbar->nevfds++] = conn->eventfd;
+	pthread_mutex_unlock(&prbar->lock);
+}
+
+/*
+ * Clients do not send anything but the shared memory request,
+ * returns -1 if the connection is closed
+ */
+static int conn_request(struct progress_conn *conn)
+{
+	unsigned int req;
+	ssize_t n;
+
+	n = recv(conn->sockfd, &req, sizeof(req), MSG_DONTWAIT);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return 0;
+	if (n <= 0)
+		return -1;
+	if (n == sizeof(req) && req == PROGRESS_SHM_REQUEST)
+		switch_to_shm(conn);
+	if (n == sizeof(req) && req == PROGRESS_EXT_REQUEST)
+		conn->ext = true;
+
+	return 0;
+}
+
+static void accept_conn(int listen)
 {
-	int listen, connfd;
-	socklen_t clilen;
-	struct sockaddr_un cliaddr;
 	struct swupdate_progress *prbar = &progress;
 	struct progress_conn *conn;
+	struct timeval tv = { .tv_sec = PROGRESS_SEND_TIMEOUT };
+	int connfd;
+
+	connfd = accept(listen, NULL, NULL);
+	if (connfd < 0) {
+		if (errno != EINTR)
+			TRACE("Accept returns: %s", strerror(errno));
+		return;
+	}
+
+	conn = (struct progress_conn *)calloc(1, sizeof(*conn));
+	if (!conn) {
+		ERROR("Out of memory, skipping...");
+		close(connfd);
+		return;
+	}
+	conn->sockfd = connfd;
+	conn->eventfd = -1;
+	/* a client that does not read is dropped */
+	setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	SIMPLEQ_INSERT_TAIL(&prbar->conns, conn, next);
+}
+
+/*
+ * Send the queued messages, the lock is not held while sending
+ */
+static void send_queued(void)
+{
+	struct swupdate_progress *prbar = &progress;
+	struct progress_conn *conn, *tmp;
+	struct progress_entry entry;
+	struct progress_msg extmsg;
+	unsigned long dropped;
+	char buf[64];
+	int ret;
+
+	while (read(prbar->wakefd[0], buf, sizeof(buf)) > 0)
+		;
+
+	for (;;) {
+		pthread_mutex_lock(&prbar->lock);
+		if (!prbar->count) {
+			pthread_mutex_unlock(&prbar->lock);
+			break;
+		}
+		memcpy(&entry, &prbar->queue[prbar->head], sizeof(entry));
+		prbar->head = (prbar->head + 1) % PROGRESS_QUEUE_LEN;
+		prbar->count--;
+		dropped = prbar->dropped;
+		prbar->dropped = 0;
+		pthread_mutex_unlock(&prbar->lock);
+
+		if (dropped)
+			TRACE("%lu progress messages dropped", dropped);
+
+		SIMPLEQ_FOREACH_SAFE(conn, &prbar->conns, next, tmp) {
+			if (conn->eventfd >= 0)
+				continue;
+			if (conn->ext) {
+				extmsg = entry.msg;
+				extmsg.magic = PROGRESS_EXT_MAGIC;
+				ret = send_all(conn->sockfd, &extmsg, sizeof(extmsg)) ||
+					send_all(conn->sockfd, &entry.ext,
+						 sizeof(entry.ext));
+			} else
+				ret = send_all(conn->sockfd, &entry.msg,
+					       sizeof(entry.msg));
+			if (ret) {
+				TRACE("A progress client disappeared, removing it.");
+				remove_conn(conn);
+			}
+		}
+	}
+}
+
+void *progress_bar_thread (void __attribute__ ((__unused__)) *data)
+{
+	int listen;
+	struct swupdate_progress *prbar = &progress;
+	struct progress_conn *conn, *tmp;
+	struct pollfd *pfds = NULL, *p;
+	unsigned int nconns, nfds = 0, i;
+	struct timespec now, last = { 0 };
+	long interval, elapsed;
+	int ret, timeout;
+
+	ret = get_swupdate_cfg()->globals.progress_rate;
+	interval = 1000 / (ret > 0 ? ret : PROGRESS_DEFAULT_RATE);
 
 	pthread_mutex_init(&prbar->lock, NULL);
 	SIMPLEQ_INIT(&prbar->conns);
 
+	ret = create_shm();
+	if (ret < 0)
+		WARN("Progress shared memory not available: %s",
+			strerror(-ret));
+	if (pipe2(prbar->wakefd, O_NONBLOCK | O_CLOEXEC) < 0) {
+		ERROR("Error creating progress pipe, exiting.");
+		exit(2);
+	}
+
 	/* Initialize and bind to UDS */
 	listen = listener_create((char*)CONFIG_SOCKET_PROGRESS_PATH, SOCK_STREAM);
 	if (listen < 0 ) {
@@ -212,27 +910,77 @@ void *progress_bar_thread (void __attribute__ ((__unused__)) *data)
 	}
 
 	do {
-		clilen = sizeof(cliaddr);
-		if ( (connfd = accept(listen, (struct sockaddr *) &cliaddr, &clilen)) < 0) {
-			if (errno == EINTR)
-				continue;
-			else {
-				TRACE("Accept returns: %s", strerror(errno));
+		nconns = 0;
+		SIMPLEQ_FOREACH(conn, &prbar->conns, next)
+			nconns++;
+		if (nconns + 2 > nfds) {
+			p = (struct pollfd *)realloc(pfds, (nconns + 2) * sizeof(*pfds));
+			if (!p) {
+				ERROR("Out of memory, skipping...");
+				sleep(1);
 				continue;
 			}
+			pfds = p;
+			nfds = nconns + 2;
+		}
+
+		pfds[0].fd = listen;
+		pfds[1].fd = prbar->wakefd[0];
+		i = 2;
+		SIMPLEQ_FOREACH(conn, &prbar->conns, next)
+			pfds[i++].fd = conn->sockfd;
+		for (i = 0; i < nconns + 2; i++) {
+			pfds[i].events = POLLIN;
+			pfds[i].revents = 0;
 		}
 
 		/*
-		 * Save the new connection to be handled by the progress thread
+		 * Publish the counters while they change, at most once
+		 * per interval, then wait for the next change
 		 */
-		conn = (struct progress_conn *)calloc(1, sizeof(*conn));
-		if (!conn) {
-			ERROR("Out of memory, skipping...");
+		timeout = -1;
+		if (__atomic_load_n(&prbar->cnt.ticking, __ATOMIC_ACQUIRE)) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			elapsed = (now.tv_sec - last.tv_sec) * 1000 +
+				(now.tv_nsec - last.tv_nsec) / 1000000;
+			if (elapsed >= interval) {
+				if (__atomic_exchange_n(&prbar->cnt.dirty, false,
+							__ATOMIC_ACQ_REL)) {
+					pthread_mutex_lock(&prbar->lock);
+					fold_counters(prbar);
+					send_progress_msg();
+					pthread_mutex_unlock(&prbar->lock);
+					last = now;
+					timeout = interval;
+				} else {
+					__atomic_store_n(&prbar->cnt.ticking, false,
+							 __ATOMIC_RELEASE);
+					/* a change that did not wake up the thread */
+					if (__atomic_load_n(&prbar->cnt.dirty,
+							    __ATOMIC_ACQUIRE) &&
+					    !__atomic_exchange_n(&prbar->cnt.ticking,
+								 true, __ATOMIC_ACQ_REL))
+						timeout = 0;
+				}
+			} else
+				timeout = interval - elapsed;
+		}
+
+		if (poll(pfds, nconns + 2, timeout) < 0) {
+			if (errno != EINTR)
+				TRACE("poll returns: %s", strerror(errno));
 			continue;
 		}
-		conn->sockfd = connfd;
-		pthread_mutex_lock(&prbar->lock);
-		SIMPLEQ_INSERT_TAIL(&prbar->conns, conn, next);
-		pthread_mutex_unlock(&prbar->lock);
+
+		/* the list is not changed by the other threads */
+		i = 2;
+		SIMPLEQ_FOREACH_SAFE(conn, &prbar->conns, next, tmp) {
+			if (pfds[i++].revents && conn_request(conn) < 0)
+				remove_conn(conn);
+		}
+		if (pfds[1].revents)
+			send_queued();
+		if (pfds[0].revents)
+			accept_conn(listen);
 	} while(1);
 }
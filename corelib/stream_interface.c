@@ -114,6 +114,75 @@ static int extract_file_to_tmp(int fd, const char *fname, unsigned long *poffs)
 	return 0;
 }
 
+/*
+ * Check if all required files were provided
+ * Update of a single file is not possible.
+ */
+static int check_required(struct swupdate_cfg *software)
+{
+	struct img_type *img;
+
+	LIST_FOREACH(img, &software->images, next) {
+		if (! img->required)
+			continue;
+		if (! img->fname[0])
+			continue;
+		if (! img->provided) {
+			ERROR("Required image file %s missing...aborting !",
+				img->fname);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * The image is a file that can be seeked: as for an image
+ * installed from the command line, only the meta data is
+ * extracted, the images are read at their offset when they
+ * are installed
+ */
+static int scan_file(int fd, struct swupdate_cfg *software)
+{
+	char output_file[MAX_IMAGE_FNAME];
+	off_t pos = 0;
+	int ret;
+
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		ERROR("Image cannot be seeked: %s", strerror(errno));
+		return -1;
+	}
+
+	ret = extract_sw_description(fd, SW_DESCRIPTION_FILENAME, &pos);
+#ifdef CONFIG_SIGNED_IMAGES
+	ret |= extract_sw_description(fd, SW_DESCRIPTION_FILENAME ".sig", &pos);
+#endif
+	if (ret) {
+		ERROR("Failed to extract meta information");
+		return -1;
+	}
+
+	snprintf(output_file, sizeof(output_file), "%s%s", get_tmpdir(),
+		 SW_DESCRIPTION_FILENAME);
+	if (parse(software, output_file)) {
+		ERROR("Compatible SW not found");
+		return -1;
+	}
+
+	if (check_hw_compatibility(software)) {
+		ERROR("SW not compatible with hardware");
+		return -1;
+	}
+
+	if (cpio_scan(fd, software, pos) < 0) {
+		ERROR("Failed to scan the image");
+		return -1;
+	}
+
+	return check_required(software);
+}
+
 static int extract_files(int fd, struct swupdate_cfg *software)
 {
 	int status = STREAM_WAIT_DESCRIPTION;
@@ -123,6 +192,9 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 	uint32_t checksum;
 	int fdout;
 	struct img_type *img, *part;
+	struct img_type **streams;
+	unsigned int nstreams;
+	int ret;
 	char output_file[MAX_IMAGE_FNAME];
 	const char* TMPDIR = get_tmpdir();
 	bool installed_directly = false;
@@ -252,6 +324,7 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 						&& (!strcmp(part->type, "ubipartition")) ) {
 						TRACE("Need to adjust partition %s before streaming %s",
 							part->volname, img->fname);
+						release_mounts(&part, 1);
 						if (install_single_image(part, software->globals.dry_run)) {
 							ERROR("Error adjusting partition %s", part->volname);
 							return -1;
@@ -260,8 +333,30 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 						part->install_directly = 1;
 					}
 				}
+				/*
+				 * All images streamed from this file are
+				 * installed together
+				 */
+				nstreams = 0;
+				LIST_FOREACH(part, &software->images, next)
+					if (part->install_directly &&
+					    !strcmp(part->fname, img->fname))
+						nstreams++;
+				streams = (struct img_type **)calloc(nstreams + 1, sizeof(*streams));
+				if (!streams)
+					return -ENOMEM;
+				streams[0] = img;
+				nstreams = 1;
+				LIST_FOREACH(part, &software->images, next)
+					if (part->install_directly && part != img &&
+					    !strcmp(part->fname, img->fname))
+						streams[nstreams++] = part;
 				img->fdin = fd;
-				if (install_single_image(img, software->globals.dry_run)) {
+				release_mounts(streams, nstreams);
+				ret = install_fanout(streams, nstreams,
+						     software->globals.dry_run);
+				free(streams);
+				if (ret) {
 					ERROR("Error streaming %s", img->fname);
 					return -1;
 				}
@@ -272,24 +367,7 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 			break;
 
 		case STREAM_END:
-
-			/*
-			 * Check if all required files were provided
-			 * Update of a single file is not possible.
-			 */
-
-			LIST_FOREACH(img, &software->images, next) {
-				if (! img->required)
-					continue;
-				if (! img->fname[0])
-					continue;
-				if (! img->provided) {
-					ERROR("Required image file %s missing...aborting !",
-						img->fname);
-					return -1;
-				}
-			}
-			return 0;
+			return check_required(software);
 		default:
 			return -1;
 		}
@@ -342,7 +420,8 @@ void *network_initializer(void *data)
 
 		/* wait for someone to issue an install request */
 		pthread_mutex_lock(&stream_mutex);
-		pthread_cond_wait(&stream_wkup, &stream_mutex);
+		while (inst.status != START)
+			pthread_cond_wait(&stream_wkup, &stream_mutex);
 		inst.status = RUN;
 		pthread_mutex_unlock(&stream_mutex);
 		notify(START, RECOVERY_NO_ERROR, INFOLEVEL, "Software Update started !");
@@ -383,8 +462,14 @@ void *network_initializer(void *data)
 		 * extract the meta data and relevant parts
 		 * (flash images) from the install image
 		 */
-		ret = extract_files(inst.fd, software);
-		close(inst.fd);
+		if (inst.fromfile) {
+			ret = scan_file(inst.fd, software);
+		} else {
+			/* images installed from the stream are in the session too */
+			swupdate_mount_cache_begin();
+			ret = extract_files(inst.fd, software);
+			close(inst.fd);
+		}
 
 		/* do carry out the installation (flash programming) */
 		if (ret == 0) {
@@ -400,7 +485,10 @@ void *network_initializer(void *data)
 			}
 
 			notify(RUN, RECOVERY_NO_ERROR, INFOLEVEL, "Installation in progress");
-			ret = install_images(software, 0, 0);
+			if (inst.fromfile)
+				ret = install_images(software, inst.fd, 1);
+			else
+				ret = install_images(software, 0, 0);
 			if (ret != 0) {
 				if (software->bootloader_transaction_marker) {
 					save_state_string((char*)BOOTVAR_TRANSACTION, STATE_FAILED);
@@ -424,6 +512,13 @@ void *network_initializer(void *data)
 			notify(FAILURE, RECOVERY_ERROR, ERRORLEVEL, "Image invalid or corrupted. Not installing ...");
 		}
 
+		/* install_images() has ended it, unless it failed before */
+		swupdate_mount_cache_end();
+
+		if (inst.fromfile)
+			close(inst.fd);
+
+		notify_flush();
 		swupdate_progress_end(inst.last_install);
 
 		pthread_mutex_lock(&stream_mutex);
@@ -0,0 +1,196 @@
+#!/usr/bin/env python3
+# Copyright (c) 2026 agent <agent@local>
+#
+# SPDX-License-Identifier:     GPL-2.0-or-later
+#
+# Simulator of the microcontroller side of the ucfw handler.
+# It creates a pseudo terminal and prints its name, the
+# device can be used as "device" for the ucfw handler.
+# GPIOs are not simulated: the handler still drives "reset" and
+# "prog", they can be lines of a gpio-sim chip.
+#
+# The simulator speaks the original protocol (one package, then
+# $READY;) and the extended one (window, binary frames, baudrate).
+# Received records are checked and written as Intel HEX to the
+# file passed with --output.
+
+import argparse
+import os
+import sys
+import termios
+import time
+import tty
+
+class Protocol(Exception):
+    pass
+
+def checksum(data):
+    return (-sum(data)) & 0xff
+
+def make_msg(msg):
+    cs = checksum(msg[1:].encode())
+    return "{}{:02X}\r\n".format(msg, cs).encode()
+
+class Simulator:
+
+    def __init__(self, fd, args):
+        self.fd = fd
+        self.args = args
+        self.rx = b''
+        self.records = []
+        self.window = 1
+        self.binary = False
+        self.baudrate = 0
+
+    def read(self, n):
+        while len(self.rx) < n:
+            data = os.read(self.fd, 4096)
+            if not data:
+                raise EOFError
+            self.rx += data
+        out, self.rx = self.rx[:n], self.rx[n:]
+        return out
+
+    def readline(self):
+        while b'\n' not in self.rx:
+            data = os.read(self.fd, 4096)
+            if not data:
+                raise EOFError
+            self.rx += data
+        line, self.rx = self.rx.split(b'\n', 1)
+        return line.rstrip(b'\r')
+
+    def send(self, msg):
+        if self.args.verbose:
+            print("TX: {}".format(msg))
+        os.write(self.fd, make_msg(msg))
+
+    def read_msg(self):
+        line = self.readline().decode()
+        if self.args.verbose:
+            print("RX: {}".format(line))
+        if not line.startswith('$') or len(line) < 3:
+            raise Protocol("Not a message: {}".format(line))
+        msg, cs = line[:-2], int(line[-2:], 16)
+        if checksum(msg[1:].encode()) != cs:
+            raise Protocol("Wrong checksum: {}".format(line))
+        return msg
+
+    def handshake(self):
+        msg = self.read_msg()
+        fields = msg.split(';')
+        if fields[0] != '$PROG':
+            raise Protocol("Expected $PROG; got {}".format(msg))
+        answer = '$READY;'
+        for field in [f for f in fields[1:] if f]:
+            if field.startswith('WIN=') and self.args.window > 1:
+                self.window = min(int(field[4:]), self.args.window)
+                answer += 'WIN={};'.format(self.window)
+            elif field == 'BIN' and self.args.binary:
+                self.binary = True
+                answer += 'BIN;'
+            elif field.startswith('BAUD=') and self.args.baudrate:
+                self.baudrate = int(field[5:])
+                answer += 'BAUD={};'.format(self.baudrate)
+        self.send(answer)
+        if self.baudrate:
+            # the pty does not care, a real UART switches here
+            if self.read_msg() != '$SYNC;':
+                raise Protocol("Expected $SYNC;")
+            self.send('$READY;')
+        print("Programming: window {}, {} records, baudrate {}".format(
+            self.window, 'binary' if self.binary else 'ASCII',
+            self.baudrate if self.baudrate else 115200))
+
+    def parse_records(self, data):
+        eof = False
+        while data:
+            count = data[0]
+            record, data = data[:count + 5], data[count + 5:]
+            if len(record) != count + 5 or checksum(record[:-1]) != record[-1]:
+                raise Protocol("Malformed record {}".format(record.hex()))
+            self.records.append(record)
+            if record[3] == 1:
+                eof = True
+        return eof
+
+    def read_package(self):
+        if self.binary:
+            if self.read(1) != b'#':
+                raise Protocol("Frame does not start with '#'")
+            hdr = self.read(2)
+            data = self.read((hdr[0] << 8) | hdr[1])
+            if checksum(data) != self.read(1)[0]:
+                raise Protocol("Wrong frame checksum")
+            return data
+        line = self.readline().decode()
+        data = b''
+        for record in line.split(':')[1:]:
+            data += bytes.fromhex(record)
+        return data
+
+    def program(self):
+        while True:
+            eof = self.parse_records(self.read_package())
+            if self.args.delay:
+                time.sleep(self.args.delay / 1000)
+            if eof:
+                self.send('$COMPLETED;')
+                return
+            self.send('$READY;')
+
+    def save(self, path):
+        with open(path, 'w') as f:
+            for record in self.records:
+                f.write(':{}\n'.format(record.hex().upper()))
+
+def main():
+    parser = argparse.ArgumentParser(description='ucfw microcontroller simulator')
+    parser.add_argument('--window', type=int, default=8,
+                        help='maximum number of packages in flight, 1 disables it')
+    parser.add_argument('--no-binary', dest='binary', action='store_false',
+                        help='refuse binary frames')
+    parser.add_argument('--no-baudrate', dest='baudrate', action='store_false',
+                        help='refuse baudrate switch')
+    parser.add_argument('--delay', type=int, default=0,
+                        help='time in ms to program a package')
+    parser.add_argument('--link', help='create a symlink to the pseudo terminal')
+    parser.add_argument('--output', help='write received firmware to file')
+    parser.add_argument('--once', action='store_true',
+                        help='exit after one update')
+    parser.add_argument('--verbose', action='store_true')
+    args = parser.parse_args()
+
+    master, slave = os.openpty()
+    tty.setraw(master)
+    name = os.ttyname(slave)
+    if args.link:
+        if os.path.lexists(args.link):
+            os.unlink(args.link)
+        os.symlink(name, args.link)
+    print(name, flush=True)
+
+    while True:
+        sim = Simulator(master, args)
+        try:
+            sim.handshake()
+            sim.program()
+        except Protocol as e:
+            print("Protocol error: {}".format(e))
+            termios.tcflush(master, termios.TCIFLUSH)
+            continue
+        except EOFError:
+            break
+        print("Completed: {} records".format(len(sim.records)), flush=True)
+        if args.output:
+            sim.save(args.output)
+        if args.once:
+            # let the handler read the last answer before hangup
+            time.sleep(0.5)
+            break
+    os.close(slave)
+    os.close(master)
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -15,16 +15,25 @@
 #include <limits.h>
 #include <errno.h>
 #include <string.h>
+#include <stdbool.h>
 #include <pthread.h>
 
 #include <archive.h>
 #include <archive_entry.h>
 
+#include "bsdqueue.h"
 #include "swupdate.h"
 #include "handler.h"
 #include "util.h"
 
-#define FIFO_FILE_NAME "archivfifo"
+/*
+ * Limits for the parallel extraction: files up to PARALLEL_MAX_FILE
+ * are read in memory and written by a worker, and not more than
+ * PARALLEL_MAX_INFLIGHT bytes are queued at the same time.
+ */
+#define PARALLEL_MAX_WORKERS	32
+#define PARALLEL_MAX_FILE	(1024 * 1024)
+#define PARALLEL_MAX_INFLIGHT	(32 * 1024 * 1024)
 
 /* Just to turn on during development */
 static int debug = 0;
@@ -34,11 +43,155 @@ void archive_handler(void);
 
 pthread_t extract_thread;
 
+/*
+ * The data coming out of copyimage() is passed to libarchive without
+ * copying it: the output buffer of the copy pipeline is handed to the
+ * extract thread, and copyimage() is blocked until libarchive asks
+ * for the next block, that is until the buffer is not used anymore.
+ */
+struct archive_stream {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	const void *buf;
+	size_t len;
+	bool avail;	/* a buffer was passed, but not yet taken */
+	bool in_use;	/* buffer was taken by libarchive */
+	bool eof;	/* copyimage() has finished */
+	bool closed;	/* libarchive does not read anymore */
+	bool failed;	/* extraction failed */
+};
+
 struct extract_data {
 	int flags;
 	int exitval;
+	unsigned int nworkers;
+	struct archive_stream *stream;
+};
+
+/*
+ * Parallel extraction
+ *
+ * The extract thread parses the archive and reads small files in
+ * memory, while a pool of workers creates and writes them, each one
+ * with its own libarchive disk writer. All entries in the same
+ * directory are assigned to the same worker, so they are written in
+ * the same order as in the archive. Directories are created by the
+ * extract thread, hardlinks are written after all queued entries
+ * are on disk.
+ */
+struct extract_job {
+	struct archive_entry *entry;
+	void *buf;
+	size_t size;
+	SIMPLEQ_ENTRY(extract_job) next;
+};
+
+SIMPLEQ_HEAD(jobqueue, extract_job);
+
+struct extract_pool;
+
+struct extract_worker {
+	pthread_t thread;
+	struct extract_pool *pool;
+	struct jobqueue jobs;
+	unsigned int pending;	/* jobs queued or running */
+	bool started;
 };
 
+struct extract_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t wkup;	/* new jobs for the workers */
+	pthread_cond_t done;	/* a job was completed */
+	struct extract_worker workers[PARALLEL_MAX_WORKERS];
+	unsigned int nworkers;
+	size_t inflight;
+	int flags;
+	bool stop;
+	bool failed;
+	unsigned long files;
+};
+
+static int archive_stream_write(void *out, const void *buf, unsigned int len)
+{
+	struct archive_stream *st = (struct archive_stream *)out;
+	int ret = 0;
+
+	pthread_mutex_lock(&st->lock);
+	if (!st->closed) {
+		st->buf = buf;
+		st->len = len;
+		st->avail = true;
+		pthread_cond_broadcast(&st->cond);
+		while ((st->avail || st->in_use) && !st->closed)
+			pthread_cond_wait(&st->cond, &st->lock);
+	}
+	/*
+	 * Data after the end of the archive is discarded,
+	 * but the stream is stopped if extraction failed
+	 */
+	if (st->failed)
+		ret = -1;
+	pthread_mutex_unlock(&st->lock);
+
+	return ret;
+}
+
+static void archive_stream_end(struct archive_stream *st)
+{
+	pthread_mutex_lock(&st->lock);
+	st->eof = true;
+	pthread_cond_broadcast(&st->cond);
+	pthread_mutex_unlock(&st->lock);
+}
+
+static ssize_t
+archive_stream_read(struct archive __attribute__ ((__unused__)) *a,
+		    void *client_data, const void **buff)
+{
+	struct archive_stream *st = (struct archive_stream *)client_data;
+	ssize_t len = 0;
+
+	pthread_mutex_lock(&st->lock);
+
+	/* previous block is not used anymore, release copyimage() */
+	st->in_use = false;
+	pthread_cond_broadcast(&st->cond);
+
+	while (!st->avail && !st->eof)
+		pthread_cond_wait(&st->cond, &st->lock);
+
+	if (st->avail) {
+		*buff = st->buf;
+		len = st->len;
+		st->avail = false;
+		st->in_use = true;
+	}
+	pthread_mutex_unlock(&st->lock);
+
+	return len;
+}
+
+static void archive_stream_close_reader(struct archive_stream *st, bool failed)
+{
+	pthread_mutex_lock(&st->lock);
+	st->closed = true;
+	st->avail = false;
+	st->in_use = false;
+	if (failed)
+		st->failed = true;
+	pthread_cond_broadcast(&st->cond);
+	pthread_mutex_unlock(&st->lock);
+}
+
+static int
+archive_stream_close(struct archive __attribute__ ((__unused__)) *a,
+		     void *client_data)
+{
+	archive_stream_close_reader((struct archive_stream *)client_data, false);
+
+	return ARCHIVE_OK;
+}
+
 static int
 copy_data(struct archive *ar, struct archive *aw)
 {
@@ -66,6 +219,289 @@ copy_data(struct archive *ar, struct archive *aw)
 	}
 }
 
+static void free_job(struct extract_job *job)
+{
+	archive_entry_free(job->entry);
+	free(job->buf);
+	free(job);
+}
+
+static int write_job(struct archive *ext, struct extract_job *job)
+{
+	int r;
+
+	r = archive_write_header(ext, job->entry);
+	if (r != ARCHIVE_OK) {
+		TRACE("archive_write_header(): %s",
+		    archive_error_string(ext));
+		return 0;
+	}
+	if (job->size &&
+	    archive_write_data(ext, job->buf, job->size) != (ssize_t)job->size) {
+		ERROR("archive_write_data(): %s %s",
+		    archive_entry_pathname(job->entry),
+		    archive_error_string(ext));
+		return -EFAULT;
+	}
+	r = archive_write_finish_entry(ext);
+	if (r != ARCHIVE_OK)  {
+		ERROR("archive_write_finish_entry(): %s",
+		    archive_error_string(ext));
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+static void *extract_worker_thread(void *p)
+{
+	struct extract_worker *w = (struct extract_worker *)p;
+	struct extract_pool *pool = w->pool;
+	struct extract_job *job;
+	struct archive *ext;
+	int ret;
+
+	ext = archive_write_disk_new();
+	if (ext)
+		archive_write_disk_set_options(ext, pool->flags);
+
+	pthread_mutex_lock(&pool->lock);
+	if (!ext)
+		pool->failed = true;
+	for (;;) {
+		while (SIMPLEQ_EMPTY(&w->jobs) && !pool->stop)
+			pthread_cond_wait(&pool->wkup, &pool->lock);
+		if (SIMPLEQ_EMPTY(&w->jobs))
+			break;
+		job = SIMPLEQ_FIRST(&w->jobs);
+		SIMPLEQ_REMOVE_HEAD(&w->jobs, next);
+		pthread_mutex_unlock(&pool->lock);
+
+		ret = (ext && !pool->failed) ? write_job(ext, job) : -EFAULT;
+
+		pthread_mutex_lock(&pool->lock);
+		if (ret)
+			pool->failed = true;
+		pool->inflight -= job->size;
+		w->pending--;
+		pthread_cond_broadcast(&pool->done);
+		pthread_mutex_unlock(&pool->lock);
+
+		free_job(job);
+
+		pthread_mutex_lock(&pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (ext && archive_write_free(ext) != ARCHIVE_OK) {
+		pthread_mutex_lock(&pool->lock);
+		pool->failed = true;
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	return NULL;
+}
+
+static struct extract_pool *extract_pool_start(unsigned int nworkers, int flags)
+{
+	struct extract_pool *pool;
+	unsigned int i;
+
+	pool = (struct extract_pool *)calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wkup, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	pool->flags = flags;
+	pool->nworkers = min(nworkers, (unsigned int)PARALLEL_MAX_WORKERS);
+
+	for (i = 0; i < pool->nworkers; i++) {
+		struct extract_worker *w = &pool->workers[i];
+
+		w->pool = pool;
+		SIMPLEQ_INIT(&w->jobs);
+		if (pthread_create(&w->thread, NULL, extract_worker_thread, w)) {
+			ERROR("Cannot start extract worker %u", i);
+			pool->nworkers = i;
+			break;
+		}
+		w->started = true;
+	}
+
+	TRACE("Parallel extraction with %u workers", pool->nworkers);
+
+	return pool;
+}
+
+/*
+ * Wait until the queued entries are written. If w is NULL,
+ * wait for all workers.
+ */
+static int extract_pool_wait(struct extract_pool *pool,
+			     struct extract_worker *w)
+{
+	unsigned int i;
+	int ret;
+
+	pthread_mutex_lock(&pool->lock);
+	for (i = 0; i < pool->nworkers; i++) {
+		struct extract_worker *cur = w ? w : &pool->workers[i];
+
+		while (cur->pending && !pool->failed)
+			pthread_cond_wait(&pool->done, &pool->lock);
+		if (w)
+			break;
+	}
+	ret = pool->failed ? -EFAULT : 0;
+	pthread_mutex_unlock(&pool->lock);
+
+	return ret;
+}
+
+static int extract_pool_queue(struct extract_pool *pool,
+			      struct extract_worker *w,
+			      struct extract_job *job)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->inflight &&
+	       pool->inflight + job->size > PARALLEL_MAX_INFLIGHT &&
+	       !pool->failed)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	if (pool->failed) {
+		ret = -EFAULT;
+	} else {
+		SIMPLEQ_INSERT_TAIL(&w->jobs, job, next);
+		w->pending++;
+		pool->inflight += job->size;
+		pool->files++;
+		pthread_cond_broadcast(&pool->wkup);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return ret;
+}
+
+/*
+ * Stop the workers after all queued entries are written
+ * and release the pool.
+ */
+static int extract_pool_stop(struct extract_pool *pool)
+{
+	struct extract_job *job;
+	unsigned int i;
+	int ret;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->wkup);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < PARALLEL_MAX_WORKERS; i++) {
+		struct extract_worker *w = &pool->workers[i];
+
+		if (w->started)
+			pthread_join(w->thread, NULL);
+		while ((job = SIMPLEQ_FIRST(&w->jobs)) != NULL) {
+			SIMPLEQ_REMOVE_HEAD(&w->jobs, next);
+			free_job(job);
+		}
+	}
+
+	ret = pool->failed ? -EFAULT : 0;
+	TRACE("Parallel extraction: %lu files written by workers",
+		pool->files);
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->wkup);
+	pthread_cond_destroy(&pool->done);
+	free(pool);
+
+	return ret;
+}
+
+static struct extract_worker *extract_pool_worker(struct extract_pool *pool,
+						  const char *pathname)
+{
+	const char *slash = strrchr(pathname, '/');
+	unsigned long hash = 5381;
+	const char *c;
+
+	/* same hash for all entries in a directory */
+	if (slash) {
+		for (c = pathname; c < slash; c++)
+			hash = hash * 33 + (unsigned char)*c;
+	}
+
+	return &pool->workers[hash % pool->nworkers];
+}
+
+/*
+ * Pass an entry to the workers if this is possible, return 1
+ * if the entry must be written by the caller.
+ */
+static int extract_pool_dispatch(struct extract_pool *pool,
+				 struct archive *a,
+				 struct archive_entry *entry)
+{
+	struct extract_worker *w;
+	struct extract_job *job;
+	mode_t type = archive_entry_filetype(entry);
+	int64_t size = archive_entry_size(entry);
+	int ret;
+
+	if (!pool->nworkers)
+		return 1;
+
+	/* Hardlinks need the target, that can be still in a queue */
+	if (archive_entry_hardlink(entry)) {
+		ret = extract_pool_wait(pool, NULL);
+		return ret ? ret : 1;
+	}
+
+	if (type == AE_IFDIR)
+		return 1;
+
+	w = extract_pool_worker(pool, archive_entry_pathname(entry));
+
+	/* big files are written directly, after the directory's queue */
+	if ((type != AE_IFREG && type != AE_IFLNK) || size > PARALLEL_MAX_FILE) {
+		ret = extract_pool_wait(pool, w);
+		return ret ? ret : 1;
+	}
+
+	job = (struct extract_job *)calloc(1, sizeof(*job));
+	if (!job)
+		return -ENOMEM;
+	job->entry = archive_entry_clone(entry);
+	if (type == AE_IFREG && size > 0) {
+		job->size = size;
+		job->buf = malloc(job->size);
+	}
+	if (!job->entry || (job->size && !job->buf)) {
+		ERROR("No memory for %s", archive_entry_pathname(entry));
+		free_job(job);
+		return -ENOMEM;
+	}
+
+	if (job->size &&
+	    archive_read_data(a, job->buf, job->size) != (ssize_t)job->size) {
+		ERROR("archive_read_data(): %s %s",
+		    archive_entry_pathname(entry), archive_error_string(a));
+		free_job(job);
+		return -EFAULT;
+	}
+
+	ret = extract_pool_queue(pool, w, job);
+	if (ret)
+		free_job(job);
+
+	return ret;
+}
+
 static void *
 extract(void *p)
 {
@@ -77,6 +513,7 @@ extract(void *p)
 	int r;
 	int flags;
 	struct extract_data *data = (struct extract_data *)p;
+	struct extract_pool *pool = NULL;
 	flags = data->flags;
 	int exitval = -EFAULT;
 
@@ -113,16 +550,23 @@ extract(void *p)
 	archive_read_support_format_all(a);
 	archive_read_support_filter_all(a);
 
+	if (data->nworkers) {
+		pool = extract_pool_start(data->nworkers, flags);
+		if (!pool) {
+			ERROR("Cannot allocate workers for parallel extraction");
+			goto out;
+		}
+	}
+
 	/*
 	 * On my system, enabling other archive formats adds 20k-30k
 	 * each.  Enabling gzip decompression adds about 20k.
 	 * Enabling bzip2 is more expensive because the libbz2 library
 	 * isn't very well factored.
 	 */
-	char* FIFO = alloca(strlen(get_tmpdir())+strlen(FIFO_FILE_NAME)+1);
-	sprintf(FIFO, "%s%s", get_tmpdir(), FIFO_FILE_NAME);
-	if ((r = archive_read_open_filename(a, FIFO, 4096))) {
-		ERROR("archive_read_open_filename(): %s %d",
+	if ((r = archive_read_open(a, data->stream, NULL,
+				   archive_stream_read, archive_stream_close))) {
+		ERROR("archive_read_open(): %s %d",
 		    archive_error_string(a), r);
 		goto out;
 	}
@@ -139,6 +583,14 @@ extract(void *p)
 		if (debug)
 			TRACE("Extracting %s", archive_entry_pathname(entry));
 
+		if (pool) {
+			r = extract_pool_dispatch(pool, a, entry);
+			if (r < 0)
+				goto out;
+			if (!r)
+				continue;
+		}
+
 		r = archive_write_header(ext, entry);
 		if (r != ARCHIVE_OK)
 			TRACE("archive_write_header(): %s",
@@ -158,6 +610,11 @@ extract(void *p)
 	exitval = 0;
 
 out:
+	if (pool) {
+		if (extract_pool_stop(pool))
+			exitval = -EFAULT;
+	}
+
 	if (ext) {
 		r = archive_write_free(ext);
 		if (r) {
@@ -172,6 +629,24 @@ out:
 		archive_read_free(a);
 	}
 
+	/*
+	 * Files written in parallel are flushed once for
+	 * the whole filesystem
+	 */
+	if (data->nworkers && !exitval) {
+		int fd = open(".", O_RDONLY | O_DIRECTORY);
+		if (fd < 0 || syncfs(fd)) {
+			ERROR("Cannot flush extracted files: %s",
+				strerror(errno));
+			exitval = -EFAULT;
+		}
+		if (fd >= 0)
+			close(fd);
+	}
+
+	/* copyimage() must not wait for a reader anymore */
+	archive_stream_close_reader(data->stream, exitval != 0);
+
 	uselocale(old_locale);
 	data->exitval = exitval;
 	pthread_exit(NULL);
@@ -181,21 +656,21 @@ static int install_archive_image(struct img_type *img,
 	void __attribute__ ((__unused__)) *data)
 {
 	char path[255];
-	int fdout = -1;
 	int ret = -1;
 	int thread_ret = -1;
 	char pwd[256] = "\0";
 	struct extract_data tf;
+	struct archive_stream stream = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
 	pthread_attr_t attr;
 	int use_mount = (strlen(img->device) && strlen(img->filesystem)) ? 1 : 0;
 	int is_mounted = 0;
 	int exitval = -EFAULT;
+	char *parallel;
 
-	char* DATADST_DIR = alloca(strlen(get_tmpdir())+strlen(DATADST_DIR_SUFFIX)+1);
-	sprintf(DATADST_DIR, "%s%s", get_tmpdir(), DATADST_DIR_SUFFIX);
-
-	char * FIFO = alloca(strlen(get_tmpdir())+strlen(FIFO_FILE_NAME)+1);
-	sprintf(FIFO, "%s%s", get_tmpdir(), FIFO_FILE_NAME);
+	const char *DATADST_DIR = NULL;
 
 	pthread_attr_init(&attr);
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
@@ -206,8 +681,8 @@ static int install_archive_image(struct img_type *img,
 	}
 
 	if (use_mount) {
-		ret = swupdate_mount(img->device, DATADST_DIR, img->filesystem);
-		if (ret) {
+		DATADST_DIR = swupdate_mount_cached(img->device, img->filesystem);
+		if (!DATADST_DIR) {
 			ERROR("Device %s with filesystem %s cannot be mounted",
 				img->device, img->filesystem);
 			return -1;
@@ -227,13 +702,6 @@ static int install_archive_image(struct img_type *img,
 		}
 	}
 
-	unlink(FIFO);
-	ret = mkfifo(FIFO, 0600);
-	if (ret) {
-		ERROR("FIFO cannot be created in archive handler");
-		goto out;
-	}
-
 	if (!getcwd(pwd, sizeof(pwd))) {
 		ERROR("Failed to determine current working directory");
 		pwd[0] = '\0';
@@ -255,6 +723,19 @@ static int install_archive_image(struct img_type *img,
 
 	tf.flags = 0;
 	tf.exitval = -EFAULT;
+	tf.nworkers = 0;
+	tf.stream = &stream;
+
+	parallel = dict_get_value(&img->properties, "parallel-extract");
+	if (parallel) {
+		errno = 0;
+		tf.nworkers = strtoul(parallel, NULL, 10);
+		if (errno || tf.nworkers > PARALLEL_MAX_WORKERS) {
+			ERROR("parallel-extract must be a number up to %d",
+				PARALLEL_MAX_WORKERS);
+			goto out;
+		}
+	}
 
 	if (img->preserve_attributes) {
 		tf.flags |= ARCHIVE_EXTRACT_OWNER | ARCHIVE_EXTRACT_PERM |
@@ -269,13 +750,7 @@ static int install_archive_image(struct img_type *img,
 		goto out;
 	}
 
-	fdout = open(FIFO, O_WRONLY);
-	if (fdout < 0) {
-		ERROR("Failed to open FIFO %s", FIFO);
-		goto out;
-	}
-
-	ret = copyimage(&fdout, img, NULL);
+	ret = copyimage(&stream, img, archive_stream_write);
 	if (ret < 0) {
 		ERROR("Error copying extracted file");
 		goto out;
@@ -284,16 +759,11 @@ static int install_archive_image(struct img_type *img,
 	exitval = 0;
 
 out:
-	if (fdout >= 0) {
-		ret = close(fdout);
-		if (ret) {
-			ERROR("failed to close FIFO %s", FIFO);
-		}
-	}
-
 	if (!thread_ret) {
 		void *status;
 
+		archive_stream_end(&stream);
+
 		ret = pthread_join(extract_thread, &status);
 		if (ret) {
 			ERROR("return code from pthread_join() is %d", ret);
@@ -312,10 +782,8 @@ out:
 		}
 	}
 
-	unlink(FIFO);
-
 	if (is_mounted) {
-		ret = swupdate_umount(DATADST_DIR);
+		ret = swupdate_umount_cached(DATADST_DIR);
 		if (ret) {
 			TRACE("Failed to unmount directory %s", DATADST_DIR);
 		}
@@ -324,17 +792,26 @@ out:
 	return exitval;
 }
 
+/*
+ * Extracting changes the working directory of
+ * the process, nothing else can run meanwhile
+ */
+static const struct handler_caps archive_caps = {
+	.flags = HANDLER_CAP_STREAM,
+	.concurrency = HANDLER_EXCLUSIVE,
+};
+
 __attribute__((constructor))
 void archive_handler(void)
 {
-	register_handler("archive", install_archive_image,
-				IMAGE_HANDLER | FILE_HANDLER, NULL);
+	register_handler_caps("archive", install_archive_image,
+				IMAGE_HANDLER | FILE_HANDLER, NULL, &archive_caps);
 }
 
 /* This is an alias for the parsers */
 __attribute__((constructor))
 void untar_handler(void)
 {
-	register_handler("tar", install_archive_image,
-				IMAGE_HANDLER | FILE_HANDLER, NULL);
+	register_handler_caps("tar", install_archive_image,
+				IMAGE_HANDLER | FILE_HANDLER, NULL, &archive_caps);
 }
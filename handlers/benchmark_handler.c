@@ -0,0 +1,216 @@
+/*
+ * (C) Copyright 2026
+ * agent, agent@local.
+ *
+ * SPDX-License-Identifier:     GPL-2.0-or-later
+ */
+
+/*
+ * Benchmark handler: the image goes through the whole
+ * copy pipeline (read, verify, decrypt, decompress) and
+ * is then dropped. The time spent in each stage is reported
+ * via notify() and in the info field of the progress
+ * interface, so that the pipeline can be measured on the
+ * target by changing the type of an image in sw-description.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "swupdate.h"
+#include "handler.h"
+#include "util.h"
+#include "progress.h"
+#include "progress_ipc.h"
+
+void benchmark_handler(void);
+
+static const char *stage_names[COPY_STAGE_MAX] = {
+	[COPY_STAGE_READ] = "read",
+	[COPY_STAGE_HASH] = "hash",
+	[COPY_STAGE_DECRYPT] = "decrypt",
+	[COPY_STAGE_INFLATE] = "inflate",
+	[COPY_STAGE_CALLBACK] = "callback",
+};
+
+static int drop_data(void __attribute__ ((__unused__)) *out,
+	const void __attribute__ ((__unused__)) *buf,
+	unsigned int __attribute__ ((__unused__)) len)
+{
+	return 0;
+}
+
+static double mb_per_s(unsigned long long bytes, unsigned long long ns)
+{
+	if (!ns)
+		return 0;
+	return (double)bytes * 1000.0 / ns;
+}
+
+/*
+ * Histogram as "<1us:n <2us:n ...", empty buckets are skipped
+ */
+static void format_histogram(char *buf, size_t size, unsigned int *hist)
+{
+	unsigned int i;
+	int len = 0;
+
+	buf[0] = '\0';
+	for (i = 0; i < COPY_STATS_BUCKETS && len < (int)size; i++) {
+		if (!hist[i])
+			continue;
+		if (i < COPY_STATS_BUCKETS - 1)
+			len += snprintf(&buf[len], size - len, "%s<%uus:%u",
+					len ? " " : "", 1U << i, hist[i]);
+		else
+			len += snprintf(&buf[len], size - len, "%s>=%uus:%u",
+					len ? " " : "", 1U << (i - 1), hist[i]);
+	}
+}
+
+static void report_console(struct img_type *img, struct copy_stats *stats)
+{
+	char hist[512];
+	unsigned int i;
+
+	INFO("Benchmark %s: %llu bytes read, %llu bytes out in %.3f ms, "
+	     "%.2f MB/s in, %.2f MB/s out",
+		img->fname, stats->bytes_in, stats->bytes_out,
+		stats->total_ns / 1000000.0,
+		mb_per_s(stats->bytes_in, stats->total_ns),
+		mb_per_s(stats->bytes_out, stats->total_ns));
+
+	for (i = 0; i < COPY_STAGE_MAX; i++) {
+		if (!stats->calls[i])
+			continue;
+		INFO("Benchmark %s: %-8s %10.3f ms %5.1f%% %8llu calls",
+			img->fname, stage_names[i],
+			stats->ns[i] / 1000000.0,
+			stats->total_ns ? 100.0 * stats->ns[i] / stats->total_ns : 0,
+			stats->calls[i]);
+		format_histogram(hist, sizeof(hist), stats->hist[i]);
+		INFO("Benchmark %s: %-8s latency %s", img->fname,
+			stage_names[i], hist);
+	}
+}
+
+/*
+ * Copy src as content of a JSON string, dst must
+ * be 6 times the length of src plus one
+ */
+static void json_escape(char *dst, const char *src)
+{
+	unsigned char c;
+
+	while ((c = *src++) != '\0') {
+		if (c == '"' || c == '\\') {
+			*dst++ = '\\';
+			*dst++ = c;
+		} else if (c < 0x20)
+			dst += sprintf(dst, "\\u%04x", c);
+		else
+			*dst++ = c;
+	}
+	*dst = '\0';
+}
+
+/*
+ * Progress info is JSON, histograms are arrays up
+ * to the last bucket in use
+ */
+static void report_progress(struct img_type *img, struct copy_stats *stats)
+{
+	char fname[sizeof(img->fname) * 6];
+	char *info;
+	unsigned int i, j, last;
+	int len, size;
+
+	/*
+	 * swupdate_progress_info() sends {"<cause>": <info>}
+	 * in the info field of the progress message
+	 */
+	size = sizeof(((struct progress_msg *)0)->info) -
+		snprintf(NULL, 0, "{\"%d\": }", BENCHMARK);
+	info = malloc(size);
+	if (!info)
+		return;
+
+	json_escape(fname, img->fname);
+
+	len = snprintf(info, size,
+		"{\"image\": \"%s\", \"bytes_in\": %llu, \"bytes_out\": %llu, "
+		"\"ms\": %.3f, \"mbps_in\": %.2f, \"mbps_out\": %.2f, \"stages\": {",
+		fname, stats->bytes_in, stats->bytes_out,
+		stats->total_ns / 1000000.0,
+		mb_per_s(stats->bytes_in, stats->total_ns),
+		mb_per_s(stats->bytes_out, stats->total_ns));
+
+	for (i = 0; i < COPY_STAGE_MAX && len < size; i++) {
+		if (!stats->calls[i])
+			continue;
+		last = 0;
+		for (j = 0; j < COPY_STATS_BUCKETS; j++)
+			if (stats->hist[i][j])
+				last = j;
+		len += snprintf(&info[len], size - len,
+			"%s\"%s\": {\"ms\": %.3f, \"calls\": %llu, \"hist\": [",
+			info[len - 1] == '{' ? "" : ", ",
+			stage_names[i], stats->ns[i] / 1000000.0,
+			stats->calls[i]);
+		for (j = 0; j <= last && len < size; j++)
+			len += snprintf(&info[len], size - len,
+				"%s%u", j ? ", " : "", stats->hist[i][j]);
+		if (len < size)
+			len += snprintf(&info[len], size - len, "]}");
+	}
+	if (len < size)
+		len += snprintf(&info[len], size - len, "}}");
+
+	if (len < size)
+		swupdate_progress_info(RUN, BENCHMARK, info);
+	else
+		WARN("Benchmark results too long for progress info");
+
+	free(info);
+}
+
+static int install_benchmark(struct img_type *img,
+	void __attribute__ ((__unused__)) *data)
+{
+	struct copy_stats *stats;
+	int ret;
+
+	stats = (struct copy_stats *)calloc(1, sizeof(*stats));
+	if (!stats)
+		return -ENOMEM;
+
+	/* nothing to seek in a null sink */
+	img->seek = 0;
+
+	ret = copyimage_stats(NULL, img, drop_data, stats);
+	if (ret) {
+		ERROR("Benchmark of %s failed after %llu bytes",
+			img->fname, stats->bytes_in);
+	} else {
+		report_console(img, stats);
+		report_progress(img, stats);
+	}
+
+	free(stats);
+	return ret;
+}
+
+static const struct handler_caps benchmark_caps = {
+	.flags = HANDLER_CAP_STREAM,
+	.concurrency = HANDLER_SHARED,
+};
+
+__attribute__((constructor))
+void benchmark_handler(void)
+{
+	register_handler_caps("benchmark", install_benchmark,
+				IMAGE_HANDLER | FILE_HANDLER, NULL,
+				&benchmark_caps);
+}
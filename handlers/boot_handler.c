@@ -118,15 +118,20 @@ static int install_boot_environment(struct img_type *img,
 	return 0;
 }
 
+static const struct handler_caps boot_caps = {
+	.flags = HANDLER_CAP_STREAM,
+	.concurrency = HANDLER_EXCLUSIVE,
+};
+
 __attribute__((constructor))
 static void uboot_handler(void)
 {
-	register_handler("uboot", install_boot_environment,
-				IMAGE_HANDLER | BOOTLOADER_HANDLER, NULL);
+	register_handler_caps("uboot", install_boot_environment,
+				IMAGE_HANDLER | BOOTLOADER_HANDLER, NULL, &boot_caps);
 }
 __attribute__((constructor))
 static void boot_handler(void)
 {
-	register_handler("bootloader", install_boot_environment,
-				IMAGE_HANDLER | BOOTLOADER_HANDLER, NULL);
+	register_handler_caps("bootloader", install_boot_environment,
+				IMAGE_HANDLER | BOOTLOADER_HANDLER, NULL, &boot_caps);
 }
@@ -0,0 +1,852 @@
+/*
+ * (C) Copyright 2026
+ * agent, agent@local.
+ *
+ * SPDX-License-Identifier:     GPL-2.0-or-later
+ */
+
+/*
+ * This handler rebuilds an image from content-defined chunks.
+ * The artifact contains an index of the chunks of the new image,
+ * optionally followed by the data of some of them (the "pack").
+ * All other chunks are taken from the image currently installed
+ * on the device, that is chunked and indexed with the same algorithm
+ * at install time, or they are fetched from a chunk store.
+ *
+ * Format of the artifact:
+ *
+ *	SWUCHUNKS 1 <min size> <avg size> <max size>\n
+ *	<sha256 of chunk> <size> <p|->\n
+ *	...
+ *	\n
+ *	<data of all chunks flagged with 'p', in index order>
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <curl/curl.h>
+#if defined(__linux__)
+#include <linux/fs.h>
+#endif
+#include "swupdate.h"
+#include "handler.h"
+#include "sslapi.h"
+#include "util.h"
+
+#define CHUNK_MAGIC		"SWUCHUNKS"
+#define CHUNK_VERSION		1
+#define CHUNK_MIN_SIZE		64
+#define CHUNK_MAX_SIZE		(16 * 1024 * 1024)
+#define CHUNK_MAX_INDEX		(64 * 1024 * 1024)
+#define CHUNK_MAX_THREADS	16
+#define CHUNK_READ_SIZE		(1024 * 1024)
+
+/* a download is aborted if less than 8 bytes/s are received for 300 s */
+#define CHUNK_STORE_TIMEOUT	300
+#define CHUNK_LOW_SPEED		8
+
+void chunk_handler(void);
+
+struct chunk_params {
+	unsigned int min;
+	unsigned int avg;
+	unsigned int max;
+	unsigned int bits;	/* log2(avg) */
+};
+
+/* A chunk of the new image, as listed in the index */
+struct chunk_entry {
+	unsigned char sha256[SHA256_HASH_LENGTH];
+	unsigned int size;
+	bool in_pack;
+};
+
+/* A chunk found in the installed image */
+struct chunk_ref {
+	unsigned char sha256[SHA256_HASH_LENGTH];
+	unsigned long long offset;
+	unsigned int size;
+	bool used;
+};
+
+struct chunk_table {
+	struct chunk_ref *refs;
+	size_t mask;
+};
+
+struct chunk_region {
+	pthread_t thread;
+	int fd;
+	const struct chunk_params *params;
+	unsigned long long start;
+	unsigned long long end;
+	unsigned long long size;
+	struct chunk_ref *refs;
+	size_t count;
+	size_t alloc;
+	int ret;
+};
+
+struct chunk_state {
+	struct chunk_params params;
+	char *index;
+	size_t index_len;
+	size_t index_alloc;
+	bool index_done;
+
+	struct chunk_entry *entries;
+	size_t count;
+	size_t cur;
+
+	unsigned char *buf;	/* data of the current chunk */
+	size_t buf_len;
+
+	int fdout;
+	int fdsrc;
+	struct chunk_table table;
+	const char *store;
+	const char *cafile;
+	unsigned long timeout;	/* seconds */
+	CURL *curl;
+	unsigned int nthreads;
+
+	/* statistics */
+	unsigned long long from_source;
+	unsigned long long from_pack;
+	unsigned long long from_store;
+};
+
+/*
+ * Gear table for the rolling hash, generated with splitmix64
+ * starting from 0 so that it can be reproduced by the tools
+ * creating the index.
+ */
+static uint64_t gear[256];
+
+static void chunk_init_gear(void)
+{
+	uint64_t x = 0, z;
+	unsigned int i;
+
+	if (gear[0])
+		return;
+	for (i = 0; i < ARRAY_SIZE(gear); i++) {
+		z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear[i] = z ^ (z >> 31);
+	}
+}
+
+/*
+ * Return the length of the chunk starting at buf. A chunk ends where
+ * the top log2(avg) bits of the gear hash are zero, but it is never
+ * shorter than min (unless len is) nor longer than max.
+ */
+static size_t chunk_find_cut(const struct chunk_params *p,
+			     const unsigned char *buf, size_t len)
+{
+	uint64_t h = 0;
+	size_t i;
+
+	if (len <= p->min)
+		return len;
+	if (len > p->max)
+		len = p->max;
+
+	for (i = p->min; i < len; i++) {
+		h = (h << 1) + gear[buf[i]];
+		if (!(h >> (64 - p->bits)))
+			return i + 1;
+	}
+
+	return len;
+}
+
+static int chunk_hash(const unsigned char *buf, size_t len,
+		      unsigned char *sha256)
+{
+	struct swupdate_digest *dgst;
+	unsigned int md_len;
+	int ret = 0;
+
+	dgst = swupdate_HASH_init(SHA_DEFAULT);
+	if (!dgst)
+		return -EFAULT;
+	if (swupdate_HASH_update(dgst, (unsigned char *)buf, len) < 0 ||
+	    swupdate_HASH_final(dgst, sha256, &md_len) < 0 ||
+	    md_len != SHA256_HASH_LENGTH)
+		ret = -EFAULT;
+	swupdate_HASH_cleanup(dgst);
+
+	return ret;
+}
+
+static int read_full(int fd, unsigned char *buf, size_t len,
+		     unsigned long long offset)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pread(fd, buf, len, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -EIO;
+		buf += ret;
+		len -= ret;
+		offset += ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Indexing of the installed image
+ *
+ * The source is split into one region for each thread, and each
+ * thread chunks its region independently. The last chunk of a region
+ * can cross the end of the region. Chunk boundaries found by the next
+ * region are not reliable until they get in sync with the ones of the
+ * whole image, so each region is extended afterwards until it reaches
+ * a boundary found by the next one.
+ */
+static bool chunk_region_has_cut(const struct chunk_region *r,
+				 unsigned long long pos)
+{
+	size_t lo = 0, hi = r->count, mid;
+
+	if (pos >= r->end)
+		return true;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (r->refs[mid].offset == pos)
+			return true;
+		if (r->refs[mid].offset < pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return false;
+}
+
+static int chunk_scan(struct chunk_region *r, unsigned long long pos,
+		      const struct chunk_region *next)
+{
+	const struct chunk_params *p = r->params;
+	unsigned long long bufoff = 0;
+	size_t avail = 0, cut, len;
+	unsigned char *buf;
+	int ret = 0;
+
+	buf = malloc(CHUNK_READ_SIZE + p->max);
+	if (!buf)
+		return -ENOMEM;
+
+	while (pos < r->size) {
+		if (next ? chunk_region_has_cut(next, pos) : pos >= r->end)
+			break;
+
+		/* a whole chunk of max size must be in the buffer */
+		len = min(r->size - pos, (unsigned long long)p->max);
+		if (pos < bufoff || pos + len > bufoff + avail) {
+			len = min(r->size - pos,
+				  (unsigned long long)(CHUNK_READ_SIZE + p->max));
+			if (read_full(r->fd, buf, len, pos)) {
+				ret = -EIO;
+				break;
+			}
+			bufoff = pos;
+			avail = len;
+		}
+
+		cut = chunk_find_cut(p, buf + (pos - bufoff),
+				     min((unsigned long long)(bufoff + avail - pos),
+					 r->size - pos));
+
+		if (r->count == r->alloc) {
+			size_t n = r->alloc ? r->alloc * 2 : 1024;
+			struct chunk_ref *refs = realloc(r->refs, n * sizeof(*refs));
+			if (!refs) {
+				ret = -ENOMEM;
+				break;
+			}
+			r->refs = refs;
+			r->alloc = n;
+		}
+		if (chunk_hash(buf + (pos - bufoff), cut, r->refs[r->count].sha256)) {
+			ret = -EFAULT;
+			break;
+		}
+		r->refs[r->count].offset = pos;
+		r->refs[r->count].size = cut;
+		r->refs[r->count].used = false;
+		r->count++;
+		pos += cut;
+	}
+
+	free(buf);
+
+	return ret;
+}
+
+static void *chunk_index_region(void *data)
+{
+	struct chunk_region *r = (struct chunk_region *)data;
+
+	r->ret = chunk_scan(r, r->start, NULL);
+
+	return NULL;
+}
+
+static size_t chunk_table_slot(struct chunk_table *t, const unsigned char *sha256)
+{
+	size_t h;
+
+	memcpy(&h, sha256, sizeof(h));
+	return h & t->mask;
+}
+
+static struct chunk_ref *chunk_table_find(struct chunk_table *t,
+					  const unsigned char *sha256,
+					  unsigned int size)
+{
+	size_t i;
+
+	if (!t->refs)
+		return NULL;
+	for (i = chunk_table_slot(t, sha256); t->refs[i].used; i = (i + 1) & t->mask) {
+		if (t->refs[i].size == size &&
+		    !memcmp(t->refs[i].sha256, sha256, SHA256_HASH_LENGTH))
+			return &t->refs[i];
+	}
+
+	return NULL;
+}
+
+static int chunk_index_source(struct chunk_state *st)
+{
+	struct chunk_region regions[CHUNK_MAX_THREADS];
+	unsigned long long size = 0;
+	unsigned int i, nthreads;
+	size_t j, total = 0, slots;
+	struct stat sb;
+	int ret = 0;
+
+	if (fstat(st->fdsrc, &sb))
+		return -EIO;
+	if (S_ISREG(sb.st_mode))
+		size = sb.st_size;
+#if defined(__linux__)
+	else if (S_ISBLK(sb.st_mode) && ioctl(st->fdsrc, BLKGETSIZE64, &size))
+		return -EIO;
+#endif
+	if (!size)
+		return 0;
+
+	nthreads = st->nthreads;
+	if (size / nthreads < st->params.max * 16ULL)
+		nthreads = 1;
+
+	memset(regions, 0, sizeof(regions));
+	for (i = 0; i < nthreads; i++) {
+		regions[i].fd = st->fdsrc;
+		regions[i].params = &st->params;
+		regions[i].start = size / nthreads * i;
+		regions[i].end = (i == nthreads - 1) ? size : size / nthreads * (i + 1);
+		regions[i].size = size;
+		if (pthread_create(&regions[i].thread, NULL, chunk_index_region,
+				   &regions[i])) {
+			nthreads = i;
+			ret = -EFAULT;
+			break;
+		}
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(regions[i].thread, NULL);
+		if (regions[i].ret)
+			ret = regions[i].ret;
+	}
+
+	for (i = 0; !ret && i + 1 < nthreads; i++) {
+		struct chunk_region *r = &regions[i];
+		unsigned long long last = r->count ?
+			r->refs[r->count - 1].offset + r->refs[r->count - 1].size :
+			r->start;
+		ret = chunk_scan(r, last, &regions[i + 1]);
+	}
+
+	for (i = 0; i < nthreads; i++)
+		total += regions[i].count;
+
+	if (!ret && total) {
+		for (slots = 1024; slots < total * 2; slots <<= 1)
+			;
+		st->table.refs = calloc(slots, sizeof(struct chunk_ref));
+		st->table.mask = slots - 1;
+		if (!st->table.refs)
+			ret = -ENOMEM;
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		for (j = 0; !ret && j < regions[i].count; j++) {
+			struct chunk_ref *ref = &regions[i].refs[j];
+			size_t k;
+
+			if (chunk_table_find(&st->table, ref->sha256, ref->size))
+				continue;
+			for (k = chunk_table_slot(&st->table, ref->sha256);
+			     st->table.refs[k].used; k = (k + 1) & st->table.mask)
+				;
+			st->table.refs[k] = *ref;
+			st->table.refs[k].used = true;
+		}
+		free(regions[i].refs);
+	}
+
+	if (!ret)
+		TRACE("Indexed %llu bytes of installed image in %zu chunks, %u threads",
+			size, total, nthreads);
+
+	return ret;
+}
+
+static int chunk_parse_index(struct chunk_state *st)
+{
+	char *line, *next, *saveptr;
+	char hash[2 * SHA256_HASH_LENGTH + 1];
+	unsigned int version, i;
+	size_t n = 0;
+	char flag;
+
+	line = strtok_r(st->index, "\n", &saveptr);
+	if (!line || sscanf(line, CHUNK_MAGIC " %u %u %u %u", &version,
+			    &st->params.min, &st->params.avg,
+			    &st->params.max) != 4 || version != CHUNK_VERSION) {
+		ERROR("Chunk index: header not recognized");
+		return -EINVAL;
+	}
+	if (st->params.min < CHUNK_MIN_SIZE || st->params.avg <= st->params.min ||
+	    st->params.max < st->params.avg || st->params.max > CHUNK_MAX_SIZE ||
+	    (st->params.avg & (st->params.avg - 1))) {
+		ERROR("Chunk index: wrong chunk sizes %u %u %u",
+			st->params.min, st->params.avg, st->params.max);
+		return -EINVAL;
+	}
+	for (i = 0; (1U << i) < st->params.avg; i++)
+		;
+	st->params.bits = i;
+
+	/* one chunk per line */
+	for (next = saveptr; *next; next++)
+		if (*next == '\n')
+			n++;
+	st->entries = calloc(n + 1, sizeof(*st->entries));
+	if (!st->entries)
+		return -ENOMEM;
+
+	while ((line = strtok_r(NULL, "\n", &saveptr)) != NULL) {
+		struct chunk_entry *e = &st->entries[st->count];
+
+		if (sscanf(line, "%64s %u %c", hash, &e->size, &flag) != 3 ||
+		    strlen(hash) != 2 * SHA256_HASH_LENGTH ||
+		    ascii_to_hash(e->sha256, hash) ||
+		    !e->size || e->size > st->params.max) {
+			ERROR("Chunk index: wrong entry \"%s\"", line);
+			return -EINVAL;
+		}
+		e->in_pack = (flag == 'p');
+		st->count++;
+	}
+
+	TRACE("Chunk index with %zu chunks (%u/%u/%u)", st->count,
+		st->params.min, st->params.avg, st->params.max);
+
+	return 0;
+}
+
+static size_t chunk_curl_write(char *data, size_t size, size_t nmemb, void *p)
+{
+	struct chunk_state *st = (struct chunk_state *)p;
+	size_t len = size * nmemb;
+	struct chunk_entry *e = &st->entries[st->cur];
+
+	if (st->buf_len + len > e->size)
+		return 0;
+	memcpy(st->buf + st->buf_len, data, len);
+	st->buf_len += len;
+
+	return len;
+}
+
+/* curl_global_init() is not thread safe */
+static pthread_once_t chunk_curl_once = PTHREAD_ONCE_INIT;
+static CURLcode chunk_curl_init_res;
+
+static void chunk_curl_global_init(void)
+{
+	chunk_curl_init_res = curl_global_init(CURL_GLOBAL_DEFAULT);
+}
+
+/*
+ * A stalled chunk store must not block the installation:
+ * connection and transfer are aborted after st->timeout
+ */
+static int chunk_curl_open(struct chunk_state *st)
+{
+	CURL *curl;
+
+	pthread_once(&chunk_curl_once, chunk_curl_global_init);
+	if (chunk_curl_init_res != CURLE_OK) {
+		ERROR("Cannot initialize libcurl: %s",
+			curl_easy_strerror(chunk_curl_init_res));
+		return -EFAULT;
+	}
+
+	curl = curl_easy_init();
+	if (!curl)
+		return -ENOMEM;
+
+	if (curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, chunk_curl_write) != CURLE_OK ||
+	    curl_easy_setopt(curl, CURLOPT_WRITEDATA, st) != CURLE_OK ||
+	    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L) != CURLE_OK ||
+#if LIBCURL_VERSION_NUM >= 0x075500
+	    curl_easy_setopt(curl, CURLOPT_REDIR_PROTOCOLS_STR,
+			     "http,https") != CURLE_OK ||
+#else
+	    curl_easy_setopt(curl, CURLOPT_REDIR_PROTOCOLS,
+			     CURLPROTO_HTTP | CURLPROTO_HTTPS) != CURLE_OK ||
+#endif
+	    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L) != CURLE_OK ||
+	    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, (long)st->timeout) != CURLE_OK ||
+	    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, (long)CHUNK_LOW_SPEED) != CURLE_OK ||
+	    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, (long)st->timeout) != CURLE_OK ||
+	    (st->cafile &&
+	     curl_easy_setopt(curl, CURLOPT_CAINFO, st->cafile) != CURLE_OK)) {
+		ERROR("Cannot set up libcurl for the chunk store");
+		curl_easy_cleanup(curl);
+		return -EFAULT;
+	}
+	st->curl = curl;
+
+	return 0;
+}
+
+static int chunk_fetch(struct chunk_state *st, struct chunk_entry *e)
+{
+	char hash[2 * SHA256_HASH_LENGTH + 1];
+	char *url;
+	int ret = 0;
+
+	if (!st->store) {
+		ERROR("Chunk not found on device and no chunk-store set");
+		return -ENOENT;
+	}
+
+	hash_to_ascii(e->sha256, hash);
+	if (asprintf(&url, "%s/%s", st->store, hash) == ENOMEM_ASPRINTF)
+		return -ENOMEM;
+
+	st->buf_len = 0;
+	if (!strncmp(url, "http://", 7) || !strncmp(url, "https://", 8)) {
+		long code = 0;
+		CURLcode res;
+
+		if (!st->curl && (ret = chunk_curl_open(st)))
+			goto out;
+		curl_easy_setopt(st->curl, CURLOPT_URL, url);
+		res = curl_easy_perform(st->curl);
+		if (res != CURLE_OK ||
+		    curl_easy_getinfo(st->curl, CURLINFO_RESPONSE_CODE, &code) != CURLE_OK ||
+		    code != 200) {
+			ERROR("Cannot fetch chunk %s (HTTP %ld): %s", url, code,
+				res != CURLE_OK ? curl_easy_strerror(res) : "bad answer");
+			ret = -EIO;
+			goto out;
+		}
+	} else {
+		const char *path = strncmp(url, "file://", 7) ? url : url + 7;
+		int fd = open(path, O_RDONLY);
+
+		if (fd < 0) {
+			ERROR("Cannot open chunk %s: %s", path, strerror(errno));
+			ret = -ENOENT;
+			goto out;
+		}
+		ret = read_full(fd, st->buf, e->size, 0);
+		close(fd);
+		if (ret) {
+			ERROR("Cannot read chunk %s", path);
+			goto out;
+		}
+		st->buf_len = e->size;
+	}
+
+out:
+	free(url);
+	return ret;
+}
+
+static int chunk_write(struct chunk_state *st, struct chunk_entry *e,
+		       bool verify)
+{
+	unsigned char sha256[SHA256_HASH_LENGTH];
+
+	if (st->buf_len != e->size) {
+		ERROR("Chunk %zu has %zu bytes instead of %u",
+			st->cur, st->buf_len, e->size);
+		return -EFAULT;
+	}
+	if (verify) {
+		if (chunk_hash(st->buf, st->buf_len, sha256))
+			return -EFAULT;
+		if (swupdate_HASH_compare(sha256, e->sha256)) {
+			ERROR("Chunk %zu: hash mismatch", st->cur);
+			return -EFAULT;
+		}
+	}
+	if (copy_write(&st->fdout, st->buf, st->buf_len) < 0)
+		return -ENOSPC;
+
+	st->buf_len = 0;
+	st->cur++;
+
+	return 0;
+}
+
+/*
+ * Write all chunks up to the next one stored in the pack,
+ * taking them from the installed image or from the chunk store.
+ */
+static int chunk_resolve_pending(struct chunk_state *st)
+{
+	struct chunk_entry *e;
+	struct chunk_ref *ref;
+	int ret;
+
+	while (st->cur < st->count && !st->entries[st->cur].in_pack) {
+		e = &st->entries[st->cur];
+		ref = chunk_table_find(&st->table, e->sha256, e->size);
+		if (ref) {
+			if (read_full(st->fdsrc, st->buf, e->size, ref->offset)) {
+				ERROR("Cannot read chunk from installed image");
+				return -EIO;
+			}
+			st->buf_len = e->size;
+			st->from_source += e->size;
+			ret = chunk_write(st, e, false);
+		} else {
+			ret = chunk_fetch(st, e);
+			st->from_store += e->size;
+			if (!ret)
+				ret = chunk_write(st, e, true);
+		}
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int chunk_start(struct chunk_state *st)
+{
+	int ret;
+
+	ret = chunk_parse_index(st);
+	if (ret)
+		return ret;
+
+	st->buf = malloc(st->params.max);
+	if (!st->buf)
+		return -ENOMEM;
+
+	chunk_init_gear();
+	if (st->fdsrc >= 0) {
+		ret = chunk_index_source(st);
+		if (ret) {
+			ERROR("Indexing of installed image failed");
+			return ret;
+		}
+	}
+
+	return chunk_resolve_pending(st);
+}
+
+static int chunk_stream_cb(void *out, const void *buf, unsigned int len)
+{
+	struct chunk_state *st = (struct chunk_state *)out;
+	const unsigned char *data = buf;
+	struct chunk_entry *e;
+	size_t n;
+	int ret;
+
+	/* collect the index up to the empty line */
+	while (!st->index_done && len) {
+		if (st->index_len + 1 >= st->index_alloc) {
+			char *tmp;
+			if (st->index_alloc >= CHUNK_MAX_INDEX) {
+				ERROR("Chunk index too big");
+				return -EFBIG;
+			}
+			st->index_alloc = st->index_alloc ? st->index_alloc * 2 : 64 * 1024;
+			tmp = realloc(st->index, st->index_alloc);
+			if (!tmp)
+				return -ENOMEM;
+			st->index = tmp;
+		}
+		st->index[st->index_len++] = *data++;
+		len--;
+		if (st->index_len >= 2 && st->index[st->index_len - 1] == '\n' &&
+		    st->index[st->index_len - 2] == '\n') {
+			st->index[st->index_len] = '\0';
+			st->index_done = true;
+			ret = chunk_start(st);
+			if (ret)
+				return ret;
+		}
+	}
+
+	/* data from the pack */
+	while (len) {
+		if (st->cur >= st->count) {
+			ERROR("Chunk pack contains more data than indexed");
+			return -EFAULT;
+		}
+		e = &st->entries[st->cur];
+		n = min((size_t)len, e->size - st->buf_len);
+		memcpy(st->buf + st->buf_len, data, n);
+		st->buf_len += n;
+		data += n;
+		len -= n;
+		if (st->buf_len == e->size) {
+			st->from_pack += e->size;
+			ret = chunk_write(st, e, true);
+			if (!ret)
+				ret = chunk_resolve_pending(st);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
+static int install_chunk_image(struct img_type *img,
+	void __attribute__ ((__unused__)) *data)
+{
+	struct chunk_state st;
+	char *source, *threads, *timeout;
+	long ncpus;
+	int ret;
+
+	memset(&st, 0, sizeof(st));
+	st.fdsrc = -1;
+
+	if (img->seek) {
+		ERROR("Option 'offset' is not supported for chunk images");
+		return -EINVAL;
+	}
+
+	source = dict_get_value(&img->properties, "chunk-source");
+	st.store = dict_get_value(&img->properties, "chunk-store");
+	threads = dict_get_value(&img->properties, "chunk-threads");
+	st.cafile = dict_get_value(&img->properties, "chunk-store-cafile");
+	timeout = dict_get_value(&img->properties, "chunk-store-timeout");
+
+	st.timeout = CHUNK_STORE_TIMEOUT;
+	if (timeout) {
+		errno = 0;
+		st.timeout = strtoul(timeout, NULL, 10);
+		if (errno || !st.timeout) {
+			ERROR("Wrong chunk-store-timeout %s", timeout);
+			return -EINVAL;
+		}
+	}
+
+	if (threads) {
+		errno = 0;
+		st.nthreads = strtoul(threads, NULL, 10);
+		if (errno || !st.nthreads) {
+			ERROR("Wrong chunk-threads %s", threads);
+			return -EINVAL;
+		}
+	} else {
+		ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		st.nthreads = ncpus > 0 ? ncpus : 1;
+	}
+	st.nthreads = min(st.nthreads, (unsigned int)CHUNK_MAX_THREADS);
+
+	if (source) {
+		if (!strcmp(source, img->device)) {
+			ERROR("chunk-source and device must be different");
+			return -EINVAL;
+		}
+		st.fdsrc = open(source, O_RDONLY);
+		if (st.fdsrc < 0) {
+			ERROR("%s cannot be opened: %s", source, strerror(errno));
+			return -ENODEV;
+		}
+	}
+
+	st.fdout = open(img->device, O_WRONLY);
+	if (st.fdout < 0) {
+		ERROR("%s cannot be opened for writing: %s", img->device,
+			strerror(errno));
+		ret = -ENODEV;
+		goto out;
+	}
+
+	ret = copyimage(&st, img, chunk_stream_cb);
+	if (!ret && !st.index_done) {
+		ERROR("Chunk index not terminated");
+		ret = -EINVAL;
+	}
+	if (!ret && st.cur != st.count) {
+		ERROR("Chunk pack truncated: %zu of %zu chunks written",
+			st.cur, st.count);
+		ret = -EFAULT;
+	}
+
+	if (!ret)
+		TRACE("Chunk image %s: %llu bytes reused, %llu from SWU, %llu from store",
+			img->fname, st.from_source, st.from_pack, st.from_store);
+
+out:
+	if (st.curl)
+		curl_easy_cleanup(st.curl);
+	if (st.fdout >= 0)
+		close(st.fdout);
+	if (st.fdsrc >= 0)
+		close(st.fdsrc);
+	free(st.table.refs);
+	free(st.entries);
+	free(st.index);
+	free(st.buf);
+
+	return ret;
+}
+
+/* indexing runs its own threads, fetching uses libcurl */
+static const struct handler_caps chunk_caps = {
+	.flags = HANDLER_CAP_STREAM,
+	.concurrency = HANDLER_EXCLUSIVE,
+};
+
+__attribute__((constructor))
+void chunk_handler(void)
+{
+	register_handler_caps("chunk_image", install_chunk_image,
+				IMAGE_HANDLER, NULL, &chunk_caps);
+}
@@ -40,13 +40,18 @@ static int install_nothing(struct img_type *img,
 	return ret;
 }
 
+static const struct handler_caps dummy_caps = {
+	.flags = HANDLER_CAP_STREAM,
+	.concurrency = HANDLER_SHARED,
+};
+
 __attribute__((constructor))
 void dummy_handler(void)
 {
-	register_handler("dummy", install_nothing,
+	register_handler_caps("dummy", install_nothing,
 				IMAGE_HANDLER |
 				FILE_HANDLER |
 				SCRIPT_HANDLER |
 				PARTITION_HANDLER,
-				NULL);
+				NULL, &dummy_caps);
 }
@@ -176,6 +176,7 @@ static int flash_write_nand_hamming1(int mtdnum, struct img_type *img)
 	int i, j;
 	int len;
 	long long imglen = 0;
+	long long reported = 0;
 	int page_idx = 0;
 	int ret = EXIT_FAILURE;
 	char mtd_device[LINESIZE];
@@ -257,7 +258,9 @@ static int flash_write_nand_hamming1(int mtdnum, struct img_type *img)
 		 * this handler does not use copyfile()
 		 * and must update itself the progress bar
 		 */
-		swupdate_progress_update((img->size - imglen) * 100 / img->size);
+		swupdate_progress_bytes(img->size - imglen - reported,
+					img->size - imglen, img->size);
+		reported = img->size - imglen;
 	}
 
 	if (cnt < 0) {
@@ -307,9 +310,15 @@ static int install_flash_hamming_image(struct img_type *img,
 	return 0;
 }
 
+static const struct handler_caps flash_hamming_caps = {
+	.flags = HANDLER_CAP_STREAM,
+	.concurrency = HANDLER_PER_DEVICE,
+};
+
 __attribute__((constructor))
 void flash_1bit_hamming_handler(void)
 {
-	register_handler("flash-hamming1", install_flash_hamming_image,
-				IMAGE_HANDLER | FILE_HANDLER,  (void *)1);
+	register_handler_caps("flash-hamming1", install_flash_hamming_image,
+				IMAGE_HANDLER | FILE_HANDLER,  (void *)1,
+				&flash_hamming_caps);
 }
@@ -86,6 +86,7 @@ static int flash_write_nand(int mtdnum, struct img_type *img)
 	int pagelen;
 	bool baderaseblock = false;
 	long long imglen = 0;
+	long long reported = 0;
 	long long blockstart = -1;
 	long long offs;
 	unsigned char *filebuf = NULL;
@@ -262,7 +263,9 @@ static int flash_write_nand(int mtdnum, struct img_type *img)
 		 * this handler does not use copyfile()
 		 * and must update itself the progress bar
 		 */
-		swupdate_progress_update((img->size - imglen) * 100 / img->size);
+		swupdate_progress_bytes(img->size - imglen - reported,
+					img->size - imglen, img->size);
+		reported = img->size - imglen;
 
 		mtdoffset += mtd->min_io_size;
 		writebuf += pagelen;
@@ -353,9 +356,14 @@ static int install_flash_image(struct img_type *img,
 	return 0;
 }
 
+static const struct handler_caps flash_caps = {
+	.flags = HANDLER_CAP_STREAM,
+	.concurrency = HANDLER_PER_DEVICE,
+};
+
 __attribute__((constructor))
 void flash_handler(void)
 {
-	register_handler("flash", install_flash_image,
-				IMAGE_HANDLER | FILE_HANDLER, NULL);
+	register_handler_caps("flash", install_flash_image,
+				IMAGE_HANDLER | FILE_HANDLER, NULL, &flash_caps);
 }
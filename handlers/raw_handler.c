@@ -35,11 +35,8 @@ static int install_raw_image(struct img_type *img,
 				img->device, strerror(errno));
 		return -1;
 	}
-#if defined(__FreeBSD__)
-	ret = copyimage(&fdout, img, copy_write_padded);
-#else
+	/* writes are padded as set in raw_caps */
 	ret = copyimage(&fdout, img, NULL);
-#endif
 
 	close(fdout);
 	return ret;
@@ -52,9 +49,10 @@ static int install_raw_file(struct img_type *img,
 	int fdout;
 	int ret = 0;
 	int use_mount = (strlen(img->device) && strlen(img->filesystem)) ? 1 : 0;
-	char* DATADST_DIR = alloca(strlen(get_tmpdir())+strlen(DATADST_DIR_SUFFIX)+1);
-	sprintf(DATADST_DIR, "%s%s", get_tmpdir(), DATADST_DIR_SUFFIX);
+	const char *DATADST_DIR = NULL;
 	char* make_path;
+	char *atomic;
+	char *tmpname = NULL;
 
 	if (strlen(img->path) == 0) {
 		ERROR("Missing path attribute");
@@ -62,8 +60,8 @@ static int install_raw_file(struct img_type *img,
 	}
 
 	if (use_mount) {
-		ret = swupdate_mount(img->device, DATADST_DIR, img->filesystem);
-		if (ret) {
+		DATADST_DIR = swupdate_mount_cached(img->device, img->filesystem);
+		if (!DATADST_DIR) {
 			ERROR("Device %s with filesystem %s cannot be mounted",
 				img->device, img->filesystem);
 			return -1;
@@ -72,7 +70,8 @@ static int install_raw_file(struct img_type *img,
 		if (snprintf(path, sizeof(path), "%s%s",
 					 DATADST_DIR, img->path) >= (int)sizeof(path)) {
 			ERROR("Path too long: %s%s", DATADST_DIR, img->path);
-			return -1;
+			ret = -1;
+			goto out;
 		}
 	} else {
 		if (snprintf(path, sizeof(path), "%s", img->path) >= (int)sizeof(path)) {
@@ -91,34 +90,81 @@ static int install_raw_file(struct img_type *img,
 		fdout = mkpath(dirname(strdupa(path)), 0755);
 		if (fdout < 0) {
 			ERROR("I cannot create path %s: %s", path, strerror(errno));
-			return -1;
+			ret = -1;
+			goto out;
 		}
 	}
 
-	fdout = openfileoutput(path);
+	/*
+	 * On request, write into a temporary file on the destination
+	 * filesystem and rename it, so that the old file stays untouched
+	 * until the new one is complete. Fall back to overwrite the file.
+	 */
+	atomic = dict_get_value(&img->properties, "atomic");
+	fdout = -1;
+	if (atomic != NULL && strcmp(atomic, "true") == 0)
+		fdout = openfileoutput_tmp(path, &tmpname);
+	if (fdout < 0)
+		fdout = openfileoutput(path);
+	if (fdout < 0) {
+		ret = -1;
+		goto out;
+	}
+
 	ret = copyimage(&fdout, img, NULL);
 	if (ret< 0) {
 		ERROR("Error copying extracted file");
 	}
-	close(fdout);
+	if (tmpname) {
+		if (closefileoutput_tmp(fdout, tmpname, path, ret >= 0) && ret >= 0)
+			ret = -1;
+	} else
+		close(fdout);
 
+out:
 	if (use_mount) {
-		swupdate_umount(DATADST_DIR);
+		swupdate_umount_cached(DATADST_DIR);
 	}
 
 	return ret;
 }
 
+/*
+ * A file on a device to be mounted holds the whole device,
+ * each mounted device has its own mount point
+ */
+static const char *raw_file_device(struct img_type *img)
+{
+	if (strlen(img->device) && strlen(img->filesystem))
+		return img->device;
+
+	return img->path;
+}
+
+static const struct handler_caps raw_caps = {
+	.flags = HANDLER_CAP_STREAM,
+	.concurrency = HANDLER_PER_DEVICE,
+#if defined(__FreeBSD__)
+	.alignment = 512,
+#endif
+};
+
+static const struct handler_caps raw_file_caps = {
+	.flags = HANDLER_CAP_STREAM,
+	.concurrency = HANDLER_PER_DEVICE,
+	.device = raw_file_device,
+};
+
 __attribute__((constructor))
 void raw_handler(void)
 {
-	register_handler("raw", install_raw_image,
-				IMAGE_HANDLER, NULL);
+	register_handler_caps("raw", install_raw_image,
+				IMAGE_HANDLER, NULL, &raw_caps);
 }
 
 	__attribute__((constructor))
 void raw_filecopy_handler(void)
 {
-	register_handler("rawfile", install_raw_file,
-				FILE_HANDLER, NULL);
+	register_handler_caps("rawfile", install_raw_file,
+				FILE_HANDLER, NULL, &raw_file_caps);
 }
@@ -10,11 +10,15 @@
 #include <stdlib.h>
 #include <libgen.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
 #include <stdbool.h>
 #include <librsync.h>
 #if defined(__linux__)
 #include <sys/sendfile.h>
+#include <linux/fs.h>
 #endif
 #if defined(__FreeBSD__)
 #include <sys/param.h>
@@ -23,8 +27,18 @@
 #include "handler.h"
 #include "util.h"
 
-/* Use rdiff's default inbuf and outbuf size of 64K */
+/*
+ * Use rdiff's default inbuf and outbuf size of 64K, the output
+ * buffer can be enlarged with the "rdiff-buffer-size" property.
+ */
 #define RDIFF_BUFFER_SIZE 64 * 1024
+#define RDIFF_MAX_BUFFER_SIZE 64 * 1024 * 1024
+
+/* Amount of the base file to prefetch for each copy command */
+#define RDIFF_PREFETCH_SIZE 1024 * 1024
+
+/* Copy commands that can be cloned for each output buffer */
+#define RDIFF_MAX_CLONES 256
 
 #define TEST_OR_FAIL(expr, failret) \
 	if (expr) { \
@@ -36,16 +50,50 @@
 void rdiff_file_handler(void);
 void rdiff_image_handler(void);
 
+/*
+ * The base file is mapped in memory when possible, so that
+ * librsync's copy commands are served without any copy or
+ * syscall. Otherwise, it is read with pread().
+ */
+struct rdiff_base_t
+{
+	int fd;
+	unsigned char *map;
+	size_t size;
+	rs_long_t prefetch_start;
+	rs_long_t prefetch_end;
+};
+
+/*
+ * Part of the output buffer that is a copy of the base file.
+ * If base and destination are on the same filesystem, it can
+ * be shared with the base instead of written (FICLONERANGE).
+ */
+struct rdiff_clone_t
+{
+	size_t out_pos;
+	rs_long_t base_pos;
+	size_t len;
+};
+
 struct rdiff_t
 {
 	rs_job_t *job;
 	rs_buffers_t buffers;
 
-	FILE *dest_file;
-	FILE *base_file;
+	int dest_fd;
+	struct rdiff_base_t base;
+
+	bool clone_enabled;
+	size_t clone_blksize;
+	struct rdiff_clone_t clones[RDIFF_MAX_CLONES];
+	unsigned int nclones;
+	unsigned long long out_written;
+	unsigned long long cloned;
 
 	char *inbuf;
 	char *outbuf;
+	size_t outbuf_size;
 
 	long long cpio_input_len;
 
@@ -69,17 +117,76 @@ static void rdiff_log(rs_loglevel level, char const *msg)
 	swupdate_notify(RUN, "%s", loglevelmap[level], msg);
 }
 
-static rs_result base_file_read_cb(void *fp, rs_long_t pos, size_t *len, void **buf)
+/*
+ * Remember where the copied data goes in the output buffer:
+ * librsync puts it at next_out.
+ */
+static void record_clone(struct rdiff_t *rdiff_state, rs_long_t pos, size_t len)
 {
-	FILE *f = (FILE *)fp;
+	size_t out_pos = rdiff_state->buffers.next_out - rdiff_state->outbuf;
+	struct rdiff_clone_t *last;
+
+	if (!rdiff_state->clone_enabled || len < rdiff_state->clone_blksize)
+		return;
+
+	if (rdiff_state->nclones) {
+		last = &rdiff_state->clones[rdiff_state->nclones - 1];
+		if (last->out_pos + last->len == out_pos &&
+		    last->base_pos + (rs_long_t)last->len == pos) {
+			last->len += len;
+			return;
+		}
+	}
+	if (rdiff_state->nclones == RDIFF_MAX_CLONES)
+		return;
 
-	if (fseek(f, pos, SEEK_SET) != 0) {
-		ERROR("Error seeking rdiff base file: %s", strerror(errno));
-		return RS_IO_ERROR;
+	last = &rdiff_state->clones[rdiff_state->nclones++];
+	last->out_pos = out_pos;
+	last->base_pos = pos;
+	last->len = len;
+}
+
+static rs_result base_file_read_cb(void *opaque, rs_long_t pos, size_t *len, void **buf)
+{
+	struct rdiff_t *rdiff_state = (struct rdiff_t *)opaque;
+	struct rdiff_base_t *base = &rdiff_state->base;
+	ssize_t ret;
+
+	if (base->map) {
+		if (pos < 0 || (size_t)pos >= base->size) {
+			ERROR("Unexpected EOF on rdiff base file.");
+			return RS_INPUT_ENDED;
+		}
+		if (*len > base->size - pos)
+			*len = base->size - pos;
+
+		/*
+		 * Ask the kernel to read ahead the next part of the
+		 * base file, unless it was already requested.
+		 */
+		if (pos < base->prefetch_start ||
+		    pos + (rs_long_t)*len > base->prefetch_end) {
+			long pagesize = sysconf(_SC_PAGESIZE);
+			rs_long_t start = pos & ~((rs_long_t)pagesize - 1);
+			size_t count = max((size_t)(pos - start) + *len,
+					   (size_t)RDIFF_PREFETCH_SIZE);
+
+			count = min(count, base->size - start);
+			(void)madvise(base->map + start, count, MADV_WILLNEED);
+			base->prefetch_start = start;
+			base->prefetch_end = start + count;
+		}
+
+		/* librsync takes the data from the mapping */
+		*buf = base->map + pos;
+		record_clone(rdiff_state, pos, *len);
+		return RS_DONE;
 	}
 
-	int ret = fread(*buf, 1, *len, f);
-	if (ret == -1) {
+	do {
+		ret = pread(base->fd, *buf, *len, pos);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0) {
 		ERROR("Error reading rdiff base file: %s", strerror(errno));
 		return RS_IO_ERROR;
 	}
@@ -88,11 +195,75 @@ static rs_result base_file_read_cb(void *fp, rs_long_t pos, size_t *len, void **
 		return RS_INPUT_ENDED;
 	}
 	*len = ret;
+	record_clone(rdiff_state, pos, *len);
 
 	return RS_DONE;
 }
 
-static rs_result fill_inbuffer(struct rdiff_t *rdiff_state, const void *buf, unsigned int *len)
+static int base_file_open(struct rdiff_base_t *base, const char *filename)
+{
+	struct stat st;
+	void *map;
+
+	base->map = NULL;
+	base->size = 0;
+	base->prefetch_start = 0;
+	base->prefetch_end = 0;
+
+	if ((base->fd = open(filename, O_RDONLY)) < 0) {
+		ERROR("%s cannot be opened for reading: %s", filename, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(base->fd, &st) == 0) {
+		if (S_ISREG(st.st_mode)) {
+			base->size = st.st_size;
+#if defined(__linux__)
+		} else if (S_ISBLK(st.st_mode)) {
+			uint64_t size;
+			if (ioctl(base->fd, BLKGETSIZE64, &size) == 0)
+				base->size = size;
+#endif
+		}
+	}
+
+	if (base->size == 0)
+		return 0;
+
+	map = mmap(NULL, base->size, PROT_READ, MAP_SHARED, base->fd, 0);
+	if (map == MAP_FAILED) {
+		TRACE("Cannot mmap %s, reading it: %s", filename, strerror(errno));
+		return 0;
+	}
+	base->map = map;
+	(void)madvise(base->map, base->size, MADV_SEQUENTIAL);
+	TRACE("Mapped rdiff base file %s (%zu bytes)", filename, base->size);
+
+	return 0;
+}
+
+static int base_file_close(struct rdiff_base_t *base)
+{
+	int ret = 0;
+
+	if (base->map) {
+		(void)munmap(base->map, base->size);
+		base->map = NULL;
+	}
+	if (base->fd >= 0) {
+		ret = close(base->fd);
+		base->fd = -1;
+	}
+
+	return ret;
+}
+
+/*
+ * If possible, the buffer coming from copyfile() is passed as it is
+ * to librsync. Only data not consumed by rs_job_iter() is copied
+ * into the input buffer, because the caller's buffer is reused.
+ */
+static rs_result fill_inbuffer(struct rdiff_t *rdiff_state, const char **buf, unsigned int *len)
 {
 	rs_buffers_t *buffers = &rdiff_state->buffers;
 
@@ -107,16 +278,20 @@ static rs_result fill_inbuffer(struct rdiff_t *rdiff_state, const void *buf, uns
 	}
 
 	if (buffers->avail_in == 0) {
-		/* No more buffered input data pending, get some... */
-		TEST_OR_FAIL(*len <= RDIFF_BUFFER_SIZE, RS_IO_ERROR);
-		buffers->next_in = rdiff_state->inbuf;
+		/* No more buffered input data pending, use the caller's data */
+		TRACE("Passing %d bytes to rdiff.", *len);
+		buffers->next_in = (char *)*buf;
 		buffers->avail_in = *len;
 		rdiff_state->cpio_input_len -= *len;
-		TRACE("Appending %d bytes to rdiff input buffer.", *len);
-		(void)memcpy(rdiff_state->inbuf, buf, *len);
+		*buf += *len;
 		*len = 0;
 	} else {
 		/* There's more input, try to append it to input buffer. */
+		if (buffers->next_in != rdiff_state->inbuf) {
+			TEST_OR_FAIL(buffers->avail_in <= RDIFF_BUFFER_SIZE, RS_IO_ERROR);
+			memmove(rdiff_state->inbuf, buffers->next_in, buffers->avail_in);
+			buffers->next_in = rdiff_state->inbuf;
+		}
 		char *target = buffers->next_in + buffers->avail_in;
 		unsigned int buflen = rdiff_state->inbuf + RDIFF_BUFFER_SIZE - target;
 		buflen = buflen > *len ? *len : buflen;
@@ -129,21 +304,99 @@ static rs_result fill_inbuffer(struct rdiff_t *rdiff_state, const void *buf, uns
 		TRACE("Appending %d bytes to rdiff input buffer.", buflen);
 		buffers->avail_in += buflen;
 		rdiff_state->cpio_input_len -= buflen;
-		(void)memcpy(target, buf, buflen);
+		(void)memcpy(target, *buf, buflen);
+		*buf += buflen;
 		*len -= buflen;
 	}
 	buffers->eof_in = rdiff_state->cpio_input_len == 0 ? true : false;
 	return RS_DONE;
 }
 
+/*
+ * Keep the input not yet consumed by librsync,
+ * it may still point into the caller's buffer.
+ */
+static rs_result stash_inbuffer(struct rdiff_t *rdiff_state)
+{
+	rs_buffers_t *buffers = &rdiff_state->buffers;
+
+	if (buffers->avail_in == 0 || buffers->next_in == rdiff_state->inbuf)
+		return RS_DONE;
+
+	TEST_OR_FAIL(buffers->avail_in <= RDIFF_BUFFER_SIZE, RS_IO_ERROR);
+	memmove(rdiff_state->inbuf, buffers->next_in, buffers->avail_in);
+	buffers->next_in = rdiff_state->inbuf;
+
+	return RS_DONE;
+}
+
+/*
+ * Write the output buffer, sharing the block aligned parts copied
+ * from the base file instead of writing them. If the filesystem
+ * cannot do it, cloning is disabled and the data is written.
+ */
+static int drain_cloned(struct rdiff_t *rdiff_state, size_t len)
+{
+	size_t bs = rdiff_state->clone_blksize;
+	size_t done = 0, skip, start, clen;
+	unsigned long long dst;
+	unsigned int i;
+
+	for (i = 0; i < rdiff_state->nclones && rdiff_state->clone_enabled; i++) {
+		struct rdiff_clone_t *c = &rdiff_state->clones[i];
+
+		dst = rdiff_state->out_written + c->out_pos;
+		skip = (bs - dst % bs) % bs;
+		if (c->len <= skip || (c->base_pos + skip) % bs)
+			continue;
+		clen = (c->len - skip) / bs * bs;
+		if (!clen)
+			continue;
+		start = c->out_pos + skip;
+
+		if (start > done &&
+		    copy_write(&rdiff_state->dest_fd, rdiff_state->outbuf + done,
+			       start - done))
+			return -1;
+		done = start;
+
+#if defined(FICLONERANGE)
+		struct file_clone_range range = {
+			.src_fd = rdiff_state->base.fd,
+			.src_offset = c->base_pos + skip,
+			.src_length = clen,
+			.dest_offset = rdiff_state->out_written + start,
+		};
+		if (ioctl(rdiff_state->dest_fd, FICLONERANGE, &range) < 0) {
+			TRACE("Cannot share data with rdiff base, copying: %s",
+			      strerror(errno));
+			rdiff_state->clone_enabled = false;
+			break;
+		}
+#endif
+		if (lseek(rdiff_state->dest_fd, rdiff_state->out_written + start + clen,
+			  SEEK_SET) < 0)
+			return -1;
+		rdiff_state->cloned += clen;
+		done = start + clen;
+	}
+
+	if (len > done &&
+	    copy_write(&rdiff_state->dest_fd, rdiff_state->outbuf + done,
+		       len - done))
+		return -1;
+
+	return 0;
+}
+
 static rs_result drain_outbuffer(struct rdiff_t *rdiff_state)
 {
 	rs_buffers_t *buffers = &rdiff_state->buffers;
 
-	int len = buffers->next_out - rdiff_state->outbuf;
-	TEST_OR_FAIL(len <= RDIFF_BUFFER_SIZE, RS_IO_ERROR);
+	size_t len = buffers->next_out - rdiff_state->outbuf;
+	TEST_OR_FAIL(len <= rdiff_state->outbuf_size, RS_IO_ERROR);
 	TEST_OR_FAIL(buffers->next_out >= rdiff_state->outbuf, RS_IO_ERROR);
-	TEST_OR_FAIL(buffers->next_out <= rdiff_state->outbuf + RDIFF_BUFFER_SIZE, RS_IO_ERROR);
+	TEST_OR_FAIL(buffers->next_out <= rdiff_state->outbuf + rdiff_state->outbuf_size, RS_IO_ERROR);
 
 	writeimage destfiledrain = copy_write;
 #if defined(__FreeBSD__)
@@ -155,14 +408,20 @@ static rs_result drain_outbuffer(struct rdiff_t *rdiff_state)
 	}
 #endif
 	if (len > 0) {
-		TRACE("Draining %d bytes from rdiff output buffer", len);
+		TRACE("Draining %zu bytes from rdiff output buffer", len);
 		buffers->next_out = rdiff_state->outbuf;
-		buffers->avail_out = RDIFF_BUFFER_SIZE;
-		int dest_file_fd = fileno(rdiff_state->dest_file);
-		if (destfiledrain(&dest_file_fd, buffers->next_out, len) != 0) {
+		buffers->avail_out = rdiff_state->outbuf_size;
+		if (rdiff_state->nclones) {
+			if (drain_cloned(rdiff_state, len) != 0) {
+				ERROR("Cannot drain rdiff output buffer.");
+				return RS_IO_ERROR;
+			}
+		} else if (destfiledrain(&rdiff_state->dest_fd, buffers->next_out, len) != 0) {
 			ERROR("Cannot drain rdiff output buffer.");
 			return RS_IO_ERROR;
 		}
+		rdiff_state->out_written += len;
+		rdiff_state->nclones = 0;
 	} else {
 		TRACE("No output rdiff buffer data to drain.");
 	}
@@ -187,18 +446,25 @@ static int apply_rdiff_chunk_cb(void *out, const void *buf, unsigned int len)
 {
 	struct rdiff_t *rdiff_state = (struct rdiff_t *)out;
 	rs_buffers_t *buffers = &rdiff_state->buffers;
+	const char *inbuf = buf;
 	unsigned int inbytesleft = len;
 	rs_result result = RS_RUNNING;
 
 	if (buffers->next_out == NULL) {
 		TEST_OR_FAIL(buffers->avail_out == 0, -1);
 		buffers->next_out = rdiff_state->outbuf;
-		buffers->avail_out = RDIFF_BUFFER_SIZE;
+		buffers->avail_out = rdiff_state->outbuf_size;
 	}
 
-	while (inbytesleft > 0 || (buffers->eof_in == true && buffers->avail_in > 0)) {
+	/*
+	 * After the last input, librsync may still have output pending
+	 * (a copy command longer than the output buffer), keep iterating
+	 * as long as it is blocked.
+	 */
+	while (inbytesleft > 0 || (buffers->eof_in == true &&
+		(buffers->avail_in > 0 || result == RS_BLOCKED))) {
 		rdiff_stats("[pre] ", rdiff_state, result);
-		result = fill_inbuffer(rdiff_state, buf, &inbytesleft);
+		result = fill_inbuffer(rdiff_state, &inbuf, &inbytesleft);
 		if (result != RS_DONE && result != RS_BLOCKED) {
 			return -1;
 		}
@@ -221,6 +487,9 @@ static int apply_rdiff_chunk_cb(void *out, const void *buf, unsigned int len)
 			break;
 		}
 	}
+	if (stash_inbuffer(rdiff_state) != RS_DONE) {
+		return -1;
+	}
 	rdiff_stats("[ret] ", rdiff_state, result);
 	return 0;
 }
@@ -233,12 +502,16 @@ static int apply_rdiff_patch(struct img_type *img,
 	struct rdiff_t rdiff_state = {};
 	rdiff_state.type =
 	    strcmp(img->type, "rdiff_image") == 0 ? IMAGE_HANDLER : FILE_HANDLER;
+	rdiff_state.dest_fd = -1;
+	rdiff_state.base.fd = -1;
+	rdiff_state.outbuf_size = RDIFF_BUFFER_SIZE;
 
-	char *mountpoint = NULL;
+	const char *mountpoint = NULL;
 	bool use_mount = (strlen(img->device) && strlen(img->filesystem)) ? true : false;
 
 	char *base_file_filename = NULL;
 	char *dest_file_filename = NULL;
+	bool replace = false;
 
 	if (rdiff_state.type == IMAGE_HANDLER) {
 		if (img->seek) {
@@ -256,42 +529,21 @@ static int apply_rdiff_patch(struct img_type *img,
 			return -1;
 		}
 
-		if ((rdiff_state.dest_file = fopen(img->device, "wb+")) == NULL) {
+		if ((rdiff_state.dest_fd = open(img->device, O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0) {
 			ERROR("%s cannot be opened for writing: %s", img->device, strerror(errno));
 			return -1;
 		}
 	}
 	if (rdiff_state.type == FILE_HANDLER) {
-		int fd;
-
 		if (strlen(img->path) == 0) {
 			ERROR("Missing path attribute");
 			return -1;
 		}
 
-		if (asprintf(&dest_file_filename, "%srdiffpatch.XXXXXX", get_tmpdir()) == -1) {
-			ERROR("Cannot allocate memory for temporary filename creation.");
-			return -1;
-		}
-		if ((fd = mkstemp(dest_file_filename)) == -1) {
-			ERROR("Cannot create temporary file %s: %s", dest_file_filename,
-				  strerror(errno));
-			return -1;
-		}
-
-		if ((rdiff_state.dest_file = fdopen(fd, "wb+")) == NULL) {
-			(void)close(fd);
-			ERROR("%s cannot be opened for writing: %s", dest_file_filename,
-				  strerror(errno));
-			return -1;
-		}
-
 		base_file_filename = img->path;
 		if (use_mount) {
-			mountpoint = alloca(strlen(get_tmpdir()) + strlen(DATADST_DIR_SUFFIX) + 1);
-			sprintf(mountpoint, "%s%s", get_tmpdir(), DATADST_DIR_SUFFIX);
-
-			if (swupdate_mount(img->device, mountpoint, img->filesystem) != 0) {
+			mountpoint = swupdate_mount_cached(img->device, img->filesystem);
+			if (!mountpoint) {
 				ERROR("Device %s with filesystem %s cannot be mounted",
 					  img->device, img->filesystem);
 				ret = -1;
@@ -304,29 +556,75 @@ static int apply_rdiff_patch(struct img_type *img,
 
 		char* make_path = dict_get_value(&img->properties, "create-destination");
 		if (make_path != NULL && strcmp(make_path, "true") == 0) {
-			TRACE("Creating path %s", dirname(base_file_filename));
-			if (mkpath(dirname(strdupa(base_file_filename)), 0755) < 0) {
-				ERROR("Cannot create path %s: %s", dirname(base_file_filename),
+			char *dir = dirname(strdupa(base_file_filename));
+			TRACE("Creating path %s", dir);
+			if (mkpath(dir, 0755) < 0) {
+				ERROR("Cannot create path %s: %s", dir, strerror(errno));
+				ret = -1;
+				goto cleanup;
+			}
+		}
+
+		/*
+		 * Write the patched file next to the base file and rename it
+		 * in place, the blocks copied from the base file are shared
+		 * with it if the filesystem supports reflinks. If this is not
+		 * possible, write to $TMPDIR and copy the result over the base.
+		 */
+		rdiff_state.dest_fd = openfileoutput_tmp(base_file_filename,
+							 &dest_file_filename);
+		if (rdiff_state.dest_fd >= 0) {
+			struct stat stat_dest_file;
+			replace = true;
+			if (fstat(rdiff_state.dest_fd, &stat_dest_file) == 0 &&
+			    stat_dest_file.st_blksize > 0) {
+				rdiff_state.clone_blksize = stat_dest_file.st_blksize;
+#if defined(FICLONERANGE)
+				rdiff_state.clone_enabled = true;
+#endif
+			}
+		} else {
+			if (asprintf(&dest_file_filename, "%srdiffpatch.XXXXXX", get_tmpdir()) == -1) {
+				ERROR("Cannot allocate memory for temporary filename creation.");
+				dest_file_filename = NULL;
+				ret = -1;
+				goto cleanup;
+			}
+			if ((rdiff_state.dest_fd = mkstemp(dest_file_filename)) == -1) {
+				ERROR("Cannot create temporary file %s: %s", dest_file_filename,
 					  strerror(errno));
+				free(dest_file_filename);
+				dest_file_filename = NULL;
 				ret = -1;
 				goto cleanup;
 			}
 		}
 	}
 
-	if ((rdiff_state.base_file = fopen(base_file_filename, "rb+")) == NULL) {
-		ERROR("%s cannot be opened for reading: %s", base_file_filename, strerror(errno));
+	if (base_file_open(&rdiff_state.base, base_file_filename) != 0) {
 		ret = -1;
 		goto cleanup;
 	}
 
+	char *buffer_size = dict_get_value(&img->properties, "rdiff-buffer-size");
+	if (buffer_size != NULL) {
+		rdiff_state.outbuf_size = ustrtoull(buffer_size, 0);
+		if (errno || rdiff_state.outbuf_size < RDIFF_BUFFER_SIZE ||
+		    rdiff_state.outbuf_size > RDIFF_MAX_BUFFER_SIZE) {
+			ERROR("rdiff-buffer-size must be between %d and %d bytes.",
+				  RDIFF_BUFFER_SIZE, RDIFF_MAX_BUFFER_SIZE);
+			ret = -1;
+			goto cleanup;
+		}
+	}
+
 	if (!(rdiff_state.inbuf = malloc(RDIFF_BUFFER_SIZE))) {
 		ERROR("Cannot allocate memory for rdiff input buffer.");
 		ret = -1;
 		goto cleanup;
 	}
 
-	if (!(rdiff_state.outbuf = malloc(RDIFF_BUFFER_SIZE))) {
+	if (!(rdiff_state.outbuf = malloc(rdiff_state.outbuf_size))) {
 		ERROR("Cannot allocate memory for rdiff output buffer.");
 		ret = -1;
 		goto cleanup;
@@ -346,7 +644,7 @@ static int apply_rdiff_patch(struct img_type *img,
 	rs_trace_set_level(loglevelmap[loglevel]);
 	rs_trace_to(rdiff_log);
 
-	rdiff_state.job = rs_patch_begin(base_file_read_cb, rdiff_state.base_file);
+	rdiff_state.job = rs_patch_begin(base_file_read_cb, &rdiff_state);
 	ret = copyfile(img->fdin,
 			&rdiff_state,
 			img->size,
@@ -363,26 +661,35 @@ static int apply_rdiff_patch(struct img_type *img,
 		goto cleanup;
 	}
 
+	if (replace) {
+		if (rdiff_state.cloned)
+			TRACE("%llu of %llu bytes shared with %s", rdiff_state.cloned,
+			      rdiff_state.out_written, base_file_filename);
+		(void)base_file_close(&rdiff_state.base);
+		ret = closefileoutput_tmp(rdiff_state.dest_fd, dest_file_filename,
+					  base_file_filename, true);
+		rdiff_state.dest_fd = -1;
+		dest_file_filename = NULL;
+		goto cleanup;
+	}
+
 	if (rdiff_state.type == FILE_HANDLER) {
 		struct stat stat_dest_file;
-		if (fstat(fileno(rdiff_state.dest_file), &stat_dest_file) == -1) {
+		if (fstat(rdiff_state.dest_fd, &stat_dest_file) == -1) {
 			ERROR("Cannot fstat file %s: %s", dest_file_filename, strerror(errno));
 			ret = -1;
 			goto cleanup;
 		}
 
 		/*
-		 * Most often $TMPDIR -- in which dest_file resides -- is a different
-		 * filesystem (probably tmpfs) than that base_file resides in. Hence,
-		 * substituting base_file by dest_file cross-filesystem via renameat()
-		 * won't work. If dest_file and base_file are indeed in the same
-		 * filesystem, metadata (uid, gid, mode, xattrs, acl, ...) has to be
-		 * preserved after renameat(). This isn't worth the effort as Linux's
-		 * sendfile() is fast, so copy the content.
+		 * dest_file is in $TMPDIR, most often a different filesystem
+		 * than the one base_file resides in, so copy the content.
+		 * The base file is not needed anymore and it is truncated, so
+		 * drop its mapping first.
 		 */
-		rdiff_state.base_file = freopen(NULL, "wb", rdiff_state.base_file);
-		rdiff_state.dest_file = freopen(NULL, "rb", rdiff_state.dest_file);
-		if ((rdiff_state.base_file == NULL) || (rdiff_state.dest_file == NULL)) {
+		(void)base_file_close(&rdiff_state.base);
+		if ((rdiff_state.base.fd = open(base_file_filename, O_WRONLY | O_TRUNC)) < 0 ||
+		    lseek(rdiff_state.dest_fd, 0, SEEK_SET) < 0) {
 			ERROR("Cannot reopen %s or %s: %s", dest_file_filename,
 				  base_file_filename, strerror(errno));
 			ret = -1;
@@ -393,8 +700,8 @@ static int apply_rdiff_patch(struct img_type *img,
 		(void)stat_dest_file;
 		char buf[DFLTPHYS];
 		int r;
-		while ((r = read(fileno(rdiff_state.dest_file), buf, DFLTPHYS)) > 0) {
-			if (write(fileno(rdiff_state.base_file), buf, r) != r) {
+		while ((r = read(rdiff_state.dest_fd, buf, DFLTPHYS)) > 0) {
+			if (write(rdiff_state.base.fd, buf, r) != r) {
 				ERROR("Write to %s failed.", base_file_filename);
 				ret = -1;
 				break;
@@ -405,12 +712,17 @@ static int apply_rdiff_patch(struct img_type *img,
 			ret = -1;
 		}
 #else
-		if (sendfile(fileno(rdiff_state.base_file), fileno(rdiff_state.dest_file),
-					 NULL, stat_dest_file.st_size) == -1) {
-			ERROR("Cannot copy from %s to %s: %s", dest_file_filename,
-			      base_file_filename, strerror(errno));
-			ret = -1;
-			goto cleanup;
+		off_t remaining = stat_dest_file.st_size;
+		while (remaining > 0) {
+			ssize_t r = sendfile(rdiff_state.base.fd, rdiff_state.dest_fd,
+					     NULL, remaining);
+			if (r <= 0) {
+				ERROR("Cannot copy from %s to %s: %s", dest_file_filename,
+				      base_file_filename, strerror(errno));
+				ret = -1;
+				goto cleanup;
+			}
+			remaining -= r;
 		}
 #endif
 	}
@@ -421,37 +733,60 @@ cleanup:
 	if (rdiff_state.job != NULL) {
 		(void)rs_job_free(rdiff_state.job);
 	}
-	if (rdiff_state.base_file != NULL) {
-		if (fclose(rdiff_state.base_file) == EOF) {
-			ERROR("Error while closing rdiff base: %s", strerror(errno));
-		}
+	if (base_file_close(&rdiff_state.base) != 0) {
+		ERROR("Error while closing rdiff base: %s", strerror(errno));
 	}
-	if (rdiff_state.dest_file != NULL) {
-		if (fclose(rdiff_state.dest_file) == EOF) {
+	if (rdiff_state.dest_fd >= 0) {
+		if (close(rdiff_state.dest_fd) != 0) {
 			ERROR("Error while closing rdiff destination: %s",
 			      strerror(errno));
 		}
 	}
 	if (rdiff_state.type == FILE_HANDLER) {
-		if (unlink(dest_file_filename) == -1) {
+		if (dest_file_filename && unlink(dest_file_filename) == -1) {
 			ERROR("Cannot delete temporary file %s, please clean up manually: %s",
 			      dest_file_filename, strerror(errno));
 		}
-		if (use_mount == true) {
-			swupdate_umount(mountpoint);
+		free(dest_file_filename);
+		if (mountpoint) {
+			swupdate_umount_cached(mountpoint);
 		}
 	}
 	return ret;
 }
 
+/*
+ * A file on a device to be mounted holds the whole device
+ */
+static const char *rdiff_file_device(struct img_type *img)
+{
+	if (strlen(img->device) && strlen(img->filesystem))
+		return img->device;
+
+	return img->path;
+}
+
+static const struct handler_caps rdiff_image_caps = {
+	.flags = HANDLER_CAP_STREAM,
+	.concurrency = HANDLER_PER_DEVICE,
+};
+
+static const struct handler_caps rdiff_file_caps = {
+	.flags = HANDLER_CAP_STREAM,
+	.concurrency = HANDLER_PER_DEVICE,
+	.device = rdiff_file_device,
+};
+
 __attribute__((constructor))
 void rdiff_image_handler(void)
 {
-	register_handler("rdiff_image", apply_rdiff_patch, IMAGE_HANDLER, NULL);
+	register_handler_caps("rdiff_image", apply_rdiff_patch, IMAGE_HANDLER,
+			      NULL, &rdiff_image_caps);
 }
 
 __attribute__((constructor))
 void rdiff_file_handler(void)
 {
-	register_handler("rdiff_file", apply_rdiff_patch, FILE_HANDLER, NULL);
+	register_handler_caps("rdiff_file", apply_rdiff_patch, FILE_HANDLER,
+			      NULL, &rdiff_file_caps);
 }
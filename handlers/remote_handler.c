@@ -11,6 +11,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <errno.h>
 #include <string.h>
 #include <zmq.h>
@@ -25,14 +26,36 @@
 
 #define REMOTE_IPC_TIMEOUT	2000
 
+/*
+ * Defaults proposed to the remote for the windowed mode,
+ * they can be changed with the properties "remote-window"
+ * and "remote-chunk-size".
+ */
+#define REMOTE_WINDOW		8
+#define REMOTE_MAX_WINDOW	256
+#define REMOTE_CHUNK_SIZE	(256 * 1024)
+#define REMOTE_MAX_CHUNK_SIZE	(16 * 1024 * 1024)
+
 static int timeout = REMOTE_IPC_TIMEOUT;
 
 struct RHmsg {
     zmq_msg_t frame[MSG_FRAMES];
 };
 
-struct remote_command {
-	char *cmd;
+/*
+ * State of the connection with the remote. If the remote does
+ * not accept the windowed mode in the answer to INIT, window is 1
+ * and each DATA message waits for its ACK as before.
+ */
+struct remote_conn {
+	void *request;
+	bool windowed;
+	unsigned int window;
+	size_t chunk_size;
+	unsigned long long sent;
+	unsigned long long acked;
+	char *buf;
+	size_t fill;
 };
 
 void remote_handler(void);
@@ -51,31 +74,113 @@ static void RHset_payload(struct RHmsg *self, const void *body, size_t size)
     memcpy (zmq_msg_data(msg), body, size);
 }
 
+static void RHfree_payload(void *data, void __attribute__ ((__unused__)) *hint)
+{
+	free(data);
+}
+
+/*
+ * The payload buffer is passed to zeromq without copying it,
+ * it is freed by zeromq when the message is sent.
+ */
+static void RHmove_payload(struct RHmsg *self, void *body, size_t size)
+{
+    zmq_msg_init_data(&self->frame[FRAME_BODY], body, size, RHfree_payload, NULL);
+}
+
 static int RHmsg_send_cmd(struct RHmsg *self, void *request)
 {
 	int i;
 	int ret;
 
+	/*
+	 * The socket is a DEALER, an empty delimiter
+	 * is required to talk with REP / ROUTER sockets
+	 */
+	if (zmq_send(request, "", 0, ZMQ_SNDMORE) < 0) {
+		for (i = 0; i < MSG_FRAMES; i++)
+			zmq_msg_close(&self->frame[i]);
+		return errno;
+	}
+
 	for (i = 0; i < MSG_FRAMES; i++) {
 		ret = zmq_msg_send (&self->frame[i], request,
 			(i < MSG_FRAMES - 1)? ZMQ_SNDMORE: 0);
-		if (ret < 0 )
+		if (ret < 0 ) {
+			for (; i < MSG_FRAMES; i++)
+				zmq_msg_close(&self->frame[i]);
 			return errno;
+		}
 	}
 
 	return 0;
 }
 
-static int RHmsg_get_ack(struct RHmsg *self, void *request)
+/*
+ * Parse the answer of the remote, in the format
+ *	ACK[:<token>]...
+ * where a token is a number (the new timeout), WINDOW=<n>,
+ * CHUNK=<bytes> (answer to INIT) or SEQ=<n> (cumulative
+ * acknowledge in windowed mode).
+ */
+static int RHparse_ack(struct remote_conn *conn, char *string, bool init)
 {
-	int rc;
-	unsigned long size;
+	char *token, *saveptr;
+	int newtimeout;
+
+	token = strtok_r(string, ":", &saveptr);
+	if (!token || strcmp(token, "ACK") != 0) {
+		ERROR("Remote Handler returns error, exiting");
+		return -EFAULT;
+	}
+
+	while ((token = strtok_r(NULL, ":", &saveptr)) != NULL) {
+		if (!strncmp(token, "WINDOW=", 7) && init) {
+			unsigned int window = strtoul(token + 7, NULL, 10);
+			if (window > 0 && window <= conn->window) {
+				conn->window = window;
+				conn->windowed = true;
+			}
+		} else if (!strncmp(token, "CHUNK=", 6) && init) {
+			size_t chunk = strtoul(token + 6, NULL, 10);
+			if (chunk > 0 && chunk <= conn->chunk_size)
+				conn->chunk_size = chunk;
+		} else if (!strncmp(token, "SEQ=", 4) && conn->windowed) {
+			unsigned long long seq = strtoull(token + 4, NULL, 10);
+			if (seq > conn->sent) {
+				ERROR("Remote acknowledges chunk %llu, sent %llu",
+					seq, conn->sent);
+				return -EFAULT;
+			}
+			if (seq > conn->acked)
+				conn->acked = seq;
+		} else {
+			/*
+			 * Check if the remote ask to wait longer
+			 */
+			newtimeout = strtoul(token, NULL, 10);
+			if (newtimeout > 0)
+				timeout = newtimeout;
+		}
+	}
+
+	/* Legacy remotes acknowledge each message */
+	if (!conn->windowed)
+		conn->acked = conn->sent;
+
+	return 0;
+}
+
+static int RHmsg_get_ack(struct remote_conn *conn, bool init)
+{
+	zmq_msg_t frame;
 	zmq_pollitem_t zpoll;
+	unsigned long size;
 	char *string;
-	int newtimeout;
-	int len;
+	int rc, more;
+	size_t moresize = sizeof(more);
 
-	zpoll.socket = request;
+	zpoll.socket = conn->request;
 	zpoll.events = ZMQ_POLLIN;
 
 	/*
@@ -86,59 +191,129 @@ static int RHmsg_get_ack(struct RHmsg *self, void *request)
 	if (rc <= 0)
 		return -EFAULT;
 
-	zmq_msg_init (&self->frame[0]);
-	if (zmq_msg_recv(&self->frame[0], request, 0) == -1) {
-		zmq_msg_close(&self->frame[0]);
-		return -EFAULT;
-	}
+	/* Skip the empty delimiter added by REP / ROUTER sockets */
+	do {
+		zmq_msg_init(&frame);
+		if (zmq_msg_recv(&frame, conn->request, 0) == -1) {
+			zmq_msg_close(&frame);
+			return -EFAULT;
+		}
+		size = zmq_msg_size(&frame);
+		if (size)
+			break;
+		zmq_msg_close(&frame);
+	} while (1);
 
-	size = zmq_msg_size(&self->frame[0]);
 	string = malloc (size + 1);
-	memcpy (string, zmq_msg_data (&self->frame[0]), size);
+	if (!string) {
+		zmq_msg_close(&frame);
+		return -ENOMEM;
+	}
+	memcpy (string, zmq_msg_data (&frame), size);
 	string[size] = '\0';
-	zmq_msg_close(&self->frame[0]);
+	zmq_msg_close(&frame);
+
+	/* Drop any further frame */
+	while (zmq_getsockopt(conn->request, ZMQ_RCVMORE, &more, &moresize) == 0 &&
+	       more) {
+		zmq_msg_init(&frame);
+		zmq_msg_recv(&frame, conn->request, 0);
+		zmq_msg_close(&frame);
+	}
 
-	/*
-	 * Check if the remote send a new timeout
-	 */
-	len = size;
+	rc = RHparse_ack(conn, string, init);
+	free(string);
 
-	if (strchr(string, ':'))
-		len = (strchr(string, ':') - string - 1);
-	if (strncmp(string, "ACK", len) != 0) {
-		ERROR("Remote Handler returns error, exiting");
-		return -EFAULT;
-	}
+	return rc;
+}
 
-	/*
-	 * Check if the remote ask to wait longer
-	 * we get ack, check the rest of the received
-	 * string
-	 */
-	if ((size > 4) && (string[3] == ':')) {
-		newtimeout = strtoul(&string[4], NULL, 10);
-		if (newtimeout > 0)
-			timeout = newtimeout;
+/*
+ * Send the collected chunk in windowed mode, waiting
+ * for acknowledges only if the window is full
+ */
+static int forward_chunk(struct remote_conn *conn)
+{
+	struct RHmsg RHmessage;
+	char bufcmd[32];
+	int ret;
+
+	if (!conn->fill)
+		return 0;
+
+	while (conn->sent - conn->acked >= conn->window) {
+		ret = RHmsg_get_ack(conn, false);
+		if (ret)
+			return ret;
 	}
 
+	snprintf(bufcmd, sizeof(bufcmd), "DATA:%llu", conn->sent + 1);
+	RHset_command(&RHmessage, bufcmd);
+	RHmove_payload(&RHmessage, conn->buf, conn->fill);
+	conn->buf = malloc(conn->chunk_size);
+	conn->fill = 0;
+
+	ret = RHmsg_send_cmd(&RHmessage, conn->request);
+	if (ret)
+		return ret;
+	conn->sent++;
+
+	if (!conn->buf)
+		return -ENOMEM;
+
 	return 0;
 }
 
-static int forward_data(void *request, const void *buf, unsigned int len)
+static int forward_data(void *out, const void *buf, unsigned int len)
 {
-	struct RHmsg RHmessage;
+	struct remote_conn *conn = (struct remote_conn *)out;
+	const char *data = buf;
+	size_t n;
 	int ret;
 
-	if (!request)
+	if (!conn || !conn->request)
 		return -EFAULT;
 
-	RHset_command(&RHmessage, "DATA");
-	RHset_payload(&RHmessage, buf, len);
-	ret = RHmsg_send_cmd(&RHmessage, request);
-	if (ret)
-		return ret;
+	/* As before, legacy remotes get the chunks of copyimage() */
+	if (!conn->windowed) {
+		struct RHmsg RHmessage;
+
+		RHset_command(&RHmessage, "DATA");
+		RHset_payload(&RHmessage, buf, len);
+		ret = RHmsg_send_cmd(&RHmessage, conn->request);
+		if (ret)
+			return ret;
+		conn->sent++;
+
+		return RHmsg_get_ack(conn, false);
+	}
 
-	ret = RHmsg_get_ack(&RHmessage, request);
+	while (len) {
+		n = min((size_t)len, conn->chunk_size - conn->fill);
+		memcpy(conn->buf + conn->fill, data, n);
+		conn->fill += n;
+		data += n;
+		len -= n;
+		if (conn->fill == conn->chunk_size) {
+			ret = forward_chunk(conn);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Send the last chunk and wait until the
+ * remote has acknowledged all of them
+ */
+static int forward_flush(struct remote_conn *conn)
+{
+	int ret;
+
+	ret = forward_chunk(conn);
+	while (!ret && conn->acked < conn->sent)
+		ret = RHmsg_get_ack(conn, false);
 
 	return ret;
 }
@@ -147,13 +322,42 @@ static int install_remote_image(struct img_type *img,
 	void __attribute__ ((__unused__)) *data)
 {
 	void *context = zmq_ctx_new();
-	void *request = zmq_socket (context, ZMQ_REQ);
-	char *connect_string;
+	void *request = zmq_socket (context, ZMQ_DEALER);
+	char *connect_string = NULL;
+	char *value;
 	int len;
 	int ret = 0;
+	int linger = 0;
 	struct RHmsg RHmessage;
+	struct remote_conn conn;
 	char bufcmd[80];
 
+	memset(&conn, 0, sizeof(conn));
+	conn.request = request;
+	conn.window = REMOTE_WINDOW;
+	conn.chunk_size = REMOTE_CHUNK_SIZE;
+
+	value = dict_get_value(&img->properties, "remote-window");
+	if (value) {
+		conn.window = strtoul(value, NULL, 10);
+		if (!conn.window || conn.window > REMOTE_MAX_WINDOW) {
+			ERROR("remote-window must be between 1 and %d",
+				REMOTE_MAX_WINDOW);
+			ret = -EINVAL;
+			goto cleanup;
+		}
+	}
+	value = dict_get_value(&img->properties, "remote-chunk-size");
+	if (value) {
+		conn.chunk_size = ustrtoull(value, 0);
+		if (!conn.chunk_size || conn.chunk_size > REMOTE_MAX_CHUNK_SIZE) {
+			ERROR("remote-chunk-size must be between 1 and %d bytes",
+				REMOTE_MAX_CHUNK_SIZE);
+			ret = -EINVAL;
+			goto cleanup;
+		}
+	}
+
 	len = strlen(img->type_data) + strlen(CONFIG_SOCKET_REMOTE_HANDLER_DIRECTORY) + strlen("ipc://") + 4;
 
 	/*
@@ -162,11 +366,15 @@ static int install_remote_image(struct img_type *img,
 	connect_string = malloc(len);
 	if (!connect_string) {
 		ERROR("Not enough memory");
-		return -ENOMEM;
+		ret = -ENOMEM;
+		goto cleanup;
 	}
 	snprintf(connect_string, len, "ipc://%s%s", CONFIG_SOCKET_REMOTE_HANDLER_DIRECTORY,
 			img->type_data);
 
+	/* Do not wait for undelivered chunks when the update fails */
+	zmq_setsockopt(request, ZMQ_LINGER, &linger, sizeof(linger));
+
 	ret = zmq_connect(request, connect_string);
 	if (ret < 0) {
 		ERROR("Connection with %s cannot be established",
@@ -178,26 +386,53 @@ static int install_remote_image(struct img_type *img,
 	/* Initialize default timeout */
 	timeout = REMOTE_IPC_TIMEOUT;
 
-	/* Send initialization string */
+	/*
+	 * Send initialization string, the windowed mode is proposed
+	 * in the body: legacy remotes ignore it and answer just ACK.
+	 */
 	snprintf(bufcmd, sizeof(bufcmd), "INIT:%lld", img->size);
 	RHset_command(&RHmessage, bufcmd);
-	RHset_payload(&RHmessage, NULL, 0);
-	RHmsg_send_cmd(&RHmessage, request);
-	if (RHmsg_get_ack(&RHmessage, request))
-		return -ENODEV;
+	snprintf(bufcmd, sizeof(bufcmd), "WINDOW=%u:CHUNK=%zu",
+		 conn.window, conn.chunk_size);
+	RHset_payload(&RHmessage, bufcmd, strlen(bufcmd));
+	if (RHmsg_send_cmd(&RHmessage, request) ||
+	    RHmsg_get_ack(&conn, true)) {
+		ret = -ENODEV;
+		goto cleanup;
+	}
 
-	ret = copyimage(request, img, forward_data);
+	if (conn.windowed) {
+		conn.buf = malloc(conn.chunk_size);
+		if (!conn.buf) {
+			ret = -ENOMEM;
+			goto cleanup;
+		}
+		TRACE("Remote %s: window %u, chunks of %zu bytes",
+			img->type_data, conn.window, conn.chunk_size);
+	} else
+		conn.window = 1;
+
+	ret = copyimage(&conn, img, forward_data);
+	if (!ret && conn.windowed)
+		ret = forward_flush(&conn);
 
 cleanup:
+	free(conn.buf);
+	free(connect_string);
 	zmq_close(request);
 	zmq_ctx_destroy(context);
 
 	return ret;
 }
 
+static const struct handler_caps remote_caps = {
+	.flags = HANDLER_CAP_STREAM,
+	.concurrency = HANDLER_EXCLUSIVE,
+};
+
 __attribute__((constructor))
 void remote_handler(void)
 {
-	register_handler("remote", install_remote_image,
-				IMAGE_HANDLER, NULL);
+	register_handler_caps("remote", install_remote_image,
+				IMAGE_HANDLER, NULL, &remote_caps);
 }
@@ -51,16 +51,60 @@
 
 void swuforward_handler(void);
 
+/*
+ * Default for the maximum amount of data that a connection
+ * can be behind the fastest one, see "forward-max-lag"
+ */
+#define DEFAULT_MAX_LAG		(4 * 1024 * 1024)
+
+/*
+ * What to do with a connection that is too slow:
+ * wait for it, drop it or go on writing its data to a file
+ */
+enum lag_policy {
+	LAG_WAIT,
+	LAG_DROP,
+	LAG_SPILL
+};
+
+enum conn_state {
+	CONN_ACTIVE,	/* reading from the chunk pool */
+	CONN_SPILLED,	/* reading from its own file */
+	CONN_DONE,	/* transfer completed */
+	CONN_DROPPED	/* transfer aborted */
+};
+
+/*
+ * Chunks of the SWU are shared by all connections and
+ * freed when all of them have sent it.
+ */
+struct fwd_chunk {
+	char *data;
+	size_t len;
+	unsigned long long offset;	/* in SWU */
+	unsigned int refs;
+	TAILQ_ENTRY(fwd_chunk) next;
+};
+TAILQ_HEAD(chunkqueue, fwd_chunk);
+
 /*
  * Track each connection
  * The handler maintains a list of connections and sends the SWU
- * to all of them at once.
+ * to all of them at once. Each connection has its own cursor
+ * in the chunk pool.
  */
 struct curlconn {
 	CURL *curl_handle;	/* CURL handle for posting image */
-	const void *buffer;	/* temporary buffer to transfer image */
-	unsigned int nbytes;	/* bytes to be transferred per iteration */
-	size_t total_bytes;	/* size of SWU image */
+	struct curl_slist *headerlist;
+	struct hnd_priv *priv;
+	enum conn_state state;
+	bool paused;		/* no data available, curl is paused */
+	struct fwd_chunk *chunk;	/* chunk to be sent, NULL if none yet */
+	size_t pos;		/* offset in chunk */
+	unsigned long long sent;	/* bytes passed to curl */
+	int spill_fd;		/* file with data for a slow connection */
+	unsigned long long spill_start;	/* SWU offset of file start */
+	unsigned long long spill_len;
 	char *url;		/* URL for forwarding */
 	bool gotMsg;		/* set if the remote board has sent a new msg */
 	RECOVERY_STATUS SWUpdateStatus;	/* final status of update */
@@ -76,95 +120,336 @@ struct hnd_priv {
 	CURLM *cm;		/* libcurl multi handle */
 	unsigned int maxwaitms;	/* maximum time in CURL wait */
 	size_t size;		/* size of SWU */
+	unsigned long long received;	/* bytes read from SWU */
+	struct chunkqueue chunks;	/* chunk pool */
+	size_t pool_bytes;
+	size_t max_lag;
+	enum lag_policy policy;
+	int still_running;
 	struct listconns conns;	/* list of connections */
 };
 
+static void release_chunk(struct hnd_priv *priv, struct fwd_chunk *chunk)
+{
+	struct fwd_chunk *first;
+
+	if (chunk->refs)
+		chunk->refs--;
+
+	/* Chunks are released in order, free the head of the pool */
+	while ((first = TAILQ_FIRST(&priv->chunks)) != NULL && !first->refs) {
+		TAILQ_REMOVE(&priv->chunks, first, next);
+		priv->pool_bytes -= first->len;
+		free(first->data);
+		free(first);
+	}
+}
+
+/*
+ * The connection does not read from the pool anymore,
+ * release all chunks it has not sent yet
+ */
+static void release_conn(struct hnd_priv *priv, struct curlconn *conn)
+{
+	struct fwd_chunk *chunk = conn->chunk, *tmp;
+
+	if (conn->state != CONN_ACTIVE)
+		return;
+
+	while (chunk) {
+		tmp = TAILQ_NEXT(chunk, next);
+		release_chunk(priv, chunk);
+		chunk = tmp;
+	}
+	conn->chunk = NULL;
+}
+
+static void drop_conn(struct hnd_priv *priv, struct curlconn *conn, const char *why)
+{
+	ERROR("Forwarding to %s aborted: %s", conn->url, why);
+	release_conn(priv, conn);
+	curl_multi_remove_handle(priv->cm, conn->curl_handle);
+	conn->state = CONN_DROPPED;
+}
+
+/*
+ * Move a slow connection out of the pool, the data it has
+ * still to send is written to a file in TMPDIR
+ */
+static int spill_conn(struct hnd_priv *priv, struct curlconn *conn)
+{
+	struct fwd_chunk *chunk;
+	char *fname;
+	int ret = 0;
+
+	if (asprintf(&fname, "%sswuforwardXXXXXX", get_tmpdir()) == ENOMEM_ASPRINTF)
+		return -ENOMEM;
+	conn->spill_fd = mkstemp(fname);
+	if (conn->spill_fd < 0) {
+		ERROR("Cannot create %s: %s", fname, strerror(errno));
+		free(fname);
+		return -EIO;
+	}
+	unlink(fname);
+	free(fname);
+
+	conn->spill_start = conn->sent;
+	conn->spill_len = 0;
+	for (chunk = conn->chunk; chunk && !ret; chunk = TAILQ_NEXT(chunk, next)) {
+		size_t skip = (chunk == conn->chunk) ? conn->pos : 0;
+		ret = copy_write(&conn->spill_fd, chunk->data + skip,
+				 chunk->len - skip);
+		conn->spill_len += chunk->len - skip;
+	}
+	if (ret) {
+		ERROR("Cannot write data for %s to disk", conn->url);
+		close(conn->spill_fd);
+		conn->spill_fd = -1;
+		return -EIO;
+	}
+
+	release_conn(priv, conn);
+	conn->state = CONN_SPILLED;
+	TRACE("Forwarding to %s is too slow, buffering on disk", conn->url);
+
+	return 0;
+}
+
 /*
  * CURL callback when posting data
- * Read from connection buffer and copy to CURL buffer
+ * Copy data from the connection's cursor to CURL buffer
  */
 static size_t curl_read_data(void *buffer, size_t size, size_t nmemb, void *userp)
 {
 	struct curlconn *conn = (struct curlconn *)userp;
-	size_t nbytes;
+	size_t nbytes = size * nmemb, n, copied = 0;
+	ssize_t ret;
 
 	if (!nmemb)
 		return 0;
 	if (!userp) {
 		ERROR("Failure IPC stream file descriptor ");
-		return -EFAULT;
+		return CURL_READFUNC_ABORT;
 	}
 
-	if (conn->nbytes > (nmemb * size))
-		nbytes = nmemb * size;
-	else
-		nbytes = conn->nbytes;
+	if (conn->state == CONN_SPILLED) {
+		n = min((unsigned long long)nbytes,
+			conn->spill_start + conn->spill_len - conn->sent);
+		if (n) {
+			ret = pread(conn->spill_fd, buffer, n,
+				    conn->sent - conn->spill_start);
+			if (ret <= 0)
+				return CURL_READFUNC_ABORT;
+			copied = ret;
+		}
+	} else {
+		while (conn->chunk && copied < nbytes) {
+			n = min(nbytes - copied, conn->chunk->len - conn->pos);
+			memcpy((char *)buffer + copied, conn->chunk->data + conn->pos, n);
+			copied += n;
+			conn->pos += n;
+			if (conn->pos == conn->chunk->len) {
+				struct fwd_chunk *chunk = conn->chunk;
+				conn->chunk = TAILQ_NEXT(chunk, next);
+				conn->pos = 0;
+				release_chunk(conn->priv, chunk);
+			}
+		}
+	}
 
-	memcpy(buffer, conn->buffer, nbytes);
+	conn->sent += copied;
+	if (!copied) {
+		conn->paused = true;
+		return CURL_READFUNC_PAUSE;
+	}
 
-	conn->nbytes -=  nbytes;
+	return copied;
+}
 
-	return nmemb;
+static void resume_conn(struct curlconn *conn)
+{
+	if (conn->paused) {
+		conn->paused = false;
+		curl_easy_pause(conn->curl_handle, CURLPAUSE_CONT);
+	}
 }
 
 /*
- * This is the copyimage's callback. When called,
- * there is a buffer to be passed to curl connections
+ * Let curl send data and collect connections that have finished
  */
-static int swu_forward_data(void *data, const void *buf, unsigned int len)
+static int run_transfers(struct hnd_priv *priv, bool wait)
 {
-	struct hnd_priv *priv = (struct hnd_priv *)data;
-	int ret, still_running = 0;
-
 	struct curlconn *conn;
-	LIST_FOREACH(conn, &priv->conns, next) {
-		conn->nbytes += len;
-		conn->buffer = buf;
+	int msgs_left = 0, numfds = 0;
+	CURLMsg *msg;
+	CURLMcode ret;
+
+	if (wait) {
+		ret = curl_multi_wait(priv->cm, NULL, 0, priv->maxwaitms, &numfds);
+		if (ret != CURLM_OK) {
+			ERROR("curl_multi_wait() returns %d", ret);
+			return FAILURE;
+		}
 	}
 
-	do {
-		int ready = 1;
+	curl_multi_perform(priv->cm, &priv->still_running);
+
+	while ((msg = curl_multi_info_read(priv->cm, &msgs_left))) {
+		long http_status_code = 0;
 
+		if (msg->msg != CURLMSG_DONE)
+			continue;
 		LIST_FOREACH(conn, &priv->conns, next) {
-			if (conn->nbytes > 0) {
-				ready = 0;
+			if (conn->curl_handle == msg->easy_handle)
 				break;
-			}
 		}
-
-		/*
-		 * Buffer transferred to all connections,
-		 * just returns and wait for next
-		 */
-		if (ready)
-			break;
-
-		int numfds=0;
-		ret = curl_multi_wait(priv->cm, NULL, 0, priv->maxwaitms, &numfds);
-		if (ret != CURLM_OK) {
-			ERROR("curl_multi_wait() returns %d", ret);
+		if (!conn) {
+			ERROR("curl handle not found in connections");
 			return FAILURE;
 		}
 
-		curl_multi_perform(priv->cm, &still_running);
-	} while (still_running);
+		curl_easy_getinfo(conn->curl_handle, CURLINFO_RESPONSE_CODE,
+				  &http_status_code);
+		if (msg->data.result != CURLE_OK || http_status_code != 200 ||
+		    conn->sent != priv->size) {
+			ERROR("Sending SWU to %s failed: %s, HTTP %ld",
+				conn->url, curl_easy_strerror(msg->data.result),
+				http_status_code);
+			drop_conn(priv, conn, "transfer failed");
+			continue;
+		}
+		release_conn(priv, conn);
+		curl_multi_remove_handle(priv->cm, conn->curl_handle);
+		conn->state = CONN_DONE;
+	}
 
-	if (!still_running) {
+	return 0;
+}
+
+/*
+ * Handle connections that are more than max_lag behind
+ * the data read from the SWU
+ */
+static int check_lag(struct hnd_priv *priv)
+{
+	struct curlconn *conn;
+	bool lagging;
+	int ret;
+
+	do {
+		lagging = false;
 		LIST_FOREACH(conn, &priv->conns, next) {
-			/* check if the buffer was transfered */
-			if (conn->nbytes) {
-				ERROR("Connection lost, data not transferred");
+			if (conn->state != CONN_ACTIVE ||
+			    priv->received - conn->sent <= priv->max_lag)
+				continue;
+			switch (priv->policy) {
+			case LAG_WAIT:
+				lagging = true;
+				break;
+			case LAG_DROP:
+				drop_conn(priv, conn, "too slow");
+				break;
+			case LAG_SPILL:
+				if (spill_conn(priv, conn))
+					drop_conn(priv, conn, "cannot buffer data");
+				break;
 			}
-			conn->total_bytes += len - conn->nbytes;
-			if (conn->total_bytes != priv->size) {
-				ERROR("Connection lost, SWU not transferred");
-				return -EIO;
+		}
+		if (!lagging)
+			break;
+		ret = run_transfers(priv, true);
+		if (ret)
+			return ret;
+	} while (priv->still_running);
+
+	return 0;
+}
+
+/*
+ * This is the copyimage's callback. The buffer is added to
+ * the chunk pool and the connections go on at their own pace.
+ */
+static int swu_forward_data(void *data, const void *buf, unsigned int len)
+{
+	struct hnd_priv *priv = (struct hnd_priv *)data;
+	struct fwd_chunk *chunk;
+	struct curlconn *conn;
+	unsigned int refs = 0;
+	int ret;
+
+	LIST_FOREACH(conn, &priv->conns, next) {
+		if (conn->state == CONN_ACTIVE)
+			refs++;
+	}
+
+	if (refs) {
+		chunk = (struct fwd_chunk *)calloc(1, sizeof(*chunk));
+		if (!chunk || !(chunk->data = malloc(len))) {
+			free(chunk);
+			ERROR("FAULT: no memory");
+			return -ENOMEM;
+		}
+		memcpy(chunk->data, buf, len);
+		chunk->len = len;
+		chunk->offset = priv->received;
+		chunk->refs = refs;
+		TAILQ_INSERT_TAIL(&priv->chunks, chunk, next);
+		priv->pool_bytes += len;
+
+		LIST_FOREACH(conn, &priv->conns, next) {
+			if (conn->state == CONN_ACTIVE && !conn->chunk)
+				conn->chunk = chunk;
+		}
+	}
+
+	LIST_FOREACH(conn, &priv->conns, next) {
+		if (conn->state == CONN_SPILLED) {
+			if (copy_write(&conn->spill_fd, buf, len)) {
+				drop_conn(priv, conn, "cannot buffer data");
+				continue;
 			}
+			conn->spill_len += len;
 		}
-		ERROR("Connection lost, skipping data");
+		if (conn->state == CONN_ACTIVE || conn->state == CONN_SPILLED)
+			resume_conn(conn);
 	}
+	priv->received += len;
 
-	return 0;
+	ret = run_transfers(priv, false);
+	if (ret)
+		return ret;
+
+	return check_lag(priv);
+}
+
+/*
+ * The whole SWU was read, wait until all connections have sent it
+ */
+static int swu_forward_complete(struct hnd_priv *priv)
+{
+	struct curlconn *conn;
+	int ret = 0;
+
+	while (!ret && priv->still_running) {
+		LIST_FOREACH(conn, &priv->conns, next)
+			resume_conn(conn);
+		ret = run_transfers(priv, true);
+	}
+	if (ret)
+		return ret;
+
+	/* Collect the last messages */
+	ret = run_transfers(priv, false);
+
+	LIST_FOREACH(conn, &priv->conns, next) {
+		if (conn->state != CONN_DONE) {
+			if (conn->state != CONN_DROPPED)
+				drop_conn(priv, conn, "connection lost");
+			ret = FAILURE;
+		}
+	}
+
+	return ret;
 }
 
 static json_object *parse_reqstatus(json_object *reply, const char **json_path)
@@ -265,6 +550,11 @@ static int retrieve_msgs(struct hnd_priv *priv, bool ignore)
 
 	LIST_FOREACH(conn, &priv->conns, next) {
 		int count = 0;
+
+		if (conn->state == CONN_DROPPED) {
+			result = -1;
+			continue;
+		}
 		do {
 			ret = get_answer(conn, &conn->SWUpdateStatus, ignore);
 			if (!conn->gotMsg) {
@@ -291,11 +581,11 @@ static int install_remote_swu(struct img_type *img,
 {
 	struct hnd_priv priv;
 	struct curlconn *conn;
-	int ret, still_running = 0;
+	struct fwd_chunk *chunk;
+	int ret, result;
 	struct dict_list_elem *url;
-	struct curl_slist *headerlist;
-	CURLMsg *msg = NULL;
 	struct dict_list *urls;
+	char *value;
 
 	/*
 	 * A single SWU can contains encrypted artifacts,
@@ -318,8 +608,33 @@ static int install_remote_swu(struct img_type *img,
 		return -EINVAL;
 	}
 
-	/* Reset list of connections */
+	memset(&priv, 0, sizeof(priv));
+	priv.max_lag = DEFAULT_MAX_LAG;
+	priv.policy = LAG_WAIT;
+
+	value = dict_get_value(&img->properties, "forward-max-lag");
+	if (value) {
+		priv.max_lag = ustrtoull(value, 0);
+		if (errno || !priv.max_lag) {
+			ERROR("Wrong forward-max-lag %s, it must be a size > 0", value);
+			return -EINVAL;
+		}
+	}
+	value = dict_get_value(&img->properties, "forward-lag-policy");
+	if (value) {
+		if (!strcmp(value, "drop"))
+			priv.policy = LAG_DROP;
+		else if (!strcmp(value, "spill"))
+			priv.policy = LAG_SPILL;
+		else if (strcmp(value, "wait")) {
+			ERROR("Unknown forward-lag-policy %s", value);
+			return -EINVAL;
+		}
+	}
+
+	/* Reset list of connections and chunk pool */
 	LIST_INIT(&priv.conns);
+	TAILQ_INIT(&priv.chunks);
 
 	/* initialize CURL */
 	ret = curl_global_init(CURL_GLOBAL_DEFAULT);
@@ -341,19 +656,21 @@ static int install_remote_swu(struct img_type *img,
 			goto handler_exit;
 		}
 
-		headerlist = NULL;
-
+		conn->priv = &priv;
+		conn->spill_fd = -1;
 		conn->curl_handle = curl_easy_init();
 		conn->url = url->value;
+		LIST_INSERT_HEAD(&priv.conns, conn, next);
 
 		if (!conn->curl_handle) {
 			/* something very bad, it should never happen */
 			ERROR("FAULT: no handle from libcurl");
-			return FAILURE;
+			ret = FAILURE;
+			goto handler_exit;
 		}
 
 		snprintf(curlheader, sizeof(curlheader), "%s%s", CUSTOM_HEADER, img->fname);
-		headerlist = curl_slist_append(headerlist, curlheader);
+		conn->headerlist = curl_slist_append(NULL, curlheader);
 
 		if ((curl_easy_setopt(conn->curl_handle, CURLOPT_POST, 1L) != CURLE_OK) ||
 		    (curl_easy_setopt(conn->curl_handle, CURLOPT_READFUNCTION,
@@ -362,10 +679,10 @@ static int install_remote_swu(struct img_type *img,
 				      conn) !=CURLE_OK) ||
 	    	    (curl_easy_setopt(conn->curl_handle, CURLOPT_USERAGENT,
 			      "libcurl-agent/1.0") != CURLE_OK) ||
-		    (curl_easy_setopt(conn->curl_handle, CURLOPT_POSTFIELDSIZE,
-				      img->size)!=CURLE_OK) || 
+		    (curl_easy_setopt(conn->curl_handle, CURLOPT_POSTFIELDSIZE_LARGE,
+				      (curl_off_t)img->size)!=CURLE_OK) ||
 		    (curl_easy_setopt(conn->curl_handle, CURLOPT_HTTPHEADER,
-				      headerlist) != CURLE_OK)) { 
+				      conn->headerlist) != CURLE_OK)) {
 			ERROR("curl set_option was not successful");
 			ret = FAILURE;
 			goto handler_exit;
@@ -387,12 +704,11 @@ static int install_remote_swu(struct img_type *img,
 		}
 		free(posturl);
 		curl_multi_add_handle(priv.cm, conn->curl_handle);
-		LIST_INSERT_HEAD(&priv.conns, conn, next);
 	}
 
 	retrieve_msgs(&priv, true);
 
-	curl_multi_perform(priv.cm, &still_running);
+	curl_multi_perform(priv.cm, &priv.still_running);
 
 	ret = copyimage(&priv, img, swu_forward_data);
 
@@ -404,61 +720,50 @@ static int install_remote_swu(struct img_type *img,
 	/*
 	 * Now checks if transfer was successful
 	 */
-	int msgs_left = 0;
-	while ((msg = curl_multi_info_read(priv.cm, &msgs_left))) {
-		CURL *eh = NULL;
-		int http_status_code=0;
-		if (msg->msg != CURLMSG_DONE) {
-			ERROR("curl_multi_info_read(), CURLMsg=%d", msg->msg);
-			ret = FAILURE;
-			break;
-		}
-		LIST_FOREACH(conn, &priv.conns, next) {
-			if (conn->curl_handle == msg->easy_handle) {
-				eh = conn->curl_handle;
-				break;
-			}
-		}
-
-		if (!eh) {
-			ERROR("curl handle not found in connections");
-			ret = FAILURE;
-			break;
-		}
-
-		curl_easy_getinfo(eh, CURLINFO_RESPONSE_CODE, &http_status_code);
-
-		if (http_status_code != 200) {
-			ERROR("Sending %s to %s failed with %d",
-				img->fname, conn->url, http_status_code);
-			ret = FAILURE;
-			break;
-		}
-	}
+	ret = swu_forward_complete(&priv);
 
 	/*
-	 * Now check if remote updates were successful
+	 * Now check if remote updates were successful,
+	 * also if some of them were dropped
 	 */
-	if (!ret) {
-		ret = retrieve_msgs(&priv, false);
-	}
+	result = retrieve_msgs(&priv, false);
+	if (!ret)
+		ret = result;
 
 handler_exit:
-	LIST_FOREACH(conn, &priv.conns, next) {
+	while (!LIST_EMPTY(&priv.conns)) {
+		conn = LIST_FIRST(&priv.conns);
 		LIST_REMOVE(conn, next);
-		curl_multi_remove_handle(priv.cm, conn->curl_handle);
-		curl_easy_cleanup(conn->curl_handle);
+		if (conn->curl_handle) {
+			curl_multi_remove_handle(priv.cm, conn->curl_handle);
+			curl_easy_cleanup(conn->curl_handle);
+		}
+		curl_slist_free_all(conn->headerlist);
+		if (conn->spill_fd >= 0)
+			close(conn->spill_fd);
 		free(conn);
 	}
 
+	while ((chunk = TAILQ_FIRST(&priv.chunks)) != NULL) {
+		TAILQ_REMOVE(&priv.chunks, chunk, next);
+		free(chunk->data);
+		free(chunk);
+	}
+
 	curl_multi_cleanup(priv.cm);
 
 	return ret;
 }
 
+/* curl_global_init() is not thread safe */
+static const struct handler_caps swuforward_caps = {
+	.flags = HANDLER_CAP_STREAM,
+	.concurrency = HANDLER_EXCLUSIVE,
+};
+
 __attribute__((constructor))
 void swuforward_handler(void)
 {
-	register_handler("swuforward", install_remote_swu,
-				IMAGE_HANDLER, NULL);
+	register_handler_caps("swuforward", install_remote_swu,
+				IMAGE_HANDLER, NULL, &swuforward_caps);
 }
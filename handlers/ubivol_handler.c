@@ -13,6 +13,8 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
 
 #include <mtd/mtd-user.h>
 #include "swupdate.h"
@@ -128,6 +130,254 @@ static int swap_volnames(libubi_t libubi,
 	return ubi_rnvols(libubi, masternode, &rnvol);
 }
 
+/*
+ * Output used while streaming into a UBI volume.
+ *
+ * Data coming from the copy pipeline is accumulated into buffers
+ * of a whole LEB, so that each write() on the volume node
+ * fills complete eraseblocks. Two buffers are used: while one
+ * is written by a separate thread, the pipeline can go on
+ * decrypting / decompressing into the other one.
+ *
+ * The kernel refuses to write more than the number of bytes
+ * declared in ubi_update_start(), so check it here to report
+ * a clear error if the decoded stream does not match the
+ * declared size.
+ */
+struct ubi_update_out {
+	int fdout;
+	long long bytes;
+	long long written;
+
+	unsigned char *buf[2];
+	size_t bufsize;
+	size_t fill;
+	int active;
+
+	pthread_t writer;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned char *pending;
+	size_t pending_len;
+	bool busy;
+	bool stop;
+	bool failed;
+};
+
+static void *ubi_volume_writer(void *data)
+{
+	struct ubi_update_out *uout = (struct ubi_update_out *)data;
+	unsigned char *buf;
+	size_t len;
+	int ret;
+
+	pthread_mutex_lock(&uout->lock);
+	for (;;) {
+		while (!uout->busy && !uout->stop)
+			pthread_cond_wait(&uout->cond, &uout->lock);
+		if (!uout->busy)
+			break;
+		buf = uout->pending;
+		len = uout->pending_len;
+		pthread_mutex_unlock(&uout->lock);
+
+		ret = copy_write(&uout->fdout, buf, len);
+
+		pthread_mutex_lock(&uout->lock);
+		if (ret < 0)
+			uout->failed = true;
+		uout->busy = false;
+		pthread_cond_broadcast(&uout->cond);
+	}
+	pthread_mutex_unlock(&uout->lock);
+
+	return NULL;
+}
+
+/*
+ * Pass the active buffer to the writer thread and switch
+ * to the other one. It waits until the previous write is done.
+ */
+static int ubi_volume_submit(struct ubi_update_out *uout)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&uout->lock);
+	while (uout->busy)
+		pthread_cond_wait(&uout->cond, &uout->lock);
+	if (uout->failed) {
+		ret = -1;
+	} else if (uout->fill) {
+		uout->pending = uout->buf[uout->active];
+		uout->pending_len = uout->fill;
+		uout->busy = true;
+		pthread_cond_broadcast(&uout->cond);
+	}
+	pthread_mutex_unlock(&uout->lock);
+
+	uout->active ^= 1;
+	uout->fill = 0;
+
+	return ret;
+}
+
+static int ubi_volume_write(void *out, const void *buf, unsigned int len)
+{
+	struct ubi_update_out *uout = (struct ubi_update_out *)out;
+	const unsigned char *src = buf;
+	size_t n;
+
+	if (uout->written + len > uout->bytes) {
+		ERROR("Image larger than declared size (%lld bytes)",
+			uout->bytes);
+		return -1;
+	}
+
+	if (!uout->bufsize) {
+		if (copy_write(&uout->fdout, buf, len) < 0)
+			return -1;
+		uout->written += len;
+		return 0;
+	}
+
+	uout->written += len;
+	while (len) {
+		n = min(uout->bufsize - uout->fill, (size_t)len);
+		memcpy(uout->buf[uout->active] + uout->fill, src, n);
+		uout->fill += n;
+		src += n;
+		len -= n;
+		if (uout->fill == uout->bufsize && ubi_volume_submit(uout) < 0) {
+			ERROR("Writing into UBI volume failed");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Set up buffering of whole LEBs. If this is not possible,
+ * data is written unbuffered as it comes from the pipeline.
+ */
+static void ubi_volume_out_init(struct ubi_update_out *uout, int fdout,
+				long long bytes, int leb_size)
+{
+	memset(uout, 0, sizeof(*uout));
+	uout->fdout = fdout;
+	uout->bytes = bytes;
+
+	if (leb_size <= 0)
+		return;
+
+	uout->buf[0] = malloc(leb_size);
+	uout->buf[1] = malloc(leb_size);
+	if (!uout->buf[0] || !uout->buf[1])
+		goto no_buffering;
+
+	pthread_mutex_init(&uout->lock, NULL);
+	pthread_cond_init(&uout->cond, NULL);
+	if (pthread_create(&uout->writer, NULL, ubi_volume_writer, uout)) {
+		pthread_mutex_destroy(&uout->lock);
+		pthread_cond_destroy(&uout->cond);
+		goto no_buffering;
+	}
+	uout->bufsize = leb_size;
+
+	return;
+
+no_buffering:
+	WARN("Cannot allocate LEB buffers, writing unbuffered");
+	free(uout->buf[0]);
+	free(uout->buf[1]);
+	uout->buf[0] = uout->buf[1] = NULL;
+}
+
+/*
+ * Write the last (partial) buffer, wait for the writer
+ * thread and release the resources.
+ */
+static int ubi_volume_out_finish(struct ubi_update_out *uout)
+{
+	int ret = 0;
+
+	if (!uout->bufsize)
+		return 0;
+
+	ret = ubi_volume_submit(uout);
+
+	pthread_mutex_lock(&uout->lock);
+	while (uout->busy)
+		pthread_cond_wait(&uout->cond, &uout->lock);
+	if (uout->failed)
+		ret = -1;
+	uout->stop = true;
+	pthread_cond_broadcast(&uout->cond);
+	pthread_mutex_unlock(&uout->lock);
+
+	pthread_join(uout->writer, NULL);
+	pthread_mutex_destroy(&uout->lock);
+	pthread_cond_destroy(&uout->cond);
+	free(uout->buf[0]);
+	free(uout->buf[1]);
+
+	return ret;
+}
+
+/*
+ * Compute the number of bytes that will be written into the volume.
+ * The UBI API requires this before the update is started, but it is
+ * unknown for compressed or encrypted images until the whole stream
+ * has been decoded. In these cases the size must be declared in
+ * sw-description with the "decompressed-size" property (for any
+ * combination of compression and encryption) or with the
+ * "decrypted-size" property for images that are encrypted only.
+ */
+static int get_volume_update_size(struct img_type *img, long long *bytes)
+{
+	char *size_str = NULL;
+	const char *prop = NULL;
+
+	*bytes = img->size;
+
+	if (!img->compressed && !img->is_encrypted)
+		return 0;
+
+	size_str = dict_get_value(&img->properties, "decompressed-size");
+	if (size_str) {
+		prop = "decompressed-size";
+	} else if (!img->compressed) {
+		size_str = dict_get_value(&img->properties, "decrypted-size");
+		prop = "decrypted-size";
+	}
+
+	if (!size_str) {
+		ERROR("%s image %s requires the \"decompressed-size\" property",
+			img->compressed ? "Compressed" : "Encrypted",
+			img->fname);
+		return -1;
+	}
+
+	*bytes = ustrtoull(size_str, 0);
+	if (errno) {
+		ERROR("%s argument: ustrtoull failed", prop);
+		return -1;
+	}
+
+	if (img->is_encrypted && !img->compressed && *bytes < AES_BLOCK_SIZE) {
+		ERROR("Encrypted image size (%lld) too small", *bytes);
+		return -1;
+	}
+
+	TRACE("Image is %s%s%s, final size %lld bytes",
+		img->compressed ? "compressed" : "",
+		(img->compressed && img->is_encrypted) ? " and " : "",
+		img->is_encrypted ? "encrypted" : "",
+		*bytes);
+
+	return 0;
+}
+
 static int update_volume(libubi_t libubi, struct img_type *img,
 	struct ubi_vol_info *vol)
 {
@@ -136,30 +386,11 @@ static int update_volume(libubi_t libubi, struct img_type *img,
 	char node[64];
 	int err;
 	char sbuf[128];
-	char *decrypted_size_str = NULL;
 	struct ubi_vol_info *repl_vol;
+	struct ubi_update_out uout;
 
-	bytes = img->size;
-	if (img->is_encrypted) {
-
-		decrypted_size_str = dict_get_value(&img->properties, "decrypted-size");
-
-		bytes = ustrtoull(decrypted_size_str, 0);
-		if (errno){
-			ERROR("decrypted-size argument: ustrtoull failed");
-			return -1;
-		}
-
-		if (img->compressed) {
-			ERROR("Decryption of compressed UBI images not supported");
-			return -1;
-		}
-		if (bytes < AES_BLOCK_SIZE) {
-			ERROR("Encrypted image size (%lld) too small", bytes);
-			return -1;
-		}
-		TRACE("Image is crypted, decrypted size %lld bytes", bytes);
-	}
+	if (get_volume_update_size(img, &bytes))
+		return -1;
 
 	if (!libubi) {
 		ERROR("Request to write into UBI, but no UBI on system");
@@ -203,6 +434,7 @@ static int update_volume(libubi_t libubi, struct img_type *img,
 	err = ubi_update_start(libubi, fdout, bytes);
 	if (err) {
 		ERROR("cannot start volume \"%s\" update", node);
+		close(fdout);
 		return -1;
 	}
 
@@ -212,13 +444,19 @@ static int update_volume(libubi_t libubi, struct img_type *img,
 
 	TRACE("Updating UBI : %s %lld",
 			img->fname, img->size);
-	if (copyimage(&fdout, img, NULL) < 0) {
+	ubi_volume_out_init(&uout, fdout, bytes, vol->leb_size);
+	err = copyimage(&uout, img, ubi_volume_write);
+	if (ubi_volume_out_finish(&uout) < 0 || err < 0) {
 		ERROR("Error copying extracted file");
 		err = -1;
+	} else if (uout.written != bytes) {
+		ERROR("Image %s has %lld bytes, but %lld were declared",
+			img->fname, uout.written, bytes);
+		err = -1;
 	}
 
 	/* handle replace */
-	if(repl_vol) {
+	if (!err && repl_vol) {
 		err = swap_volnames(libubi, vol, repl_vol);
 		if(err)
 			ERROR("replace: failed to swap volume names %s<->%s: %d",
@@ -252,132 +490,322 @@ static int install_ubivol_image(struct img_type *img,
 
 }
 
-static int adjust_volume(struct img_type *cfg,
-	void __attribute__ ((__unused__)) *data)
+/*
+ * Repartitioning of a UBI device
+ *
+ * All "partitions" entries for the same MTD device are collected and
+ * compared with the volumes found on the device. A plan is computed,
+ * so that each volume is touched only once:
+ *  - volumes with the same size and type are left untouched
+ *  - dynamic volumes with a different size are resized in place
+ *  - volumes changing type are dropped and created again
+ *  - missing volumes are created
+ * Operations freeing space (remove, shrink) run before the ones
+ * consuming space (grow, create), and the plan is checked against
+ * the available LEBs before anything is changed on the device.
+ */
+struct ubi_plan_entry {
+	struct img_type *cfg;
+	struct ubi_part *vol;	/* existing volume, NULL if none */
+	int vol_type;
+	unsigned int requested_lebs;
+	unsigned int allocated_lebs;
+	bool remove;
+	bool resize;
+	bool create;
+};
+
+static int get_mtd_from_cfg(struct img_type *cfg)
 {
-	struct flash_description *nandubi = get_flash_info();
-	struct ubi_part *ubivol;
-	struct ubi_mkvol_request req;
-	struct mtd_ubi_info *mtd_info;
-	int mtdnum, req_vol_type;
-	char node[64];
-	int err;
 	struct flash_description *flash = get_flash_info();
+	int mtdnum;
 
-	/* determine the requested volume type */
-	if (!strcmp(cfg->type_data, "static"))
-		req_vol_type = UBI_STATIC_VOLUME;
-	else
-		req_vol_type = UBI_DYNAMIC_VOLUME;
-
-	/*
-	 * Partition are adjusted only in one MTD device
-	 * Other MTD are not touched
-	 */
 	mtdnum = get_mtd_from_device(cfg->device);
 	if (mtdnum < 0) {
 		/* Allow device to be specified by name OR number */
 		mtdnum = get_mtd_from_name(cfg->device);
 	}
-	if (mtdnum < 0 || !mtd_dev_present(flash->libmtd, mtdnum)) {
-		ERROR("%s does not exist: partitioning not possible",
-			cfg->device);
+	if (mtdnum < 0 || !mtd_dev_present(flash->libmtd, mtdnum))
 		return -ENODEV;
+
+	return mtdnum;
+}
+
+static bool is_ubi_partition(struct img_type *img)
+{
+	return img->is_partitioner && !strcmp(img->type, "ubipartition");
+}
+
+/*
+ * Collect all partition entries for the MTD device. If cfg
+ * is not the first entry for the device, the device was already
+ * repartitioned and nothing must be done.
+ */
+static int ubi_plan_collect(struct img_type *cfg, int mtdnum,
+			    struct ubi_plan_entry **pentries)
+{
+	struct swupdate_cfg *sw = get_swupdate_cfg();
+	struct ubi_plan_entry *entries;
+	struct img_type *img, *first = NULL;
+	bool listed = false;
+	int count = 0, i = 0;
+
+	LIST_FOREACH(img, &sw->images, next) {
+		if (!is_ubi_partition(img) || get_mtd_from_cfg(img) != mtdnum)
+			continue;
+		if (!first)
+			first = img;
+		if (img == cfg)
+			listed = true;
+		count++;
 	}
 
-	mtd_info = &nandubi->mtd_info[mtdnum];
+	if (listed && first != cfg)
+		return 0;
 
-	/*
-	 * Search for volume with the same name
-	 */
-	ubivol = mtd_info->ubi_partitions.lh_first;
-	for(ubivol = mtd_info->ubi_partitions.lh_first;
-		ubivol != NULL;
-		ubivol = ubivol->next.le_next) {
-		if (strcmp(ubivol->vol_info.name, cfg->volname) == 0) {
-			break;
+	/* Not called from sw-description, just adjust this volume */
+	if (!listed)
+		count = 1;
+
+	entries = (struct ubi_plan_entry *)calloc(count, sizeof(*entries));
+	if (!entries) {
+		ERROR("No memory: malloc failed");
+		return -ENOMEM;
+	}
+
+	if (!listed) {
+		entries[0].cfg = cfg;
+	} else {
+		LIST_FOREACH(img, &sw->images, next) {
+			if (is_ubi_partition(img) && get_mtd_from_cfg(img) == mtdnum)
+				entries[i++].cfg = img;
 		}
 	}
 
-	if (ubivol) {
-		unsigned int requested_lebs, allocated_lebs;
+	*pentries = entries;
+	return count;
+}
 
-		/* This should never happen, the fields are filled by scan_ubi */
-		if (!mtd_info->dev_info.leb_size) {
-			return -EFAULT;
+static int ubi_plan_compute(struct mtd_ubi_info *mtd_info,
+			    struct ubi_plan_entry *entries, int count)
+{
+	unsigned int leb_size = mtd_info->dev_info.leb_size;
+	long long needed_lebs = 0;
+	struct ubi_plan_entry *e;
+	int i, j;
+
+	/* This should never happen, the fields are filled by scan_ubi */
+	if (!leb_size)
+		return -EFAULT;
+
+	for (i = 0; i < count; i++) {
+		e = &entries[i];
+
+		for (j = 0; j < i; j++) {
+			if (!strcmp(entries[j].cfg->volname, e->cfg->volname)) {
+				ERROR("Volume %s is listed twice for %s",
+					e->cfg->volname, e->cfg->device);
+				return -EINVAL;
+			}
 		}
 
-		/* Check if size is changed */
-		requested_lebs = cfg->partsize / mtd_info->dev_info.leb_size +
-			((cfg->partsize % mtd_info->dev_info.leb_size) ? 1 : 0);
-		allocated_lebs = ubivol->vol_info.rsvd_bytes / mtd_info->dev_info.leb_size;
+		/* determine the requested volume type */
+		if (!strcmp(e->cfg->type_data, "static"))
+			e->vol_type = UBI_STATIC_VOLUME;
+		else
+			e->vol_type = UBI_DYNAMIC_VOLUME;
+
+		e->requested_lebs = e->cfg->partsize / leb_size +
+			((e->cfg->partsize % leb_size) ? 1 : 0);
+		e->vol = search_volume(e->cfg->volname,
+				       &mtd_info->ubi_partitions);
+
+		if (!e->vol) {
+			e->create = true;
+			needed_lebs += e->requested_lebs;
+			continue;
+		}
 
-		if (requested_lebs == allocated_lebs &&
-		    req_vol_type == ubivol->vol_info.type) {
+		e->allocated_lebs = e->vol->vol_info.rsvd_bytes / leb_size;
+		if (e->requested_lebs == e->allocated_lebs &&
+		    e->vol_type == e->vol->vol_info.type) {
 			TRACE("skipping volume %s (same size and type)",
-			      ubivol->vol_info.name);
-			return 0;
+			      e->cfg->volname);
+			continue;
 		}
 
-		snprintf(node, sizeof(node), "/dev/ubi%d", ubivol->vol_info.dev_num);
-		err = ubi_rmvol(nandubi->libubi, node, ubivol->vol_info.vol_id);
-		if (err) {
-			ERROR("Volume %s cannot be dropped", ubivol->vol_info.name);
-			return -1;
+		/*
+		 * Static volumes cannot be shrunk below the data
+		 * they contain, so they are always created again
+		 */
+		if (e->vol_type == e->vol->vol_info.type &&
+		    e->vol_type == UBI_DYNAMIC_VOLUME) {
+			e->resize = true;
+		} else {
+			e->remove = true;
+			e->create = true;
 		}
-		TRACE("Removed UBI Volume %s", ubivol->vol_info.name);
+		needed_lebs += (long long)e->requested_lebs - e->allocated_lebs;
+	}
 
-		LIST_REMOVE(ubivol, next);
-		free(ubivol);
+	if (needed_lebs > mtd_info->dev_info.avail_lebs) {
+		ERROR("New layout on %s needs %lld LEBs more, only %d available",
+			entries[0].cfg->device, needed_lebs,
+			mtd_info->dev_info.avail_lebs);
+		return -ENOSPC;
 	}
 
-	/* We do not need a volume to get the right node */
-	snprintf(node, sizeof(node), "/dev/ubi%d", mtd_info->dev_info.dev_num);
+	return 0;
+}
+
+static int ubi_plan_remove(libubi_t libubi, const char *node,
+			   struct ubi_plan_entry *e)
+{
+	int err;
+
+	err = ubi_rmvol(libubi, node, e->vol->vol_info.vol_id);
+	if (err) {
+		ERROR("Volume %s cannot be dropped", e->vol->vol_info.name);
+		return -1;
+	}
+	TRACE("Removed UBI Volume %s", e->cfg->volname);
+
+	return 0;
+}
+
+static int ubi_plan_resize(libubi_t libubi, const char *node,
+			   struct ubi_plan_entry *e)
+{
+	int err;
+
+	err = ubi_rsvol(libubi, node, e->vol->vol_info.vol_id,
+			e->cfg->partsize);
+	if (err) {
+		ERROR("cannot resize UBI volume %s to %lld bytes",
+			e->cfg->volname, e->cfg->partsize);
+		return -1;
+	}
+	TRACE("Resized UBI volume %s to %lld bytes (old size %lld)",
+	      e->cfg->volname, e->cfg->partsize,
+	      e->vol->vol_info.rsvd_bytes);
+
+	return 0;
+}
+
+static int ubi_plan_create(libubi_t libubi, const char *node,
+			   struct ubi_plan_entry *e)
+{
+	struct ubi_mkvol_request req;
+	int err;
 
 	/*
-	 * Creates all other partitions as specified in the description file
 	 * Volumes are empty, and they are filled later by the update procedure
 	 */
 	memset(&req, 0, sizeof(req));
-	req.vol_type = req_vol_type;
+	req.vol_type = e->vol_type;
 	req.vol_id = UBI_VOL_NUM_AUTO;
 	req.alignment = 1;
-	req.bytes = cfg->partsize;
-	req.name = cfg->volname;
-	err = ubi_mkvol(nandubi->libubi, node, &req);
+	req.bytes = e->cfg->partsize;
+	req.name = e->cfg->volname;
+	err = ubi_mkvol(libubi, node, &req);
 	if (err < 0) {
 		ERROR("cannot create %s UBI volume %s of %lld bytes",
-		      (req_vol_type == UBI_DYNAMIC_VOLUME) ? "dynamic" : "static",
+		      (req.vol_type == UBI_DYNAMIC_VOLUME) ? "dynamic" : "static",
 			req.name, req.bytes);
 		return err;
 	}
+	TRACE("Created %s UBI volume %s of %lld bytes",
+	      (req.vol_type == UBI_DYNAMIC_VOLUME) ? "dynamic" : "static",
+	      req.name, req.bytes);
 
-	ubivol = (struct ubi_part *)calloc(1, sizeof(struct ubi_part));
-	if (!ubivol) {
-		ERROR("No memory: malloc failed");
-		return -ENOMEM;
+	return 0;
+}
+
+static int ubi_plan_apply(libubi_t libubi, struct mtd_ubi_info *mtd_info,
+			  struct ubi_plan_entry *entries, int count)
+{
+	char node[64];
+	struct ubi_plan_entry *e;
+	int i, err = 0;
+
+	snprintf(node, sizeof(node), "/dev/ubi%d", mtd_info->dev_info.dev_num);
+
+	/* first release space: removed and shrunk volumes */
+	for (i = 0; i < count && !err; i++) {
+		e = &entries[i];
+		if (e->remove)
+			err = ubi_plan_remove(libubi, node, e);
+		else if (e->resize && e->requested_lebs < e->allocated_lebs)
+			err = ubi_plan_resize(libubi, node, e);
 	}
-	err = ubi_get_vol_info1(nandubi->libubi,
-		mtd_info->dev_info.dev_num, req.vol_id,
-		&ubivol->vol_info);
-	if (err) {
-		ERROR("cannot get information about "
-			"newly created UBI volume");
-		return err;
+
+	/* then consume it: grown and new volumes */
+	for (i = 0; i < count && !err; i++) {
+		e = &entries[i];
+		if (e->resize && e->requested_lebs > e->allocated_lebs)
+			err = ubi_plan_resize(libubi, node, e);
+		else if (e->create)
+			err = ubi_plan_create(libubi, node, e);
 	}
-	LIST_INSERT_HEAD(&mtd_info->ubi_partitions, ubivol, next);
-	TRACE("Created %s UBI volume %s of %lld bytes (old size %lld)",
-	      (req_vol_type == UBI_DYNAMIC_VOLUME) ? "dynamic" : "static",
-	      req.name, req.bytes, ubivol->vol_info.rsvd_bytes);
 
-	return 0;
+	return err;
+}
+
+static int adjust_volume(struct img_type *cfg,
+	void __attribute__ ((__unused__)) *data)
+{
+	struct flash_description *flash = get_flash_info();
+	struct ubi_plan_entry *entries = NULL;
+	struct mtd_ubi_info *mtd_info;
+	int mtdnum, count, err;
+
+	/*
+	 * Partition are adjusted only in one MTD device
+	 * Other MTD are not touched
+	 */
+	mtdnum = get_mtd_from_cfg(cfg);
+	if (mtdnum < 0) {
+		ERROR("%s does not exist: partitioning not possible",
+			cfg->device);
+		return -ENODEV;
+	}
+
+	mtd_info = &flash->mtd_info[mtdnum];
+
+	count = ubi_plan_collect(cfg, mtdnum, &entries);
+	if (count <= 0)
+		return count;
+
+	err = ubi_plan_compute(mtd_info, entries, count);
+	if (!err)
+		err = ubi_plan_apply(flash->libubi, mtd_info, entries, count);
+
+	/*
+	 * Read the new layout back in one pass, even after a failure,
+	 * to keep the volume list in sync with the device
+	 */
+	if (ubi_rescan_volumes(mtdnum) && !err) {
+		ERROR("cannot get information about UBI volumes on %s",
+			cfg->device);
+		err = -EFAULT;
+	}
+
+	free(entries);
+
+	return err;
 }
 
+/* volumes of a MTD device are changed through the same libubi */
+static const struct handler_caps ubivol_caps = {
+	.flags = HANDLER_CAP_STREAM,
+	.concurrency = HANDLER_EXCLUSIVE,
+};
+
 __attribute__((constructor))
 void ubi_handler(void)
 {
-	register_handler("ubivol", install_ubivol_image,
-				IMAGE_HANDLER, NULL);
+	register_handler_caps("ubivol", install_ubivol_image,
+				IMAGE_HANDLER, NULL, &ubivol_caps);
 	register_handler("ubipartition", adjust_volume,
 				PARTITION_HANDLER, NULL);
 }
@@ -39,6 +39,24 @@
  * the modulo-256 sum over all bytes of the message
  * string except for the start marker "$".
  *
+ * Protocol extension (opt-in with the properties "window", "binary"
+ * and "baudrate"):
+ * - the handler sends $PROG;WIN=<n>;BIN;BAUD=<rate>;<<CS>><CR><LF>
+ *   with the requested features only.
+ * - the microcontroller answers with $READY; followed by the
+ *   features it accepts, e.g. $READY;WIN=4;BIN;<<CS>><CR><LF>.
+ *   A plain $READY; means that the extension is not supported.
+ * - if BAUD was accepted, both sides switch to the new baud rate,
+ *   the handler sends $SYNC;<<CS>><CR><LF> and the microcontroller
+ *   confirms with $READY;<<CS>><CR><LF>.
+ * - up to WIN packages are sent before waiting for $READY;, the
+ *   microcontroller answers to each package in order.
+ * - with BIN, each package is sent as binary frame instead of ASCII:
+ *   '#' <len MSB> <len LSB> <records> <CS>
+ *   where records are the binary content of the Intel HEX records
+ *   (count, address, type, data, checksum) and CS is the two's
+ *   complement of the modulo-256 sum of the records.
+ *
  * The handler expects to get in the properties the setup for the reset
  * and prog gpios. They should be in this format:
  *
@@ -79,6 +97,8 @@
 #define RESET_CONSUMER	"swupdate-uc-handler"
 #define PROG_CONSUMER	RESET_CONSUMER
 #define DEFAULT_TIMEOUT 2
+#define MAX_WINDOW	64
+#define PACKAGE_SIZE	1024
 
 void ucfw_handler(void);
 
@@ -105,10 +125,49 @@ struct handler_priv {
 	int fduart;
 	bool debug;
 	unsigned int timeout;
-	char buf[1024];	/* enough for 3 records */
+	char buf[PACKAGE_SIZE];	/* enough for 3 records */
 	unsigned int nbytes;
+	/* protocol extension */
+	uint8_t frame[PACKAGE_SIZE / 2 + 4];	/* binary package */
+	unsigned int window;
+	bool binary;
+	unsigned int baudrate;
+	unsigned int inflight;	/* packages sent, not yet acknowledged */
+	bool completed;
+	char rxbuf[256];	/* received, not yet parsed */
+	unsigned int rxlen;
+};
+
+static const struct {
+	unsigned int rate;
+	speed_t speed;
+} baudrates[] = {
+	{ 115200, B115200 },
+	{ 230400, B230400 },
+	{ 460800, B460800 },
+	{ 921600, B921600 },
+#ifdef B1000000
+	{ 1000000, B1000000 },
+#endif
+#ifdef B2000000
+	{ 2000000, B2000000 },
+#endif
+#ifdef B3000000
+	{ 3000000, B3000000 },
+#endif
 };
 
+static speed_t get_speed(unsigned int rate)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(baudrates); i++)
+		if (baudrates[i].rate == rate)
+			return baudrates[i].speed;
+
+	return B0;
+}
+
 static int switch_mode(char *devreset, int resoffset, char *devprog, int progoffset, int mode)
 {
 	struct gpiod_chip *chipreset, *chipprog;
@@ -235,7 +294,7 @@ static int insert_chksum(char *buf, unsigned int len)
 	return len;
 }
 
-static int set_uart (int fd)
+static int set_uart (int fd, speed_t speed)
 {
 	struct termios tty;
 
@@ -244,8 +303,8 @@ static int set_uart (int fd)
 		return -1;
 	}
 
-	 cfsetospeed (&tty, (speed_t) B115200);
-	 cfsetispeed (&tty, (speed_t) B115200);
+	 cfsetospeed (&tty, speed);
+	 cfsetispeed (&tty, speed);
 
 	 tty.c_cflag |= (CLOCAL | CREAD);	/* ignore modem controls */
 	 tty.c_cflag &= ~CSIZE;
@@ -303,45 +362,75 @@ static void dump_ascii(bool rxdir, char *buf, int count)
 	free(outbuf);
 }
 
-static int receive_msg(int fd, char *rx, size_t size,
-			unsigned int timeout, bool debug)
+/*
+ * Get the next message from the microcontroller. More messages
+ * can arrive with a single read when packages are pipelined,
+ * so data after the first <LF> is kept for the next call.
+ */
+static int receive_msg(struct handler_priv *priv, char *rx, size_t size)
 {
 	fd_set fds;
 	struct timeval tv;
 	int ret;
 	unsigned int count;
+	char *eol;
 
-	/* Initialize structures for select */
-	FD_ZERO(&fds);
-	FD_SET(fd, &fds);
+	while (!(eol = memchr(priv->rxbuf, '\n', priv->rxlen))) {
+		if (priv->rxlen == sizeof(priv->rxbuf)) {
+			ERROR("Message from microcontroller too long");
+			priv->rxlen = 0;
+			return -EBADMSG;
+		}
 
-	/*
-	 * Microcontrolle answers very fast,
-	 * Timeout is just to take care if no answer is
-	 * sent
-	 */
-	tv.tv_sec = timeout;
-	tv.tv_usec = 0; /* Check for not more as 10 mSec */
+		/* Initialize structures for select */
+		FD_ZERO(&fds);
+		FD_SET(priv->fduart, &fds);
+
+		/*
+		 * Microcontrolle answers very fast,
+		 * Timeout is just to take care if no answer is
+		 * sent
+		 */
+		tv.tv_sec = priv->timeout;
+		tv.tv_usec = 0;
 
-	ret = select(fd + 1, &fds, NULL, NULL, &tv);
-	if (ret == 0) {
-		ERROR("Timeout, no answer from microcontroller");
-		return -EPROTO;
+		ret = select(priv->fduart + 1, &fds, NULL, NULL, &tv);
+		if (ret == 0) {
+			ERROR("Timeout, no answer from microcontroller");
+			return -EPROTO;
+		}
+
+		ret = read(priv->fduart, priv->rxbuf + priv->rxlen,
+			   sizeof(priv->rxbuf) - priv->rxlen);
+		if (ret <= 0) {
+			ERROR("Error in read: %d", ret);
+			return -EBADMSG;
+		}
+		priv->rxlen += ret;
 	}
 
-	ret = read(fd, rx, size);
-	if (ret < 3) {
-		ERROR("Error in read: %d", ret);
+	count = eol - priv->rxbuf + 1;
+	if (count >= size) {
+		ERROR("Message from microcontroller too long");
+		priv->rxlen = 0;
 		return -EBADMSG;
 	}
-	count = ret;
+	memcpy(rx, priv->rxbuf, count);
+	rx[count] = '\0';
+	priv->rxlen -= count;
+	memmove(priv->rxbuf, priv->rxbuf + count, priv->rxlen);
 
-	if (debug)
+	if (priv->debug)
 		dump_ascii(true, rx, count);
 
 	/*
 	 * Try some syntax check
 	 */
+	if (count < 3) {
+		ERROR("Message too short: %d bytes", count);
+		return -EBADMSG;
+	}
+
 	if (rx[0] != '$') {
 		ERROR("First byte is not '$' but '%c'", rx[0]);
 		return -EBADMSG;
@@ -370,16 +459,86 @@ static int write_msg(int fd, const char *msg)
 {
 	int len, ret;
 	char *buf;
+	size_t size = strlen(msg);
 
-	buf = strdup(msg);
+	/* room for checksum and CR/LF */
+	buf = malloc(size + 5);
+	if (!buf)
+		return -ENOMEM;
+	memcpy(buf, msg, size + 1);
 
-	len = insert_chksum(buf, strlen(buf));
+	len = insert_chksum(buf, size);
 	ret = write_data(fd, buf, len);
 	free(buf);
 	return ret;
 }
 
-static int prepare_update(struct handler_priv *priv, 
+/*
+ * Parse the answer to an extended $PROG; request and keep
+ * only the features accepted by the microcontroller
+ */
+static int parse_ready(struct handler_priv *priv, char *msg)
+{
+	unsigned int window = 1, baudrate = 0;
+	bool binary = false;
+	char *saveptr = NULL;
+	char *tok;
+
+	if (strncmp(msg, "$READY;", strlen("$READY;")))
+		return -EBADMSG;
+
+	for (tok = strtok_r(msg + strlen("$READY;"), ";", &saveptr); tok;
+	     tok = strtok_r(NULL, ";", &saveptr)) {
+		if (!strncmp(tok, "WIN=", 4))
+			window = strtoul(tok + 4, NULL, 10);
+		else if (!strcmp(tok, "BIN"))
+			binary = true;
+		else if (!strncmp(tok, "BAUD=", 5))
+			baudrate = strtoul(tok + 5, NULL, 10);
+		else
+			WARN("Unknown feature from microcontroller: %s", tok);
+	}
+
+	if (window < 1 || window > priv->window)
+		window = 1;
+	if (binary && !priv->binary)
+		binary = false;
+	if (baudrate && baudrate != priv->baudrate)
+		baudrate = 0;
+
+	priv->window = window;
+	priv->binary = binary;
+	priv->baudrate = baudrate;
+
+	return 0;
+}
+
+static int switch_baudrate(struct handler_priv *priv)
+{
+	char msg[128];
+	int ret;
+
+	/* $READY; for the extended $PROG; must be sent with the old speed */
+	tcdrain(priv->fduart);
+	if (set_uart(priv->fduart, get_speed(priv->baudrate)) < 0)
+		return -EFAULT;
+	priv->rxlen = 0;
+
+	ret = write_msg(priv->fduart, "$SYNC;");
+	if (ret < 0)
+		return ret;
+
+	ret = receive_msg(priv, msg, sizeof(msg));
+	if (ret < 0 || strcmp(msg, "$READY;")) {
+		ERROR("No answer from microcontroller at %u baud",
+			priv->baudrate);
+		return -EBADMSG;
+	}
+
+	return 0;
+}
+
+static int prepare_update(struct handler_priv *priv,
 			  struct img_type *img)
 {
 	int ret;
@@ -401,62 +560,180 @@ static int prepare_update(struct handler_priv *priv,
 		return -ENODEV;
 	}
 
-	set_uart(priv->fduart);
+	set_uart(priv->fduart, B115200);
 
 	/* No FW data to be sent */
 	priv->nbytes = 0;
 
+	if (priv->window > 1 || priv->binary || priv->baudrate) {
+		len = snprintf(msg, sizeof(msg) - 4, "$PROG;");
+		if (priv->window > 1)
+			len += snprintf(&msg[len], sizeof(msg) - 4 - len,
+					"WIN=%u;", priv->window);
+		if (priv->binary)
+			len += snprintf(&msg[len], sizeof(msg) - 4 - len,
+					"BIN;");
+		if (priv->baudrate)
+			len += snprintf(&msg[len], sizeof(msg) - 4 - len,
+					"BAUD=%u;", priv->baudrate);
+		write_msg(priv->fduart, msg);
+
+		len = receive_msg(priv, msg, sizeof(msg));
+		if (len < 0 || parse_ready(priv, msg))
+			return -EBADMSG;
+
+		TRACE("Microcontroller accepted window %u, %s records, baudrate %u",
+			priv->window, priv->binary ? "binary" : "ASCII",
+			priv->baudrate ? priv->baudrate : 115200);
+		if (priv->baudrate)
+			return switch_baudrate(priv);
+
+		return 0;
+	}
+
 	write_msg(priv->fduart, "$PROG;");
 
-	len = receive_msg(priv->fduart, msg, sizeof(msg), priv->timeout, priv->debug);
+	len = receive_msg(priv, msg, sizeof(msg));
 	if (len < 0 || strcmp(msg, "$READY;"))
 		return -EBADMSG;
 
 	return 0;
 }
 
+/*
+ * Wait for the answer to the oldest package in flight
+ */
+static int wait_ack(struct handler_priv *priv)
+{
+	char msg[80];
+	int ret;
+
+	msg[0] = '\0';
+	ret = receive_msg(priv, msg, sizeof(msg));
+	if (ret < 0)
+		return ret;
+	priv->inflight--;
+	if (!strcmp(msg, "$COMPLETED;")) {
+		priv->completed = true;
+		return 0;
+	}
+	if (strcmp(msg, "$READY;")) {
+		ERROR("Unexpected answer from microcontroller: %s", msg);
+		return -EBADMSG;
+	}
+
+	return 0;
+}
+
+/*
+ * Convert a package of Intel HEX records into a binary frame
+ */
+static int pack_binary(struct handler_priv *priv)
+{
+	unsigned int i, len = 0;
+	uint8_t *out = &priv->frame[3];
+	uint8_t chksum = 0;
+	char *p;
+
+	for (i = 0; i < priv->nbytes; i++) {
+		p = &priv->buf[i];
+		if (*p == ':' || *p == '\r' || *p == '\n')
+			continue;
+		if (i + 1 >= priv->nbytes || !isxdigit(p[0]) || !isxdigit(p[1])) {
+			ERROR("Malformed record in package");
+			return -EINVAL;
+		}
+		out[len] = from_ascii(p, 2, LG_16);
+		chksum += out[len++];
+		i++;
+	}
+
+	priv->frame[0] = '#';
+	priv->frame[1] = (len >> 8) & 0xff;
+	priv->frame[2] = len & 0xff;
+	out[len] = ~chksum + 1;
+
+	return len + 4;
+}
+
+static int send_package(struct handler_priv *priv)
+{
+	int ret;
+
+	if (priv->debug)
+		dump_ascii(false, priv->buf, priv->nbytes);
+	if (priv->binary) {
+		ret = pack_binary(priv);
+		if (ret < 0)
+			return ret;
+		ret = write_data(priv->fduart, (char *)priv->frame, ret);
+	} else
+		ret = write_data(priv->fduart, priv->buf, priv->nbytes);
+	priv->nbytes = 0;
+	if (ret < 0)
+		return ret;
+	priv->inflight++;
+
+	return 0;
+}
+
 static int update_fw(void *data, const void *buffer, unsigned int size)
 {
 	int cnt = 0;
 	char c;
 	int ret;
-	char msg[80];
 	struct handler_priv *priv = (struct handler_priv *)data;
 	const char *buf = (const char *)buffer;
 
 	while (size > 0) {
+		if (priv->completed)
+			return 0;
 		c = buf[cnt++];
+		if (priv->nbytes >= sizeof(priv->buf) - 1) {
+			ERROR("Package too long, missing end of line");
+			return -EINVAL;
+		}
 		priv->buf[priv->nbytes++] = c;
 		size--;
 		if (c == '\n') {
-			/* Send data */
-			if (priv->debug)
-				dump_ascii(false, priv->buf, priv->nbytes);
-			ret = write_data(priv->fduart, priv->buf, priv->nbytes);
-			if (ret < 0)
-				return ret;
-			priv->buf[priv->nbytes] = '\0';
-			msg[0] = '\0';
-			ret = receive_msg(priv->fduart, msg, sizeof(msg),
-					  priv->timeout, priv->debug);
-			priv->nbytes = 0;
-			if (ret < 0) {
-				return ret;
+			/* Send data, as many packages as the window allows */
+			while (priv->inflight >= priv->window && !priv->completed) {
+				ret = wait_ack(priv);
+				if (ret < 0)
+					return ret;
 			}
-			if (!strcmp(msg, "$READY;"))
-				continue;
-			if (!strcmp(msg, "$COMPLETED;"))
+			if (priv->completed)
 				return 0;
+			ret = send_package(priv);
+			if (ret < 0)
+				return ret;
 		}
 	}
 	return 0;
 }
 
+/*
+ * Collect the answers for the packages still in flight
+ */
+static int drain_fw(struct handler_priv *priv)
+{
+	int ret;
+
+	while (priv->inflight > 0 && !priv->completed) {
+		ret = wait_ack(priv);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
 static int finish_update(struct handler_priv *priv)
 {
 	int ret;
 
-	close(priv->fduart);
+	if (priv->fduart >= 0)
+		close(priv->fduart);
 	ret = switch_mode(priv->reset.gpiodev, priv->reset.offset,
 			  priv->prog.gpiodev, priv->prog.offset, MODE_NORMAL);
 	if (ret < 0) {
@@ -515,6 +792,8 @@ static int install_uc_firmware_image(struct img_type *img,
 
 	memset(&hnd_data, 0, sizeof(hnd_data));
 	hnd_data.timeout = DEFAULT_TIMEOUT;
+	hnd_data.fduart = -1;
+	hnd_data.window = 1;
 
 	const char *properties_list[] = { "reset", "prog"};
 
@@ -553,6 +832,37 @@ static int install_uc_firmware_image(struct img_type *img,
 			hnd_data.timeout = strtoul(entry->value, NULL, 10);
 	}
 
+	properties = dict_get_list(&img->properties, "window");
+	if (properties) {
+		entry = LIST_FIRST(properties);
+		if (entry)
+			hnd_data.window = strtoul(entry->value, NULL, 10);
+		if (hnd_data.window < 1 || hnd_data.window > MAX_WINDOW) {
+			ERROR("Window must be between 1 and %d", MAX_WINDOW);
+			return -EINVAL;
+		}
+	}
+
+	properties = dict_get_list(&img->properties, "binary");
+	if (properties) {
+		entry = LIST_FIRST(properties);
+		if (entry && !strcmp(entry->value, "true"))
+			hnd_data.binary = true;
+	}
+
+	properties = dict_get_list(&img->properties, "baudrate");
+	if (properties) {
+		entry = LIST_FIRST(properties);
+		if (entry)
+			hnd_data.baudrate = strtoul(entry->value, NULL, 10);
+		if (hnd_data.baudrate == 115200)
+			hnd_data.baudrate = 0;
+		if (hnd_data.baudrate && get_speed(hnd_data.baudrate) == B0) {
+			ERROR("Unsupported baudrate %s", entry->value);
+			return -EINVAL;
+		}
+	}
+
 	ret = prepare_update(&hnd_data, img);
 	if (ret) {
 		ERROR("Prepare failed !!");
@@ -560,6 +870,8 @@ static int install_uc_firmware_image(struct img_type *img,
 	}
 
 	ret = copyimage(&hnd_data, img, update_fw);
+	if (!ret)
+		ret = drain_fw(&hnd_data);
 	if (ret) {
 		ERROR("Transferring image to uController was not successful");
 		goto handler_exit;
@@ -572,9 +884,14 @@ handler_exit:
 	return ret;
 }
 
+static const struct handler_caps ucfw_caps = {
+	.flags = HANDLER_CAP_STREAM,
+	.concurrency = HANDLER_PER_DEVICE,
+};
+
 __attribute__((constructor))
 void ucfw_handler(void)
 {
-	register_handler("ucfw", install_uc_firmware_image,
-				IMAGE_HANDLER, NULL);
+	register_handler_caps("ucfw", install_uc_firmware_image,
+				IMAGE_HANDLER, NULL, &ucfw_caps);
 }
@@ -55,6 +55,7 @@ void mtd_cleanup (void);
 int get_mtd_from_device(char *s);
 int get_mtd_from_name(const char *s);
 int flash_erase(int mtdnum);
+int ubi_rescan_volumes(int mtd);
 
 struct flash_description *get_flash_info(void);
 #define isNand(flash, index) \
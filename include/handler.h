@@ -31,16 +31,48 @@ typedef enum {
 #define ANY_HANDLER (IMAGE_HANDLER | FILE_HANDLER | SCRIPT_HANDLER | \
 			BOOTLOADER_HANDLER | PARTITION_HANDLER)
 
+/*
+ * Capabilities of a handler, used by the installer
+ * to decide how images can be installed
+ */
+#define HANDLER_CAP_STREAM	(1 << 0)	/* reads img->fdin sequentially,
+						   it can be a stream or a pipe */
+
+typedef enum {
+	HANDLER_EXCLUSIVE = 0,	/* nothing else runs at the same time */
+	HANDLER_PER_DEVICE,	/* runs with images on other devices */
+	HANDLER_SHARED		/* does not hold any device */
+} HANDLER_CONCURRENCY;
+
+/*
+ * Returns the device an image holds while it is installed,
+ * NULL if the image cannot be installed together with other ones
+ */
+typedef const char *(*handler_device)(struct img_type *img);
+
+struct handler_caps {
+	unsigned int flags;
+	HANDLER_CONCURRENCY concurrency;
+	handler_device device;	/* NULL: device or else path of the image */
+	unsigned int buffer_size;	/* preferred size of the writes, 0 = default */
+	unsigned int alignment;	/* writes are multiples of it, 0 = none */
+};
+
 typedef int (*handler)(struct img_type *img, void *data);
 struct installer_handler{
 	char	desc[64];
 	handler installer;
 	void	*data;
 	unsigned int mask;
+	struct handler_caps caps;
 };
 
 int register_handler(const char *desc, 
 		handler installer, HANDLER_MASK mask, void *data);
+int register_handler_caps(const char *desc, handler installer,
+		HANDLER_MASK mask, void *data, const struct handler_caps *caps);
+const char *get_handler_device(struct installer_handler *hnd,
+		struct img_type *img);
 
 struct installer_handler *find_handler(struct img_type *img);
 void print_registered_handlers(void);
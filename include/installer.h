@@ -18,6 +18,8 @@ int check_if_required(struct imglist *list, struct filehdr *pfdh,
 				struct img_type **pimg);
 int install_images(struct swupdate_cfg *sw, int fdsw, int fromfile);
 int install_single_image(struct img_type *img, int dry_run);
+int install_fanout(struct img_type *imgs[], unsigned int count, int dry_run);
+void release_mounts(struct img_type *imgs[], unsigned int count);
 int postupdate(struct swupdate_cfg *swcfg, const char *info);
 void cleanup_files(struct swupdate_cfg *software);
 
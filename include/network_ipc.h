@@ -16,9 +16,14 @@
  */
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include "swupdate_status.h"
 
 #define IPC_MAGIC		0x14052001
+#define IPC_MAGIC_V2		0x14052002
+#define IPC_VERSION		2
+#define IPC_MAX_FRAME_SIZE	(1024 * 1024)
 
 typedef enum {
 	REQ_INSTALL,
@@ -28,6 +33,11 @@ typedef enum {
 	POST_UPDATE,
 	SWUPDATE_SUBPROCESS,
 	REQ_INSTALL_DRYRUN,
+	IPC_HELLO,
+	REQ_INSTALL_FD,		/* the image is a file descriptor passed */
+	REQ_INSTALL_FD_DRYRUN,	/* with SCM_RIGHTS along the request */
+	SUBSCRIBE,		/* status and notifications are pushed */
+	GET_HISTORY,		/* notifications from a sequence number */
 } msgtype;
 
 enum {
@@ -53,6 +63,17 @@ typedef union {
 				      * with additional information
 				      */
 	} instmsg;
+	struct {
+		int level;	/* notifications up to this level, 0 for all */
+	} subscribe;
+	struct {
+		unsigned int seq;	/* first message wanted / returned */
+		unsigned int next;	/* sequence number of the next message */
+		int current;
+		int error;
+		int level;
+		char desc[2044];	/* does not make msgdata larger */
+	} history;
 } msgdata;
 	
 typedef struct {
@@ -61,20 +82,99 @@ typedef struct {
 	msgdata data;
 } ipc_message;
 
+/*
+ * Protocol version 2: a frame is a header followed by
+ * len bytes of TLV (type, length, value) elements. The
+ * magic tells a frame from the fixed ipc_message, that
+ * is still accepted. Integers are in host byte order.
+ */
+struct ipc_frame_header {
+	uint32_t magic;		/* IPC_MAGIC_V2 */
+	uint32_t type;		/* msgtype */
+	uint32_t len;		/* size of the TLVs */
+};
+
+struct ipc_tlv_header {
+	uint16_t tag;		/* ipc_tag */
+	uint16_t reserved;
+	uint32_t len;		/* size of the value */
+};
+
+typedef enum {
+	IPC_TAG_VERSION = 1,	/* uint32_t, IPC_HELLO only */
+	IPC_TAG_SOURCE,		/* uint32_t */
+	IPC_TAG_CMD,		/* uint32_t */
+	IPC_TAG_TIMEOUT,	/* uint32_t */
+	IPC_TAG_CURRENT,	/* uint32_t */
+	IPC_TAG_LAST_RESULT,	/* uint32_t */
+	IPC_TAG_ERROR,		/* uint32_t */
+	IPC_TAG_DATA,		/* bytes: info, command, status or answer text */
+	IPC_TAG_LEVEL,		/* uint32_t, SUBSCRIBE and GET_HISTORY */
+	IPC_TAG_SEQ,		/* uint32_t, GET_HISTORY only */
+	IPC_TAG_NEXT,		/* uint32_t, GET_HISTORY only */
+} ipc_tag;
+
+typedef struct {
+	int type;
+	int version;
+	sourcetype source;
+	int cmd;
+	int timeout;
+	int current;
+	int last_result;
+	int error;
+	int level;
+	unsigned int seq;
+	unsigned int next;
+	size_t len;
+	char *data;	/* len bytes plus a terminating zero */
+} ipc_frame;
+
+/*
+ * A GET_HISTORY answer in a frame carries in IPC_TAG_DATA the
+ * messages one after the other, each one this header followed
+ * by len bytes of text without terminating zero
+ */
+struct ipc_history_record {
+	uint32_t seq;
+	int32_t status;		/* RECOVERY_STATUS */
+	int32_t error;
+	int32_t level;
+	uint32_t len;
+};
+
+int ipc_frame_read(int fd, ipc_frame *frame);
+int ipc_frame_write(int fd, const ipc_frame *frame);
+char *ipc_frame_build(const ipc_frame *frame, size_t *size);
+int ipc_frame_parse(int type, const char *buf, size_t len, ipc_frame *frame);
+int ipc_frame_from_message(ipc_frame *frame, const ipc_message *msg, int req_type);
+int ipc_frame_to_message(const ipc_frame *frame, ipc_message *msg, int req_type);
+void ipc_frame_free(ipc_frame *frame);
+int ipc_send_cmd_ext(ipc_frame *frame);
+
 int ipc_inst_start(void);
 int ipc_inst_start_ext(sourcetype source, size_t len, const char *info, bool dryrun);
+int ipc_inst_start_fd(int fd, sourcetype source, size_t len, const char *info,
+			bool dryrun);
 int ipc_send_data(int connfd, char *buf, int size);
 void ipc_end(int connfd);
 int ipc_get_status(ipc_message *msg);
 int ipc_postupdate(ipc_message *msg);
 int ipc_send_cmd(ipc_message *msg);
+int ipc_subscribe(int level);
+int ipc_notify_receive(int connfd, ipc_message *msg);
+int ipc_get_history(unsigned int seq, ipc_message *msg);
 
 typedef int (*writedata)(char **buf, int *size);
 typedef int (*getstatus)(ipc_message *msg);
+int ipc_get_history_records(unsigned int seq, unsigned int *next,
+			    getstatus callback);
 typedef int (*terminated)(RECOVERY_STATUS status);
 int ipc_wait_for_complete(getstatus callback);
 int swupdate_image_write(char *buf, int size);
 int swupdate_async_start(writedata wr_func, getstatus status_func,
 				terminated end_func, bool dryrun);
+int swupdate_async_start_fd(int fd, getstatus status_func,
+				terminated end_func, bool dryrun);
 
 #endif
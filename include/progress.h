@@ -18,6 +18,10 @@
  */
 void swupdate_progress_init(unsigned int nsteps);
 void swupdate_progress_update(unsigned int perc);
+void swupdate_progress_bytes(unsigned long long delta, unsigned long long done,
+			     unsigned long long total);
+void swupdate_progress_expected(unsigned long long bytes);
+void swupdate_progress_mute(bool mute);
 void swupdate_progress_inc_step(char *image);
 void swupdate_progress_step_completed(void);
 void swupdate_progress_end(RECOVERY_STATUS status);
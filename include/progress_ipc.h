@@ -31,6 +31,62 @@ struct progress_msg {
 	char		info[2048];   	/* additional information about install */
 };
 
+/*
+ * Extended progress: a client that writes PROGRESS_EXT_REQUEST
+ * on the progress socket receives messages with magic
+ * PROGRESS_EXT_MAGIC, each one followed by a struct progress_ext.
+ * Sizes are in bytes and rates in bytes per second, they are 0
+ * (eta is -1) if not known.
+ */
+#define PROGRESS_EXT_REQUEST	0x45585431	/* "EXT1" */
+#define PROGRESS_EXT_MAGIC	0x45585432
+
+struct progress_ext {
+	unsigned long long cur_bytes;	/* processed in the current step */
+	unsigned long long cur_total;	/* size of the current step */
+	unsigned long long dwl_bytes;	/* SWU data received */
+	unsigned long long inst_bytes;	/* data processed by the handlers */
+	unsigned long long inst_total;	/* inst_bytes at the end */
+	unsigned int	dwl_rate;	/* last sample */
+	unsigned int	dwl_rate_avg;	/* smoothed */
+	unsigned int	inst_rate;	/* last sample */
+	unsigned int	inst_rate_avg;	/* smoothed */
+	int		eta;		/* seconds to the end of the installation */
+	unsigned int	cur_permille;	/* per mille of the current step */
+};
+
+/*
+ * Shared memory progress: a client that writes PROGRESS_SHM_REQUEST
+ * on the progress socket receives a progress_msg with magic
+ * PROGRESS_SHM_MAGIC and, as SCM_RIGHTS, a descriptor for a
+ * struct progress_shm and an eventfd signalled after each update.
+ * msg is valid when seq was even and unchanged while reading it.
+ */
+#define PROGRESS_SHM_REQUEST	0x53484d31	/* "SHM1" */
+#define PROGRESS_SHM_MAGIC	0x53484d32
+
+struct progress_shm {
+	unsigned int	magic;		/* PROGRESS_SHM_MAGIC */
+	unsigned int	seq;		/* odd while msg is written */
+	struct progress_msg msg;
+	struct progress_ext ext;
+};
+
+struct progress_shm_client {
+	int connfd;
+	int eventfd;
+	const struct progress_shm *shm;
+	unsigned int seq;		/* last one read */
+};
+
 int progress_ipc_connect(bool reconnect);
 int progress_ipc_receive(int *connfd, struct progress_msg *msg);
+int progress_ipc_connect_ext(bool reconnect);
+int progress_ipc_receive_ext(int *connfd, struct progress_msg *msg,
+			     struct progress_ext *ext);
+int progress_ipc_shm_connect(bool reconnect, struct progress_shm_client *client);
+int progress_ipc_shm_read(struct progress_shm_client *client,
+			  struct progress_msg *msg, struct progress_ext *ext);
+int progress_ipc_shm_wait(struct progress_shm_client *client, int timeout_ms);
+void progress_ipc_shm_close(struct progress_shm_client *client);
 #endif
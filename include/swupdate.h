@@ -120,6 +120,7 @@ struct swupdate_global_cfg {
 	char current_version[SWUPDATE_GENERAL_STRING_SIZE];
 	int cert_purpose;
 	char forced_signer_name[SWUPDATE_GENERAL_STRING_SIZE];
+	int progress_rate;
 };
 
 struct swupdate_cfg {
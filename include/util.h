@@ -60,6 +60,7 @@ typedef enum {
 typedef enum {
 	CANCELUPDATE=LASTLOGLEVEL + 1,
 	CHANGE,
+	BENCHMARK,
 } NOTIFY_CAUSE;
 
 enum {
@@ -69,6 +70,7 @@ enum {
 
 struct installer {
 	int	fd;			/* install image file handle */
+	int	fromfile;		/* fd is a file, images are read at their offset */
 	RECOVERY_STATUS	status;		/* "idle" or "request source" info */
 	RECOVERY_STATUS	last_install;	/* result from last installation */
 	int	last_error;		/* error code if installation failed */
@@ -83,23 +85,20 @@ typedef void (*notifier) (RECOVERY_STATUS status, int error, int level, const ch
 
 #define swupdate_notify(status, format, level, arg...) do { \
 	if (loglevel >= level) { \
-		char tmpbuf[NOTIFY_BUF_SIZE]; \
 		if (status == FAILURE) { \
 			if (loglevel >= DEBUGLEVEL) \
-				snprintf(tmpbuf, sizeof(tmpbuf), \
+				notifyf(FAILURE, 0, level, \
 				     	"ERROR %s : %s : %d : " format, \
 					       	__FILE__, \
 					       	__func__, \
 					       	__LINE__, \
 						## arg); \
 			else \
-				snprintf(tmpbuf, sizeof(tmpbuf), \
+				notifyf(FAILURE, 0, level, \
 					       	"ERROR : " format, ## arg); \
-			notify(FAILURE, 0, level, tmpbuf); \
 		} else {\
-			snprintf(tmpbuf, sizeof(tmpbuf), \
+			notifyf(RUN, RECOVERY_NO_ERROR, level, \
 				       	"[%s] : " format, __func__, ## arg); \
-			notify(RUN, RECOVERY_NO_ERROR, level, tmpbuf); \
 		} \
 	} \
 } while(0)
@@ -157,6 +156,29 @@ char *sdup(const char *str);
  */
 typedef int (*writeimage) (void *out, const void *buf, unsigned int len);
 
+/*
+ * Statistics of copyimage_stats(), for benchmarks
+ */
+typedef enum {
+	COPY_STAGE_READ,
+	COPY_STAGE_HASH,	/* cpio checksum and sha256 */
+	COPY_STAGE_DECRYPT,
+	COPY_STAGE_INFLATE,
+	COPY_STAGE_CALLBACK,
+	COPY_STAGE_MAX
+} COPY_STAGE;
+
+#define COPY_STATS_BUCKETS	24	/* bucket n: latency < 2^n us */
+
+struct copy_stats {
+	unsigned long long ns[COPY_STAGE_MAX];
+	unsigned long long calls[COPY_STAGE_MAX];
+	unsigned int hist[COPY_STAGE_MAX][COPY_STATS_BUCKETS];
+	unsigned long long bytes_in;	/* read from input */
+	unsigned long long bytes_out;	/* passed to the callback */
+	unsigned long long total_ns;
+};
+
 int openfile(const char *filename);
 int copy_write(void *out, const void *buf, unsigned int len);
 #if defined(__FreeBSD__)
@@ -167,14 +189,22 @@ int copyfile(int fdin, void *out, unsigned int nbytes, unsigned long *offs,
 	int skip_file, int compressed, uint32_t *checksum,
 	unsigned char *hash, int encrypted, writeimage callback);
 int copyimage(void *out, struct img_type *img, writeimage callback);
+int copyimage_stats(void *out, struct img_type *img, writeimage callback,
+		    struct copy_stats *stats);
 int extract_sw_description(int fd, const char *descfile, off_t *offs);
 off_t extract_next_file(int fd, int fdout, off_t start, int compressed,
 			int encrypted, unsigned char *hash);
 int openfileoutput(const char *filename);
+int openfileoutput_tmp(const char *filename, char **tmpname);
+int closefileoutput_tmp(int fdout, char *tmpname, const char *filename,
+			bool commit);
 int mkpath(char *dir, mode_t mode);
 
 int register_notifier(notifier client);
 void notify(RECOVERY_STATUS status, int error, int level, const char *msg);
+void notifyf(RECOVERY_STATUS status, int error, int level,
+	     const char *fmt, ...) __attribute__ ((format (printf, 4, 5)));
+void notify_flush(void);
 void notify_init(void);
 int syslog_init(void);
 
@@ -207,6 +237,14 @@ const char* get_tmpdirscripts(void);
 int swupdate_mount(const char *device, const char *dir, const char *fstype);
 int swupdate_umount(const char *dir);
 
+/* Filesystems kept mounted during an installation */
+const char *swupdate_mount_cached(const char *device, const char *fstype);
+int swupdate_umount_cached(const char *dir);
+void swupdate_mount_cache_release(const char *device);
+bool swupdate_mount_cache_defer_sync(void);
+void swupdate_mount_cache_begin(void);
+int swupdate_mount_cache_end(void);
+
 /* Date / Time utilities */
 char *swupdate_time_iso8601(void);
 #endif
@@ -72,20 +72,542 @@ static int prepare_ipc(void) {
 	return connfd;
 }
 
-int ipc_postupdate(ipc_message *msg) {
-	int connfd = prepare_ipc();
-	if (connfd < 0) {
-		return -1;
+static int read_all(int fd, void *buf, size_t size)
+{
+	size_t offset = 0;
+	ssize_t ret;
+
+	while (offset < size) {
+		ret = read(fd, (char *)buf + offset, size - offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		offset += ret;
 	}
 
+	return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t size)
+{
+	size_t offset = 0;
 	ssize_t ret;
+
+	while (offset < size) {
+		ret = write(fd, (const char *)buf + offset, size - offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		offset += ret;
+	}
+
+	return 0;
+}
+
+static bool is_request(int type)
+{
+	return type == REQ_INSTALL || type == REQ_INSTALL_DRYRUN ||
+		type == REQ_INSTALL_FD || type == REQ_INSTALL_FD_DRYRUN ||
+		type == POST_UPDATE || type == SWUPDATE_SUBPROCESS;
+}
+
+/*
+ * The union in ipc_message is read according to the type of
+ * the message, and for an ACK / NACK to the request it answers:
+ * the subprocesses answer with instmsg, the installer with a text.
+ */
+static bool has_instmsg(int type, int req_type)
+{
+	if (is_request(type))
+		return true;
+	return (type == ACK || type == NACK) && req_type == SWUPDATE_SUBPROCESS;
+}
+
+static int frame_set_data(ipc_frame *frame, const char *data, size_t len)
+{
+	frame->data = (char *)malloc(len + 1);
+	if (!frame->data)
+		return -ENOMEM;
+	memcpy(frame->data, data, len);
+	frame->data[len] = '\0';
+	frame->len = len;
+
+	return 0;
+}
+
+void ipc_frame_free(ipc_frame *frame)
+{
+	free(frame->data);
+	frame->data = NULL;
+	frame->len = 0;
+}
+
+/*
+ * A GET_HISTORY answer carries a message if its sequence
+ * number is before the next one. In a request, next is
+ * equal to seq.
+ */
+static bool history_has_record(const ipc_message *msg)
+{
+	return (int)(msg->data.history.seq - msg->data.history.next) < 0;
+}
+
+static int history_pack(ipc_frame *frame, const ipc_message *msg)
+{
+	struct ipc_history_record rec;
+	char *buf;
+	int ret;
+
+	rec.seq = msg->data.history.seq;
+	rec.status = msg->data.history.current;
+	rec.error = msg->data.history.error;
+	rec.level = msg->data.history.level;
+	rec.len = strnlen(msg->data.history.desc, sizeof(msg->data.history.desc));
+
+	buf = (char *)malloc(sizeof(rec) + rec.len);
+	if (!buf)
+		return -ENOMEM;
+	memcpy(buf, &rec, sizeof(rec));
+	memcpy(buf + sizeof(rec), msg->data.history.desc, rec.len);
+	ret = frame_set_data(frame, buf, sizeof(rec) + rec.len);
+	free(buf);
+
+	return ret;
+}
+
+/*
+ * Copy the message at *offset in the records of a GET_HISTORY
+ * frame into msg. Returns -ENOENT after the last one, -EMSGSIZE
+ * if the text was truncated.
+ */
+static int history_unpack(const ipc_frame *frame, size_t *offset,
+			  ipc_message *msg)
+{
+	struct ipc_history_record rec;
+	size_t len, size = sizeof(msg->data.history.desc) - 1;
+
+	if (*offset >= frame->len)
+		return -ENOENT;
+	if (frame->len - *offset < sizeof(rec))
+		return -EINVAL;
+	memcpy(&rec, frame->data + *offset, sizeof(rec));
+	*offset += sizeof(rec);
+	if (frame->len - *offset < rec.len)
+		return -EINVAL;
+
+	msg->data.history.seq = rec.seq;
+	msg->data.history.current = rec.status;
+	msg->data.history.error = rec.error;
+	msg->data.history.level = rec.level;
+	len = rec.len < size ? rec.len : size;
+	memcpy(msg->data.history.desc, frame->data + *offset, len);
+	msg->data.history.desc[len] = '\0';
+	*offset += rec.len;
+
+	return rec.len > size ? -EMSGSIZE : 0;
+}
+
+int ipc_frame_from_message(ipc_frame *frame, const ipc_message *msg, int req_type)
+{
+	memset(frame, 0, sizeof(*frame));
+	frame->type = msg->type;
+
+	if (msg->type == GET_STATUS) {
+		frame->current = msg->data.status.current;
+		frame->last_result = msg->data.status.last_result;
+		frame->error = msg->data.status.error;
+		return frame_set_data(frame, msg->data.status.desc,
+			strnlen(msg->data.status.desc, sizeof(msg->data.status.desc)));
+	}
+
+	if (msg->type == SUBSCRIBE) {
+		frame->level = msg->data.subscribe.level;
+		return 0;
+	}
+
+	if (msg->type == GET_HISTORY) {
+		frame->seq = msg->data.history.seq;
+		frame->next = msg->data.history.next;
+		frame->current = msg->data.history.current;
+		frame->error = msg->data.history.error;
+		frame->level = msg->data.history.level;
+		if (!history_has_record(msg))
+			return 0;
+		return history_pack(frame, msg);
+	}
+
+	if (has_instmsg(msg->type, req_type)) {
+		size_t len = msg->data.instmsg.len;
+
+		frame->source = msg->data.instmsg.source;
+		frame->cmd = msg->data.instmsg.cmd;
+		frame->timeout = msg->data.instmsg.timeout;
+		/* commands are often sent as a string without len */
+		if (!len)
+			len = strnlen(msg->data.instmsg.buf,
+				      sizeof(msg->data.instmsg.buf));
+		if (len > sizeof(msg->data.instmsg.buf))
+			len = sizeof(msg->data.instmsg.buf);
+		return frame_set_data(frame, msg->data.instmsg.buf, len);
+	}
+
+	return frame_set_data(frame, msg->data.msg,
+			      strnlen(msg->data.msg, sizeof(msg->data.msg)));
+}
+
+/*
+ * Data that does not fit into the message is truncated
+ * and -EMSGSIZE is returned
+ */
+int ipc_frame_to_message(const ipc_frame *frame, ipc_message *msg, int req_type)
+{
+	size_t size, len = frame->len;
+	char *dst;
+
+	memset(msg, 0, sizeof(*msg));
+	msg->magic = IPC_MAGIC;
+	msg->type = frame->type;
+
+	if (frame->type == GET_STATUS) {
+		msg->data.status.current = frame->current;
+		msg->data.status.last_result = frame->last_result;
+		msg->data.status.error = frame->error;
+		dst = msg->data.status.desc;
+		/* keep the terminating zero */
+		size = sizeof(msg->data.status.desc) - 1;
+	} else if (frame->type == SUBSCRIBE) {
+		msg->data.subscribe.level = frame->level;
+		return 0;
+	} else if (frame->type == GET_HISTORY) {
+		size_t offset = 0;
+		int ret;
+
+		msg->data.history.seq = frame->seq;
+		msg->data.history.next = frame->next;
+		msg->data.history.current = frame->current;
+		msg->data.history.error = frame->error;
+		msg->data.history.level = frame->level;
+		/* the first message, if any */
+		ret = history_unpack(frame, &offset, msg);
+		return ret == -ENOENT ? 0 : ret;
+	} else if (has_instmsg(frame->type, req_type)) {
+		msg->data.instmsg.source = frame->source;
+		msg->data.instmsg.cmd = frame->cmd;
+		msg->data.instmsg.timeout = frame->timeout;
+		dst = msg->data.instmsg.buf;
+		size = sizeof(msg->data.instmsg.buf);
+		msg->data.instmsg.len = len < size ? len : size;
+	} else {
+		dst = msg->data.msg;
+		size = sizeof(msg->data.msg) - 1;
+	}
+
+	if (len > size)
+		len = size;
+	if (len)
+		memcpy(dst, frame->data, len);
+
+	return frame->len > size ? -EMSGSIZE : 0;
+}
+
+static char *put_tlv(char *p, ipc_tag tag, const void *value, uint32_t len)
+{
+	struct ipc_tlv_header tlv;
+
+	tlv.tag = tag;
+	tlv.reserved = 0;
+	tlv.len = len;
+	memcpy(p, &tlv, sizeof(tlv));
+	p += sizeof(tlv);
+	if (len)
+		memcpy(p, value, len);
+
+	return p + len;
+}
+
+static char *put_int(char *p, ipc_tag tag, int value)
+{
+	uint32_t v = (uint32_t)value;
+
+	/* zero is the default, it is not sent */
+	if (!value)
+		return p;
+	return put_tlv(p, tag, &v, sizeof(v));
+}
+
+/*
+ * Return the whole frame, header included, to be freed by the caller
+ */
+char *ipc_frame_build(const ipc_frame *frame, size_t *size)
+{
+	struct ipc_frame_header hdr;
+	size_t max;
+	char *buf, *p;
+
+	if (frame->len > IPC_MAX_FRAME_SIZE)
+		return NULL;
+
+	max = sizeof(hdr) + 10 * (sizeof(struct ipc_tlv_header) + sizeof(uint32_t)) +
+		sizeof(struct ipc_tlv_header) + frame->len;
+	buf = (char *)malloc(max);
+	if (!buf)
+		return NULL;
+
+	p = buf + sizeof(hdr);
+	if (frame->type == IPC_HELLO)
+		p = put_int(p, IPC_TAG_VERSION, frame->version);
+	p = put_int(p, IPC_TAG_SOURCE, frame->source);
+	p = put_int(p, IPC_TAG_CMD, frame->cmd);
+	p = put_int(p, IPC_TAG_TIMEOUT, frame->timeout);
+	p = put_int(p, IPC_TAG_CURRENT, frame->current);
+	p = put_int(p, IPC_TAG_LAST_RESULT, frame->last_result);
+	p = put_int(p, IPC_TAG_ERROR, frame->error);
+	p = put_int(p, IPC_TAG_LEVEL, frame->level);
+	p = put_int(p, IPC_TAG_SEQ, frame->seq);
+	p = put_int(p, IPC_TAG_NEXT, frame->next);
+	if (frame->len)
+		p = put_tlv(p, IPC_TAG_DATA, frame->data, frame->len);
+
+	hdr.magic = IPC_MAGIC_V2;
+	hdr.type = frame->type;
+	hdr.len = p - buf - sizeof(hdr);
+	memcpy(buf, &hdr, sizeof(hdr));
+	*size = p - buf;
+
+	return buf;
+}
+
+/*
+ * Parse the TLVs following the header, unknown tags are skipped
+ */
+int ipc_frame_parse(int type, const char *buf, size_t len, ipc_frame *frame)
+{
+	struct ipc_tlv_header tlv;
+	uint32_t value;
+	int *field;
+
+	memset(frame, 0, sizeof(*frame));
+	frame->type = type;
+
+	while (len >= sizeof(tlv)) {
+		memcpy(&tlv, buf, sizeof(tlv));
+		buf += sizeof(tlv);
+		len -= sizeof(tlv);
+		if (tlv.len > len)
+			goto err;
+
+		field = NULL;
+		switch (tlv.tag) {
+		case IPC_TAG_VERSION:
+			field = &frame->version;
+			break;
+		case IPC_TAG_SOURCE:
+			field = (int *)&frame->source;
+			break;
+		case IPC_TAG_CMD:
+			field = &frame->cmd;
+			break;
+		case IPC_TAG_TIMEOUT:
+			field = &frame->timeout;
+			break;
+		case IPC_TAG_CURRENT:
+			field = &frame->current;
+			break;
+		case IPC_TAG_LAST_RESULT:
+			field = &frame->last_result;
+			break;
+		case IPC_TAG_ERROR:
+			field = &frame->error;
+			break;
+		case IPC_TAG_LEVEL:
+			field = &frame->level;
+			break;
+		case IPC_TAG_SEQ:
+			field = (int *)&frame->seq;
+			break;
+		case IPC_TAG_NEXT:
+			field = (int *)&frame->next;
+			break;
+		case IPC_TAG_DATA:
+			ipc_frame_free(frame);
+			if (frame_set_data(frame, buf, tlv.len))
+				goto err;
+			break;
+		}
+		if (field) {
+			if (tlv.len != sizeof(value))
+				goto err;
+			memcpy(&value, buf, sizeof(value));
+			*field = (int)value;
+		}
+		buf += tlv.len;
+		len -= tlv.len;
+	}
+	if (len)
+		goto err;
+
+	return 0;
+
+err:
+	ipc_frame_free(frame);
+	return -EINVAL;
+}
+
+/*
+ * Read a frame, or a fixed ipc_message that is converted
+ * as a request. Returns 0 or a negative error.
+ */
+int ipc_frame_read(int fd, ipc_frame *frame)
+{
+	struct ipc_frame_header hdr;
+	ipc_message msg;
+	char *buf;
+	int ret;
+
+	memset(frame, 0, sizeof(*frame));
+	if (read_all(fd, &hdr, sizeof(hdr)))
+		return -EIO;
+
+	if (hdr.magic == IPC_MAGIC) {
+		memcpy(&msg, &hdr, sizeof(hdr));
+		if (read_all(fd, (char *)&msg + sizeof(hdr), sizeof(msg) - sizeof(hdr)))
+			return -EIO;
+		ret = ipc_frame_from_message(frame, &msg, msg.type);
+		frame->version = 1;
+		return ret;
+	}
+
+	if (hdr.magic != IPC_MAGIC_V2 || hdr.len > IPC_MAX_FRAME_SIZE + 1024)
+		return -EINVAL;
+
+	buf = (char *)malloc(hdr.len ? hdr.len : 1);
+	if (!buf)
+		return -ENOMEM;
+	if (read_all(fd, buf, hdr.len)) {
+		free(buf);
+		return -EIO;
+	}
+	ret = ipc_frame_parse(hdr.type, buf, hdr.len, frame);
+	free(buf);
+	/* IPC_HELLO carries the version proposed by the peer */
+	if (!ret && frame->type != IPC_HELLO)
+		frame->version = 2;
+
+	return ret;
+}
+
+int ipc_frame_write(int fd, const ipc_frame *frame)
+{
+	size_t size;
+	char *buf;
+	int ret;
+
+	buf = ipc_frame_build(frame, &size);
+	if (!buf)
+		return -ENOMEM;
+	ret = write_all(fd, buf, size) ? -EIO : 0;
+	free(buf);
+
+	return ret;
+}
+
+/*
+ * Connect and agree on the protocol version: an installer
+ * that does not know frames drops the connection after the
+ * IPC_HELLO, and the fixed ipc_message is used
+ */
+static int prepare_ipc_versioned(int *version)
+{
+	ipc_frame hello;
+	int connfd;
+
+	connfd = prepare_ipc();
+	if (connfd < 0)
+		return connfd;
+
+	memset(&hello, 0, sizeof(hello));
+	hello.type = IPC_HELLO;
+	hello.version = IPC_VERSION;
+	if (!ipc_frame_write(connfd, &hello) && !ipc_frame_read(connfd, &hello) &&
+	    hello.type == IPC_HELLO && hello.version >= 2) {
+		ipc_frame_free(&hello);
+		*version = 2;
+		return connfd;
+	}
+	ipc_frame_free(&hello);
+	close(connfd);
+
+	*version = 1;
+	return prepare_ipc();
+}
+
+/*
+ * Send a request and wait for the answer, with the
+ * protocol agreed with the installer
+ */
+static int ipc_request(int connfd, int version, ipc_frame *frame)
+{
+	int req_type = frame->type;
+	ipc_message msg;
+	int ret;
+
+	if (version >= 2) {
+		ret = ipc_frame_write(connfd, frame);
+		ipc_frame_free(frame);
+		if (ret)
+			return ret;
+		return ipc_frame_read(connfd, frame);
+	}
+
+	if (ipc_frame_to_message(frame, &msg, req_type))
+		return -EMSGSIZE;
+	ipc_frame_free(frame);
+	if (write_all(connfd, &msg, sizeof(msg)) ||
+	    read_all(connfd, &msg, sizeof(msg)))
+		return -EIO;
+
+	return ipc_frame_from_message(frame, &msg, req_type);
+}
+
+/*
+ * Exchange an ipc_message, the answer replaces it
+ */
+static int ipc_exchange(ipc_message *msg, int *fd)
+{
+	int req_type = msg->type;
+	ipc_frame frame;
+	int version;
+	int connfd;
+	int ret;
+
+	connfd = prepare_ipc_versioned(&version);
+	if (connfd < 0)
+		return -1;
+
+	ret = ipc_frame_from_message(&frame, msg, req_type);
+	if (!ret)
+		ret = ipc_request(connfd, version, &frame);
+	if (!ret)
+		ipc_frame_to_message(&frame, msg, req_type);
+	ipc_frame_free(&frame);
+
+	if (ret || !fd)
+		close(connfd);
+	else
+		*fd = connfd;
+
+	return ret ? -1 : 0;
+}
+
+int ipc_postupdate(ipc_message *msg) {
 	char* tmpbuf = NULL;
 	if (msg->data.instmsg.len > 0) {
 		if ((tmpbuf = strndupa(msg->data.instmsg.buf,
 				msg->data.instmsg.len > sizeof(msg->data.instmsg.buf)
 				    ? sizeof(msg->data.instmsg.buf)
 				    : msg->data.instmsg.len)) == NULL) {
-			close(connfd);
 			return -1;
 		}
 	}
@@ -96,63 +618,98 @@ int ipc_postupdate(ipc_message *msg) {
 	}
 	msg->magic = IPC_MAGIC;
 	msg->type = POST_UPDATE;
-	ret = write(connfd, msg, sizeof(*msg));
-	if (ret != sizeof(*msg)) {
-		close(connfd);
-		return -1;
-	}
-	ret = read(connfd, msg, sizeof(*msg));
-	if (ret <= 0) {
-		close(connfd);
-		return -1;
-	}
 
-	close(connfd);
-	return 0;
+	return ipc_exchange(msg, NULL);
 }
 
-static int __ipc_get_status(int connfd, ipc_message *msg)
+int ipc_get_status(ipc_message *msg)
 {
-	ssize_t ret;
-
 	memset(msg, 0, sizeof(*msg));
 	msg->magic = IPC_MAGIC;
 	msg->type = GET_STATUS;
-	ret = write(connfd, msg, sizeof(*msg));
-	if (ret != sizeof(*msg))
-		return -1;
 
-	ret = read(connfd, msg, sizeof(*msg));
-	if (ret <= 0)
+	return ipc_exchange(msg, NULL);
+}
+
+/*
+ * Read the notifications incrementally: msg returns the oldest
+ * one still kept by SWUpdate from sequence number seq on, with
+ * its own sequence number in data.history.seq (higher than seq
+ * if some were overwritten). The next call asks for seq + 1,
+ * data.history.seq equal to data.history.next means that there
+ * is nothing new yet.
+ */
+int ipc_get_history(unsigned int seq, ipc_message *msg)
+{
+	memset(msg, 0, sizeof(*msg));
+	msg->magic = IPC_MAGIC;
+	msg->type = GET_HISTORY;
+	msg->data.history.seq = seq;
+	msg->data.history.next = seq;
+
+	if (ipc_exchange(msg, NULL))
 		return -1;
 
-	return 0;
+	/* an older SWUpdate does not know GET_HISTORY */
+	return msg->type == GET_HISTORY ? 0 : -1;
 }
 
-int ipc_get_status(ipc_message *msg)
+/*
+ * Read the notifications from sequence number seq on with a
+ * single request: callback gets each message still in the
+ * history, as ipc_get_history() returns it, and *next is the
+ * sequence number to ask for the next time. SWUpdate returns
+ * a limited number of messages at once, and just one with
+ * the fixed ipc_message. Returns the number of messages.
+ */
+int ipc_get_history_records(unsigned int seq, unsigned int *next,
+			    getstatus callback)
 {
-	int ret;
-	int connfd;
+	ipc_message msg;
+	ipc_frame frame;
+	size_t offset = 0;
+	int version, connfd, ret, count = 0;
 
-	connfd = prepare_ipc();
-	if (connfd < 0) {
+	memset(&msg, 0, sizeof(msg));
+	msg.magic = IPC_MAGIC;
+	msg.type = GET_HISTORY;
+	msg.data.history.seq = seq;
+	msg.data.history.next = seq;
+
+	connfd = prepare_ipc_versioned(&version);
+	if (connfd < 0)
 		return -1;
-	}
-	ret = __ipc_get_status(connfd, msg);
+	ret = ipc_frame_from_message(&frame, &msg, GET_HISTORY);
+	if (!ret)
+		ret = ipc_request(connfd, version, &frame);
 	close(connfd);
+	if (ret || frame.type != GET_HISTORY) {
+		/* an older SWUpdate does not know GET_HISTORY */
+		ipc_frame_free(&frame);
+		return -1;
+	}
 
-	return ret;
+	memset(&msg, 0, sizeof(msg));
+	msg.magic = IPC_MAGIC;
+	msg.type = GET_HISTORY;
+	msg.data.history.next = frame.next;
+	while ((ret = history_unpack(&frame, &offset, &msg)) != -ENOENT) {
+		if (ret == -EINVAL)
+			break;
+		if (callback)
+			callback(&msg);
+		count++;
+	}
+	*next = frame.next;
+	ipc_frame_free(&frame);
+
+	return ret == -EINVAL ? -1 : count;
 }
 
 int ipc_inst_start_ext(sourcetype source, size_t len, const char *buf, bool dryrun)
 {
 	int connfd;
 	ipc_message msg;
-	ssize_t ret;
-
-	connfd = prepare_ipc();
-	if (connfd < 0)
-		return -1;
 
 	memset(&msg, 0, sizeof(msg));
 
@@ -176,17 +733,8 @@ int ipc_inst_start_ext(sourcetype source, size_t len, const char *buf, bool dryr
 		memcpy(msg.data.instmsg.buf, buf, len);
 	}
 
-	ret = write(connfd, &msg, sizeof(msg));
-	if (ret != sizeof(msg)) {
-		close(connfd);
-		return -1;
-	}
-
-	ret = read(connfd, &msg, sizeof(msg));
-	if (ret <= 0) {
-		close(connfd);
+	if (ipc_exchange(&msg, &connfd))
 		return -1;
-	}
 
 	if (msg.type != ACK) {
 		close(connfd);
@@ -205,6 +753,88 @@ int ipc_inst_start(void)
 	return ipc_inst_start_ext(SOURCE_UNKNOWN, 0, NULL, false);
 }
 
+/*
+ * Send buf with fd attached (SCM_RIGHTS)
+ */
+static int send_with_fd(int connfd, const void *buf, size_t size, int fd)
+{
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	ssize_t ret;
+
+	memset(&mh, 0, sizeof(mh));
+	memset(&control, 0, sizeof(control));
+	iov.iov_base = (void *)buf;
+	iov.iov_len = size;
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control.buf;
+	mh.msg_controllen = sizeof(control.buf);
+	cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	do {
+		ret = sendmsg(connfd, &mh, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret <= 0)
+		return -1;
+
+	/* the descriptor went with the first byte */
+	return write_all(connfd, (const char *)buf + ret, size - ret);
+}
+
+/*
+ * Install the image read from fd: instead of streaming it
+ * through the socket, the descriptor itself is passed to the
+ * installer, that reads it directly. An image in a memfd
+ * sealed with F_SEAL_WRITE, F_SEAL_SHRINK and F_SEAL_GROW
+ * must start at offset 0, and it is read at the offsets of
+ * the single files, without copying. Any other descriptor
+ * is read as a stream from its current offset.
+ * The connection is closed after the answer, the result
+ * is reported as for the other installations.
+ */
+int ipc_inst_start_fd(int fd, sourcetype source, size_t len, const char *info,
+			bool dryrun)
+{
+	int connfd;
+	ipc_message msg;
+	int ret;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.magic = IPC_MAGIC;
+	msg.type = (!dryrun) ? REQ_INSTALL_FD : REQ_INSTALL_FD_DRYRUN;
+	msg.data.instmsg.source = source;
+	if (len > sizeof(msg.data.instmsg.buf))
+		len = sizeof(msg.data.instmsg.buf);
+	if (source) {
+		msg.data.instmsg.len = len;
+		memcpy(msg.data.instmsg.buf, info, len);
+	}
+
+	connfd = prepare_ipc();
+	if (connfd < 0)
+		return -1;
+
+	ret = send_with_fd(connfd, &msg, sizeof(msg), fd);
+	if (!ret)
+		ret = read_all(connfd, &msg, sizeof(msg));
+	close(connfd);
+
+	if (ret || msg.type != ACK)
+		return -1;
+
+	return 0;
+}
+
 /*
  * This is not required, it is really a wrapper for
  * write, but make interface consistent
@@ -235,22 +865,94 @@ int swupdate_image_write(char *buf, int size)
 	return ipc_send_data(rq->connfd, buf, size);
 }
 
+/*
+ * Keep a connection open to receive the status and the
+ * notifications (up to level, 0 for all) as they happen.
+ * The current status is sent first, then a GET_STATUS
+ * message for each event, read with ipc_notify_receive().
+ */
+int ipc_subscribe(int level)
+{
+	ipc_message msg;
+	int connfd;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.magic = IPC_MAGIC;
+	msg.type = SUBSCRIBE;
+	msg.data.subscribe.level = level;
+
+	if (ipc_exchange(&msg, &connfd))
+		return -1;
+
+	if (msg.type != ACK) {
+		close(connfd);
+		return -1;
+	}
+
+	return connfd;
+}
+
+int ipc_notify_receive(int connfd, ipc_message *msg)
+{
+	ipc_frame frame;
+	int ret;
+
+	ret = ipc_frame_read(connfd, &frame);
+	if (ret)
+		return -1;
+	ipc_frame_to_message(&frame, msg, GET_STATUS);
+	ipc_frame_free(&frame);
+
+	return 0;
+}
+
+/*
+ * Wait for the events of a subscription, an installer
+ * that does not know SUBSCRIBE is polled
+ */
+static int wait_for_events(getstatus callback, ipc_message *message)
+{
+	RECOVERY_STATUS status = IDLE;
+	int connfd;
+
+	connfd = ipc_subscribe(0);
+	if (connfd < 0)
+		return -1;
+
+	do {
+		if (ipc_notify_receive(connfd, message)) {
+			close(connfd);
+			return -1;
+		}
+
+		if ((status != (RECOVERY_STATUS)message->data.status.current) ||
+			strlen(message->data.status.desc)) {
+			if (callback)
+				callback(message);
+		}
+
+		status = (RECOVERY_STATUS)message->data.status.current;
+	} while (message->data.status.current != IDLE);
+
+	close(connfd);
+
+	return 0;
+}
+
 int ipc_wait_for_complete(getstatus callback)
 {
-	int fd;
 	RECOVERY_STATUS status = IDLE;
 	ipc_message message;
 	int ret;
 
+	if (!wait_for_events(callback, &message))
+		return message.data.status.last_result;
+
 	do {
-		fd = prepare_ipc();
-		if (fd < 0)
-			break;
-		ret = __ipc_get_status(fd, &message);
-		ipc_end(fd);
+		ret = ipc_get_status(&message);
 
 		if (ret < 0) {
-			printf("__ipc_get_status returned %d\n", ret);
+			printf("ipc_get_status returned %d\n", ret);
 			message.data.status.last_result = FAILURE;
 			break;
 		}
@@ -296,7 +998,8 @@ static void *swupdate_async_thread(void *data)
 			swupdate_image_write(pbuf, size);
 	} while(size > 0);
 
-	ipc_end(rq->connfd);
+	if (rq->connfd >= 0)
+		ipc_end(rq->connfd);
 	printf("Now getting status\n");
 
 	/*
@@ -375,29 +1078,62 @@ int swupdate_async_start(writedata wr_func, getstatus status_func,
 	return handle;
 }
 
-int ipc_send_cmd(ipc_message *msg)
+/*
+ * As swupdate_async_start(), the image is read by
+ * the installer from fd
+ */
+int swupdate_async_start_fd(int fd, getstatus status_func,
+				terminated end_func, bool dryrun)
 {
-	int connfd = prepare_ipc();
-	int ret;
+	struct async_lib *rq;
+
+	if (handle)
+		return -EBUSY;
 
-	if (connfd < 0) {
+	rq = get_request();
+
+	rq->wr = NULL;
+	rq->get = status_func;
+	rq->end = end_func;
+
+	if (ipc_inst_start_fd(fd, SOURCE_UNKNOWN, 0, NULL, dryrun) < 0)
 		return -1;
-	}
 
+	rq->connfd = -1;
+
+	async_thread_id = start_ipc_thread(swupdate_async_thread, rq);
+
+	handle++;
+
+	return handle;
+}
+
+int ipc_send_cmd(ipc_message *msg)
+{
 	/* TODO: Check source type */
 	msg->magic = IPC_MAGIC;
 	msg->type = SWUPDATE_SUBPROCESS;
-	ret = write(connfd, msg, sizeof(*msg));
-	if (ret != sizeof(*msg)) {
-		close(connfd);
-		return -1;
-	}
-	ret = read(connfd, msg, sizeof(*msg));
-	if (ret <= 0) {
-		close(connfd);
+
+	return ipc_exchange(msg, NULL);
+}
+
+/*
+ * Same as ipc_send_cmd(), without limits on the size of the
+ * data. The answer replaces the content of frame.
+ */
+int ipc_send_cmd_ext(ipc_frame *frame)
+{
+	int version;
+	int connfd;
+	int ret;
+
+	connfd = prepare_ipc_versioned(&version);
+	if (connfd < 0)
 		return -1;
-	}
+
+	frame->type = SWUPDATE_SUBPROCESS;
+	ret = ipc_request(connfd, version, frame);
 	close(connfd);
 
-	return 0;
+	return ret ? -1 : 0;
 }
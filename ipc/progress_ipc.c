@@ -7,6 +7,10 @@
 
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -57,3 +61,238 @@ int progress_ipc_receive(int *connfd, struct progress_msg *msg) {
 	}
 	return ret;
 }
+
+/*
+ * Ask SWUpdate for the extended messages, a SWUpdate that does
+ * not know them goes on sending the plain ones
+ */
+int progress_ipc_connect_ext(bool reconnect)
+{
+	unsigned int req = PROGRESS_EXT_REQUEST;
+	int fd = progress_ipc_connect(reconnect);
+
+	if (write(fd, &req, sizeof(req)) != sizeof(req)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int read_all(int fd, void *buf, size_t count)
+{
+	ssize_t n;
+
+	while (count > 0) {
+		n = read(fd, buf, count);
+		if (n <= 0)
+			return -1;
+		count -= (size_t)n;
+		buf = (char *)buf + n;
+	}
+
+	return 0;
+}
+
+/*
+ * Receive a message and, if SWUpdate sent it, its extension;
+ * ext->eta is -1 and the rest zeroed if there is none
+ */
+int progress_ipc_receive_ext(int *connfd, struct progress_msg *msg,
+			     struct progress_ext *ext)
+{
+	if (read_all(*connfd, msg, sizeof(*msg)) ||
+	    (msg->magic == PROGRESS_EXT_MAGIC &&
+	     read_all(*connfd, ext, sizeof(*ext)))) {
+		fprintf(stdout, "Connection closing..\n");
+		close(*connfd);
+		*connfd = -1;
+		return -1;
+	}
+	if (msg->magic != PROGRESS_EXT_MAGIC) {
+		memset(ext, 0, sizeof(*ext));
+		ext->eta = -1;
+	}
+
+	return sizeof(*msg);
+}
+
+#define PROGRESS_SHM_TIMEOUT	1000	/* ms */
+
+/*
+ * Read a whole progress_msg, with the descriptors
+ * passed along it if any
+ */
+static int receive_with_fds(int connfd, struct progress_msg *msg, int *fds,
+			    unsigned int nfds)
+{
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct pollfd pfd;
+	size_t offset = 0;
+	ssize_t n;
+
+	while (offset < sizeof(*msg)) {
+		pfd.fd = connfd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, PROGRESS_SHM_TIMEOUT) <= 0)
+			return -1;
+
+		memset(&mh, 0, sizeof(mh));
+		iov.iov_base = (char *)msg + offset;
+		iov.iov_len = sizeof(*msg) - offset;
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = control.buf;
+		mh.msg_controllen = sizeof(control.buf);
+		n = recvmsg(connfd, &mh, MSG_CMSG_CLOEXEC);
+		if (n <= 0)
+			return -1;
+		offset += n;
+
+		for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET ||
+			    cmsg->cmsg_type != SCM_RIGHTS)
+				continue;
+			if (cmsg->cmsg_len == CMSG_LEN(nfds * sizeof(int)))
+				memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Map the progress shared memory: the client reads
+ * the current progress from memory instead of receiving
+ * every message. -1 is returned if SWUpdate does not pass
+ * the segment, the client can connect for the messages.
+ */
+int progress_ipc_shm_connect(bool reconnect, struct progress_shm_client *client)
+{
+	unsigned int req = PROGRESS_SHM_REQUEST;
+	struct progress_msg msg;
+	int fds[2] = {-1, -1};
+	void *shm;
+
+	memset(client, 0, sizeof(*client));
+	client->connfd = progress_ipc_connect(reconnect);
+	client->eventfd = -1;
+
+	if (write(client->connfd, &req, sizeof(req)) != sizeof(req))
+		goto err;
+
+	/* messages sent before the request was served are skipped */
+	do {
+		if (receive_with_fds(client->connfd, &msg, fds, 2))
+			goto err;
+	} while (msg.magic != PROGRESS_SHM_MAGIC);
+
+	if (fds[0] < 0 || fds[1] < 0)
+		goto err;
+
+	shm = mmap(NULL, sizeof(*client->shm), PROT_READ, MAP_SHARED, fds[0], 0);
+	close(fds[0]);
+	fds[0] = -1;
+	if (shm == MAP_FAILED)
+		goto err;
+
+	client->shm = (const struct progress_shm *)shm;
+	client->eventfd = fds[1];
+	if (client->shm->magic != PROGRESS_SHM_MAGIC) {
+		progress_ipc_shm_close(client);
+		return -1;
+	}
+
+	return 0;
+
+err:
+	if (fds[0] >= 0)
+		close(fds[0]);
+	if (fds[1] >= 0)
+		close(fds[1]);
+	close(client->connfd);
+	client->connfd = -1;
+	return -1;
+}
+
+/*
+ * Copy the current progress (and its extension if ext is
+ * not NULL), returns 1 if it changed since the last call,
+ * 0 if not
+ */
+int progress_ipc_shm_read(struct progress_shm_client *client,
+			  struct progress_msg *msg, struct progress_ext *ext)
+{
+	const struct progress_shm *shm = client->shm;
+	unsigned int seq;
+
+	for (;;) {
+		seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			/* SWUpdate is writing it */
+			sched_yield();
+			continue;
+		}
+		memcpy(msg, &shm->msg, sizeof(*msg));
+		if (ext)
+			memcpy(ext, &shm->ext, sizeof(*ext));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (seq == __atomic_load_n(&shm->seq, __ATOMIC_RELAXED))
+			break;
+	}
+
+	if (seq == client->seq)
+		return 0;
+	client->seq = seq;
+
+	return 1;
+}
+
+/*
+ * Wait until SWUpdate signals an update, timeout_ms < 0 waits
+ * forever. Returns 1 after an update, 0 on timeout and -1 if
+ * the connection to SWUpdate is lost.
+ */
+int progress_ipc_shm_wait(struct progress_shm_client *client, int timeout_ms)
+{
+	struct pollfd pfds[2];
+	uint64_t count;
+	char buf[64];
+	int ret;
+
+	pfds[0].fd = client->eventfd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = client->connfd;
+	pfds[1].events = POLLIN;
+
+	ret = poll(pfds, 2, timeout_ms);
+	if (ret <= 0)
+		return ret;
+	if (pfds[1].revents &&
+	    recv(client->connfd, buf, sizeof(buf), MSG_DONTWAIT) <= 0)
+		return -1;
+	if (pfds[0].revents &&
+	    read(client->eventfd, &count, sizeof(count)) == sizeof(count))
+		return 1;
+
+	return 0;
+}
+
+void progress_ipc_shm_close(struct progress_shm_client *client)
+{
+	if (client->shm)
+		munmap((void *)client->shm, sizeof(*client->shm));
+	if (client->eventfd >= 0)
+		close(client->eventfd);
+	if (client->connfd >= 0)
+		close(client->connfd);
+	client->shm = NULL;
+	client->eventfd = -1;
+	client->connfd = -1;
+}
@@ -1802,14 +1802,21 @@ static server_op_res_t server_activation_ipc(ipc_message *msg)
 	return result;
 }
 
-static server_op_res_t server_configuration_ipc(ipc_message *msg)
+/*
+ * The configuration may be larger than ipc_message
+ * and it is taken from the frame
+ */
+static server_op_res_t server_configuration_ipc(ipc_frame *frame)
 {
 	struct json_object *json_root;
 	unsigned int polling;
 	json_object *json_data;
 
-	json_root = server_tokenize_msg(msg->data.instmsg.buf,
-					sizeof(msg->data.instmsg.buf));
+	if (!frame->data)
+		return SERVER_EERR;
+
+	/* with the terminating zero */
+	json_root = server_tokenize_msg(frame->data, frame->len + 1);
 	if (!json_root)
 		return SERVER_EERR;
 
@@ -1830,19 +1837,21 @@ static server_op_res_t server_configuration_ipc(ipc_message *msg)
 server_op_res_t server_ipc(int fd)
 {
 	ipc_message msg;
+	ipc_frame frame;
 	server_op_res_t result = SERVER_OK;
 	int ret;
 
-	ret = read(fd, &msg, sizeof(msg));
-	if (ret != sizeof(msg))
+	/* requests larger than ipc_message come as a frame */
+	if (ipc_frame_read(fd, &frame))
 		return SERVER_EERR;
+	ret = ipc_frame_to_message(&frame, &msg, SWUPDATE_SUBPROCESS);
 
 	switch (msg.data.instmsg.cmd) {
 	case CMD_ACTIVATION:
-		result = server_activation_ipc(&msg);
+		result = ret ? SERVER_EERR : server_activation_ipc(&msg);
 		break;
 	case CMD_CONFIG:
-		result = server_configuration_ipc(&msg);
+		result = server_configuration_ipc(&frame);
 		break;
 	default:
 		result = SERVER_EERR;
@@ -1855,6 +1864,7 @@ server_op_res_t server_ipc(int fd)
 		msg.type = ACK;
 
 	msg.data.instmsg.len = 0;
+	ipc_frame_free(&frame);
 
 	if (write(fd, &msg, sizeof(msg)) != sizeof(msg)) {
 		TRACE("IPC ERROR: sending back msg");
@@ -0,0 +1,150 @@
+#!/bin/sh
+# (C) Copyright 2026
+# agent, agent@local.
+#
+# SPDX-License-Identifier:     GPL-2.0-or-later
+#
+# Compare the serial and the parallel extraction of the archive
+# handler. A tarball with many small files is packed into a SWU
+# image twice, without and with "parallel-extract", and installed
+# with "swupdate -i" into a directory of the filesystem to measure
+# (a tmpfs, an ext4 mount, ...).
+#
+# The parallel mode ends with a syncfs() of the filesystem, the
+# serial mode does not flush anything: each run is followed by
+# "sync -f" on the target and the time includes it, so that both
+# modes are measured up to the data being on the disk.
+#
+# swupdate must be built with the archive handler and a parser for
+# libconfig. For signed images, pass the private key with -K and
+# the public key with -k (RSA signatures, see signed_images.rst).
+
+usage() {
+	cat <<EOF
+Usage: $0 [options] <swupdate> <directory>
+  -n <files>    number of files in the tarball (default 50000)
+  -s <bytes>    size of each file (default 1024)
+  -d <dirs>     number of directories (default 100)
+  -j <workers>  value of parallel-extract (default: number of CPUs)
+  -r <runs>     runs for each mode, the median is reported (default 3)
+  -K <key>      private key to sign sw-description
+  -k <key>      public key passed to swupdate
+EOF
+	exit 1
+}
+
+FILES=50000
+SIZE=1024
+DIRS=100
+WORKERS=$(nproc)
+RUNS=3
+PRIVKEY=
+PUBKEY=
+
+while getopts "n:s:d:j:r:K:k:" opt; do
+	case $opt in
+	n) FILES=$OPTARG ;;
+	s) SIZE=$OPTARG ;;
+	d) DIRS=$OPTARG ;;
+	j) WORKERS=$OPTARG ;;
+	r) RUNS=$OPTARG ;;
+	K) PRIVKEY=$OPTARG ;;
+	k) PUBKEY=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+shift $((OPTIND - 1))
+[ $# -eq 2 ] || usage
+
+SWUPDATE=$(realpath "$1")
+TARGET=$(realpath "$2")
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+now() {
+	date +%s.%N
+}
+
+# files are spread in DIRS directories, in the order of a rootfs
+mktarball() {
+	mkdir "$WORK/tree"
+	i=0
+	while [ $i -lt "$DIRS" ]; do
+		n=$((FILES / DIRS + (i < FILES % DIRS)))
+		mkdir "$WORK/tree/d$i"
+		if [ $n -gt 0 ]; then
+			head -c $((n * SIZE)) /dev/urandom |
+				split -b "$SIZE" -a 6 - "$WORK/tree/d$i/f"
+		fi
+		i=$((i + 1))
+	done
+	tar -C "$WORK/tree" -cf "$WORK/rootfs.tar" .
+	rm -rf "$WORK/tree"
+}
+
+# mkswu <name> <properties>
+mkswu() {
+	dir="$WORK/$1"
+	mkdir "$dir"
+	ln "$WORK/rootfs.tar" "$dir/rootfs.tar"
+	cat > "$dir/sw-description" <<EOF
+software =
+{
+	version = "1.0.0";
+	files: (
+		{
+			filename = "rootfs.tar";
+			type = "archive";
+			path = "$TARGET";
+			sha256 = "$(sha256sum "$WORK/rootfs.tar" | cut -d' ' -f1)";
+			$2
+		}
+	);
+}
+EOF
+	files="sw-description"
+	if [ -n "$PRIVKEY" ]; then
+		openssl dgst -sha256 -sign "$PRIVKEY" "$dir/sw-description" \
+			> "$dir/sw-description.sig"
+		files="$files sw-description.sig"
+	fi
+	(cd "$dir" && for f in $files rootfs.tar; do echo "$f"; done |
+		cpio -o -H crc --quiet > "$WORK/$1.swu")
+}
+
+# run <name>: prints the seconds taken by the installation and the sync
+run() {
+	find "$TARGET" -mindepth 1 -delete
+	sync -f "$TARGET"
+	[ -w /proc/sys/vm/drop_caches ] && echo 3 > /proc/sys/vm/drop_caches
+	start=$(now)
+	"$SWUPDATE" -l 1 ${PUBKEY:+-k "$PUBKEY"} -i "$WORK/$1.swu" \
+		> "$WORK/$1.log" 2>&1 || {
+		echo "Installation of $1 failed, see below" >&2
+		cat "$WORK/$1.log" >&2
+		exit 1
+	}
+	sync -f "$TARGET"
+	end=$(now)
+	echo "$start $end" | awk '{ printf "%.2f\n", $2 - $1 }'
+}
+
+median() {
+	sort -n | awk '{ v[NR] = $1 } END { print v[int((NR + 1) / 2)] }'
+}
+
+mktarball
+mkswu serial ""
+mkswu parallel "properties: { parallel-extract = \"$WORKERS\"; };"
+
+echo "$FILES files of $SIZE bytes in $DIRS directories, $(nproc) CPUs"
+echo "target $TARGET ($(stat -f -c %T "$TARGET"))"
+for mode in serial parallel; do
+	r=0
+	while [ $r -lt "$RUNS" ]; do
+		run $mode
+		r=$((r + 1))
+	done > "$WORK/$mode.times"
+	echo "$mode: $(median < "$WORK/$mode.times")s (runs: $(tr '\n' ' ' < "$WORK/$mode.times"))"
+done
+find "$TARGET" -mindepth 1 -delete
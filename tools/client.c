@@ -43,6 +43,8 @@ static void usage(void) {
 		" -q : go quite, resets verbosity\n"
 		" -v : go verbose, essentially print upgrade status messages from server\n"
 		" -p : ask the server to run post-update commands if upgrade succeeds\n"
+		" -s : stream the image through the socket instead of passing\n"
+		"      the file descriptor to the server\n"
 		);
 }
 
@@ -51,6 +53,7 @@ int fd = STDIN_FILENO;
 int verbose = 1;
 bool dryrun = false;
 bool run_postupdate = false;
+bool stream = false;
 int end_status = EXIT_SUCCESS;
 
 pthread_mutex_t mymutex;
@@ -129,8 +132,16 @@ static int send_file(const char* filename) {
 	/* May be set non-zero by end() function on failure */
 	end_status = EXIT_SUCCESS;
 
-	rc = swupdate_async_start(readimage, printstatus,
-				end, dryrun);
+	/*
+	 * SWUpdate reads the image itself from the passed descriptor,
+	 * an older SWUpdate refuses it and the image is streamed
+	 */
+	rc = -1;
+	if (!stream)
+		rc = swupdate_async_start_fd(fd, printstatus, end, dryrun);
+	if (rc < 0)
+		rc = swupdate_async_start(readimage, printstatus,
+					end, dryrun);
 
 	/* return if we've hit an error scenario */
 	if (rc < 0) {
@@ -162,7 +173,7 @@ int main(int argc, char *argv[]) {
 	pthread_mutex_init(&mymutex, NULL);
 
 	/* parse command line options */
-	while ((c = getopt(argc, argv, "dhqvp")) != EOF) {
+	while ((c = getopt(argc, argv, "dhqvps")) != EOF) {
 		switch (c) {
 		case 'd':
 			dryrun = true;
@@ -179,6 +190,9 @@ int main(int argc, char *argv[]) {
 		case 'p':
 			run_postupdate = true;
 			break;
+		case 's':
+			stream = true;
+			break;
 		default:
 			usage();
 			return -1;
@@ -0,0 +1,144 @@
+#!/usr/bin/env python3
+# (C) Copyright 2026
+# agent, agent@local.
+#
+# SPDX-License-Identifier:     GPL-2.0-or-later
+#
+# Build the artifact installed by the chunk handler ("chunk_image")
+# from a new image. The image is split into content-defined chunks
+# with the same gear hash used by the handler, and the index is
+# followed by the data of the chunks that must be shipped in the SWU
+# (the "pack").
+#
+# Without options every chunk is packed. With --base, chunks that
+# are found in the base image (the version installed on the device,
+# set as chunk-source) are not packed. With --store, chunks that are
+# not in the base image are written into a directory, named after
+# their SHA-256, to be served as chunk-store, instead of being packed.
+
+import argparse
+import hashlib
+import os
+import sys
+
+MAGIC = "SWUCHUNKS"
+VERSION = 1
+MIN_SIZE = 64
+MAX_SIZE = 16 * 1024 * 1024
+MASK = (1 << 64) - 1
+
+
+def gear_table():
+    # splitmix64 starting from 0, as in chunk_handler.c
+    gear = []
+    x = 0
+    for _ in range(256):
+        x = (x + 0x9e3779b97f4a7c15) & MASK
+        z = x
+        z = ((z ^ (z >> 30)) * 0xbf58476d1ce4e5b9) & MASK
+        z = ((z ^ (z >> 27)) * 0x94d049bb133111eb) & MASK
+        gear.append(z ^ (z >> 31))
+    return gear
+
+
+def chunks(data, cmin, cavg, cmax):
+    """Yield (offset, size) of the chunks of data"""
+    gear = gear_table()
+    shift = 64 - (cavg.bit_length() - 1)
+    pos = 0
+    size = len(data)
+    while pos < size:
+        end = min(size, pos + cmax)
+        cut = end
+        if end - pos > cmin:
+            h = 0
+            for i in range(pos + cmin, end):
+                h = ((h << 1) + gear[data[i]]) & MASK
+                if not h >> shift:
+                    cut = i + 1
+                    break
+        yield pos, cut - pos
+        pos = cut
+
+
+def size_arg(value):
+    units = {"k": 1024, "m": 1024 * 1024}
+    mult = units.get(value[-1:].lower(), 1)
+    if mult != 1:
+        value = value[:-1]
+    return int(value, 0) * mult
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Build an artifact for the SWUpdate chunk handler")
+    parser.add_argument("image", help="new image")
+    parser.add_argument("output", help="artifact to be put into the SWU")
+    parser.add_argument("--min", type=size_arg, default=16 * 1024,
+                        help="minimum chunk size (default 16k)")
+    parser.add_argument("--avg", type=size_arg, default=64 * 1024,
+                        help="average chunk size, a power of 2 (default 64k)")
+    parser.add_argument("--max", type=size_arg, default=256 * 1024,
+                        help="maximum chunk size (default 256k)")
+    parser.add_argument("--base",
+                        help="installed image, its chunks are not packed")
+    parser.add_argument("--store",
+                        help="directory for the chunks that are neither in "
+                             "the base image nor packed")
+    args = parser.parse_args()
+
+    if (args.min < MIN_SIZE or args.avg <= args.min or args.max < args.avg
+            or args.max > MAX_SIZE or args.avg & (args.avg - 1)):
+        sys.exit("wrong chunk sizes: %d <= min < avg <= max <= %d, "
+                 "avg must be a power of 2" % (MIN_SIZE, MAX_SIZE))
+
+    known = set()
+    if args.base:
+        with open(args.base, "rb") as f:
+            base = f.read()
+        for off, size in chunks(base, args.min, args.avg, args.max):
+            known.add((hashlib.sha256(base[off:off + size]).digest(), size))
+        del base
+
+    with open(args.image, "rb") as f:
+        data = f.read()
+
+    if args.store:
+        os.makedirs(args.store, exist_ok=True)
+
+    index = ["%s %d %d %d %d\n" % (MAGIC, VERSION, args.min, args.avg,
+                                   args.max)]
+    pack = []
+    stats = {"p": 0, "base": 0, "store": 0}
+    for off, size in chunks(data, args.min, args.avg, args.max):
+        chunk = data[off:off + size]
+        digest = hashlib.sha256(chunk).digest()
+        if (digest, size) in known:
+            flag = "-"
+            stats["base"] += size
+        elif args.store:
+            flag = "-"
+            path = os.path.join(args.store, digest.hex())
+            if not os.path.exists(path):
+                with open(path, "wb") as f:
+                    f.write(chunk)
+            stats["store"] += size
+        else:
+            flag = "p"
+            pack.append(chunk)
+            stats["p"] += size
+        index.append("%s %d %s\n" % (digest.hex(), size, flag))
+    index.append("\n")
+
+    with open(args.output, "wb") as f:
+        f.write("".join(index).encode("ascii"))
+        for chunk in pack:
+            f.write(chunk)
+
+    print("%d chunks: %d bytes packed, %d from the base image, "
+          "%d in the store" % (len(index) - 2, stats["p"], stats["base"],
+                               stats["store"]))
+
+
+if __name__ == "__main__":
+    main()